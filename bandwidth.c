@@ -0,0 +1,358 @@
+#include "bandwidth.h"
+#include "metrics.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#define BANDWIDTH_MAX_WAIT_NS 100000000ULL  // Waiters re-check at least this often
+#define BANDWIDTH_MIN_WAIT_NS 200000ULL
+
+typedef struct {
+    double rate;    // Bytes per second; 0 means unlimited
+    double burst;
+    double tokens;  // Negative after a charge larger than the tokens banked
+    uint64_t refilled_ns;
+} token_bucket_t;
+
+struct bandwidth_client {
+    in_addr_t ip;
+    int in_use;
+    int configured;  // Weight set by bandwidth_set_weight; never evicted
+    unsigned weight;
+    size_t active;   // Transfers registered
+    uint64_t last_active_ns;
+    token_bucket_t bucket;
+    _Atomic uint64_t received;
+    uint64_t window_start_ns;  // Throughput window, advanced by scrapes
+    uint64_t window_received;
+    double throughput;         // Bytes per second over the last complete window
+};
+
+/* A charge waiting for tokens; lives on the waiting thread's stack */
+typedef struct waiter {
+    bandwidth_client_t *client;
+    size_t bytes;
+    double stamp;
+    struct waiter *next;
+} waiter_t;
+
+struct bandwidth_scheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int limited;
+    double client_rate;
+    token_bucket_t global;
+    double virtual_time;  // Stamp of the charge paid most recently
+    waiter_t *waiters;    // Ordered by stamp
+    size_t active_transfers;
+    uint64_t throttled_ns;
+    bandwidth_client_t clients[BANDWIDTH_MAX_CLIENTS];  // [0] is shared by clients that do not fit
+};
+
+static void bucket_init(token_bucket_t *bucket, double rate, uint64_t now) {
+    bucket->rate = rate;
+    bucket->burst = rate * BANDWIDTH_BURST_MS / 1000.0;
+    if (bucket->burst < BANDWIDTH_MIN_BURST) {
+        bucket->burst = BANDWIDTH_MIN_BURST;
+    }
+    bucket->tokens = bucket->burst;
+    bucket->refilled_ns = now;
+}
+
+static void bucket_refill(token_bucket_t *bucket, uint64_t now) {
+    if (bucket->rate > 0 && now > bucket->refilled_ns) {
+        bucket->tokens += (double)(now - bucket->refilled_ns) * bucket->rate / 1e9;
+        if (bucket->tokens > bucket->burst) {
+            bucket->tokens = bucket->burst;
+        }
+    }
+    bucket->refilled_ns = now;
+}
+
+/* A charge goes ahead once the bucket holds its size, or a full burst for larger charges */
+static double bucket_need(const token_bucket_t *bucket, size_t bytes) {
+    return ((double)bytes < bucket->burst) ? (double)bytes : bucket->burst;
+}
+
+static int bucket_ready(const token_bucket_t *bucket, size_t bytes) {
+    return bucket->rate == 0 || bucket->tokens >= bucket_need(bucket, bytes);
+}
+
+static uint64_t bucket_delay_ns(const token_bucket_t *bucket, size_t bytes) {
+    if (bucket_ready(bucket, bytes)) {
+        return 0;
+    }
+    return (uint64_t)((bucket_need(bucket, bytes) - bucket->tokens) * 1e9 / bucket->rate);
+}
+
+static void bucket_pay(token_bucket_t *bucket, size_t bytes) {
+    if (bucket->rate > 0) {
+        bucket->tokens -= (double)bytes;
+    }
+}
+
+bandwidth_scheduler_t* bandwidth_create(uint64_t global_rate, uint64_t client_rate) {
+    bandwidth_scheduler_t *scheduler = (bandwidth_scheduler_t *)calloc(1, sizeof(bandwidth_scheduler_t));
+    if (!scheduler) {
+        return NULL;
+    }
+    uint64_t now = metrics_now_ns();
+    scheduler->limited = global_rate > 0 || client_rate > 0;
+    scheduler->client_rate = (double)client_rate;
+    bucket_init(&scheduler->global, (double)global_rate, now);
+
+    bandwidth_client_t *shared = &scheduler->clients[0];
+    shared->in_use = 1;
+    shared->configured = 1;
+    shared->weight = 1;
+    shared->window_start_ns = now;
+    bucket_init(&shared->bucket, scheduler->client_rate, now);
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->changed, NULL);
+    return scheduler;
+}
+
+void bandwidth_destroy(bandwidth_scheduler_t *scheduler) {
+    if (!scheduler) {
+        return;
+    }
+    pthread_cond_destroy(&scheduler->changed);
+    pthread_mutex_destroy(&scheduler->lock);
+    free(scheduler);
+}
+
+/* The entry for ip, claiming a free or idle one if it has none; NULL if every entry is busy. Lock held. */
+static bandwidth_client_t* find_client(bandwidth_scheduler_t *scheduler, in_addr_t ip) {
+    bandwidth_client_t *unused = NULL;
+    bandwidth_client_t *idle = NULL;  // Longest idle entry without transfers or a configured weight
+    for (int i = 1; i < BANDWIDTH_MAX_CLIENTS; i++) {
+        bandwidth_client_t *client = &scheduler->clients[i];
+        if (!client->in_use) {
+            if (!unused) {
+                unused = client;
+            }
+        } else if (client->ip == ip) {
+            return client;
+        } else if (client->active == 0 && !client->configured &&
+                   (!idle || client->last_active_ns < idle->last_active_ns)) {
+            idle = client;
+        }
+    }
+    bandwidth_client_t *victim = unused ? unused : idle;
+    if (!victim) {
+        return NULL;
+    }
+    uint64_t now = metrics_now_ns();
+    memset(victim, 0, sizeof(*victim));
+    victim->ip = ip;
+    victim->in_use = 1;
+    victim->weight = 1;
+    victim->last_active_ns = now;
+    victim->window_start_ns = now;
+    bucket_init(&victim->bucket, scheduler->client_rate, now);
+    return victim;
+}
+
+int bandwidth_set_weight(bandwidth_scheduler_t *scheduler, const char *ip, unsigned weight) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip, &addr) != 1 || weight < 1 || weight > BANDWIDTH_MAX_WEIGHT) {
+        return ERROR_FILE_IO;
+    }
+    pthread_mutex_lock(&scheduler->lock);
+    bandwidth_client_t *client = find_client(scheduler, addr.s_addr);
+    if (client) {
+        client->configured = 1;
+        client->weight = weight;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return client ? SUCCESS : ERROR_BUSY;
+}
+
+void bandwidth_begin(bandwidth_scheduler_t *scheduler, const struct sockaddr_in *client_addr,
+                     bandwidth_flow_t *flow) {
+    pthread_mutex_lock(&scheduler->lock);
+    bandwidth_client_t *client = find_client(scheduler, client_addr->sin_addr.s_addr);
+    if (!client) {
+        client = &scheduler->clients[0];
+    }
+    client->active++;
+    scheduler->active_transfers++;
+    flow->client = client;
+    flow->finish = scheduler->virtual_time;
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+void bandwidth_end(bandwidth_scheduler_t *scheduler, bandwidth_flow_t *flow) {
+    pthread_mutex_lock(&scheduler->lock);
+    flow->client->active--;
+    flow->client->last_active_ns = metrics_now_ns();
+    scheduler->active_transfers--;
+    pthread_mutex_unlock(&scheduler->lock);
+    flow->client = NULL;
+}
+
+/* Sleep on the condition for at most delay_ns; lock held */
+static void wait_changed(bandwidth_scheduler_t *scheduler, uint64_t delay_ns) {
+    if (delay_ns < BANDWIDTH_MIN_WAIT_NS) {
+        delay_ns = BANDWIDTH_MIN_WAIT_NS;
+    } else if (delay_ns > BANDWIDTH_MAX_WAIT_NS) {
+        delay_ns = BANDWIDTH_MAX_WAIT_NS;
+    }
+    struct timespec wake_at;
+    clock_gettime(CLOCK_REALTIME, &wake_at);
+    wake_at.tv_nsec += (long)delay_ns;
+    while (wake_at.tv_nsec >= 1000000000L) {
+        wake_at.tv_sec++;
+        wake_at.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&scheduler->changed, &scheduler->lock, &wake_at);
+}
+
+void bandwidth_charge(bandwidth_scheduler_t *scheduler, bandwidth_flow_t *flow, size_t bytes) {
+    bandwidth_client_t *client = flow->client;
+    atomic_fetch_add_explicit(&client->received, bytes, memory_order_relaxed);
+    if (!scheduler->limited || bytes == 0) {
+        return;
+    }
+
+    uint64_t started = metrics_now_ns();
+    pthread_mutex_lock(&scheduler->lock);
+    waiter_t self;
+    self.client = client;
+    self.bytes = bytes;
+    self.stamp = ((flow->finish > scheduler->virtual_time) ? flow->finish : scheduler->virtual_time) +
+                 (double)bytes / client->weight;
+    flow->finish = self.stamp;
+    waiter_t **link = &scheduler->waiters;
+    while (*link && (*link)->stamp <= self.stamp) {
+        link = &(*link)->next;
+    }
+    self.next = *link;
+    *link = &self;
+
+    uint64_t now;
+    for (;;) {
+        now = metrics_now_ns();
+        bucket_refill(&scheduler->global, now);
+
+        /* The earliest stamp whose client can pay goes next; clients over their own limit are skipped */
+        waiter_t *next = scheduler->waiters;
+        while (next) {
+            bucket_refill(&next->client->bucket, now);
+            if (bucket_ready(&next->client->bucket, next->bytes)) {
+                break;
+            }
+            next = next->next;
+        }
+        if (next == &self && bucket_ready(&scheduler->global, bytes)) {
+            break;
+        }
+        if (next == &self) {
+            wait_changed(scheduler, bucket_delay_ns(&scheduler->global, bytes));
+        } else if (next) {
+            wait_changed(scheduler, BANDWIDTH_MAX_WAIT_NS);  // Woken when the earlier charge is paid
+        } else {
+            wait_changed(scheduler, bucket_delay_ns(&client->bucket, bytes));
+        }
+    }
+
+    bucket_pay(&scheduler->global, bytes);
+    bucket_pay(&client->bucket, bytes);
+    scheduler->virtual_time = self.stamp;
+    for (link = &scheduler->waiters; *link != &self; link = &(*link)->next) {
+    }
+    *link = self.next;
+    scheduler->throttled_ns += now - started;
+    if (scheduler->waiters) {
+        pthread_cond_broadcast(&scheduler->changed);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+void bandwidth_get_stats(bandwidth_scheduler_t *scheduler, bandwidth_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&scheduler->lock);
+    stats->throttled_ns = scheduler->throttled_ns;
+    stats->active_transfers = scheduler->active_transfers;
+    for (int i = 1; i < BANDWIDTH_MAX_CLIENTS; i++) {
+        stats->clients += (size_t)scheduler->clients[i].in_use;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/* snprintf at out + *used; returns 0 once the buffer is full */
+static int append(char *out, size_t size, size_t *used, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(out + *used, size - *used, format, args);
+    va_end(args);
+    if (length < 0 || (size_t)length >= size - *used) {
+        out[*used] = '\0';
+        return 0;
+    }
+    *used += (size_t)length;
+    return 1;
+}
+
+/* Prometheus label value for a client entry */
+static const char* client_label(const bandwidth_scheduler_t *scheduler, const bandwidth_client_t *client,
+                                char *text) {
+    if (client == &scheduler->clients[0]) {
+        return "other";
+    }
+    struct in_addr addr;
+    addr.s_addr = client->ip;
+    return inet_ntop(AF_INET, &addr, text, INET_ADDRSTRLEN);
+}
+
+size_t bandwidth_write_metrics(bandwidth_scheduler_t *scheduler, char *out, size_t size) {
+    static const char *families[3][2] = {
+        { "eftt_client_received_bytes_total", "counter" },
+        { "eftt_client_throughput_bytes_per_second", "gauge" },
+        { "eftt_client_active_transfers", "gauge" },
+    };
+    size_t used = 0;
+    if (size == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&scheduler->lock);
+    uint64_t now = metrics_now_ns();
+    int fits = append(out, size, &used,
+                      "# TYPE eftt_bandwidth_throttled_seconds_total counter\n"
+                      "eftt_bandwidth_throttled_seconds_total %.6f\n"
+                      "# TYPE eftt_bandwidth_active_transfers gauge\neftt_bandwidth_active_transfers %zu\n",
+                      scheduler->throttled_ns / 1e9, scheduler->active_transfers);
+    for (int i = 0; i < BANDWIDTH_MAX_CLIENTS; i++) {
+        bandwidth_client_t *client = &scheduler->clients[i];
+        uint64_t received = atomic_load_explicit(&client->received, memory_order_relaxed);
+        if (client->in_use && now - client->window_start_ns >= BANDWIDTH_RATE_WINDOW_NS) {
+            client->throughput = (double)(received - client->window_received) * 1e9 /
+                                 (double)(now - client->window_start_ns);
+            client->window_start_ns = now;
+            client->window_received = received;
+        }
+    }
+    for (int family = 0; family < 3 && fits; family++) {
+        fits = append(out, size, &used, "# TYPE %s %s\n", families[family][0], families[family][1]);
+        for (int i = 0; i < BANDWIDTH_MAX_CLIENTS && fits; i++) {
+            const bandwidth_client_t *client = &scheduler->clients[i];
+            uint64_t received = atomic_load_explicit(&client->received, memory_order_relaxed);
+            if (!client->in_use || (i == 0 && received == 0 && client->active == 0)) {
+                continue;
+            }
+            char ip[INET_ADDRSTRLEN];
+            const char *label = client_label(scheduler, client, ip);
+            if (family == 0) {
+                fits = append(out, size, &used, "%s{client=\"%s\"} %llu\n", families[family][0], label,
+                              (unsigned long long)received);
+            } else if (family == 1) {
+                fits = append(out, size, &used, "%s{client=\"%s\"} %.0f\n", families[family][0], label,
+                              client->throughput);
+            } else {
+                fits = append(out, size, &used, "%s{client=\"%s\"} %zu\n", families[family][0], label,
+                              client->active);
+            }
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return used;
+}
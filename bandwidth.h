@@ -0,0 +1,62 @@
+#ifndef BANDWIDTH_H
+#define BANDWIDTH_H
+
+#include "common.h"
+#include <stdint.h>
+
+/*
+ * Upload bandwidth scheduler. A global token bucket caps the server's
+ * total receive rate and one bucket per client IP caps each client; both
+ * refill continuously and bank at most BANDWIDTH_BURST_MS worth of
+ * tokens. Transfers waiting for tokens are served in weighted fair order
+ * (self-clocked fair queuing): each charge is stamped bytes / weight past
+ * the later of the transfer's previous stamp and the scheduler's virtual
+ * clock, and the earliest stamp whose client bucket can pay goes next. A
+ * small upload that arrives while large ones are running therefore waits
+ * about one chunk per active transfer, not behind their backlogs.
+ *
+ * Received bytes are counted per client whether or not limits are set;
+ * without limits a charge is one atomic add and takes no lock.
+ */
+#define BANDWIDTH_MAX_CLIENTS 256     // Client IPs tracked at once; the rest share one entry
+#define BANDWIDTH_BURST_MS 100        // Tokens a bucket may bank, in milliseconds of its rate
+#define BANDWIDTH_MIN_BURST (256 * 1024)
+#define BANDWIDTH_MAX_WEIGHT 1000
+#define BANDWIDTH_RATE_WINDOW_NS 1000000000ULL  // Exported throughput is averaged over at least this
+
+typedef struct bandwidth_scheduler bandwidth_scheduler_t;
+typedef struct bandwidth_client bandwidth_client_t;
+
+/* One transfer's place in the schedule, from begin to end */
+typedef struct {
+    bandwidth_client_t *client;
+    double finish;  // Virtual finish stamp of its last charge
+} bandwidth_flow_t;
+
+typedef struct {
+    uint64_t throttled_ns;     // Time transfers spent waiting for tokens
+    size_t active_transfers;
+    size_t clients;            // Client entries in use
+} bandwidth_stats_t;
+
+/* Rates are bytes per second; 0 leaves that limit off */
+bandwidth_scheduler_t* bandwidth_create(uint64_t global_rate, uint64_t client_rate);
+void bandwidth_destroy(bandwidth_scheduler_t *scheduler);
+
+/* Weight (1..BANDWIDTH_MAX_WEIGHT, default 1) of transfers from ip; call before serving */
+int bandwidth_set_weight(bandwidth_scheduler_t *scheduler, const char *ip, unsigned weight);
+
+/* Register a transfer from client_addr, and drop it when the connection is done */
+void bandwidth_begin(bandwidth_scheduler_t *scheduler, const struct sockaddr_in *client_addr,
+                     bandwidth_flow_t *flow);
+void bandwidth_end(bandwidth_scheduler_t *scheduler, bandwidth_flow_t *flow);
+
+/* Account bytes just received on flow, blocking until the buckets have paid for them */
+void bandwidth_charge(bandwidth_scheduler_t *scheduler, bandwidth_flow_t *flow, size_t bytes);
+
+void bandwidth_get_stats(bandwidth_scheduler_t *scheduler, bandwidth_stats_t *stats);
+
+/* Per-client byte counters, throughput and active transfers in Prometheus text; returns bytes written */
+size_t bandwidth_write_metrics(bandwidth_scheduler_t *scheduler, char *out, size_t size);
+
+#endif /* BANDWIDTH_H */
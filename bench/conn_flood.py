@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""Many concurrent slow clients against one server engine.
+
+Starts ./server with the given engine in a scratch directory, then opens
+CLIENTS connections at once. Each sends the legacy header and half of a
+BODY-byte body, every client idles for IDLE seconds, then each sends the
+rest and waits for the acknowledgment. Reports completed uploads, wall
+time and the server's peak RSS and thread count.
+
+Usage: bench/conn_flood.py [-s SERVER] [-e ENGINE] [-n CLIENTS] [-p PORT]
+                           [--body BYTES] [--idle SECONDS] [-- SERVER_ARGS...]
+"""
+
+import argparse
+import os
+import resource
+import selectors
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def server_status(pid):
+    """VmHWM in KiB and the current thread count from /proc"""
+    fields = {}
+    try:
+        with open("/proc/%d/status" % pid) as status:
+            for line in status:
+                key, _, value = line.partition(":")
+                fields[key] = value.split()[0] if value.split() else "0"
+    except OSError:
+        return 0, 0
+    return int(fields.get("VmHWM", 0)), int(fields.get("Threads", 0))
+
+
+def wait_for_port(port, proc):
+    for _ in range(100):
+        if proc.poll() is not None:
+            sys.exit("server exited during startup")
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=0.1).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    sys.exit("server did not start listening on port %d" % port)
+
+
+class Client:
+    def __init__(self, index, body):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.sock.setblocking(False)
+        header = b"flood_%d\0" % index + struct.pack("<Q", body)
+        half = body // 2
+        self.first = header + os.urandom(half)
+        self.second = os.urandom(body - half)
+        self.pending = b""
+        self.ack = b""
+        self.state = "connecting"
+
+
+def run(args):
+    clients = [Client(i, args.body) for i in range(args.clients)]
+    sel = selectors.DefaultSelector()
+    peak_kb, peak_threads = 0, 0
+    failed = 0
+
+    def sample():
+        nonlocal peak_kb, peak_threads
+        kb, threads = server_status(args.server_pid)
+        peak_kb = max(peak_kb, kb)
+        peak_threads = max(peak_threads, threads)
+
+    def fail(client):
+        nonlocal failed
+        if client.state != "failed":
+            try:
+                sel.unregister(client.sock)
+            except (KeyError, ValueError):
+                pass
+            client.sock.close()
+            client.state = "failed"
+            failed += 1
+
+    def pump(until_states, deadline):
+        """Drive sends and ack reads until no client is in until_states"""
+        while any(c.state in until_states for c in clients) and time.monotonic() < deadline:
+            for key, events in sel.select(timeout=0.1):
+                client = key.data
+                try:
+                    if client.state == "connecting":
+                        err = client.sock.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR)
+                        if err:
+                            fail(client)
+                            continue
+                        client.pending = client.first
+                        client.state = "sending_first"
+                    if client.state in ("sending_first", "sending_second") and events & selectors.EVENT_WRITE:
+                        sent = client.sock.send(client.pending)
+                        client.pending = client.pending[sent:]
+                        if not client.pending:
+                            if client.state == "sending_first":
+                                client.state = "idle"
+                                sel.unregister(client.sock)
+                            else:
+                                client.state = "awaiting_ack"
+                                sel.modify(client.sock, selectors.EVENT_READ, client)
+                    elif client.state == "awaiting_ack" and events & selectors.EVENT_READ:
+                        data = client.sock.recv(256)
+                        client.ack += data
+                        if not data or b"success" in client.ack:
+                            sel.unregister(client.sock)
+                            client.sock.close()
+                            client.state = "done" if b"success" in client.ack else "failed"
+                            if client.state == "failed":
+                                failed += 1
+                except OSError:
+                    fail(client)
+            sample()
+
+    start = time.monotonic()
+    for client in clients:
+        try:
+            client.sock.connect_ex(("127.0.0.1", args.port))
+            sel.register(client.sock, selectors.EVENT_WRITE, client)
+        except OSError:
+            fail(client)
+    pump(("connecting", "sending_first"), start + args.timeout)
+
+    idle_until = time.monotonic() + args.idle
+    while time.monotonic() < idle_until:
+        sample()
+        time.sleep(0.1)
+
+    for client in clients:
+        if client.state == "idle":
+            client.pending = client.second
+            client.state = "sending_second"
+            sel.register(client.sock, selectors.EVENT_WRITE, client)
+    pump(("connecting", "sending_first", "sending_second", "awaiting_ack"), start + args.timeout)
+    elapsed = time.monotonic() - start
+
+    done = sum(1 for c in clients if c.state == "done")
+    print("%s: %d/%d completed in %.1f s, server peak %d threads, %.0f MB RSS"
+          % (args.engine, done, args.clients, elapsed, peak_threads, peak_kb / 1024))
+    for client in clients:
+        if client.state not in ("done", "failed"):
+            client.sock.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-s", "--server", default="./server")
+    parser.add_argument("-e", "--engine", default="epoll")
+    parser.add_argument("-n", "--clients", type=int, default=10000)
+    parser.add_argument("-p", "--port", type=int, default=9331)
+    parser.add_argument("--body", type=int, default=1024)
+    parser.add_argument("--idle", type=float, default=1.0)
+    parser.add_argument("--timeout", type=float, default=120.0)
+    parser.add_argument("server_args", nargs="*")
+    args = parser.parse_args()
+
+    # Every client socket and every server-side connection needs a descriptor
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+    if hard < args.clients + 64:
+        print("warning: RLIMIT_NOFILE %d is below the client count" % hard, file=sys.stderr)
+
+    server = os.path.abspath(args.server)
+    with tempfile.TemporaryDirectory() as scratch:
+        proc = subprocess.Popen([server, "-e", args.engine] + args.server_args + [str(args.port)],
+                                cwd=scratch, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            wait_for_port(args.port, proc)
+            args.server_pid = proc.pid
+            run(args)
+        finally:
+            proc.terminate()
+            proc.wait()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Upload throughput against the number of parallel streams (client -j N).
+
+There is no netem here, so every stream goes through an in-process relay
+that models a long-fat link: each connection may forward at most WINDOW
+bytes per RTT, the throughput a TCP window of that size reaches on that
+round trip. The relay sits between ./client and a ./server started in a
+scratch directory; each received file is compared with the source.
+
+Usage: bench/parallel_streams.py [-s SERVER] [-c CLIENT] [-e ENGINE]
+           [--size-mb N] [--window BYTES] [--rtt-ms MS] [--streams 1,2,4,...]
+           [-- SERVER_ARGS...]
+"""
+
+import argparse
+import filecmp
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+def pace(src, dst, window, rtt):
+    """Forward src to dst, at most window bytes per rtt seconds"""
+    try:
+        next_tick = time.monotonic()
+        while True:
+            budget = window
+            while budget > 0:
+                data = src.recv(min(budget, 1 << 16))
+                if not data:
+                    dst.shutdown(socket.SHUT_WR)
+                    return
+                dst.sendall(data)
+                budget -= len(data)
+            next_tick += rtt
+            delay = next_tick - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+    except OSError:
+        pass
+
+
+def copy(src, dst):
+    """Forward the return path (acks, server responses) unshaped"""
+    try:
+        while True:
+            data = src.recv(1 << 16)
+            if not data:
+                dst.shutdown(socket.SHUT_WR)
+                return
+            dst.sendall(data)
+    except OSError:
+        pass
+
+
+def relay(listener, upstream_port, window, rtt):
+    while True:
+        try:
+            downstream, _ = listener.accept()
+        except OSError:
+            return
+        upstream = socket.create_connection(("127.0.0.1", upstream_port))
+        threading.Thread(target=pace, args=(downstream, upstream, window, rtt), daemon=True).start()
+        threading.Thread(target=copy, args=(upstream, downstream), daemon=True).start()
+
+
+def wait_for_port(port, proc):
+    for _ in range(100):
+        if proc.poll() is not None:
+            sys.exit("server exited during startup")
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=0.1).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    sys.exit("server did not start listening on port %d" % port)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-s", "--server", default="./server")
+    parser.add_argument("-c", "--client", default="./client")
+    parser.add_argument("-e", "--engine", default="pool")
+    parser.add_argument("-p", "--port", type=int, default=9351)
+    parser.add_argument("--size-mb", type=int, default=32)
+    parser.add_argument("--window", type=int, default=256 * 1024)
+    parser.add_argument("--rtt-ms", type=float, default=20.0)
+    parser.add_argument("--streams", default="1,2,4,8,16")
+    parser.add_argument("server_args", nargs="*")
+    args = parser.parse_args()
+
+    server = os.path.abspath(args.server)
+    client = os.path.abspath(args.client)
+    relay_port = args.port + 1
+    with tempfile.TemporaryDirectory() as scratch:
+        source = os.path.join(scratch, "streams.bin")
+        with open(source, "wb") as out:
+            for _ in range(args.size_mb):
+                out.write(os.urandom(1 << 20))
+        received = os.path.join(scratch, "received_files", "streams.bin")
+
+        proc = subprocess.Popen([server, "-e", args.engine] + args.server_args + [str(args.port)],
+                                cwd=scratch, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind(("127.0.0.1", relay_port))
+        listener.listen(64)
+        try:
+            wait_for_port(args.port, proc)
+            threading.Thread(target=relay, daemon=True,
+                             args=(listener, args.port, args.window, args.rtt_ms / 1000)).start()
+            print("%d MiB, %s engine, each stream capped at %d KiB per %.0f ms"
+                  % (args.size_mb, args.engine, args.window // 1024, args.rtt_ms))
+            for streams in [int(n) for n in args.streams.split(",")]:
+                if os.path.exists(received):
+                    os.unlink(received)
+                start = time.monotonic()
+                status = subprocess.call([client, "-j", str(streams), "127.0.0.1", str(relay_port), source],
+                                         stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+                elapsed = time.monotonic() - start
+                intact = status == 0 and os.path.exists(received) and filecmp.cmp(source, received, shallow=False)
+                print("N=%-3d %7.1f MB/s  %6.2f s%s" % (streams, os.path.getsize(source) / elapsed / 1e6,
+                                                     elapsed, "" if intact else "  FAILED"))
+        finally:
+            listener.close()
+            proc.terminate()
+            proc.wait()
+
+
+if __name__ == "__main__":
+    main()
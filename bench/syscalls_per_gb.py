@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Receive-side system calls per GB and wall time for each server engine.
+
+Starts ./server -e ENGINE -M METRICS_PORT in a scratch directory, runs
+CLIENTS concurrent ./client uploads of a SIZE_MB random file, compares
+every received file with the source and reads the counters from the
+metrics endpoint. Syscalls are the recv and write histogram counts for
+the blocking engines and the io_uring_enter count for uring (the few
+open, close and register calls per file are not counted).
+
+Usage: bench/syscalls_per_gb.py [-s SERVER] [-c CLIENT] [-e threads,epoll,uring]
+           [-n CLIENTS] [--size-mb N] [-p PORT] [-- SERVER_ARGS...]
+"""
+
+import argparse
+import filecmp
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+# The uring engine also times each receive and write op, but submits them in batches
+SYSCALL_COUNTERS = {"uring": ("eftt_uring_enter_calls_total",)}
+BLOCKING_COUNTERS = ("eftt_recv_duration_seconds_count", "eftt_write_duration_seconds_count")
+
+
+def wait_for_port(port, proc):
+    for _ in range(100):
+        if proc.poll() is not None:
+            sys.exit("server exited during startup")
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=0.1).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    sys.exit("server did not start listening on port %d" % port)
+
+
+def scrape(port):
+    """Sample values by metric name; histogram and counter lines only"""
+    with urllib.request.urlopen("http://127.0.0.1:%d/metrics" % port, timeout=5) as response:
+        text = response.read().decode()
+    values = {}
+    for line in text.splitlines():
+        if line and not line.startswith("#"):
+            name, _, value = line.rpartition(" ")
+            values[name] = float(value)
+    return values
+
+
+def run_engine(args, engine, scratch, sources):
+    workdir = os.path.join(scratch, engine)
+    os.mkdir(workdir)
+    metrics_port = args.port + 1
+    proc = subprocess.Popen([args.server, "-e", engine, "-M", str(metrics_port)] + args.server_args
+                            + [str(args.port)], cwd=workdir, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    try:
+        wait_for_port(args.port, proc)
+        before = scrape(metrics_port)
+        start = time.monotonic()
+        clients = [subprocess.Popen([args.client, "127.0.0.1", str(args.port), source],
+                                    stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+                   for source in sources]
+        failed = sum(1 for client in clients if client.wait() != 0)
+        elapsed = time.monotonic() - start
+        after = scrape(metrics_port)
+    finally:
+        proc.terminate()
+        proc.wait()
+
+    for source in sources:
+        received = os.path.join(workdir, "received_files", os.path.basename(source))
+        if not os.path.exists(received) or not filecmp.cmp(source, received, shallow=False):
+            failed += 1
+    received_bytes = after.get("eftt_received_bytes_total", 0) - before.get("eftt_received_bytes_total", 0)
+    counters = SYSCALL_COUNTERS.get(engine, BLOCKING_COUNTERS)
+    syscalls = sum(after.get(name, 0) - before.get(name, 0) for name in counters)
+    per_gb = syscalls / (received_bytes / 1e9) if received_bytes else 0
+    print("%-8s %8.1fk syscalls/GB  %8.0f ms%s" % (engine, per_gb / 1000, elapsed * 1000,
+                                                  "  %d FAILED" % failed if failed else ""))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-s", "--server", default="./server")
+    parser.add_argument("-c", "--client", default="./client")
+    parser.add_argument("-e", "--engines", default="threads,epoll,uring")
+    parser.add_argument("-n", "--clients", type=int, default=1)
+    parser.add_argument("-p", "--port", type=int, default=9361)
+    parser.add_argument("--size-mb", type=int, default=500)
+    parser.add_argument("server_args", nargs="*")
+    args = parser.parse_args()
+    args.server = os.path.abspath(args.server)
+    args.client = os.path.abspath(args.client)
+
+    with tempfile.TemporaryDirectory() as scratch:
+        # One name per client so concurrent uploads do not share an output file
+        source = os.path.join(scratch, "upload_0.bin")
+        with open(source, "wb") as out:
+            for _ in range(args.size_mb):
+                out.write(os.urandom(1 << 20))
+        sources = [source]
+        for i in range(1, args.clients):
+            sources.append(os.path.join(scratch, "upload_%d.bin" % i))
+            os.link(source, sources[-1])
+
+        print("%d x %d MiB, %d concurrent client(s)" % (args.clients, args.size_mb, args.clients))
+        for engine in args.engines.split(","):
+            run_engine(args, engine, scratch, sources)
+
+
+if __name__ == "__main__":
+    main()
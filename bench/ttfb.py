@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""Client time-to-first-byte and peak RSS for one upload.
+
+Runs ./client against a local sink that speaks the legacy framing
+(NUL-terminated name, size_t size, payload, then an ack). The sink
+timestamps the first payload byte; TTFB is measured from the moment the
+client process is started. Peak RSS is the client's ru_maxrss.
+
+Usage: bench/ttfb.py [-c CLIENT] [-s SIZE_MB] [-p PORT] [-r RUNS] [FILE]
+Without FILE a SIZE_MB file of random bytes is created in a scratch
+directory and removed afterwards.
+"""
+
+import argparse
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+def run_sink(listener, result):
+    conn, _ = listener.accept()
+    with conn:
+        header = b""
+        while b"\0" not in header or len(header) < header.index(b"\0") + 1 + 8:
+            data = conn.recv(4096)
+            if not data:
+                return
+            header += data
+        name_end = header.index(b"\0")
+        size = struct.unpack("<Q", header[name_end + 1:name_end + 9])[0]
+        received = len(header) - (name_end + 9)
+        if received > 0 or size == 0:
+            result["first_byte_ns"] = time.monotonic_ns()
+        while received < size:
+            data = conn.recv(1 << 20)
+            if not data:
+                return
+            if "first_byte_ns" not in result:
+                result["first_byte_ns"] = time.monotonic_ns()
+            received += len(data)
+        result["received"] = received
+        conn.sendall(b"File received successfully")
+
+
+def measure(client, port, path):
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(("127.0.0.1", port))
+    listener.listen(1)
+    result = {}
+    sink = threading.Thread(target=run_sink, args=(listener, result))
+    sink.start()
+
+    start_ns = time.monotonic_ns()
+    proc = subprocess.Popen([client, "127.0.0.1", str(port), path],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    _, status, usage = os.wait4(proc.pid, 0)
+    end_ns = time.monotonic_ns()
+    sink.join()
+    listener.close()
+
+    if os.waitstatus_to_exitcode(status) != 0 or "first_byte_ns" not in result:
+        sys.exit("client failed (exit status %d)" % os.waitstatus_to_exitcode(status))
+    return ((result["first_byte_ns"] - start_ns) / 1e6, (end_ns - start_ns) / 1e6,
+            usage.ru_maxrss / 1024)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-c", "--client", default="./client")
+    parser.add_argument("-s", "--size-mb", type=int, default=500)
+    parser.add_argument("-p", "--port", type=int, default=9321)
+    parser.add_argument("-r", "--runs", type=int, default=3)
+    parser.add_argument("file", nargs="?")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as scratch:
+        path = args.file
+        if not path:
+            path = os.path.join(scratch, "ttfb.bin")
+            with open(path, "wb") as out:
+                for _ in range(args.size_mb):
+                    out.write(os.urandom(1 << 20))
+        size_mb = os.path.getsize(path) / (1 << 20)
+        for run in range(1, args.runs + 1):
+            ttfb, total, rss = measure(args.client, args.port, path)
+            print("run %d: %.0f MiB  time-to-first-byte %8.1f ms  total %8.1f ms  peak RSS %6.1f MiB"
+                  % (run, size_mb, ttfb, total, rss))
+
+
+if __name__ == "__main__":
+    main()
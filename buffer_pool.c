@@ -0,0 +1,262 @@
+#include "buffer_pool.h"
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+/* Free buffers are linked through their first bytes */
+typedef struct free_buffer {
+    struct free_buffer *next;
+} free_buffer_t;
+
+/* Shared state of one size class */
+typedef struct {
+    pthread_mutex_t lock;
+    free_buffer_t *free_list;
+    unsigned char *slab_next;  // Uncarved part of the newest slab
+    unsigned char *slab_end;
+} size_class_t;
+
+/* One thread's caches and counters; handed to a later thread once it exits */
+typedef struct thread_cache {
+    void *buffers[BUFFER_POOL_CLASS_COUNT][BUFFER_POOL_CACHE_MAX];
+    int counts[BUFFER_POOL_CLASS_COUNT];
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t oversize;
+    struct thread_cache *next;
+    atomic_int in_use;
+} __attribute__((aligned(64))) thread_cache_t;
+
+static size_class_t classes[BUFFER_POOL_CLASS_COUNT] = {
+    { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL }, { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL }, { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL }, { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL }, { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL },
+};
+
+/* Push-only list of every cache ever created */
+static _Atomic(thread_cache_t *) caches = NULL;
+static _Thread_local thread_cache_t *local_cache = NULL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_int hugepages = -1;  // -1 until configured or read from the environment
+static _Atomic uint64_t slab_count = 0;
+static _Atomic uint64_t huge_slab_count = 0;
+
+static size_t class_size(int index) {
+    return (size_t)BUFFER_POOL_MIN_SIZE << (2 * index);
+}
+
+/* Smallest class that fits size, or -1 if it needs malloc */
+static int class_index(size_t size) {
+    if (size <= BUFFER_POOL_MIN_SIZE) {
+        return 0;
+    }
+    int bits = 64 - __builtin_clzll((unsigned long long)(size - 1));  // ceil(log2(size))
+    int index = (bits - 7) / 2;
+    return (index < BUFFER_POOL_CLASS_COUNT) ? index : -1;
+}
+
+static int cache_capacity(int index) {
+    size_t capacity = BUFFER_POOL_CACHE_BYTES / class_size(index);
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    return (capacity > BUFFER_POOL_CACHE_MAX) ? BUFFER_POOL_CACHE_MAX : (int)capacity;
+}
+
+/* Single-writer add: a relaxed load and store, no locked instruction */
+static inline void cache_add(_Atomic uint64_t *value, uint64_t delta) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+void buffer_pool_use_hugepages(int enable) {
+    atomic_store(&hugepages, enable ? 1 : 0);
+}
+
+/* Map one slab, preferring reserved huge pages when they were asked for */
+static unsigned char* map_slab(size_t length) {
+    int huge = atomic_load(&hugepages);
+    if (huge < 0) {
+        const char *setting = getenv(BUFFER_POOL_HUGEPAGES_ENV);
+        huge = (setting && strcmp(setting, "0") != 0) ? 1 : 0;
+        atomic_store(&hugepages, huge);
+    }
+    void *slab = MAP_FAILED;
+    if (huge) {
+        slab = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED) {
+            atomic_fetch_add(&huge_slab_count, 1);
+        }
+    }
+    if (slab == MAP_FAILED) {
+        slab = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            return NULL;
+        }
+        if (huge) {
+            /* No reserved huge pages: let transparent huge pages back it where they can */
+            madvise(slab, length, MADV_HUGEPAGE);
+        }
+    }
+    atomic_fetch_add(&slab_count, 1);
+    return (unsigned char *)slab;
+}
+
+/* Pop up to max buffers from the shared free list; returns how many */
+static int shared_pop(int index, void **out, int max) {
+    size_class_t *cls = &classes[index];
+    int count = 0;
+    pthread_mutex_lock(&cls->lock);
+    while (count < max && cls->free_list) {
+        out[count++] = cls->free_list;
+        cls->free_list = cls->free_list->next;
+    }
+    pthread_mutex_unlock(&cls->lock);
+    return count;
+}
+
+/* Splice count buffers onto the shared free list under one lock */
+static void shared_push(int index, void **buffers, int count) {
+    if (count == 0) {
+        return;
+    }
+    for (int i = 0; i + 1 < count; i++) {
+        ((free_buffer_t *)buffers[i])->next = (free_buffer_t *)buffers[i + 1];
+    }
+    size_class_t *cls = &classes[index];
+    pthread_mutex_lock(&cls->lock);
+    ((free_buffer_t *)buffers[count - 1])->next = cls->free_list;
+    cls->free_list = (free_buffer_t *)buffers[0];
+    pthread_mutex_unlock(&cls->lock);
+}
+
+/* Take a never-used buffer from the newest slab, mapping a new one if it is used up */
+static void* carve(int index) {
+    size_class_t *cls = &classes[index];
+    size_t size = class_size(index);
+    pthread_mutex_lock(&cls->lock);
+    if (cls->slab_next == cls->slab_end) {
+        size_t length = (size > BUFFER_POOL_SLAB_SIZE) ? size : BUFFER_POOL_SLAB_SIZE;
+        unsigned char *slab = map_slab(length);
+        if (!slab) {
+            pthread_mutex_unlock(&cls->lock);
+            return NULL;
+        }
+        cls->slab_next = slab;
+        cls->slab_end = slab + length;
+    }
+    void *buffer = cls->slab_next;
+    cls->slab_next += size;
+    pthread_mutex_unlock(&cls->lock);
+    return buffer;
+}
+
+/* Thread exit: give the cached buffers back and leave the counters for the next thread */
+static void release_cache(void *arg) {
+    thread_cache_t *cache = (thread_cache_t *)arg;
+    for (int index = 0; index < BUFFER_POOL_CLASS_COUNT; index++) {
+        shared_push(index, cache->buffers[index], cache->counts[index]);
+        cache->counts[index] = 0;
+    }
+    local_cache = NULL;
+    atomic_store(&cache->in_use, 0);
+}
+
+static void create_cache_key(void) {
+    pthread_key_create(&cache_key, release_cache);
+}
+
+static thread_cache_t* acquire_cache(void) {
+    pthread_once(&cache_key_once, create_cache_key);
+    thread_cache_t *cache;
+    for (cache = atomic_load(&caches); cache; cache = cache->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&cache->in_use, &expected, 1)) {
+            break;
+        }
+    }
+    if (!cache) {
+        cache = (thread_cache_t *)aligned_alloc(64, sizeof(thread_cache_t));
+        if (!cache) {
+            return NULL;
+        }
+        memset(cache, 0, sizeof(*cache));
+        atomic_init(&cache->in_use, 1);
+        cache->next = atomic_load(&caches);
+        while (!atomic_compare_exchange_weak(&caches, &cache->next, cache)) {
+        }
+    }
+    pthread_setspecific(cache_key, cache);
+    local_cache = cache;
+    return cache;
+}
+
+void* buffer_pool_alloc(size_t size) {
+    int index = class_index(size);
+    thread_cache_t *cache = local_cache ? local_cache : acquire_cache();
+    if (index < 0) {
+        if (cache) {
+            cache_add(&cache->oversize, 1);
+        }
+        return malloc(size);
+    }
+    if (!cache) {
+        void *buffer;
+        return (shared_pop(index, &buffer, 1) == 1) ? buffer : carve(index);
+    }
+
+    /* Refill half the cache at once so the next allocations stay lock-free */
+    if (cache->counts[index] == 0) {
+        int batch = (cache_capacity(index) + 1) / 2;
+        cache->counts[index] = shared_pop(index, cache->buffers[index], batch);
+    }
+    if (cache->counts[index] > 0) {
+        cache_add(&cache->hits, 1);
+        return cache->buffers[index][--cache->counts[index]];
+    }
+    void *buffer = carve(index);
+    if (buffer) {
+        cache_add(&cache->misses, 1);
+    }
+    return buffer;
+}
+
+void buffer_pool_free(void *buffer, size_t size) {
+    if (!buffer) {
+        return;
+    }
+    int index = class_index(size);
+    if (index < 0) {
+        free(buffer);
+        return;
+    }
+    thread_cache_t *cache = local_cache ? local_cache : acquire_cache();
+    if (!cache) {
+        shared_push(index, &buffer, 1);
+        return;
+    }
+
+    /* A full cache drains its older half to the shared list in one splice */
+    int capacity = cache_capacity(index);
+    if (cache->counts[index] == capacity) {
+        int drain = (capacity + 1) / 2;
+        shared_push(index, cache->buffers[index], drain);
+        memmove(cache->buffers[index], cache->buffers[index] + drain,
+                (size_t)(capacity - drain) * sizeof(void *));
+        cache->counts[index] = capacity - drain;
+    }
+    cache->buffers[index][cache->counts[index]++] = buffer;
+}
+
+void buffer_pool_get_stats(buffer_pool_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (thread_cache_t *cache = atomic_load(&caches); cache; cache = cache->next) {
+        stats->hits += atomic_load_explicit(&cache->hits, memory_order_relaxed);
+        stats->misses += atomic_load_explicit(&cache->misses, memory_order_relaxed);
+        stats->oversize += atomic_load_explicit(&cache->oversize, memory_order_relaxed);
+    }
+    stats->slabs = atomic_load(&slab_count);
+    stats->huge_slabs = atomic_load(&huge_slab_count);
+}
@@ -0,0 +1,44 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include "common.h"
+#include <stdint.h>
+
+/*
+ * Process-wide pool of I/O buffers. Requests are rounded up to a size
+ * class (powers of four from 256 bytes to 4 MiB) and carved from 2 MiB
+ * slabs that are never returned to the system. Each thread keeps a small
+ * cache per class, so a steady allocate/free cycle takes no lock; the
+ * shared per-class free lists are only touched to refill or drain a
+ * cache in batches. Larger requests fall through to malloc.
+ */
+#define BUFFER_POOL_MIN_SIZE 256
+#define BUFFER_POOL_CLASS_COUNT 8              // 256 B, 1 KiB, ... 4 MiB
+#define BUFFER_POOL_SLAB_SIZE (2 * 1024 * 1024)  // One huge page on x86-64
+#define BUFFER_POOL_CACHE_BYTES (1024 * 1024)  // Per-thread, per-class cache budget
+#define BUFFER_POOL_CACHE_MAX 32               // Buffers per thread and class at most
+
+/* Environment variable that requests MAP_HUGETLB slabs (same as -H on the server) */
+#define BUFFER_POOL_HUGEPAGES_ENV "EFTT_HUGEPAGES"
+
+/* Counters summed over every thread */
+typedef struct {
+    uint64_t hits;          // Served from a thread cache or a shared free list
+    uint64_t misses;        // Carved from fresh slab memory
+    uint64_t oversize;      // Larger than the biggest class; passed to malloc
+    uint64_t slabs;         // Slabs mapped
+    uint64_t huge_slabs;    // Of which backed by MAP_HUGETLB
+} buffer_pool_stats_t;
+
+/* Back new slabs with MAP_HUGETLB; falls back to normal pages if none are reserved */
+void buffer_pool_use_hugepages(int enable);
+
+/* A buffer of at least size bytes (uninitialized); NULL if out of memory */
+void* buffer_pool_alloc(size_t size);
+
+/* Return a buffer; size must be the size it was allocated with */
+void buffer_pool_free(void *buffer, size_t size);
+
+void buffer_pool_get_stats(buffer_pool_stats_t *stats);
+
+#endif /* BUFFER_POOL_H */
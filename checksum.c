@@ -0,0 +1,113 @@
+#include "checksum.h"
+#include "crypto.h"
+#include "protocol.h"
+
+int checksum_init(checksum_state_t *state, uint64_t length) {
+    memset(state, 0, sizeof(*state));
+    state->length = length;
+    state->chunk_count = (length + CHECKSUM_CHUNK_SIZE - 1) / CHECKSUM_CHUNK_SIZE;
+    state->bad_entry = UINT64_MAX;
+    if (state->chunk_count > 0) {
+        if (state->chunk_count > SIZE_MAX / sizeof(uint32_t)) {
+            return ERROR_MEMORY;
+        }
+        state->chunk_crcs = (uint32_t *)malloc((size_t)state->chunk_count * sizeof(uint32_t));
+        if (!state->chunk_crcs) {
+            return ERROR_MEMORY;
+        }
+    }
+    return SUCCESS;
+}
+
+void checksum_free(checksum_state_t *state) {
+    free(state->chunk_crcs);
+    state->chunk_crcs = NULL;
+}
+
+/* Run the fused kernel over buffer, closing each chunk's CRC at its boundary */
+static void checksum_pass(checksum_state_t *state, unsigned char *buffer, size_t size, int decrypt) {
+    const checksum_kernel_t *kernel = checksum_active_kernel();
+    while (size > 0 && state->position < state->length) {
+        uint64_t index = state->position / CHECKSUM_CHUNK_SIZE;
+        uint64_t chunk_end = (index + 1) * CHECKSUM_CHUNK_SIZE;
+        if (chunk_end > state->length) {
+            chunk_end = state->length;
+        }
+        size_t take = size;
+        if (chunk_end - state->position < take) {
+            take = (size_t)(chunk_end - state->position);
+        }
+        state->running = kernel->xor_crc_fn(buffer, take, ENCRYPTION_KEY, state->running, decrypt);
+        buffer += take;
+        size -= take;
+        state->position += take;
+        if (state->position == chunk_end) {
+            state->chunk_crcs[index] = state->running;
+            state->running = 0;
+        }
+    }
+    if (size > 0) {
+        encrypt_buffer(buffer, size, ENCRYPTION_KEY);  // Past the declared length: cipher only
+    }
+}
+
+void checksum_encrypt(checksum_state_t *state, unsigned char *buffer, size_t size) {
+    checksum_pass(state, buffer, size, 0);
+}
+
+void checksum_decrypt(checksum_state_t *state, unsigned char *buffer, size_t size) {
+    checksum_pass(state, buffer, size, 1);
+}
+
+/* Fold the chunk CRCs together rather than checksumming the file a second time */
+uint32_t checksum_file_crc(const checksum_state_t *state) {
+    uint32_t crc = 0;
+    for (uint64_t i = 0; i < state->chunk_count; i++) {
+        uint64_t chunk_length = state->length - i * CHECKSUM_CHUNK_SIZE;
+        if (chunk_length > CHECKSUM_CHUNK_SIZE) {
+            chunk_length = CHECKSUM_CHUNK_SIZE;
+        }
+        crc = crc32c_combine(crc, state->chunk_crcs[i], chunk_length);
+    }
+    return crc;
+}
+
+size_t checksum_trailer_size(const checksum_state_t *state) {
+    return (size_t)(state->chunk_count + 1) * sizeof(uint32_t);
+}
+
+void checksum_encode_trailer(const checksum_state_t *state, unsigned char *out) {
+    for (uint64_t i = 0; i < state->chunk_count; i++) {
+        put_le32(out + i * sizeof(uint32_t), state->chunk_crcs[i]);
+    }
+    put_le32(out + state->chunk_count * sizeof(uint32_t), checksum_file_crc(state));
+}
+
+size_t checksum_consume_trailer(checksum_state_t *state, const unsigned char *data, size_t len) {
+    size_t used = 0;
+    while (used < len && checksum_trailer_remaining(state) > 0) {
+        state->word[state->trailer_checked % sizeof(uint32_t)] = data[used++];
+        state->trailer_checked++;
+        if (state->trailer_checked % sizeof(uint32_t) != 0) {
+            continue;
+        }
+        uint64_t entry = state->trailer_checked / sizeof(uint32_t) - 1;
+        uint32_t expected = (entry < state->chunk_count) ? state->chunk_crcs[entry] : checksum_file_crc(state);
+        if (get_le32(state->word) != expected && state->bad_entry == UINT64_MAX) {
+            state->bad_entry = entry;
+        }
+    }
+    return used;
+}
+
+size_t checksum_trailer_remaining(const checksum_state_t *state) {
+    return checksum_trailer_size(state) - (size_t)state->trailer_checked;
+}
+
+int checksum_verify(const checksum_state_t *state) {
+    if (checksum_trailer_remaining(state) > 0 || state->position != state->length ||
+        state->bad_entry != UINT64_MAX) {
+        return ERROR_CHECKSUM;
+    }
+    return SUCCESS;
+}
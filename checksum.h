@@ -0,0 +1,49 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "common.h"
+#include <stdint.h>
+
+/*
+ * Per-chunk CRC32C of an OP_PUT payload (PUT_FEATURE_CHECKSUM, see
+ * protocol.h). The sender and the receiver run every payload byte through
+ * checksum_encrypt or checksum_decrypt, which checksum the plaintext in the
+ * same pass as the cipher, so integrity checking never re-reads the data.
+ */
+typedef struct {
+    uint64_t length;            // Payload bytes covered
+    uint64_t position;          // Payload bytes checksummed so far
+    uint64_t chunk_count;
+    uint32_t *chunk_crcs;       // Filled in as each chunk completes
+    uint32_t running;           // CRC of the current chunk so far
+    uint64_t trailer_checked;   // Receiver: trailer bytes compared so far
+    unsigned char word[4];      // Receiver: trailer entry still being assembled
+    uint64_t bad_entry;         // Receiver: first mismatching trailer entry, UINT64_MAX if none
+} checksum_state_t;
+
+/* Set up for a payload of length bytes; ERROR_MEMORY if the chunk table cannot be allocated */
+int checksum_init(checksum_state_t *state, uint64_t length);
+void checksum_free(checksum_state_t *state);
+
+/* Encrypt or decrypt the next size payload bytes in place, checksumming their plaintext */
+void checksum_encrypt(checksum_state_t *state, unsigned char *buffer, size_t size);
+void checksum_decrypt(checksum_state_t *state, unsigned char *buffer, size_t size);
+
+/* CRC32C of the whole payload, once every byte has gone through */
+uint32_t checksum_file_crc(const checksum_state_t *state);
+
+/* Sender: the trailer is trailer_size bytes, written by checksum_encode_trailer */
+size_t checksum_trailer_size(const checksum_state_t *state);
+void checksum_encode_trailer(const checksum_state_t *state, unsigned char *out);
+
+/*
+ * Receiver: compare trailer bytes as they arrive. Returns how many of the
+ * len bytes belonged to the trailer; the trailer is complete once
+ * checksum_trailer_remaining is 0, and checksum_verify then tells whether
+ * every entry matched (SUCCESS or ERROR_CHECKSUM).
+ */
+size_t checksum_consume_trailer(checksum_state_t *state, const unsigned char *data, size_t len);
+size_t checksum_trailer_remaining(const checksum_state_t *state);
+int checksum_verify(const checksum_state_t *state);
+
+#endif /* CHECKSUM_H */
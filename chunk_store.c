@@ -0,0 +1,432 @@
+#include "chunk_store.h"
+#include "chunker.h"
+#include "hash.h"
+#include "logger.h"
+#include <fcntl.h>
+
+typedef struct {
+    unsigned char digest[CHUNK_DIGEST_SIZE];
+    uint64_t offset;
+    uint32_t length;
+    uint32_t used;
+} chunk_entry_t;
+
+struct chunk_store {
+    pthread_mutex_t lock;         // Guards everything below; data writes happen outside it
+    char dir[MAX_FILENAME_LEN];
+    int data_fd;
+    int index_fd;                 // Opened O_APPEND so each record lands whole
+    uint64_t data_size;           // Next append offset in the data log
+    chunk_entry_t *table;         // Open addressing, keyed by the digest's leading bytes
+    size_t capacity;
+    chunk_store_stats_t stats;
+};
+
+/* Index records with a zero length and digest mark a point where all earlier data was synced */
+static const unsigned char checkpoint_digest[CHUNK_DIGEST_SIZE] = {0};
+
+static size_t slot_of(const chunk_store_t *store, const unsigned char *digest) {
+    uint64_t key;
+    memcpy(&key, digest, sizeof(key));
+    return (size_t)key & (store->capacity - 1);
+}
+
+/* Find a digest's entry; caller holds the lock */
+static chunk_entry_t* find_entry(chunk_store_t *store, const unsigned char *digest) {
+    for (size_t slot = slot_of(store, digest);; slot = (slot + 1) & (store->capacity - 1)) {
+        chunk_entry_t *entry = &store->table[slot];
+        if (!entry->used) {
+            return NULL;
+        }
+        if (memcmp(entry->digest, digest, CHUNK_DIGEST_SIZE) == 0) {
+            return entry;
+        }
+    }
+}
+
+/* Add an entry, growing the table at half load; caller holds the lock */
+static int insert_entry(chunk_store_t *store, const unsigned char *digest, uint64_t offset, uint32_t length) {
+    if ((store->stats.chunks + 1) * 2 > store->capacity) {
+        size_t old_capacity = store->capacity;
+        chunk_entry_t *old_table = store->table;
+        chunk_entry_t *table = (chunk_entry_t *)calloc(old_capacity * 2, sizeof(chunk_entry_t));
+        if (!table) {
+            return ERROR_MEMORY;
+        }
+        store->table = table;
+        store->capacity = old_capacity * 2;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_table[i].used) {
+                size_t slot = slot_of(store, old_table[i].digest);
+                while (table[slot].used) {
+                    slot = (slot + 1) & (store->capacity - 1);
+                }
+                table[slot] = old_table[i];
+            }
+        }
+        free(old_table);
+    }
+
+    size_t slot = slot_of(store, digest);
+    while (store->table[slot].used) {
+        slot = (slot + 1) & (store->capacity - 1);
+    }
+    chunk_entry_t *entry = &store->table[slot];
+    memcpy(entry->digest, digest, CHUNK_DIGEST_SIZE);
+    entry->offset = offset;
+    entry->length = length;
+    entry->used = 1;
+    store->stats.chunks++;
+    return SUCCESS;
+}
+
+static void encode_index_record(unsigned char *out, const unsigned char *digest, uint64_t offset,
+                                uint32_t length) {
+    memset(out, 0, CHUNK_INDEX_RECORD_SIZE);
+    memcpy(out, digest, CHUNK_DIGEST_SIZE);
+    put_le64(out + CHUNK_DIGEST_SIZE, offset);
+    put_le32(out + CHUNK_DIGEST_SIZE + 8, length);
+}
+
+/* Sync the data log, then record that in the index; caller holds the lock */
+static int write_checkpoint(chunk_store_t *store) {
+    unsigned char record[CHUNK_INDEX_RECORD_SIZE];
+    encode_index_record(record, checkpoint_digest, 0, 0);
+    if (fdatasync(store->data_fd) < 0 ||
+        write(store->index_fd, record, sizeof(record)) != (ssize_t)sizeof(record) ||
+        fdatasync(store->index_fd) < 0) {
+        perror("Failed to sync chunk store");
+        return ERROR_FILE_IO;
+    }
+    return SUCCESS;
+}
+
+/* True if length bytes at offset in the data log hash to digest */
+static int verify_chunk(chunk_store_t *store, const unsigned char *digest, uint64_t offset, uint32_t length,
+                        unsigned char *buffer) {
+    unsigned char actual[SHA256_DIGEST_SIZE];
+    if (pread(store->data_fd, buffer, length, (off_t)offset) != (ssize_t)length) {
+        return 0;
+    }
+    sha256(buffer, length, actual);
+    return memcmp(actual, digest, CHUNK_DIGEST_SIZE) == 0;
+}
+
+/*
+ * Load the index. Records before the last checkpoint are trusted; later
+ * ones may describe data that never reached the disk, so they are
+ * re-verified and the index is rewritten with only the good ones.
+ */
+static int load_index(chunk_store_t *store) {
+    struct stat index_stat;
+    if (fstat(store->index_fd, &index_stat) < 0) {
+        return ERROR_FILE_IO;
+    }
+    size_t record_count = (size_t)index_stat.st_size / CHUNK_INDEX_RECORD_SIZE;
+    unsigned char *records = (unsigned char *)malloc(record_count * CHUNK_INDEX_RECORD_SIZE + 1);
+    unsigned char *buffer = (unsigned char *)malloc(CDC_MAX_CHUNK_SIZE);
+    if (!records || !buffer) {
+        free(records);
+        free(buffer);
+        return ERROR_MEMORY;
+    }
+    if (pread(store->index_fd, records, record_count * CHUNK_INDEX_RECORD_SIZE, 0) !=
+        (ssize_t)(record_count * CHUNK_INDEX_RECORD_SIZE)) {
+        free(records);
+        free(buffer);
+        return ERROR_FILE_IO;
+    }
+
+    size_t trusted = 0;
+    for (size_t i = 0; i < record_count; i++) {
+        const unsigned char *record = records + i * CHUNK_INDEX_RECORD_SIZE;
+        if (get_le32(record + CHUNK_DIGEST_SIZE + 8) == 0 &&
+            memcmp(record, checkpoint_digest, CHUNK_DIGEST_SIZE) == 0) {
+            trusted = i + 1;
+        }
+    }
+
+    int status = SUCCESS;
+    size_t dropped = 0;
+    size_t kept_tail = trusted;
+    for (size_t i = 0; i < record_count && status == SUCCESS; i++) {
+        unsigned char *record = records + i * CHUNK_INDEX_RECORD_SIZE;
+        uint64_t offset = get_le64(record + CHUNK_DIGEST_SIZE);
+        uint32_t length = get_le32(record + CHUNK_DIGEST_SIZE + 8);
+        if (length == 0 || find_entry(store, record)) {
+            continue;
+        }
+        int valid = (length <= CDC_MAX_CHUNK_SIZE && offset + length <= store->data_size);
+        if (valid && i >= trusted) {
+            valid = verify_chunk(store, record, offset, length, buffer);
+            if (valid) {
+                memmove(records + kept_tail++ * CHUNK_INDEX_RECORD_SIZE, record, CHUNK_INDEX_RECORD_SIZE);
+            }
+        }
+        if (!valid) {
+            dropped++;
+            continue;
+        }
+        status = insert_entry(store, record, offset, length);
+        store->stats.stored_bytes += length;
+    }
+
+    /* Replace the unverified (or torn) tail with the records that checked out, then checkpoint */
+    if (status == SUCCESS && (trusted < record_count || (size_t)index_stat.st_size % CHUNK_INDEX_RECORD_SIZE != 0)) {
+        size_t tail_size = (kept_tail - trusted) * CHUNK_INDEX_RECORD_SIZE;
+        if (ftruncate(store->index_fd, (off_t)(trusted * CHUNK_INDEX_RECORD_SIZE)) < 0 ||
+            (tail_size > 0 && write(store->index_fd, records + trusted * CHUNK_INDEX_RECORD_SIZE, tail_size) !=
+                                  (ssize_t)tail_size)) {
+            status = ERROR_FILE_IO;
+        } else {
+            status = write_checkpoint(store);
+        }
+    }
+    if (dropped > 0) {
+        log_message(LOG_WARNING, "Chunk store: dropped %zu index records without valid data", dropped);
+    }
+
+    free(records);
+    free(buffer);
+    return status;
+}
+
+chunk_store_t* chunk_store_open(const char *dir) {
+    chunk_store_t *store = (chunk_store_t *)calloc(1, sizeof(chunk_store_t));
+    if (!store) {
+        return NULL;
+    }
+    pthread_mutex_init(&store->lock, NULL);
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    store->capacity = 1024;
+    store->table = (chunk_entry_t *)calloc(store->capacity, sizeof(chunk_entry_t));
+
+    char path[MAX_PATH_LEN];
+    create_directory_if_not_exists(dir);
+    snprintf(path, sizeof(path), "%s/%s", dir, CHUNK_FILES_DIR);
+    create_directory_if_not_exists(path);
+
+    snprintf(path, sizeof(path), "%s/%s", dir, CHUNK_DATA_FILE);
+    store->data_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    snprintf(path, sizeof(path), "%s/%s", dir, CHUNK_INDEX_FILE);
+    store->index_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    struct stat data_stat;
+    if (!store->table || store->data_fd < 0 || store->index_fd < 0 || fstat(store->data_fd, &data_stat) < 0) {
+        perror("Failed to open chunk store");
+        chunk_store_close(store);
+        return NULL;
+    }
+    store->data_size = (uint64_t)data_stat.st_size;
+
+    if (load_index(store) != SUCCESS) {
+        fprintf(stderr, "Failed to load chunk store index\n");
+        chunk_store_close(store);
+        return NULL;
+    }
+    log_message(LOG_INFO, "Chunk store %s: %llu chunks, %llu bytes", dir,
+                (unsigned long long)store->stats.chunks, (unsigned long long)store->stats.stored_bytes);
+    return store;
+}
+
+void chunk_store_close(chunk_store_t *store) {
+    if (!store) {
+        return;
+    }
+    if (store->data_fd >= 0) {
+        close(store->data_fd);
+    }
+    if (store->index_fd >= 0) {
+        close(store->index_fd);
+    }
+    pthread_mutex_destroy(&store->lock);
+    free(store->table);
+    free(store);
+}
+
+int chunk_store_contains(chunk_store_t *store, const unsigned char *digest) {
+    pthread_mutex_lock(&store->lock);
+    int present = (find_entry(store, digest) != NULL);
+    pthread_mutex_unlock(&store->lock);
+    return present;
+}
+
+int chunk_store_put(chunk_store_t *store, const unsigned char *digest, const unsigned char *data,
+                    uint32_t length) {
+    if (length == 0 || length > CDC_MAX_CHUNK_SIZE) {
+        return ERROR_FILE_IO;
+    }
+    pthread_mutex_lock(&store->lock);
+    if (find_entry(store, digest)) {
+        store->stats.dedup_hits++;
+        store->stats.dedup_bytes += length;
+        pthread_mutex_unlock(&store->lock);
+        return SUCCESS;
+    }
+    uint64_t offset = store->data_size;
+    store->data_size += length;
+    pthread_mutex_unlock(&store->lock);
+
+    /* Reserve-then-write keeps the lock off the disk path */
+    if (pwrite(store->data_fd, data, length, (off_t)offset) != (ssize_t)length) {
+        perror("Failed to write chunk");
+        return ERROR_FILE_IO;
+    }
+
+    int status = SUCCESS;
+    pthread_mutex_lock(&store->lock);
+    if (find_entry(store, digest)) {
+        /* Another upload stored the same chunk meanwhile; our copy stays unreferenced */
+        store->stats.dedup_hits++;
+        store->stats.dedup_bytes += length;
+    } else {
+        unsigned char record[CHUNK_INDEX_RECORD_SIZE];
+        encode_index_record(record, digest, offset, length);
+        if (write(store->index_fd, record, sizeof(record)) != (ssize_t)sizeof(record)) {
+            perror("Failed to update chunk index");
+            status = ERROR_FILE_IO;
+        } else {
+            status = insert_entry(store, digest, offset, length);
+            store->stats.stored_bytes += length;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    return status;
+}
+
+int chunk_store_get(chunk_store_t *store, const unsigned char *digest, unsigned char *buffer,
+                    uint32_t *length) {
+    pthread_mutex_lock(&store->lock);
+    chunk_entry_t *entry = find_entry(store, digest);
+    uint64_t offset = entry ? entry->offset : 0;
+    *length = entry ? entry->length : 0;
+    pthread_mutex_unlock(&store->lock);
+
+    if (!entry || !verify_chunk(store, digest, offset, *length, buffer)) {
+        return ERROR_FILE_IO;
+    }
+    return SUCCESS;
+}
+
+int chunk_store_commit_file(chunk_store_t *store, const char *name, uint64_t size,
+                            const chunk_ref_t *chunks, uint64_t count) {
+    pthread_mutex_lock(&store->lock);
+    int status = SUCCESS;
+    for (uint64_t i = 0; i < count && status == SUCCESS; i++) {
+        if (!find_entry(store, chunks[i].digest)) {
+            status = ERROR_FILE_IO;
+        }
+    }
+    if (status == SUCCESS) {
+        status = write_checkpoint(store);
+    }
+    pthread_mutex_unlock(&store->lock);
+    if (status != SUCCESS) {
+        return status;
+    }
+
+    /* Write the manifest beside its final name and rename it into place */
+    char path[MAX_PATH_LEN];
+    char staging_path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s/%s", store->dir, CHUNK_FILES_DIR, name);
+    snprintf(staging_path, sizeof(staging_path), "%s/%s/.%s.tmp", store->dir, CHUNK_FILES_DIR, name);
+    FILE *manifest = fopen(staging_path, "wb");
+    if (!manifest) {
+        perror("Failed to create file manifest");
+        return ERROR_FILE_IO;
+    }
+
+    unsigned char header[FILE_MANIFEST_HEADER_SIZE];
+    put_le32(header, FILE_MANIFEST_MAGIC);
+    put_le32(header + 4, FILE_MANIFEST_VERSION);
+    put_le64(header + 8, size);
+    put_le64(header + 16, count);
+    if (fwrite(header, 1, sizeof(header), manifest) != sizeof(header)) {
+        status = ERROR_FILE_IO;
+    }
+    for (uint64_t i = 0; i < count && status == SUCCESS; i++) {
+        unsigned char entry[CHUNK_LIST_ENTRY_SIZE];
+        memcpy(entry, chunks[i].digest, CHUNK_DIGEST_SIZE);
+        put_le32(entry + CHUNK_DIGEST_SIZE, chunks[i].length);
+        if (fwrite(entry, 1, sizeof(entry), manifest) != sizeof(entry)) {
+            status = ERROR_FILE_IO;
+        }
+    }
+    if (fflush(manifest) != 0 || fdatasync(fileno(manifest)) < 0) {
+        status = ERROR_FILE_IO;
+    }
+    if (fclose(manifest) != 0) {
+        status = ERROR_FILE_IO;
+    }
+    if (status == SUCCESS && rename(staging_path, path) < 0) {
+        status = ERROR_FILE_IO;
+    }
+    if (status != SUCCESS) {
+        perror("Failed to write file manifest");
+        unlink(staging_path);
+    }
+    return status;
+}
+
+int chunk_store_extract(chunk_store_t *store, const char *name, int out_fd) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s/%s", store->dir, CHUNK_FILES_DIR, name);
+    FILE *manifest = fopen(path, "rb");
+    if (!manifest) {
+        perror("Failed to open file manifest");
+        return ERROR_FILE_IO;
+    }
+
+    unsigned char header[FILE_MANIFEST_HEADER_SIZE];
+    unsigned char *buffer = (unsigned char *)malloc(CDC_MAX_CHUNK_SIZE);
+    int status = SUCCESS;
+    if (!buffer) {
+        status = ERROR_MEMORY;
+    } else if (fread(header, 1, sizeof(header), manifest) != sizeof(header) ||
+               get_le32(header) != FILE_MANIFEST_MAGIC || get_le32(header + 4) != FILE_MANIFEST_VERSION) {
+        fprintf(stderr, "Invalid file manifest: %s\n", path);
+        status = ERROR_FILE_IO;
+    }
+
+    uint64_t size = (status == SUCCESS) ? get_le64(header + 8) : 0;
+    uint64_t count = (status == SUCCESS) ? get_le64(header + 16) : 0;
+    uint64_t written = 0;
+    for (uint64_t i = 0; i < count && status == SUCCESS; i++) {
+        unsigned char entry[CHUNK_LIST_ENTRY_SIZE];
+        uint32_t length;
+        if (fread(entry, 1, sizeof(entry), manifest) != sizeof(entry) ||
+            chunk_store_get(store, entry, buffer, &length) != SUCCESS) {
+            fprintf(stderr, "Missing or corrupt chunk %llu of %s\n", (unsigned long long)i, name);
+            status = ERROR_FILE_IO;
+            break;
+        }
+        for (uint32_t done = 0; done < length;) {
+            ssize_t bytes_written = write(out_fd, buffer + done, length - done);
+            if (bytes_written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_written <= 0) {
+                perror("Failed to write extracted data");
+                status = ERROR_FILE_IO;
+                break;
+            }
+            done += (uint32_t)bytes_written;
+        }
+        written += length;
+    }
+    if (status == SUCCESS && written != size) {
+        fprintf(stderr, "Manifest of %s covers %llu of %llu bytes\n", name, (unsigned long long)written,
+                (unsigned long long)size);
+        status = ERROR_FILE_IO;
+    }
+
+    free(buffer);
+    fclose(manifest);
+    return status;
+}
+
+void chunk_store_get_stats(chunk_store_t *store, chunk_store_stats_t *stats) {
+    pthread_mutex_lock(&store->lock);
+    *stats = store->stats;
+    pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,58 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include "common.h"
+#include "protocol.h"
+#include <stdint.h>
+
+/*
+ * Content-addressed chunk store. Chunk data is appended to a single data
+ * log, and an append-only index maps each SHA-256 digest to its offset and
+ * length. The index is loaded into memory at startup. Stored files are
+ * manifests (a list of chunk digests) under CHUNK_STORE_DIR/files, so a
+ * chunk shared by many uploads is kept once.
+ */
+#define CHUNK_STORE_DIR "chunk_store"
+#define CHUNK_DATA_FILE "chunks.dat"
+#define CHUNK_INDEX_FILE "chunks.idx"
+#define CHUNK_FILES_DIR "files"
+
+#define CHUNK_INDEX_RECORD_SIZE 48  // digest, offset (8), length (4), reserved (4)
+#define FILE_MANIFEST_MAGIC 0x46544645u  // "EFTF" on disk
+#define FILE_MANIFEST_VERSION 1
+#define FILE_MANIFEST_HEADER_SIZE 24
+
+typedef struct chunk_store chunk_store_t;
+
+typedef struct {
+    uint64_t chunks;          // Distinct chunks in the store
+    uint64_t stored_bytes;    // Bytes in the data log
+    uint64_t dedup_hits;      // Chunks offered again after they were stored
+    uint64_t dedup_bytes;
+} chunk_store_stats_t;
+
+/* Open (creating if needed) the store under dir and load its index */
+chunk_store_t* chunk_store_open(const char *dir);
+void chunk_store_close(chunk_store_t *store);
+
+/* True if a chunk with this digest is stored */
+int chunk_store_contains(chunk_store_t *store, const unsigned char *digest);
+
+/* Store a chunk unless it is already present; the digest must match the data */
+int chunk_store_put(chunk_store_t *store, const unsigned char *digest, const unsigned char *data,
+                    uint32_t length);
+
+/* Read a chunk into buffer (at least CDC_MAX_CHUNK_SIZE bytes) and verify it */
+int chunk_store_get(chunk_store_t *store, const unsigned char *digest, unsigned char *buffer,
+                    uint32_t *length);
+
+/* Make every stored chunk durable, then publish name as a manifest of chunks */
+int chunk_store_commit_file(chunk_store_t *store, const char *name, uint64_t size,
+                            const chunk_ref_t *chunks, uint64_t count);
+
+/* Reassemble a stored file into out_fd */
+int chunk_store_extract(chunk_store_t *store, const char *name, int out_fd);
+
+void chunk_store_get_stats(chunk_store_t *store, chunk_store_stats_t *stats);
+
+#endif /* CHUNK_STORE_H */
@@ -0,0 +1,45 @@
+#include "chunker.h"
+
+/* Stricter mask before the average size and a looser one after it keeps chunk sizes close to the average */
+#define CDC_MASK_SMALL 0x1a250e90227c0000ULL  // 18 bits
+#define CDC_MASK_LARGE 0x1a210e8022680000ULL  // 14 bits, a subset of the small mask
+
+static uint64_t gear_table[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* Fixed pseudo-random table; every client must use the same one for dedup to work */
+static void init_gear_table(void) {
+    uint64_t state = 0x45465454u;  // "EFTT"
+    for (int i = 0; i < 256; i++) {
+        state += 0x9e3779b97f4a7c15ULL;  // splitmix64
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+size_t cdc_next_boundary(const unsigned char *data, size_t size) {
+    pthread_once(&gear_once, init_gear_table);
+    if (size <= CDC_MIN_CHUNK_SIZE) {
+        return size;
+    }
+
+    size_t limit = (size < CDC_MAX_CHUNK_SIZE) ? size : CDC_MAX_CHUNK_SIZE;
+    size_t normal = (limit < CDC_AVG_CHUNK_SIZE) ? limit : CDC_AVG_CHUNK_SIZE;
+    uint64_t fingerprint = 0;
+    size_t i = CDC_MIN_CHUNK_SIZE;
+    for (; i < normal; i++) {
+        fingerprint = (fingerprint << 1) + gear_table[data[i]];
+        if (!(fingerprint & CDC_MASK_SMALL)) {
+            return i + 1;
+        }
+    }
+    for (; i < limit; i++) {
+        fingerprint = (fingerprint << 1) + gear_table[data[i]];
+        if (!(fingerprint & CDC_MASK_LARGE)) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
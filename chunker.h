@@ -0,0 +1,22 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include "common.h"
+#include <stdint.h>
+
+/*
+ * Content-defined chunking (FastCDC-style gear hash). Boundaries depend on
+ * the data, not on offsets, so an insertion only changes the chunks around
+ * it and identical content from different files splits the same way.
+ */
+#define CDC_MIN_CHUNK_SIZE (16 * 1024)
+#define CDC_AVG_CHUNK_SIZE (64 * 1024)
+#define CDC_MAX_CHUNK_SIZE (256 * 1024)
+
+/*
+ * Length of the chunk starting at data. Callers pass at least
+ * CDC_MAX_CHUNK_SIZE bytes unless the input ends sooner.
+ */
+size_t cdc_next_boundary(const unsigned char *data, size_t size);
+
+#endif /* CHUNKER_H */
@@ -1,5 +1,40 @@
 #include "common.h"
 #include "crypto.h"
+#include "protocol.h"
+#include "delta.h"
+#include "chunker.h"
+#include "hash.h"
+#include "compress.h"
+#include "transfer.h"
+#include "buffer_pool.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+
+/* Upper bound on parallel streams for one file */
+#define MAX_STREAMS 64
+
+/* Reconnect attempts for resumable transfers, with linear backoff in seconds */
+#define RESUME_MAX_ATTEMPTS 5
+
+/* One byte range sent over its own connection in parallel mode */
+typedef struct {
+    const char *server_ip;
+    int server_port;
+    int file_fd;
+    const char *filename;
+    uint64_t transfer_id;
+    uint64_t total_size;
+    uint64_t offset;
+    uint64_t length;
+    int resume;             // Query the server's chunk map and send only missing chunks
+    int stream_index;       // Resumable streams own chunk partition stream_index of stream_count
+    int stream_count;
+    uint64_t bytes_sent;
+    uint64_t chunks_skipped;
+    int status;
+    char response[256];
+} range_stream_t;
 
 /* Signal handler for graceful shutdown */
 void signal_handler(int sig) {
@@ -7,40 +42,1001 @@ void signal_handler(int sig) {
     exit(EXIT_SUCCESS);
 }
 
+/* Send the extended header for this stream */
+static int send_stream_header(int client_socket, const range_stream_t *stream, uint16_t opcode) {
+    request_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTOCOL_MAGIC;
+    header.version = PROTOCOL_VERSION;
+    header.opcode = opcode;
+    header.name_len = (uint16_t)strlen(stream->filename);
+    header.transfer_id = stream->transfer_id;
+    header.total_size = stream->total_size;
+    header.offset = stream->offset;
+    header.length = stream->length;
+    
+    int status = send_request(client_socket, &header, stream->filename);
+    if (status != SUCCESS) {
+        perror("Failed to send request header");
+        report_early_response(client_socket);
+    }
+    return status;
+}
+
+/* Fetch the chunk map and send the missing chunks of this stream's partition */
+static int send_missing_chunks(int client_socket, range_stream_t *stream) {
+    int status = send_stream_header(client_socket, stream, OP_RESUME);
+    if (status != SUCCESS) {
+        return status;
+    }
+    
+    uint32_t chunk_size;
+    uint64_t chunk_count;
+    unsigned char *bitmap;
+    status = recv_chunk_map(client_socket, &chunk_size, &chunk_count, &bitmap);
+    if (status != SUCCESS) {
+        fprintf(stderr, "Failed to receive chunk map\n");
+        report_early_response(client_socket);
+        return status;
+    }
+    
+    uint64_t first = chunk_count * stream->stream_index / stream->stream_count;
+    uint64_t last = chunk_count * (stream->stream_index + 1) / stream->stream_count;
+    for (uint64_t index = first; index < last && status == SUCCESS; index++) {
+        if (bitmap[index / 8] & (1u << (index % 8))) {
+            stream->chunks_skipped++;
+            continue;
+        }
+        uint64_t offset = index * chunk_size;
+        uint64_t length = (stream->total_size - offset < chunk_size) ? stream->total_size - offset : chunk_size;
+        status = send_chunk_record(client_socket, offset, (uint32_t)length);
+        if (status == SUCCESS) {
+            status = send_file_data(client_socket, stream->file_fd, offset, length, 0);
+        }
+        if (status == SUCCESS) {
+            stream->bytes_sent += length;
+        }
+    }
+    free(bitmap);
+    
+    if (status == SUCCESS) {
+        status = send_chunk_record(client_socket, 0, 0);
+    }
+    return status;
+}
+
+/* Thread body: send one range (or chunk partition) over its own connection */
+static void* range_stream_main(void *arg) {
+    range_stream_t *stream = (range_stream_t *)arg;
+    int attempts = stream->resume ? RESUME_MAX_ATTEMPTS : 1;
+    
+    for (int attempt = 1; attempt <= attempts; attempt++) {
+        if (attempt > 1) {
+            printf("Stream %d: connection lost, resuming in %d s (attempt %d/%d)\n",
+                   stream->stream_index, attempt - 1, attempt, attempts);
+            sleep((unsigned int)(attempt - 1));
+        }
+    
+        stream->status = ERROR_CONNECT;
+        stream->chunks_skipped = 0;
+        int client_socket = connect_to_server(stream->server_ip, stream->server_port);
+        if (client_socket < 0) {
+            continue;
+        }
+    
+        if (stream->resume) {
+            stream->status = send_missing_chunks(client_socket, stream);
+        } else {
+            stream->status = send_stream_header(client_socket, stream, OP_RANGE);
+            if (stream->status == SUCCESS) {
+                stream->status = send_file_data(client_socket, stream->file_fd, stream->offset,
+                                                stream->length, 0);
+                stream->bytes_sent = (stream->status == SUCCESS) ? stream->length : 0;
+            }
+        }
+    
+        if (stream->status == SUCCESS && receive_ack(client_socket, stream->response,
+                                                     sizeof(stream->response)) <= 0) {
+            stream->status = ERROR_NETWORK;
+        }
+        close(client_socket);
+    
+        /* Local read errors will not go away by reconnecting */
+        if (stream->status == SUCCESS || stream->status == ERROR_FILE_IO) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Split the file into ranges (or chunk partitions) and send them over parallel connections */
+static int send_parallel(const char *server_ip, int server_port, int file_fd, const char *filename,
+                         const struct stat *file_stat, int stream_count, int resume) {
+    range_stream_t streams[MAX_STREAMS];
+    pthread_t threads[MAX_STREAMS];
+    uint64_t file_size = (uint64_t)file_stat->st_size;
+    
+    /* Ranges are aligned to the server's chunk size so every chunk arrives whole */
+    uint64_t range_size = (file_size + stream_count - 1) / stream_count;
+    range_size = (range_size + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE * TRANSFER_CHUNK_SIZE;
+    if (range_size == 0) {
+        range_size = TRANSFER_CHUNK_SIZE;
+    }
+    
+    /* Resumable streams never need more than one per chunk */
+    uint64_t chunk_count = (file_size + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE;
+    if (resume && (uint64_t)stream_count > chunk_count) {
+        stream_count = (chunk_count > 0) ? (int)chunk_count : 1;
+    }
+    
+    uint64_t transfer_id = file_transfer_id(file_stat);
+    
+    int started = 0;
+    for (int i = 0; i < stream_count; i++) {
+        uint64_t offset = resume ? 0 : (uint64_t)i * range_size;
+        if (offset >= file_size && i > 0) {
+            break;
+        }
+        range_stream_t *stream = &streams[started];
+        memset(stream, 0, sizeof(*stream));
+        stream->server_ip = server_ip;
+        stream->server_port = server_port;
+        stream->file_fd = file_fd;
+        stream->filename = filename;
+        stream->transfer_id = transfer_id;
+        stream->total_size = file_size;
+        stream->offset = offset;
+        stream->length = resume ? 0 : ((file_size - offset < range_size) ? file_size - offset : range_size);
+        stream->resume = resume;
+        stream->stream_index = i;
+        stream->stream_count = stream_count;
+    
+        if (pthread_create(&threads[started], NULL, range_stream_main, stream) != 0) {
+            perror("Failed to create stream thread");
+            break;
+        }
+        started++;
+    }
+    
+    int status = (started > 0) ? SUCCESS : ERROR_THREAD;
+    uint64_t chunks_skipped = 0;
+    uint64_t bytes_sent = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (resume) {
+            printf("Stream %d: %llu bytes %s", i, (unsigned long long)streams[i].bytes_sent,
+                   streams[i].status == SUCCESS ? "sent" : "FAILED");
+        } else {
+            printf("Stream %d: bytes %llu-%llu %s", i, (unsigned long long)streams[i].offset,
+                   (unsigned long long)(streams[i].offset + streams[i].length),
+                   streams[i].status == SUCCESS ? "sent" : "FAILED");
+        }
+        if (streams[i].response[0] != '\0') {
+            printf(" (%s)", streams[i].response);
+        }
+        printf("\n");
+        chunks_skipped += streams[i].chunks_skipped;
+        bytes_sent += streams[i].bytes_sent;
+        if (streams[i].status != SUCCESS) {
+            status = streams[i].status;
+        }
+    }
+    if (started < stream_count && (resume || (uint64_t)started * range_size < file_size)) {
+        status = ERROR_THREAD;
+    }
+    if (resume) {
+        printf("Server already had %llu of %llu chunks; sent %llu bytes\n",
+               (unsigned long long)chunks_skipped, (unsigned long long)chunk_count,
+               (unsigned long long)bytes_sent);
+    }
+    return status;
+}
+
+/* Upload only the blocks that differ from the server's existing copy */
+static int send_delta(const char *server_ip, int server_port, int file_fd, const char *filename,
+                      const struct stat *file_stat) {
+    int client_socket = connect_to_server(server_ip, server_port);
+    if (client_socket < 0) {
+        return ERROR_CONNECT;
+    }
+    
+    request_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTOCOL_MAGIC;
+    header.version = PROTOCOL_VERSION;
+    header.opcode = OP_DELTA;
+    header.name_len = (uint16_t)strlen(filename);
+    header.transfer_id = file_transfer_id(file_stat);
+    header.total_size = (uint64_t)file_stat->st_size;
+    int status = send_request(client_socket, &header, filename);
+    if (status != SUCCESS) {
+        perror("Failed to send request header");
+        report_early_response(client_socket);
+        close(client_socket);
+        return status;
+    }
+    
+    delta_stats_t stats;
+    status = delta_send(client_socket, file_fd, header.total_size, &stats);
+    if (status != SUCCESS) {
+        fprintf(stderr, "Failed to send delta\n");
+        report_early_response(client_socket);
+        close(client_socket);
+        return status;
+    }
+    printf("Delta: %llu literal bytes sent, %llu bytes reused from the server's copy (%llu commands%s)\n",
+           (unsigned long long)stats.literal_bytes, (unsigned long long)stats.copied_bytes,
+           (unsigned long long)stats.commands, (stats.flags & DELTA_FLAG_INPLACE) ? ", patchable in place" : "");
+    
+    char response[256];
+    if (receive_ack(client_socket, response, sizeof(response)) <= 0) {
+        fprintf(stderr, "Server rejected the delta\n");
+        status = ERROR_NETWORK;
+    } else {
+        printf("Server response: %s\n", response);
+    }
+    close(client_socket);
+    return status;
+}
+
+/* Split the file into content-defined chunks; *chunks must be freed by the caller */
+static int chunk_file(int file_fd, uint64_t file_size, chunk_ref_t **chunks, uint64_t *count) {
+    *chunks = (chunk_ref_t *)malloc((size_t)(file_size / CDC_MIN_CHUNK_SIZE + 1) * sizeof(chunk_ref_t));
+    *count = 0;
+    if (!*chunks) {
+        perror("Failed to allocate chunk list");
+        return ERROR_MEMORY;
+    }
+    if (file_size == 0) {
+        return SUCCESS;
+    }
+    
+    unsigned char *data = (unsigned char *)mmap(NULL, (size_t)file_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Failed to map file");
+        free(*chunks);
+        *chunks = NULL;
+        return ERROR_FILE_IO;
+    }
+    madvise(data, (size_t)file_size, MADV_SEQUENTIAL);
+    
+    for (uint64_t offset = 0; offset < file_size;) {
+        size_t length = cdc_next_boundary(data + offset, (size_t)(file_size - offset));
+        chunk_ref_t *chunk = &(*chunks)[(*count)++];
+        sha256(data + offset, length, chunk->digest);
+        chunk->length = (uint32_t)length;
+        offset += length;
+    }
+    munmap(data, (size_t)file_size);
+    return SUCCESS;
+}
+
+/* Upload as content-defined chunks, sending only those the server's chunk store lacks */
+static int send_dedup(const char *server_ip, int server_port, int file_fd, const char *filename,
+                      const struct stat *file_stat) {
+    uint64_t file_size = (uint64_t)file_stat->st_size;
+    chunk_ref_t *chunks;
+    uint64_t count;
+    int status = chunk_file(file_fd, file_size, &chunks, &count);
+    if (status != SUCCESS) {
+        return status;
+    }
+    
+    int client_socket = connect_to_server(server_ip, server_port);
+    if (client_socket < 0) {
+        free(chunks);
+        return ERROR_CONNECT;
+    }
+    
+    request_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTOCOL_MAGIC;
+    header.version = PROTOCOL_VERSION;
+    header.opcode = OP_CAS;
+    header.name_len = (uint16_t)strlen(filename);
+    header.transfer_id = file_transfer_id(file_stat);
+    header.total_size = file_size;
+    status = send_request(client_socket, &header, filename);
+    if (status == SUCCESS) {
+        status = send_chunk_list(client_socket, chunks, count);
+    }
+    
+    uint32_t max_chunk;
+    uint64_t map_count;
+    unsigned char *bitmap = NULL;
+    if (status == SUCCESS) {
+        status = recv_chunk_map(client_socket, &max_chunk, &map_count, &bitmap);
+    }
+    if (status != SUCCESS || map_count != count) {
+        fprintf(stderr, "Server did not answer the chunk query (is it running with -s cas?)\n");
+        report_early_response(client_socket);
+        close(client_socket);
+        free(chunks);
+        free(bitmap);
+        return (status != SUCCESS) ? status : ERROR_NETWORK;
+    }
+    
+    uint64_t offset = 0;
+    uint64_t sent = 0;
+    uint64_t present = 0;
+    for (uint64_t i = 0; i < count && status == SUCCESS; i++) {
+        if (bitmap[i / 8] & (1u << (i % 8))) {
+            present++;
+        } else {
+            status = send_file_data(client_socket, file_fd, offset, chunks[i].length, 0);
+            sent += chunks[i].length;
+        }
+        offset += chunks[i].length;
+    }
+    free(chunks);
+    free(bitmap);
+    printf("Dedup: %llu of %llu chunks already on the server; sent %llu of %llu bytes\n",
+           (unsigned long long)present, (unsigned long long)count, (unsigned long long)sent,
+           (unsigned long long)file_size);
+    
+    char response[256];
+    if (status == SUCCESS && receive_ack(client_socket, response, sizeof(response)) <= 0) {
+        fprintf(stderr, "Server did not acknowledge the upload\n");
+        status = ERROR_NETWORK;
+    } else if (status == SUCCESS) {
+        printf("Server response: %s\n", response);
+    }
+    close(client_socket);
+    return status;
+}
+
+/* Incompressible chunks back off the compressor for up to this many chunks */
+#define COMPRESS_MAX_BACKOFF 32
+
+/* Compress and send the file as frames; codec is what the server agreed to */
+static int send_frames(int client_socket, int file_fd, uint64_t file_size, uint32_t codec) {
+    unsigned char *chunk = (unsigned char *)buffer_pool_alloc(STREAM_CHUNK_SIZE);
+    unsigned char *frame_buffer = (unsigned char *)buffer_pool_alloc(FRAME_HEADER_SIZE + STREAM_CHUNK_SIZE);
+    if (!chunk || !frame_buffer) {
+        perror("Failed to allocate send buffers");
+        buffer_pool_free(chunk, STREAM_CHUNK_SIZE);
+        buffer_pool_free(frame_buffer, FRAME_HEADER_SIZE + STREAM_CHUNK_SIZE);
+        return ERROR_MEMORY;
+    }
+    
+    int status = SUCCESS;
+    uint64_t offset = 0;
+    uint64_t frames = 0;
+    uint64_t compressed_frames = 0;
+    uint64_t wire_bytes = 0;
+    unsigned long long cpu_nsec = 0;
+    unsigned int backoff = 1;  // Chunks to skip after the next incompressible one
+    unsigned int skip = 0;
+    progress_t progress;
+    progress_init(&progress);
+    while (offset < file_size) {
+        size_t want = STREAM_CHUNK_SIZE;
+        if (file_size - offset < want) {
+            want = (size_t)(file_size - offset);
+        }
+        ssize_t bytes_read = pread(file_fd, chunk, want, (off_t)offset);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            fprintf(stderr, "\nFailed to read file at byte %llu\n", (unsigned long long)offset);
+            status = ERROR_FILE_IO;
+            break;
+        }
+    
+        /* Keep the compressed form only if it saves at least 1/COMPRESS_MIN_SAVING */
+        frame_header_t frame = { (uint32_t)bytes_read, (uint32_t)bytes_read, 0, 0 };
+        unsigned char *payload = frame_buffer + FRAME_HEADER_SIZE;
+        if (codec == CODEC_LZ && skip == 0) {
+            unsigned long long started = thread_cpu_time_ns();
+            size_t packed = lz_compress(chunk, (size_t)bytes_read, payload,
+                                        (size_t)bytes_read - (size_t)bytes_read / COMPRESS_MIN_SAVING);
+            unsigned long long elapsed = thread_cpu_time_ns() - started;
+            cpu_nsec += elapsed;
+            frame.cpu_usec = (uint32_t)(elapsed / 1000);
+            if (packed > 0) {
+                frame.stored_length = (uint32_t)packed;
+                frame.compressed = 1;
+                compressed_frames++;
+                backoff = 1;
+            } else {
+                /* Media and encrypted data rarely change mid-file; probe less often */
+                skip = backoff;
+                if (backoff < COMPRESS_MAX_BACKOFF) {
+                    backoff *= 2;
+                }
+            }
+        } else if (skip > 0) {
+            skip--;
+        }
+        if (!frame.compressed) {
+            memcpy(payload, chunk, (size_t)bytes_read);
+        }
+    
+        encode_frame_header(&frame, frame_buffer);
+        encrypt_buffer(payload, frame.stored_length, ENCRYPTION_KEY);
+        if (send_all(client_socket, frame_buffer, FRAME_HEADER_SIZE + frame.stored_length) != SUCCESS) {
+            perror("Failed to send file data");
+            report_early_response(client_socket);
+            status = ERROR_NETWORK;
+            break;
+        }
+        offset += (uint64_t)bytes_read;
+        frames++;
+        wire_bytes += FRAME_HEADER_SIZE + frame.stored_length;
+        progress_bytes(&progress, "Sent", offset, file_size);
+    }
+    buffer_pool_free(chunk, STREAM_CHUNK_SIZE);
+    buffer_pool_free(frame_buffer, FRAME_HEADER_SIZE + STREAM_CHUNK_SIZE);
+    
+    if (status == SUCCESS) {
+        printf("\nCompression (%s): %llu of %llu chunks compressed, %llu -> %llu bytes on the wire "
+               "(%.2fx), %.1f ms CPU\n", codec_name(codec), (unsigned long long)compressed_frames,
+               (unsigned long long)frames, (unsigned long long)file_size, (unsigned long long)wire_bytes,
+               wire_bytes ? (double)file_size / wire_bytes : 1.0, cpu_nsec / 1000000.0);
+    }
+    return status;
+}
+
+/* Upload the whole file, compressing chunks if the server supports it */
+static int send_compressed(const char *server_ip, int server_port, int file_fd, const char *filename,
+                           const struct stat *file_stat) {
+    int client_socket = connect_to_server(server_ip, server_port);
+    if (client_socket < 0) {
+        return ERROR_CONNECT;
+    }
+    
+    request_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTOCOL_MAGIC;
+    header.version = PROTOCOL_VERSION;
+    header.opcode = OP_UPLOAD;
+    header.name_len = (uint16_t)strlen(filename);
+    header.flags = CODEC_MASK(CODEC_LZ);
+    header.transfer_id = file_transfer_id(file_stat);
+    header.total_size = (uint64_t)file_stat->st_size;
+    int status = send_request(client_socket, &header, filename);
+    
+    unsigned char reply[CODEC_REPLY_SIZE];
+    if (status == SUCCESS) {
+        status = recv_all(client_socket, reply, sizeof(reply));
+    }
+    uint32_t codec = get_le32(reply);
+    if (status != SUCCESS || (codec != CODEC_NONE && codec != CODEC_LZ)) {
+        fprintf(stderr, "Server did not accept the compressed upload\n");
+        report_early_response(client_socket);
+        close(client_socket);
+        return (status != SUCCESS) ? status : ERROR_NETWORK;
+    }
+    
+    status = send_frames(client_socket, file_fd, header.total_size, codec);
+    char response[256];
+    if (status == SUCCESS && receive_ack(client_socket, response, sizeof(response)) <= 0) {
+        fprintf(stderr, "Server did not acknowledge the upload\n");
+        status = ERROR_NETWORK;
+    } else if (status == SUCCESS) {
+        printf("Server response: %s\n", response);
+    }
+    close(client_socket);
+    return status;
+}
+
+/* Files found under a session's root directory */
+typedef struct {
+    char **paths;          // Relative to the root
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t total_bytes;
+    uint64_t skipped;      // Symlinks and special files
+} file_list_t;
+
+static void free_file_list(file_list_t *list) {
+    for (uint64_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+}
+
+static int add_file(file_list_t *list, const char *path, uint64_t size) {
+    if (list->count == list->capacity) {
+        uint64_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        char **paths = (char **)realloc(list->paths, (size_t)capacity * sizeof(char *));
+        if (!paths) {
+            return ERROR_MEMORY;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    if (!(list->paths[list->count] = strdup(path))) {
+        return ERROR_MEMORY;
+    }
+    list->count++;
+    list->total_bytes += size;
+    return SUCCESS;
+}
+
+/* Recursively list the regular files under path; root_len is the length of the root prefix */
+static int collect_files(char *path, size_t path_len, size_t root_len, file_list_t *list) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Failed to open directory %s: %s\n", path, strerror(errno));
+        return ERROR_FILE_IO;
+    }
+    
+    int status = SUCCESS;
+    struct dirent *entry;
+    while (status == SUCCESS && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        size_t name_len = strlen(entry->d_name);
+        if (path_len + 1 + name_len - root_len - 1 > SESSION_MAX_PATH_LEN || path_len + 1 + name_len >= PATH_MAX) {
+            fprintf(stderr, "Skipping %s/%s: path too long\n", path, entry->d_name);
+            list->skipped++;
+            continue;
+        }
+        struct stat entry_stat;
+        if (fstatat(dirfd(dir), entry->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW) < 0) {
+            fprintf(stderr, "Failed to stat %s/%s: %s\n", path, entry->d_name, strerror(errno));
+            status = ERROR_FILE_IO;
+            break;
+        }
+    
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, entry->d_name, name_len + 1);
+        if (S_ISDIR(entry_stat.st_mode)) {
+            status = collect_files(path, path_len + 1 + name_len, root_len, list);
+        } else if (S_ISREG(entry_stat.st_mode)) {
+            status = add_file(list, path + root_len + 1, (uint64_t)entry_stat.st_size);
+        } else {
+            list->skipped++;
+        }
+        path[path_len] = '\0';
+    }
+    closedir(dir);
+    return status;
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Sender side of an OP_SESSION stream: records are batched into one buffer */
+#define SESSION_SEND_BUFFER (256 * 1024)
+
+typedef struct {
+    int sock;
+    unsigned char *buffer;
+    size_t len;
+    const file_list_t *list;
+    const uint64_t *sent;          // List index of each file sent, in stream order
+    unsigned char ack[SESSION_ACK_SIZE];
+    size_t ack_fill;
+    uint32_t confirmed;
+    uint64_t confirmed_bytes;
+    uint32_t failed;
+    int done;
+} session_sender_t;
+
+/* Consume the server's acknowledgments; without wait, only those already received */
+static int read_session_acks(session_sender_t *sender, int wait) {
+    while (!sender->done) {
+        ssize_t received = recv(sender->sock, sender->ack + sender->ack_fill, SESSION_ACK_SIZE - sender->ack_fill,
+                                wait ? 0 : MSG_DONTWAIT);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received < 0 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return SUCCESS;
+        }
+        if (received <= 0) {
+            return ERROR_NETWORK;
+        }
+        sender->ack_fill += (size_t)received;
+        if (sender->ack_fill < SESSION_ACK_SIZE) {
+            continue;
+        }
+        sender->ack_fill = 0;
+    
+        uint32_t kind = get_le32(sender->ack);
+        uint32_t count = get_le32(sender->ack + 4);
+        if (kind == SESSION_ACK_FAILED) {
+            sender->failed++;
+            fprintf(stderr, "\nServer failed to store %s\n",
+                    (count < sender->list->count) ? sender->list->paths[sender->sent[count]] : "(unknown file)");
+        } else if (kind == SESSION_ACK_BATCH || kind == SESSION_ACK_DONE) {
+            sender->confirmed = count;
+            sender->confirmed_bytes = get_le64(sender->ack + 8);
+            sender->done = (kind == SESSION_ACK_DONE);
+        } else {
+            return ERROR_NETWORK;
+        }
+    }
+    return SUCCESS;
+}
+
+static int flush_session(session_sender_t *sender) {
+    if (send_all(sender->sock, sender->buffer, sender->len) != SUCCESS) {
+        perror("Failed to send session data");
+        return ERROR_NETWORK;
+    }
+    sender->len = 0;
+    return read_session_acks(sender, 0);
+}
+
+/* Append one file (record header, path, encrypted data) to the stream */
+static int send_session_file(session_sender_t *sender, int file_fd, const char *path, uint64_t size) {
+    size_t path_len = strlen(path);
+    if (sender->len + SESSION_RECORD_HEADER_SIZE + path_len > SESSION_SEND_BUFFER &&
+        flush_session(sender) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    encode_session_record((uint16_t)path_len, size, sender->buffer + sender->len);
+    memcpy(sender->buffer + sender->len + SESSION_RECORD_HEADER_SIZE, path, path_len);
+    sender->len += SESSION_RECORD_HEADER_SIZE + path_len;
+    
+    uint64_t offset = 0;
+    while (offset < size) {
+        if (sender->len == SESSION_SEND_BUFFER && flush_session(sender) != SUCCESS) {
+            return ERROR_NETWORK;
+        }
+        size_t want = SESSION_SEND_BUFFER - sender->len;
+        if (want > size - offset) {
+            want = (size_t)(size - offset);
+        }
+        ssize_t bytes_read = pread(file_fd, sender->buffer + sender->len, want, (off_t)offset);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            /* The record already announced the size, so the stream cannot continue */
+            fprintf(stderr, "\n%s changed while it was being sent\n", path);
+            return ERROR_FILE_IO;
+        }
+        encrypt_buffer(sender->buffer + sender->len, (size_t)bytes_read, ENCRYPTION_KEY);
+        sender->len += (size_t)bytes_read;
+        offset += (uint64_t)bytes_read;
+    }
+    return SUCCESS;
+}
+
+/* Send every regular file under root over one connection, without per-file round trips */
+static int send_session(const char *server_ip, int server_port, const char *root, const char *root_name) {
+    char *path = (char *)malloc(PATH_MAX);
+    if (!path) {
+        perror("Failed to allocate path buffer");
+        return ERROR_MEMORY;
+    }
+    file_list_t list;
+    memset(&list, 0, sizeof(list));
+    size_t root_len = (size_t)snprintf(path, PATH_MAX, "%s", root);
+    int status = collect_files(path, root_len, root_len, &list);
+    if (status != SUCCESS) {
+        free(path);
+        free_file_list(&list);
+        return status;
+    }
+    
+    /* Sorted order keeps each directory's files together for the server */
+    qsort(list.paths, (size_t)list.count, sizeof(char *), compare_paths);
+    printf("Found %llu files (%llu bytes)%s\n", (unsigned long long)list.count,
+           (unsigned long long)list.total_bytes, list.skipped ? ", skipping links and special files" : "");
+    
+    session_sender_t sender;
+    memset(&sender, 0, sizeof(sender));
+    sender.list = &list;
+    sender.buffer = (unsigned char *)buffer_pool_alloc(SESSION_SEND_BUFFER);
+    uint64_t *sent = (uint64_t *)malloc((size_t)(list.count + 1) * sizeof(uint64_t));
+    sender.sent = sent;
+    sender.sock = (sender.buffer && sent) ? connect_to_server(server_ip, server_port) : -1;
+    if (sender.sock < 0) {
+        free(path);
+        buffer_pool_free(sender.buffer, SESSION_SEND_BUFFER);
+        free(sent);
+        free_file_list(&list);
+        return ERROR_CONNECT;
+    }
+    
+    request_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTOCOL_MAGIC;
+    header.version = PROTOCOL_VERSION;
+    header.opcode = OP_SESSION;
+    header.name_len = (uint16_t)strlen(root_name);
+    header.total_size = list.total_bytes;
+    header.length = list.count;
+    status = send_request(sender.sock, &header, root_name);
+    
+    uint64_t sent_count = 0;
+    uint64_t sent_bytes = 0;
+    uint64_t unreadable = 0;
+    progress_t progress;
+    progress_init(&progress);
+    for (uint64_t i = 0; i < list.count && status == SUCCESS; i++) {
+        snprintf(path, PATH_MAX, "%s/%s", root, list.paths[i]);
+        int file_fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat file_stat;
+        if (file_fd < 0 || fstat(file_fd, &file_stat) < 0) {
+            fprintf(stderr, "\nSkipping %s: %s\n", path, strerror(errno));
+            if (file_fd >= 0) {
+                close(file_fd);
+            }
+            unreadable++;
+            continue;
+        }
+        status = send_session_file(&sender, file_fd, list.paths[i], (uint64_t)file_stat.st_size);
+        close(file_fd);
+        sent[sent_count++] = i;
+        sent_bytes += (uint64_t)file_stat.st_size;
+        if (status == SUCCESS && sender.len == 0 && progress_due(&progress, i + 1 == list.count)) {
+            printf("Sent %llu/%llu files (%llu bytes), server confirmed %u\r", (unsigned long long)sent_count,
+                   (unsigned long long)list.count, (unsigned long long)sent_bytes, sender.confirmed);
+            fflush(stdout);
+        }
+    }
+    
+    /* End record, then wait for the final acknowledgment */
+    if (status == SUCCESS) {
+        if (sender.len + SESSION_RECORD_HEADER_SIZE > SESSION_SEND_BUFFER) {
+            status = flush_session(&sender);
+        }
+        encode_session_record(0, 0, sender.buffer + sender.len);
+        sender.len += SESSION_RECORD_HEADER_SIZE;
+    }
+    if (status == SUCCESS) {
+        status = flush_session(&sender);
+    }
+    if (status == SUCCESS) {
+        status = read_session_acks(&sender, 1);
+    }
+    if (status != SUCCESS) {
+        fprintf(stderr, "\nSession aborted after %llu files; the server confirmed %u\n",
+                (unsigned long long)sent_count, sender.confirmed);
+        report_early_response(sender.sock);
+    } else {
+        printf("\nSession: %llu files (%llu bytes) sent, %u stored, %u failed on the server, %llu unreadable\n",
+               (unsigned long long)sent_count, (unsigned long long)sent_bytes, sender.confirmed, sender.failed,
+               (unsigned long long)unreadable);
+        if (sender.failed || unreadable) {
+            status = ERROR_FILE_IO;
+        }
+    }
+    close(sender.sock);
+    free(path);
+    buffer_pool_free(sender.buffer, SESSION_SEND_BUFFER);
+    free(sent);
+    free_file_list(&list);
+    return status;
+}
+
+/* Download a stored file into the current directory under the same name */
+static int download_file(const char *server_ip, int server_port, const char *name) {
+    if (!is_safe_filename(name) || strlen(name) >= MAX_FILENAME_LEN) {
+        fprintf(stderr, "Invalid file name: %s\n", name);
+        return ERROR_FILE_IO;
+    }
+    
+    /* Write beside the target and rename, so a failed download never replaces a good file */
+    char partial[MAX_PATH_LEN];
+    snprintf(partial, sizeof(partial), "%s.part", name);
+    int out_fd = open(partial, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd < 0) {
+        perror("Failed to create output file");
+        return ERROR_FILE_IO;
+    }
+    printf("Downloading %s from %s:%d...\n", name, server_ip, server_port);
+    uint64_t file_size = 0;
+    int status = get_file(server_ip, server_port, name, out_fd, 1, &file_size);
+    if (close(out_fd) < 0 && status == SUCCESS) {
+        perror("Failed to flush output file");
+        status = ERROR_FILE_IO;
+    }
+    if (status == SUCCESS && rename(partial, name) < 0) {
+        perror("Failed to rename downloaded file");
+        status = ERROR_FILE_IO;
+    }
+    if (status != SUCCESS) {
+        unlink(partial);
+        return status;
+    }
+    printf("\nSaved %s (%llu bytes)\n", name, (unsigned long long)file_size);
+    return SUCCESS;
+}
+
+/* Print client usage */
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-j streams] [-r] [-d] [-c] [-z] [-S] [-L] [-n buffers] [-b size]\n"
+                    "          [-B rate] [-T ms] [-Z] <server_ip> <server_port> [path]\n"
+                    "       %s -G [-B rate] [-T ms] <server_ip> <server_port> name\n", prog, prog);
+    fprintf(stderr, "  path        A file, or a directory to send recursively over one connection\n");
+    fprintf(stderr, "  -j streams  Send the file over N parallel connections (default: 1)\n");
+    fprintf(stderr, "  -r          Resumable: send only chunks the server lacks, reconnect on failure\n");
+    fprintf(stderr, "  -d          Delta: send only the blocks that differ from the server's copy\n");
+    fprintf(stderr, "  -c          Dedup: send only chunks the server's chunk store lacks\n");
+    fprintf(stderr, "  -z          Compress each chunk before encryption (sent raw if incompressible)\n");
+    fprintf(stderr, "  -S          Ask the server to fsync the file before acknowledging it\n");
+    fprintf(stderr, "  -L          Legacy framing (filename and size_t), for servers that predate OP_PUT\n");
+    fprintf(stderr, "  -G          Download the stored file name into the current directory\n");
+    fprintf(stderr, "  -n buffers  Buffers in the read/encrypt/send pipeline ring (default: %d)\n",
+            PIPELINE_DEFAULT_BUFFERS);
+    fprintf(stderr, "  -b size     Size of each pipeline buffer, K/M suffixes allowed (default: %dK)\n",
+            PIPELINE_DEFAULT_BUFFER_SIZE / 1024);
+    fprintf(stderr, "  -B rate     Link rate in bytes/s (K/M/G): size socket buffers to its bandwidth-delay\n"
+                    "              product instead of leaving them to kernel autotuning\n");
+    fprintf(stderr, "  -T ms       Round-trip time for -B (default: measured on each connection)\n");
+    fprintf(stderr, "  -Z          Copy every send instead of using MSG_ZEROCOPY for large buffers\n");
+    fprintf(stderr, "Example: %s localhost 8080 ./myfile.txt\n", prog);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 3 || argc > 4) {
-        fprintf(stderr, "Usage: %s <server_ip> <server_port> [file_path]\n", argv[0]);
-        fprintf(stderr, "Example: %s localhost 8080 ./myfile.txt\n", argv[0]);
+    int stream_count = 1;
+    int resume = 0;
+    int delta = 0;
+    int dedup = 0;
+    int compress = 0;
+    int legacy = 0;
+    int download = 0;
+    uint16_t features = 0;
+    pipeline_config_t pipeline = { PIPELINE_DEFAULT_BUFFERS, PIPELINE_DEFAULT_BUFFER_SIZE };
+    int pipeline_set = 0;
+    uint64_t buffer_size;
+    transport_config_t transport = { 0, 0, 1 };
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "j:rdczSLGn:b:B:T:Zh")) != -1) {
+        switch (opt_char) {
+        case 'j':
+            stream_count = atoi(optarg);
+            if (stream_count < 1 || stream_count > MAX_STREAMS) {
+                fprintf(stderr, "Stream count must be between 1 and %d\n", MAX_STREAMS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            resume = 1;
+            break;
+        case 'd':
+            delta = 1;
+            break;
+        case 'c':
+            dedup = 1;
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'S':
+            features |= PUT_FEATURE_SYNC;
+            break;
+        case 'L':
+            legacy = 1;
+            break;
+        case 'G':
+            download = 1;
+            break;
+        case 'n':
+            pipeline.buffer_count = atoi(optarg);
+            if (pipeline.buffer_count < 1 || pipeline.buffer_count > PIPELINE_MAX_BUFFERS) {
+                fprintf(stderr, "Buffer count must be between 1 and %d\n", PIPELINE_MAX_BUFFERS);
+                return EXIT_FAILURE;
+            }
+            pipeline_set = 1;
+            break;
+        case 'b':
+            if (parse_byte_size(optarg, &buffer_size) != SUCCESS || buffer_size < PIPELINE_MIN_BUFFER_SIZE ||
+                buffer_size > PIPELINE_MAX_BUFFER_SIZE) {
+                fprintf(stderr, "Buffer size must be between %dK and %dM\n", PIPELINE_MIN_BUFFER_SIZE / 1024,
+                        PIPELINE_MAX_BUFFER_SIZE / (1024 * 1024));
+                return EXIT_FAILURE;
+            }
+            pipeline.buffer_size = (size_t)buffer_size;
+            pipeline_set = 1;
+            break;
+        case 'B':
+            if (parse_byte_size(optarg, &transport.link_rate) != SUCCESS) {
+                fprintf(stderr, "Invalid link rate: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'T': {
+            double rtt_ms = atof(optarg);
+            if (rtt_ms <= 0 || rtt_ms > 10000) {
+                fprintf(stderr, "Round-trip time must be between 0 and 10000 ms\n");
+                return EXIT_FAILURE;
+            }
+            transport.rtt_us = (uint32_t)(rtt_ms * 1000);
+            break;
+        }
+        case 'Z':
+            transport.zerocopy = 0;
+            break;
+        default:
+            print_usage(argv[0]);
+            return (opt_char == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    
+    if (argc - optind < 2 || argc - optind > 3) {
+        print_usage(argv[0]);
         return EXIT_FAILURE;
     }
+    if ((delta || dedup || compress) && (stream_count > 1 || resume || delta + dedup + compress > 1)) {
+        fprintf(stderr, "-d, -c and -z cannot be combined with each other or with -j or -r\n");
+        return EXIT_FAILURE;
+    }
+    if ((legacy || features || pipeline_set) && (stream_count > 1 || resume || delta || dedup || compress)) {
+        fprintf(stderr, "-S, -L, -n and -b apply to plain single-stream uploads\n");
+        return EXIT_FAILURE;
+    }
+    if (legacy && features) {
+        fprintf(stderr, "-S needs the versioned header and cannot be used with -L\n");
+        return EXIT_FAILURE;
+    }
+    if (transport.rtt_us && !transport.link_rate) {
+        fprintf(stderr, "-T sets the round trip for -B and needs it\n");
+        return EXIT_FAILURE;
+    }
+    transport_configure(&transport);
     
-    const char *server_ip = argv[1];
-    int server_port = atoi(argv[2]);
-    const char *file_path = (argc == 4) ? argv[3] : "test.txt";
+    const char *server_ip = argv[optind];
+    int server_port = atoi(argv[optind + 1]);
+    const char *file_path = (argc - optind == 3) ? argv[optind + 2] : "test.txt";
     
     /* Setup signal handlers */
     setup_signal_handlers(signal_handler);
     
+    if (download) {
+        if (argc - optind != 3 || legacy || features || pipeline_set || stream_count > 1 || resume || delta ||
+            dedup || compress) {
+            fprintf(stderr, "-G takes a file name and no other transfer options\n");
+            return EXIT_FAILURE;
+        }
+        if (download_file(server_ip, server_port, file_path) != SUCCESS) {
+            fprintf(stderr, "Download failed\n");
+            return EXIT_FAILURE;
+        }
+        printf("File transfer completed.\n");
+        return EXIT_SUCCESS;
+    }
+    
     /* Validate file path */
-    FILE *file = fopen(file_path, "rb");
-    if (!file) {
+    int file_fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
         perror("Failed to open file");
         return EXIT_FAILURE;
     }
     
     /* Get file size */
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    if (file_size < 0) {
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) < 0) {
         fprintf(stderr, "Failed to determine file size\n");
-        fclose(file);
+        close(file_fd);
         return EXIT_FAILURE;
     }
+    uint64_t file_size = (uint64_t)file_stat.st_size;
+    
+    /* A directory is sent as one session, named after its last path component */
+    if (S_ISDIR(file_stat.st_mode)) {
+        close(file_fd);
+        char resolved[PATH_MAX];
+        const char *root_name = realpath(file_path, resolved) ? strrchr(resolved, '/') + 1 : "";
+        if (delta || dedup || compress || stream_count > 1 || resume) {
+            fprintf(stderr, "-d, -c, -z, -j and -r apply to single files, not directories\n");
+            return EXIT_FAILURE;
+        }
+        if (!is_safe_filename(root_name) || strlen(root_name) >= MAX_FILENAME_LEN) {
+            fprintf(stderr, "Cannot send %s as a session: it needs a plain directory name\n", file_path);
+            return EXIT_FAILURE;
+        }
+        printf("Sending directory %s as %s/ to %s:%d...\n", file_path, root_name, server_ip, server_port);
+        if (send_session(server_ip, server_port, file_path, root_name) != SUCCESS) {
+            fprintf(stderr, "Session transfer incomplete\n");
+            return EXIT_FAILURE;
+        }
+        printf("File transfer completed.\n");
+        return EXIT_SUCCESS;
+    }
     
     printf("File: %s\n", file_path);
-    printf("Size: %ld bytes\n", file_size);
+    printf("Size: %llu bytes\n", (unsigned long long)file_size);
     
     /* Extract filename from path */
     const char *filename = strrchr(file_path, '/');
@@ -50,108 +1046,149 @@ int main(int argc, char *argv[]) {
     filename = filename ? filename + 1 : file_path;
     printf("Filename: %s\n", filename);
     
-    /* Read file into memory */
-    unsigned char *file_data = (unsigned char *)malloc(file_size);
-    if (!file_data) {
-        perror("Failed to allocate memory for file data");
-        fclose(file);
-        return EXIT_FAILURE;
+    if (delta || dedup) {
+        printf("Sending %s to %s:%d...\n", delta ? "delta" : "new chunks", server_ip, server_port);
+        int status = delta ? send_delta(server_ip, server_port, file_fd, filename, &file_stat)
+                           : send_dedup(server_ip, server_port, file_fd, filename, &file_stat);
+        close(file_fd);
+        if (status != SUCCESS) {
+            fprintf(stderr, "%s transfer failed\n", delta ? "Delta" : "Dedup");
+            return EXIT_FAILURE;
+        }
+        printf("File transfer completed.\n");
+        return EXIT_SUCCESS;
     }
     
-    size_t bytes_read = fread(file_data, 1, file_size, file);
-    fclose(file);
+    if (compress) {
+        printf("Sending compressed to %s:%d...\n", server_ip, server_port);
+        int status = send_compressed(server_ip, server_port, file_fd, filename, &file_stat);
+        close(file_fd);
+        if (status != SUCCESS) {
+            fprintf(stderr, "Compressed transfer failed\n");
+            return EXIT_FAILURE;
+        }
+        printf("File transfer completed.\n");
+        return EXIT_SUCCESS;
+    }
+    
+    if (stream_count > 1 || resume) {
+        printf("Sending over %d %s stream%s to %s:%d...\n", stream_count, resume ? "resumable" : "parallel",
+               stream_count > 1 ? "s" : "", server_ip, server_port);
+        int status = send_parallel(server_ip, server_port, file_fd, filename, &file_stat, stream_count, resume);
+        close(file_fd);
+        if (status != SUCCESS) {
+            fprintf(stderr, "Parallel transfer failed\n");
+            return EXIT_FAILURE;
+        }
+        printf("File transfer completed.\n");
+        return EXIT_SUCCESS;
+    }
     
-    if (bytes_read != (size_t)file_size) {
-        fprintf(stderr, "Failed to read entire file (read %zu of %ld bytes)\n", bytes_read, file_size);
-        free(file_data);
+    /* The server would read this legacy header as an extended request */
+    if (legacy_header_collides(filename, (size_t)file_size)) {
+        fprintf(stderr, "Filename %s with this file size is reserved by the extended protocol\n", filename);
+        close(file_fd);
         return EXIT_FAILURE;
     }
     
-    printf("File read successfully\n");
+    /* Connect to server */
+    printf("Connecting to server %s:%d...\n", server_ip, server_port);
+    int client_socket = connect_to_server(server_ip, server_port);
+    if (client_socket < 0) {
+        close(file_fd);
+        return EXIT_FAILURE;
+    }
+    
+    printf("Connected to server\n");
+    transport_describe(client_socket);
     
-    /* Encrypt file data */
-    printf("Encrypting file...\n");
-    encrypt_buffer(file_data, file_size, ENCRYPTION_KEY);
-    printf("File encrypted\n");
+    /* Hold partial segments until the payload starts, so the header leaves with it */
+    socket_set_cork(client_socket, 1);
+    if (legacy) {
+        /* Send filename */
+        if (send_all(client_socket, filename, strlen(filename) + 1) != SUCCESS) {
+            perror("Failed to send filename");
+            report_early_response(client_socket);
+            close(file_fd);
+            close(client_socket);
+            return EXIT_FAILURE;
+        }
     
-    /* Create socket */
-    int client_socket = create_socket();
+        printf("Filename sent: %s\n", filename);
     
-    /* Setup server address */
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
+        /* Send file size */
+        size_t size_to_send = (size_t)file_size;
+        if (send_all(client_socket, &size_to_send, sizeof(size_to_send)) != SUCCESS) {
+            perror("Failed to send file size");
+            report_early_response(client_socket);
+            close(file_fd);
+            close(client_socket);
+            return EXIT_FAILURE;
+        }
     
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        fprintf(stderr, "Invalid server IP address: %s\n", server_ip);
-        free(file_data);
+        printf("File size sent: %zu bytes\n", size_to_send);
+    } else if (send_put_header(client_socket, filename, &file_stat, features | PUT_FEATURE_CHECKSUM) != SUCCESS) {
+        report_early_response(client_socket);
+        close(file_fd);
         close(client_socket);
         return EXIT_FAILURE;
+    } else {
+        printf("Request header sent: %s, %llu bytes\n", filename, (unsigned long long)file_size);
     }
     
-    /* Connect to server */
-    printf("Connecting to server %s:%d...\n", server_ip, server_port);
-    if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        free(file_data);
+    /* Per-chunk CRCs are taken while encrypting; the server verifies them before it acknowledges */
+    checksum_state_t checksum;
+    if (checksum_init(&checksum, file_size) != SUCCESS) {
+        perror("Failed to allocate checksums");
+        close(file_fd);
         close(client_socket);
         return EXIT_FAILURE;
     }
     
-    printf("Connected to server\n");
-    
-    /* Send filename */
-    if (send(client_socket, filename, strlen(filename) + 1, 0) < 0) {
-        perror("Failed to send filename");
-        free(file_data);
+    /* Read, encrypt and send the file as overlapping pipeline stages */
+    printf("Sending encrypted file data...\n");
+    pipeline_stats_t stats;
+    if (send_file_pipelined(client_socket, file_fd, 0, file_size, &pipeline, 1, legacy ? NULL : &checksum,
+                            &stats) != SUCCESS) {
+        checksum_free(&checksum);
+        close(file_fd);
         close(client_socket);
         return EXIT_FAILURE;
     }
+    socket_set_cork(client_socket, 0);
+    printf("\n");
     
-    printf("Filename sent: %s\n", filename);
+    printf("File data sent successfully\n");
+    print_pipeline_stats(&pipeline, &stats);
+    close(file_fd);
     
-    /* Send file size */
-    size_t size_to_send = (size_t)file_size;
-    if (send(client_socket, &size_to_send, sizeof(size_to_send), 0) < 0) {
-        perror("Failed to send file size");
-        free(file_data);
+    /* The feature reply was sent before the payload; it is waiting in the socket buffer */
+    uint32_t granted = 0;
+    if (!legacy && check_put_reply(client_socket, features | PUT_FEATURE_CHECKSUM, &granted) != SUCCESS) {
+        checksum_free(&checksum);
         close(client_socket);
         return EXIT_FAILURE;
     }
-    
-    printf("File size sent: %zu bytes\n", size_to_send);
-    
-    /* Send encrypted file data */
-    printf("Sending encrypted file data...\n");
-    size_t total_sent = 0;
-    while (total_sent < size_to_send) {
-        ssize_t bytes_sent = send(client_socket, file_data + total_sent, 
-                                  size_to_send - total_sent, 0);
-        if (bytes_sent < 0) {
-            perror("Failed to send file data");
-            free(file_data);
+    if (granted & PUT_FEATURE_CHECKSUM) {
+        if (send_checksum_trailer(client_socket, &checksum) != SUCCESS) {
+            checksum_free(&checksum);
             close(client_socket);
             return EXIT_FAILURE;
         }
-        total_sent += bytes_sent;
-        printf("Sent %zu/%zu bytes (%.1f%%)\r", total_sent, size_to_send, 
-               (double)total_sent / size_to_send * 100);
-        fflush(stdout);
+        printf("File CRC32C: %08x (%llu chunk checksums sent)\n", checksum_file_crc(&checksum),
+               (unsigned long long)checksum.chunk_count);
     }
-    printf("\n");
-    
-    printf("File data sent successfully\n");
-    free(file_data);
+    checksum_free(&checksum);
     
     /* Receive acknowledgment */
     char ack_buffer[256];
-    memset(ack_buffer, 0, sizeof(ack_buffer));
-    ssize_t ack_bytes = recv(client_socket, ack_buffer, sizeof(ack_buffer) - 1, 0);
-    
-    if (ack_bytes > 0) {
-        ack_buffer[ack_bytes] = '\0';
+    if (receive_ack(client_socket, ack_buffer, sizeof(ack_buffer)) > 0) {
         printf("Server response: %s\n", ack_buffer);
+        if (strcmp(ack_buffer, ACK_CHECKSUM_MISMATCH) == 0) {
+            fprintf(stderr, "Server discarded the file: it did not arrive intact\n");
+            close(client_socket);
+            return EXIT_FAILURE;
+        }
     } else {
         printf("No acknowledgment received from server\n");
     }
@@ -161,5 +1198,3 @@ int main(int argc, char *argv[]) {
     
     return EXIT_SUCCESS;
 }
-
-
@@ -1,4 +1,7 @@
 #include "common.h"
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <poll.h>
 
 /* Print error message and exit */
 void error_exit(const char *message) {
@@ -34,11 +37,297 @@ void setup_signal_handlers(void (*handler)(int)) {
 
 /* Get current timestamp as string */
 char* get_timestamp() {
-    static char timestamp[64];
+    static _Thread_local char timestamp[64];
     time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
     return timestamp;
 }
 
+/* Send exactly size bytes, retrying on short writes */
+int send_all(int sockfd, const void *data, size_t size) {
+    const unsigned char *ptr = (const unsigned char *)data;
+    size_t total_sent = 0;
+    while (total_sent < size) {
+        ssize_t bytes_sent = send(sockfd, ptr + total_sent, size - total_sent, MSG_NOSIGNAL);
+        if (bytes_sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_sent <= 0) {
+            return ERROR_NETWORK;
+        }
+        total_sent += bytes_sent;
+    }
+    return SUCCESS;
+}
+
+/* Receive exactly size bytes, retrying on short reads */
+int recv_all(int sockfd, void *data, size_t size) {
+    unsigned char *ptr = (unsigned char *)data;
+    size_t total_received = 0;
+    while (total_received < size) {
+        ssize_t bytes_received = recv(sockfd, ptr + total_received, size - total_received, 0);
+        if (bytes_received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_received <= 0) {
+            return ERROR_NETWORK;
+        }
+        total_received += bytes_received;
+    }
+    return SUCCESS;
+}
+
+/* CPU time consumed by the calling thread, for per-chunk cost accounting */
+unsigned long long thread_cpu_time_ns(void) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) < 0) {
+        return 0;
+    }
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+/* Parse a byte count with an optional binary K, M or G suffix */
+int parse_byte_size(const char *text, uint64_t *size) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) {
+        return ERROR_FILE_IO;
+    }
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0' || value == 0) {
+        return ERROR_FILE_IO;
+    }
+    *size = value;
+    return SUCCESS;
+}
+
+/* Applied to every client connection; zerocopy is on unless turned off */
+static transport_config_t transport = { 0, 0, 1 };
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/* Set the tuning for connections made from now on */
+void transport_configure(const transport_config_t *config) {
+    transport = *config;
+}
+
+/* RTT the kernel has measured for the connection, in microseconds; 0 if unknown */
+static uint32_t measured_rtt_us(int sockfd) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0) {
+        return 0;
+    }
+    return info.tcpi_rtt;
+}
 
+/* Disable Nagle and, with a link rate set, size the socket buffers to the bandwidth-delay product */
+void transport_tune_socket(int sockfd) {
+    int one = 1;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+        perror("Failed to set TCP_NODELAY");
+    }
+    if (transport.link_rate == 0) {
+        return;
+    }
+    uint32_t rtt_us = transport.rtt_us ? transport.rtt_us : measured_rtt_us(sockfd);
+    uint64_t bdp = transport.link_rate * rtt_us / 1000000;
+    if (bdp < TRANSPORT_MIN_BUFFER) {
+        bdp = TRANSPORT_MIN_BUFFER;
+    }
+    if (bdp > TRANSPORT_MAX_BUFFER) {
+        bdp = TRANSPORT_MAX_BUFFER;
+    }
+    /* The kernel caps these at net.core.wmem_max / rmem_max; transport_describe shows what stuck */
+    int size = (int)bdp;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+        perror("Failed to size socket buffers");
+    }
+}
+
+/* Print the connection's RTT and socket buffer sizes */
+void transport_describe(int sockfd) {
+    int send_buffer = 0;
+    int receive_buffer = 0;
+    socklen_t length = sizeof(int);
+    getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &send_buffer, &length);
+    length = sizeof(int);
+    getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, &length);
+    uint32_t rtt_us = transport.rtt_us ? transport.rtt_us : measured_rtt_us(sockfd);
+    printf("Transport: RTT %.2f ms, socket buffers %d KiB send / %d KiB receive", rtt_us / 1000.0,
+           send_buffer / 1024, receive_buffer / 1024);
+    if (transport.link_rate) {
+        printf(" (bandwidth-delay product at %.1f MiB/s)\n", transport.link_rate / (1024.0 * 1024.0));
+    } else {
+        printf(" (autotuned)\n");
+    }
+}
+
+/* Hold back partial segments (on) until the header and payload can leave together, then flush (off) */
+void socket_set_cork(int sockfd, int on) {
+    setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+void zerocopy_init(zerocopy_sender_t *sender, int sockfd) {
+    memset(sender, 0, sizeof(*sender));
+    sender->sockfd = sockfd;
+    int one = 1;
+    sender->enabled = transport.zerocopy && setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+}
+
+int zerocopy_reached(const zerocopy_sender_t *sender, uint32_t id) {
+    return (int32_t)(sender->completed - id) >= 0;
+}
+
+/* Read every queued completion; returns how many ranges arrived, or ERROR_NETWORK */
+static int read_completions(zerocopy_sender_t *sender) {
+    int ranges = 0;
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(sender->sockfd, &message, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return ERROR_NETWORK;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err error;
+            memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+            if (error.ee_errno != 0 || error.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                sender->copied = 1;
+                sender->enabled = 0;  // Pinning pages only to have them copied is pure overhead
+            }
+            /* Ids ee_info..ee_data inclusive; they can complete out of order */
+            uint32_t count = error.ee_data - error.ee_info + 1;
+            for (uint32_t i = 0; i < count && i < ZEROCOPY_WINDOW; i++) {
+                sender->done[(error.ee_info + i) % ZEROCOPY_WINDOW] = 1;
+            }
+            ranges++;
+        }
+    }
+    while (sender->completed != sender->next_id && sender->done[sender->completed % ZEROCOPY_WINDOW]) {
+        sender->done[sender->completed % ZEROCOPY_WINDOW] = 0;
+        sender->completed++;
+    }
+    return ranges;
+}
+
+int zerocopy_reap(zerocopy_sender_t *sender, int block) {
+    int waited_ms = 0;
+    for (;;) {
+        int ranges = read_completions(sender);
+        if (ranges < 0) {
+            return ERROR_NETWORK;
+        }
+        if (ranges > 0 || !block || sender->completed == sender->next_id) {
+            return SUCCESS;
+        }
+
+        /* A queued completion shows up as POLLERR; so does a socket error, which ends the wait */
+        struct pollfd pfd = { sender->sockfd, 0, 0 };
+        int ready = poll(&pfd, 1, 100);
+        if (ready < 0 && errno != EINTR) {
+            return ERROR_NETWORK;
+        }
+        if (ready == 0 && (waited_ms += 100) >= ZEROCOPY_STALL_TIMEOUT_MS) {
+            errno = ETIMEDOUT;
+            return ERROR_NETWORK;
+        }
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (ready > 0 && (getsockopt(sender->sockfd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error ||
+                          (pfd.revents & (POLLHUP | POLLNVAL)))) {
+            errno = error ? error : ECONNRESET;
+            return ERROR_NETWORK;
+        }
+    }
+}
+
+/* Send all of data, zerocopy when it is large enough and the socket still allows it */
+int zerocopy_send(zerocopy_sender_t *sender, const void *data, size_t size) {
+    if (!sender->enabled || size < ZEROCOPY_MIN_SEND) {
+        return send_all(sender->sockfd, data, size);
+    }
+    const unsigned char *ptr = (const unsigned char *)data;
+    size_t total_sent = 0;
+    while (total_sent < size) {
+        if (sender->next_id - sender->completed >= ZEROCOPY_WINDOW && zerocopy_reap(sender, 1) != SUCCESS) {
+            return ERROR_NETWORK;
+        }
+        ssize_t bytes_sent = send(sender->sockfd, ptr + total_sent, size - total_sent,
+                                  MSG_NOSIGNAL | MSG_ZEROCOPY);
+        if (bytes_sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_sent < 0 && errno == ENOBUFS) {
+            /* Over the socket's pinned-page allowance (net.core.optmem_max); copy the rest */
+            return send_all(sender->sockfd, ptr + total_sent, size - total_sent);
+        }
+        if (bytes_sent <= 0) {
+            return ERROR_NETWORK;
+        }
+        sender->next_id++;
+        sender->zerocopy_bytes += (uint64_t)bytes_sent;
+        total_sent += (size_t)bytes_sent;
+    }
+    return SUCCESS;
+}
+
+int zerocopy_drain(zerocopy_sender_t *sender) {
+    while (sender->completed != sender->next_id) {
+        if (zerocopy_reap(sender, 1) != SUCCESS) {
+            return ERROR_NETWORK;
+        }
+    }
+    return SUCCESS;
+}
+
+void progress_init(progress_t *progress) {
+    progress->next_ns = 0;
+}
+
+/* Whether a progress line is due now; final always is */
+int progress_due(progress_t *progress, int final) {
+    uint64_t now = monotonic_ns();
+    if (!final && now < progress->next_ns) {
+        return 0;
+    }
+    progress->next_ns = now + (uint64_t)PROGRESS_INTERVAL_MS * 1000000ULL;
+    return 1;
+}
+
+/* Print "<verb> done/total bytes (pct%)" in place, if due */
+void progress_bytes(progress_t *progress, const char *verb, uint64_t done, uint64_t total) {
+    if (!progress_due(progress, done >= total)) {
+        return;
+    }
+    printf("%s %llu/%llu bytes (%.1f%%)\r", verb, (unsigned long long)done, (unsigned long long)total,
+           total ? (double)done / total * 100 : 100.0);
+    fflush(stdout);
+}
@@ -15,10 +15,13 @@
 #include <time.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <stdint.h>
 
 /* Default configuration */
 #define DEFAULT_PORT 8080
 #define DEFAULT_BUFFER_SIZE 4096
+#define DEFAULT_LISTEN_BACKLOG 128
+#define MAX_SERVER_SHARDS 64
 #define MAX_FILENAME_LEN 256
 #define MAX_PATH_LEN 512
 #define ENCRYPTION_KEY 0xAA  // Simple XOR key (can be enhanced)
@@ -26,6 +29,7 @@
 /* Protocol constants */
 #define MAX_PACKET_SIZE 4096
 #define HEADER_SIZE 256
+#define STREAM_CHUNK_SIZE (64 * 1024)  // Default per-connection receive buffer
 
 /* Error codes */
 #define SUCCESS 0
@@ -37,18 +41,107 @@
 #define ERROR_FILE_IO -6
 #define ERROR_MEMORY -7
 #define ERROR_THREAD -8
+#define ERROR_NETWORK -9
+#define ERROR_BUSY -10
+#define ERROR_UNSUPPORTED -11  // Facility missing on this kernel; caller may fall back
+#define ERROR_CHECKSUM -12     // Data does not match the checksum sent with it
 
 /* Directory paths */
 #define RECEIVED_FILES_DIR "received_files"
 #define LOGS_DIR "logs"
 #define LOG_FILE "logs/transfer.log"
 
+/* Accepted client connection handed to a connection handler */
+typedef struct {
+    int client_socket;
+    struct sockaddr_in client_addr;
+    uint64_t accepted_ns;  // Monotonic time of accept(), for request latency
+    const unsigned char *request_header;  // Extended header an event loop already read, or NULL
+} client_info_t;
+
+/* Blocking per-connection handler; must close the client socket */
+typedef void (*client_handler_t)(const client_info_t *client);
+
 /* Function prototypes */
 void error_exit(const char *message);
 void create_directory_if_not_exists(const char *dir_path);
 int create_socket();
 void setup_signal_handlers(void (*handler)(int));
 char* get_timestamp();
+int send_all(int sockfd, const void *data, size_t size);
+int recv_all(int sockfd, void *data, size_t size);
+unsigned long long thread_cpu_time_ns(void);
+int parse_byte_size(const char *text, uint64_t *size);
+
+/*
+ * Client transport tuning, applied to every connection once it is up.
+ * TCP_NODELAY is always set; callers cork around a header and the payload
+ * that follows it so the two leave in full segments. With a link rate
+ * configured, SO_SNDBUF and SO_RCVBUF are sized to the bandwidth-delay
+ * product, using the RTT the handshake measured unless one is given;
+ * without one the kernel keeps autotuning them.
+ */
+#define TRANSPORT_MIN_BUFFER (64 * 1024)
+#define TRANSPORT_MAX_BUFFER (64 * 1024 * 1024)
+
+typedef struct {
+    uint64_t link_rate;  // Bytes per second; 0 leaves buffer sizing to the kernel
+    uint32_t rtt_us;     // Round trip for the BDP; 0 measures it per connection
+    int zerocopy;        // Send large buffers with MSG_ZEROCOPY where the kernel supports it
+} transport_config_t;
+
+void transport_configure(const transport_config_t *config);
+void transport_tune_socket(int sockfd);
+void transport_describe(int sockfd);
+void socket_set_cork(int sockfd, int on);
+
+/*
+ * MSG_ZEROCOPY sends. The kernel sends straight from the caller's pages
+ * and numbers each successful send call; the buffer must stay untouched
+ * until the error queue reports that id complete. Sends smaller than
+ * ZEROCOPY_MIN_SEND are copied, since pinning pages costs more than the
+ * copy. When the kernel reports it had to copy anyway (loopback, or a
+ * device without scatter-gather) zerocopy is switched off for the socket.
+ */
+#define ZEROCOPY_MIN_SEND (64 * 1024)
+#define ZEROCOPY_WINDOW 1024              // Send ids that may be outstanding at once
+#define ZEROCOPY_STALL_TIMEOUT_MS 30000   // Give up on completions after this long without one
+
+typedef struct {
+    int sockfd;
+    int enabled;
+    int copied;              // Kernel copied a zerocopy send; later sends copy up front
+    uint32_t next_id;        // Id of the next zerocopy send call
+    uint32_t completed;      // Every id below this has completed
+    uint64_t zerocopy_bytes;
+    unsigned char done[ZEROCOPY_WINDOW];  // Completions that arrived ahead of `completed`
+} zerocopy_sender_t;
+
+/* Enable zerocopy on sockfd if the configuration and the kernel allow it */
+void zerocopy_init(zerocopy_sender_t *sender, int sockfd);
+
+/* Send all of data; with zerocopy, data stays in use until zerocopy_reached(next_id after the call) */
+int zerocopy_send(zerocopy_sender_t *sender, const void *data, size_t size);
+
+/* Collect completions, waiting for at least one new one if block is set */
+int zerocopy_reap(zerocopy_sender_t *sender, int block);
+
+/* Whether every send before id has completed */
+int zerocopy_reached(const zerocopy_sender_t *sender, uint32_t id);
+
+/* Wait until every zerocopy send has completed */
+int zerocopy_drain(zerocopy_sender_t *sender);
+
+/* Progress lines are printed at most every PROGRESS_INTERVAL_MS, and always at the end */
+#define PROGRESS_INTERVAL_MS 200
+
+typedef struct {
+    uint64_t next_ns;
+} progress_t;
+
+void progress_init(progress_t *progress);
+int progress_due(progress_t *progress, int final);
+void progress_bytes(progress_t *progress, const char *verb, uint64_t done, uint64_t total);
 
 #endif /* COMMON_H */
 
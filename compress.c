@@ -0,0 +1,201 @@
+#include "compress.h"
+
+/*
+ * LZ4 block format: sequences of a token (literal length << 4 | match
+ * length - 4), extra length bytes of 255, the literals, a little-endian
+ * 16-bit match offset and more length bytes. The last sequence carries
+ * literals only; the last 5 bytes are always literals and no match starts
+ * within 12 bytes of the end.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_SKIP_TRIGGER 6  // Step grows by one every 64 bytes without a match
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lz_compress_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+/* Write a length continuation (the part beyond the token's 15) */
+static inline unsigned char* write_length(unsigned char *op, unsigned char *op_end, size_t length) {
+    while (length >= 255) {
+        if (op >= op_end) {
+            return NULL;
+        }
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= op_end) {
+        return NULL;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+/* Emit literals [anchor, anchor + literals) and, if match_length > 0, one match */
+static unsigned char* write_sequence(unsigned char *op, unsigned char *op_end, const unsigned char *anchor,
+                                     size_t literals, size_t offset, size_t match_length) {
+    if (op >= op_end) {
+        return NULL;
+    }
+    unsigned char *token = op++;
+    size_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+    *token = (unsigned char)(((literals < 15) ? literals : 15) << 4);
+    if (literals >= 15 && !(op = write_length(op, op_end, literals - 15))) {
+        return NULL;
+    }
+    if ((size_t)(op_end - op) < literals) {
+        return NULL;
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    if (match_length == 0) {
+        return op;
+    }
+
+    if (op_end - op < 2) {
+        return NULL;
+    }
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    *token |= (unsigned char)((match_code < 15) ? match_code : 15);
+    if (match_code >= 15 && !(op = write_length(op, op_end, match_code - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+size_t lz_compress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    unsigned char *op = dst;
+    unsigned char *op_end = dst + capacity;
+    const unsigned char *anchor = src;
+
+    if (size > LZ_MATCH_LIMIT) {
+        memset(table, 0, sizeof(table));
+        const unsigned char *ip = src + 1;
+        const unsigned char *match_limit = src + size - LZ_MATCH_LIMIT;
+        const unsigned char *literal_limit = src + size - LZ_LAST_LITERALS;
+        table[lz_hash(read32(src))] = 0;
+
+        while (ip < match_limit) {
+            uint32_t sequence = read32(ip);
+            uint32_t slot = lz_hash(sequence);
+            const unsigned char *ref = src + table[slot];
+            table[slot] = (uint32_t)(ip - src);
+            if (ref >= ip || (size_t)(ip - ref) > LZ_MAX_OFFSET || read32(ref) != sequence) {
+                ip += 1 + ((size_t)(ip - anchor) >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+
+            /* Extend backwards over pending literals, then forwards */
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t match_length = LZ_MIN_MATCH;
+            while (ip + match_length < literal_limit && ip[match_length] == ref[match_length]) {
+                match_length++;
+            }
+
+            op = write_sequence(op, op_end, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), match_length);
+            if (!op) {
+                return 0;
+            }
+            ip += match_length;
+            anchor = ip;
+            if (ip < match_limit) {
+                table[lz_hash(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+            }
+        }
+    }
+
+    op = write_sequence(op, op_end, anchor, (size_t)(src + size - anchor), 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+/* Read a length continuation; returns 0 on truncated input */
+static inline int read_length(const unsigned char **ip, const unsigned char *ip_end, size_t *length) {
+    unsigned char byte;
+    do {
+        if (*ip >= ip_end) {
+            return 0;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+int lz_decompress(const unsigned char *src, size_t size, unsigned char *dst, size_t raw_size) {
+    const unsigned char *ip = src;
+    const unsigned char *ip_end = src + size;
+    unsigned char *op = dst;
+    unsigned char *op_end = dst + raw_size;
+
+    while (ip < ip_end) {
+        unsigned char token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(&ip, ip_end, &literals)) {
+            return ERROR_FILE_IO;
+        }
+        if ((size_t)(ip_end - ip) < literals || (size_t)(op_end - op) < literals) {
+            return ERROR_FILE_IO;
+        }
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == ip_end) {
+            break;
+        }
+
+        if (ip_end - ip < 2) {
+            return ERROR_FILE_IO;
+        }
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !read_length(&ip, ip_end, &match_length)) {
+            return ERROR_FILE_IO;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(op_end - op) < match_length) {
+            return ERROR_FILE_IO;
+        }
+
+        /* Overlapping matches repeat the last offset bytes, so copy forward */
+        const unsigned char *match = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, match, match_length);
+            op += match_length;
+        } else {
+            for (size_t i = 0; i < match_length; i++) {
+                *op++ = match[i];
+            }
+        }
+    }
+    return (op == op_end) ? SUCCESS : ERROR_FILE_IO;
+}
+
+const char* codec_name(uint32_t codec) {
+    switch (codec) {
+    case CODEC_NONE:
+        return "none";
+    case CODEC_LZ:
+        return "lz";
+    default:
+        return "unknown";
+    }
+}
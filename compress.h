@@ -0,0 +1,27 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "common.h"
+#include <stdint.h>
+
+/* Codecs a client can offer for OP_UPLOAD; the server picks one */
+#define CODEC_NONE 0
+#define CODEC_LZ 1   // LZ77 in the LZ4 block format
+
+#define CODEC_MASK(codec) (1u << (codec))
+
+/* A chunk is sent compressed only if that saves at least 1/COMPRESS_MIN_SAVING of it */
+#define COMPRESS_MIN_SAVING 8
+
+/* Worst-case compressed size of size input bytes */
+size_t lz_compress_bound(size_t size);
+
+/* Compress into dst; returns the compressed size, or 0 if it does not fit in capacity */
+size_t lz_compress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity);
+
+/* Decompress exactly raw_size bytes into dst; fails on malformed or truncated input */
+int lz_decompress(const unsigned char *src, size_t size, unsigned char *dst, size_t raw_size);
+
+const char* codec_name(uint32_t codec);
+
+#endif /* COMPRESS_H */
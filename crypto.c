@@ -1,85 +1,691 @@
 #include "crypto.h"
+#include "buffer_pool.h"
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
 
-/* Encrypt a file using XOR cipher */
-int encrypt_file(const char *input_file, const char *output_file, unsigned char key) {
-    FILE *input_fp = fopen(input_file, "rb");
-    if (!input_fp) {
-        perror("Failed to open input file for encryption");
-        return ERROR_FILE_IO;
+#if defined(__x86_64__) || defined(__i386__)
+#define CRYPTO_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define CRYPTO_X86_KERNELS 0
+#endif
+
+/* Threads for the file transforms; 0 means one per online CPU */
+static size_t file_threads = 0;
+
+void crypto_set_file_threads(size_t threads) {
+    file_threads = threads;
+}
+
+/* One mapped file transform, shared by its threads */
+typedef struct {
+    const unsigned char *input;
+    int output_fd;               // May be the input's own descriptor when transforming in place
+    uint64_t size;
+    unsigned char key;
+    _Atomic uint64_t next_chunk;
+    _Atomic int status;
+} file_job_t;
+
+static int pwrite_all(int fd, const unsigned char *data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, (off_t)offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return ERROR_FILE_IO;
+        }
+        data += written;
+        size -= (size_t)written;
+        offset += (uint64_t)written;
     }
+    return SUCCESS;
+}
+
+/*
+ * Claim chunks until none are left. Each block is copied out of the
+ * mapping, XORed while it is still in cache and written with pwrite:
+ * storing through a shared writable mapping instead costs a page fault
+ * and a filesystem callback per dirtied page, which is slower than the
+ * copy it saves.
+ */
+static void* file_worker_main(void *arg) {
+    file_job_t *job = (file_job_t *)arg;
+    const crypto_kernel_t *kernel = crypto_active_kernel();
+    unsigned char *buffer = (unsigned char *)buffer_pool_alloc(CRYPT_FILE_BLOCK_SIZE);
+    if (!buffer) {
+        atomic_store(&job->status, ERROR_MEMORY);
+        return NULL;
+    }
+    uint64_t chunk_count = (job->size + CRYPT_FILE_CHUNK_SIZE - 1) / CRYPT_FILE_CHUNK_SIZE;
+    while (atomic_load(&job->status) == SUCCESS) {
+        uint64_t index = atomic_fetch_add(&job->next_chunk, 1);
+        if (index >= chunk_count) {
+            break;
+        }
+        uint64_t offset = index * CRYPT_FILE_CHUNK_SIZE;
+        size_t length = (job->size - offset < CRYPT_FILE_CHUNK_SIZE) ? (size_t)(job->size - offset)
+                                                                      : CRYPT_FILE_CHUNK_SIZE;
+
+        /* Fault the chunk in with one call instead of a page fault per 4 KiB (Linux 5.14+) */
+#ifdef MADV_POPULATE_READ
+        madvise((void *)(job->input + offset), length, MADV_POPULATE_READ);
+#endif
+        for (size_t done = 0; done < length; done += CRYPT_FILE_BLOCK_SIZE) {
+            size_t take = (length - done < CRYPT_FILE_BLOCK_SIZE) ? length - done : CRYPT_FILE_BLOCK_SIZE;
+            memcpy(buffer, job->input + offset + done, take);
+            kernel->xor_fn(buffer, take, job->key);
+            if (pwrite_all(job->output_fd, buffer, take, offset + done) != SUCCESS) {
+                perror("Failed to write output");
+                atomic_store(&job->status, ERROR_FILE_IO);
+                break;
+            }
+        }
+    }
+    buffer_pool_free(buffer, CRYPT_FILE_BLOCK_SIZE);
+    return NULL;
+}
 
-    FILE *output_fp = fopen(output_file, "wb");
-    if (!output_fp) {
-        perror("Failed to open output file for encryption");
-        fclose(input_fp);
+/* Map size bytes of input_fd and transform them into output_fd on up to file_threads threads */
+static int transform_mapped(int input_fd, int output_fd, uint64_t size, unsigned char key) {
+    if (size == 0) {
+        return SUCCESS;
+    }
+    void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, input_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map input file");
         return ERROR_FILE_IO;
     }
+    madvise(map, (size_t)size, MADV_SEQUENTIAL);
+    file_job_t job = { (const unsigned char *)map, output_fd, size, key, 0, SUCCESS };
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = file_threads ? file_threads : (cpus > 0 ? (size_t)cpus : 1);
+    uint64_t chunk_count = (size + CRYPT_FILE_CHUNK_SIZE - 1) / CRYPT_FILE_CHUNK_SIZE;
+    if (thread_count > chunk_count) {
+        thread_count = (size_t)chunk_count;
+    }
+    if (thread_count > CRYPT_MAX_THREADS) {
+        thread_count = CRYPT_MAX_THREADS;
+    }
 
-    unsigned char *buffer = (unsigned char *)malloc(DEFAULT_BUFFER_SIZE);
+    /* The calling thread works too; one that fails to start only leaves its share to the others */
+    pthread_t threads[CRYPT_MAX_THREADS];
+    size_t started = 0;
+    while (started + 1 < thread_count && pthread_create(&threads[started], NULL, file_worker_main, &job) == 0) {
+        started++;
+    }
+    file_worker_main(&job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    munmap(map, (size_t)size);
+    return atomic_load(&job.status);
+}
+
+/* Read, XOR and write through one buffer, for pipes and other descriptors that cannot be mapped */
+static int transform_stream(int input_fd, int output_fd, unsigned char key) {
+    unsigned char *buffer = (unsigned char *)buffer_pool_alloc(CRYPT_STREAM_BUFFER_SIZE);
     if (!buffer) {
         perror("Memory allocation failed");
-        fclose(input_fp);
-        fclose(output_fp);
         return ERROR_MEMORY;
     }
+    int status = SUCCESS;
+    for (;;) {
+        ssize_t bytes_read = read(input_fd, buffer, CRYPT_STREAM_BUFFER_SIZE);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            perror("Failed to read input");
+            status = ERROR_FILE_IO;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        encrypt_buffer(buffer, (size_t)bytes_read, key);
+        size_t written = 0;
+        while (written < (size_t)bytes_read && status == SUCCESS) {
+            ssize_t result = write(output_fd, buffer + written, (size_t)bytes_read - written);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result < 0) {
+                perror("Failed to write output");
+                status = ERROR_FILE_IO;
+                break;
+            }
+            written += (size_t)result;
+        }
+        if (status != SUCCESS) {
+            break;
+        }
+    }
+    buffer_pool_free(buffer, CRYPT_STREAM_BUFFER_SIZE);
+    return status;
+}
+
+/* XOR a regular file in place: each block is read from the mapping before it is overwritten */
+static int transform_in_place(const char *path, unsigned char key, const char *what) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+        fprintf(stderr, "Failed to open %s for in-place %s: %s\n", path, what,
+                (fd < 0) ? strerror(errno) : "not a regular file");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ERROR_FILE_IO;
+    }
+    int status = transform_mapped(fd, fd, (uint64_t)file_stat.st_size, key);
+    if (close(fd) < 0 && status == SUCCESS) {
+        perror("Failed to close file");
+        status = ERROR_FILE_IO;
+    }
+    return status;
+}
 
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, DEFAULT_BUFFER_SIZE, input_fp)) > 0) {
-        encrypt_buffer(buffer, bytes_read, key);
-        if (fwrite(buffer, 1, bytes_read, output_fp) != bytes_read) {
-            perror("Failed to write encrypted data");
-            free(buffer);
-            fclose(input_fp);
-            fclose(output_fp);
+/*
+ * Shared body of encrypt_file and decrypt_file. Regular files are mapped
+ * and split across threads; "-" (whose descriptor may be write-only or
+ * positioned) and anything that is not a regular file go through
+ * transform_stream. An output that names the input
+ * file, or no output at all, transforms the input in place.
+ */
+static int transform_file(const char *input_file, const char *output_file, unsigned char key,
+                          const char *what) {
+    int input_is_stdin = strcmp(input_file, "-") == 0;
+    int output_is_stdout = output_file && strcmp(output_file, "-") == 0;
+    struct stat input_stat;
+    struct stat output_stat;
+    if (!output_file || (!input_is_stdin && !output_is_stdout && stat(input_file, &input_stat) == 0 &&
+                         stat(output_file, &output_stat) == 0 && input_stat.st_dev == output_stat.st_dev &&
+                         input_stat.st_ino == output_stat.st_ino)) {
+        if (input_is_stdin) {
+            fprintf(stderr, "Standard input cannot be used for in-place %s\n", what);
             return ERROR_FILE_IO;
         }
+        return transform_in_place(input_file, key, what);
     }
 
-    free(buffer);
-    fclose(input_fp);
-    fclose(output_fp);
-    return SUCCESS;
+    int input_fd = input_is_stdin ? STDIN_FILENO : open(input_file, O_RDONLY | O_CLOEXEC);
+    if (input_fd < 0) {
+        fprintf(stderr, "Failed to open input file for %s: %s\n", what, strerror(errno));
+        return ERROR_FILE_IO;
+    }
+    int output_fd = output_is_stdout ? STDOUT_FILENO
+                                     : open(output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (output_fd < 0) {
+        fprintf(stderr, "Failed to open output file for %s: %s\n", what, strerror(errno));
+        if (!input_is_stdin) {
+            close(input_fd);
+        }
+        return ERROR_FILE_IO;
+    }
+
+    int status;
+    if (input_is_stdin || output_is_stdout || fstat(input_fd, &input_stat) < 0 ||
+        fstat(output_fd, &output_stat) < 0 || !S_ISREG(input_stat.st_mode) || !S_ISREG(output_stat.st_mode)) {
+        status = transform_stream(input_fd, output_fd, key);
+    } else {
+        status = transform_mapped(input_fd, output_fd, (uint64_t)input_stat.st_size, key);
+    }
+
+    if (!input_is_stdin) {
+        close(input_fd);
+    }
+    if (!output_is_stdout && close(output_fd) < 0 && status == SUCCESS) {
+        perror("Failed to close output file");
+        status = ERROR_FILE_IO;
+    }
+    return status;
+}
+
+/* Encrypt a file using XOR cipher */
+int encrypt_file(const char *input_file, const char *output_file, unsigned char key) {
+    return transform_file(input_file, output_file, key, "encryption");
 }
 
 /* Decrypt a file using XOR cipher */
 int decrypt_file(const char *input_file, const char *output_file, unsigned char key) {
-    FILE *input_fp = fopen(input_file, "rb");
-    if (!input_fp) {
-        perror("Failed to open input file for decryption");
-        return ERROR_FILE_IO;
+    return transform_file(input_file, output_file, key, "decryption");
+}
+
+/* Scalar reference kernel: one byte per iteration */
+static void xor_kernel_scalar(unsigned char *buffer, size_t size, unsigned char key) {
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] ^= key;
+    }
+}
+
+/* Short-run helper for kernel heads and tails; inlined so it inherits each kernel's ISA */
+static inline __attribute__((always_inline))
+void xor_short(unsigned char *buffer, size_t size, unsigned char key) {
+    const uint64_t pattern = 0x0101010101010101ULL * key;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buffer + i, sizeof(word));
+        word ^= pattern;
+        memcpy(buffer + i, &word, sizeof(word));
+    }
+    for (; i < size; i++) {
+        buffer[i] ^= key;
     }
+}
 
-    FILE *output_fp = fopen(output_file, "wb");
-    if (!output_fp) {
-        perror("Failed to open output file for decryption");
-        fclose(input_fp);
-        return ERROR_FILE_IO;
+/* Word-wide kernel: 8 bytes per operation after aligning the head */
+static void xor_kernel_word(unsigned char *buffer, size_t size, unsigned char key) {
+    const uint64_t pattern = 0x0101010101010101ULL * key;
+    size_t i = 0;
+    while (i < size && ((uintptr_t)(buffer + i) & (sizeof(uint64_t) - 1)) != 0) {
+        buffer[i++] ^= key;
     }
+    for (; i + 4 * sizeof(uint64_t) <= size; i += 4 * sizeof(uint64_t)) {
+        uint64_t words[4];
+        memcpy(words, buffer + i, sizeof(words));
+        words[0] ^= pattern;
+        words[1] ^= pattern;
+        words[2] ^= pattern;
+        words[3] ^= pattern;
+        memcpy(buffer + i, words, sizeof(words));
+    }
+    xor_short(buffer + i, size - i, key);
+}
 
-    unsigned char *buffer = (unsigned char *)malloc(DEFAULT_BUFFER_SIZE);
-    if (!buffer) {
-        perror("Memory allocation failed");
-        fclose(input_fp);
-        fclose(output_fp);
-        return ERROR_MEMORY;
+#if CRYPTO_X86_KERNELS
+/* SSE2 kernel: 64 bytes per iteration on 16-byte aligned stores */
+__attribute__((target("sse2")))
+static void xor_kernel_sse2(unsigned char *buffer, size_t size, unsigned char key) {
+    size_t head = (16 - ((uintptr_t)buffer & 15)) & 15;
+    if (head > size) {
+        head = size;
     }
+    xor_short(buffer, head, key);
 
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, DEFAULT_BUFFER_SIZE, input_fp)) > 0) {
-        decrypt_buffer(buffer, bytes_read, key);
-        if (fwrite(buffer, 1, bytes_read, output_fp) != bytes_read) {
-            perror("Failed to write decrypted data");
-            free(buffer);
-            fclose(input_fp);
-            fclose(output_fp);
-            return ERROR_FILE_IO;
+    const __m128i pattern = _mm_set1_epi8((char)key);
+    size_t i = head;
+    for (; i + 64 <= size; i += 64) {
+        __m128i *p = (__m128i *)(buffer + i);
+        _mm_store_si128(p, _mm_xor_si128(_mm_load_si128(p), pattern));
+        _mm_store_si128(p + 1, _mm_xor_si128(_mm_load_si128(p + 1), pattern));
+        _mm_store_si128(p + 2, _mm_xor_si128(_mm_load_si128(p + 2), pattern));
+        _mm_store_si128(p + 3, _mm_xor_si128(_mm_load_si128(p + 3), pattern));
+    }
+    for (; i + 16 <= size; i += 16) {
+        __m128i *p = (__m128i *)(buffer + i);
+        _mm_store_si128(p, _mm_xor_si128(_mm_load_si128(p), pattern));
+    }
+    xor_short(buffer + i, size - i, key);
+}
+
+/* AVX2 kernel: 128 bytes per iteration on 32-byte aligned stores */
+__attribute__((target("avx2")))
+static void xor_kernel_avx2(unsigned char *buffer, size_t size, unsigned char key) {
+    size_t head = (32 - ((uintptr_t)buffer & 31)) & 31;
+    if (head > size) {
+        head = size;
+    }
+    xor_short(buffer, head, key);
+
+    const __m256i pattern = _mm256_set1_epi8((char)key);
+    size_t i = head;
+    for (; i + 128 <= size; i += 128) {
+        __m256i *p = (__m256i *)(buffer + i);
+        _mm256_store_si256(p, _mm256_xor_si256(_mm256_load_si256(p), pattern));
+        _mm256_store_si256(p + 1, _mm256_xor_si256(_mm256_load_si256(p + 1), pattern));
+        _mm256_store_si256(p + 2, _mm256_xor_si256(_mm256_load_si256(p + 2), pattern));
+        _mm256_store_si256(p + 3, _mm256_xor_si256(_mm256_load_si256(p + 3), pattern));
+    }
+    for (; i + 32 <= size; i += 32) {
+        __m256i *p = (__m256i *)(buffer + i);
+        _mm256_store_si256(p, _mm256_xor_si256(_mm256_load_si256(p), pattern));
+    }
+    xor_short(buffer + i, size - i, key);
+}
+
+/* AVX-512 kernel: 256 bytes per iteration on 64-byte aligned stores */
+__attribute__((target("avx512f")))
+static void xor_kernel_avx512(unsigned char *buffer, size_t size, unsigned char key) {
+    size_t head = (64 - ((uintptr_t)buffer & 63)) & 63;
+    if (head > size) {
+        head = size;
+    }
+    xor_short(buffer, head, key);
+
+    const __m512i pattern = _mm512_set1_epi8((char)key);
+
+    size_t i = head;
+    for (; i + 256 <= size; i += 256) {
+        __m512i *p = (__m512i *)(buffer + i);
+        _mm512_store_si512(p, _mm512_xor_si512(_mm512_load_si512(p), pattern));
+        _mm512_store_si512(p + 1, _mm512_xor_si512(_mm512_load_si512(p + 1), pattern));
+        _mm512_store_si512(p + 2, _mm512_xor_si512(_mm512_load_si512(p + 2), pattern));
+        _mm512_store_si512(p + 3, _mm512_xor_si512(_mm512_load_si512(p + 3), pattern));
+    }
+    for (; i + 64 <= size; i += 64) {
+        __m512i *p = (__m512i *)(buffer + i);
+        _mm512_store_si512(p, _mm512_xor_si512(_mm512_load_si512(p), pattern));
+    }
+    xor_short(buffer + i, size - i, key);
+}
+
+static int cpu_has_sse2(void) { return __builtin_cpu_supports("sse2"); }
+static int cpu_has_avx2(void) { return __builtin_cpu_supports("avx2"); }
+static int cpu_has_avx512(void) {
+    return __builtin_cpu_supports("avx512f");
+}
+#endif /* CRYPTO_X86_KERNELS */
+
+static int cpu_always(void) { return 1; }
+
+/* Kernel table, fastest last; every entry produces output identical to scalar */
+static const crypto_kernel_t xor_kernels[] = {
+    { "scalar", xor_kernel_scalar, cpu_always },
+    { "word", xor_kernel_word, cpu_always },
+#if CRYPTO_X86_KERNELS
+    { "sse2", xor_kernel_sse2, cpu_has_sse2 },
+    { "avx2", xor_kernel_avx2, cpu_has_avx2 },
+    { "avx512", xor_kernel_avx512, cpu_has_avx512 },
+#endif
+};
+
+#define XOR_KERNEL_COUNT (sizeof(xor_kernels) / sizeof(xor_kernels[0]))
+
+static const crypto_kernel_t *active_kernel = &xor_kernels[0];
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* Pick the fastest supported kernel, or the one named by EFTT_XOR_KERNEL */
+static void select_kernel(void) {
+#if CRYPTO_X86_KERNELS
+    __builtin_cpu_init();
+#endif
+    const char *forced = getenv(XOR_KERNEL_ENV);
+    const crypto_kernel_t *best = &xor_kernels[0];
+    for (size_t i = 0; i < XOR_KERNEL_COUNT; i++) {
+        if (!xor_kernels[i].supported()) {
+            continue;
         }
+        if (forced && strcmp(forced, xor_kernels[i].name) == 0) {
+            active_kernel = &xor_kernels[i];
+            return;
+        }
+        best = &xor_kernels[i];
+    }
+    if (forced) {
+        fprintf(stderr, "Unsupported %s=%s, using %s kernel\n", XOR_KERNEL_ENV, forced, best->name);
     }
+    active_kernel = best;
+}
 
-    free(buffer);
-    fclose(input_fp);
-    fclose(output_fp);
-    return SUCCESS;
+/* Number of kernels compiled in */
+size_t crypto_kernel_count(void) {
+    return XOR_KERNEL_COUNT;
+}
+
+/* Kernel by index, or NULL when out of range */
+const crypto_kernel_t* crypto_kernel_at(size_t index) {
+    return (index < XOR_KERNEL_COUNT) ? &xor_kernels[index] : NULL;
+}
+
+/* Kernel chosen for encrypt_buffer/decrypt_buffer on this CPU */
+const crypto_kernel_t* crypto_active_kernel(void) {
+    pthread_once(&kernel_once, select_kernel);
+    return active_kernel;
+}
+
+/* CRC32C polynomial, bit-reflected */
+#define CRC32C_POLY 0x82F63B78u
+
+/* Interleaved hardware CRC: three independent streams of this many bytes, merged by shifting */
+#define CRC32C_STRIPE 4096
+
+static uint32_t crc_table[8][256];  // Slicing-by-8 tables for the software kernel
+static uint32_t x2n_table[32];      // x^(2^n) mod P, for shifting a CRC past zeros
+static uint32_t stripe_shift[2];    // x^(8 * CRC32C_STRIPE) and x^(16 * CRC32C_STRIPE) mod P
+static pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+
+/* a * b modulo P, in the reflected bit order; a must be nonzero */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^(n * 2^k) modulo P */
+static uint32_t x2nmodp(uint64_t n, unsigned k) {
+    uint32_t p = 1u << 31;  // x^0
+    while (n) {
+        if (n & 1) {
+            p = multmodp(x2n_table[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+static void build_crc_tables(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = crc_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_table[k][n] = c;
+        }
+    }
+    uint32_t p = 1u << 30;  // x^1
+    x2n_table[0] = p;
+    for (int n = 1; n < 32; n++) {
+        x2n_table[n] = p = multmodp(p, p);
+    }
+    stripe_shift[0] = x2nmodp(CRC32C_STRIPE, 3);
+    stripe_shift[1] = x2nmodp(2 * CRC32C_STRIPE, 3);
+}
+
+/* One 8-byte step of the table kernel; c is the raw (uninverted) register */
+static inline uint32_t crc_table_word(uint32_t c, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    c ^= (uint32_t)word;
+    uint32_t high = (uint32_t)(word >> 32);
+    return crc_table[7][c & 0xff] ^ crc_table[6][(c >> 8) & 0xff] ^ crc_table[5][(c >> 16) & 0xff] ^
+           crc_table[4][c >> 24] ^ crc_table[3][high & 0xff] ^ crc_table[2][(high >> 8) & 0xff] ^
+           crc_table[1][(high >> 16) & 0xff] ^ crc_table[0][high >> 24];
+#else
+    const unsigned char *bytes = (const unsigned char *)&word;
+    for (int i = 0; i < 8; i++) {
+        c = crc_table[0][(c ^ bytes[i]) & 0xff] ^ (c >> 8);
+    }
+    return c;
+#endif
+}
+
+/* Software kernel: slicing-by-8 CRC on each word as it is XORed */
+static uint32_t xor_crc_kernel_table(unsigned char *buffer, size_t size, unsigned char key, uint32_t crc,
+                                     int decrypt) {
+    const uint64_t pattern = 0x0101010101010101ULL * key;
+    const uint64_t to_plain = decrypt ? pattern : 0;  // Turns an input word into plaintext
+    uint32_t c = ~crc;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buffer + i, sizeof(word));
+        c = crc_table_word(c, word ^ to_plain);
+        word ^= pattern;
+        memcpy(buffer + i, &word, sizeof(word));
+    }
+    for (; i < size; i++) {
+        unsigned char byte = buffer[i];
+        c = crc_table[0][(c ^ byte ^ (unsigned char)to_plain) & 0xff] ^ (c >> 8);
+        buffer[i] = byte ^ key;
+    }
+    return ~c;
+}
+
+#if CRYPTO_X86_KERNELS
+/* XOR and CRC one stripe of words; c is the raw register */
+__attribute__((target("sse4.2")))
+static inline uint64_t xor_crc_words_sse42(unsigned char *buffer, size_t words, uint64_t c,
+                                            uint64_t pattern, uint64_t to_plain) {
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        memcpy(&word, buffer + i * sizeof(word), sizeof(word));
+        c = _mm_crc32_u64(c, word ^ to_plain);
+        word ^= pattern;
+        memcpy(buffer + i * sizeof(word), &word, sizeof(word));
+    }
+    return c;
+}
+
+/*
+ * SSE4.2 kernel: the crc32 instruction has a latency of three cycles but
+ * issues every cycle, so large buffers run three stripes side by side and
+ * merge them with two carry-less shifts per 12 KiB.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t xor_crc_kernel_sse42(unsigned char *buffer, size_t size, unsigned char key, uint32_t crc,
+                                     int decrypt) {
+    const uint64_t pattern = 0x0101010101010101ULL * key;
+    const uint64_t to_plain = decrypt ? pattern : 0;
+    uint64_t c = (uint32_t)~crc;
+    size_t i = 0;
+    for (; i + 3 * CRC32C_STRIPE <= size; i += 3 * CRC32C_STRIPE) {
+        uint64_t c0 = c;
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        unsigned char *s0 = buffer + i;
+        unsigned char *s1 = s0 + CRC32C_STRIPE;
+        unsigned char *s2 = s1 + CRC32C_STRIPE;
+        for (size_t w = 0; w < CRC32C_STRIPE; w += sizeof(uint64_t)) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, s0 + w, sizeof(w0));
+            memcpy(&w1, s1 + w, sizeof(w1));
+            memcpy(&w2, s2 + w, sizeof(w2));
+            c0 = _mm_crc32_u64(c0, w0 ^ to_plain);
+            c1 = _mm_crc32_u64(c1, w1 ^ to_plain);
+            c2 = _mm_crc32_u64(c2, w2 ^ to_plain);
+            w0 ^= pattern;
+            w1 ^= pattern;
+            w2 ^= pattern;
+            memcpy(s0 + w, &w0, sizeof(w0));
+            memcpy(s1 + w, &w1, sizeof(w1));
+            memcpy(s2 + w, &w2, sizeof(w2));
+        }
+        c = multmodp(stripe_shift[1], (uint32_t)c0) ^ multmodp(stripe_shift[0], (uint32_t)c1) ^ (uint32_t)c2;
+    }
+    size_t words = (size - i) / sizeof(uint64_t);
+    c = xor_crc_words_sse42(buffer + i, words, c, pattern, to_plain);
+    i += words * sizeof(uint64_t);
+    uint32_t c32 = (uint32_t)c;
+    for (; i < size; i++) {
+        unsigned char byte = buffer[i];
+        c32 = _mm_crc32_u8(c32, byte ^ (unsigned char)to_plain);
+        buffer[i] = byte ^ key;
+    }
+    return ~c32;
+}
+
+static int cpu_has_sse42(void) { return __builtin_cpu_supports("sse4.2"); }
+#endif /* CRYPTO_X86_KERNELS */
+
+/* Checksum kernel table, fastest last; every entry agrees with the table kernel */
+static const checksum_kernel_t checksum_kernels[] = {
+    { "table", xor_crc_kernel_table, cpu_always },
+#if CRYPTO_X86_KERNELS
+    { "sse4.2", xor_crc_kernel_sse42, cpu_has_sse42 },
+#endif
+};
+
+#define CHECKSUM_KERNEL_COUNT (sizeof(checksum_kernels) / sizeof(checksum_kernels[0]))
+
+static const checksum_kernel_t *active_checksum_kernel = &checksum_kernels[0];
+static pthread_once_t checksum_kernel_once = PTHREAD_ONCE_INIT;
+
+/* Pick the fastest supported checksum kernel, or the one named by EFTT_CRC_KERNEL */
+static void select_checksum_kernel(void) {
+    pthread_once(&crc_tables_once, build_crc_tables);
+#if CRYPTO_X86_KERNELS
+    __builtin_cpu_init();
+#endif
+    const char *forced = getenv(CHECKSUM_KERNEL_ENV);
+    const checksum_kernel_t *best = &checksum_kernels[0];
+    for (size_t i = 0; i < CHECKSUM_KERNEL_COUNT; i++) {
+        if (!checksum_kernels[i].supported()) {
+            continue;
+        }
+        if (forced && strcmp(forced, checksum_kernels[i].name) == 0) {
+            active_checksum_kernel = &checksum_kernels[i];
+            return;
+        }
+        best = &checksum_kernels[i];
+    }
+    if (forced) {
+        fprintf(stderr, "Unsupported %s=%s, using %s kernel\n", CHECKSUM_KERNEL_ENV, forced, best->name);
+    }
+    active_checksum_kernel = best;
+}
+
+size_t checksum_kernel_count(void) {
+    return CHECKSUM_KERNEL_COUNT;
+}
+
+const checksum_kernel_t* checksum_kernel_at(size_t index) {
+    pthread_once(&crc_tables_once, build_crc_tables);
+    return (index < CHECKSUM_KERNEL_COUNT) ? &checksum_kernels[index] : NULL;
+}
+
+const checksum_kernel_t* checksum_active_kernel(void) {
+    pthread_once(&checksum_kernel_once, select_checksum_kernel);
+    return active_checksum_kernel;
+}
+
+/* Plain CRC32C of read-only data, with the table kernel's word loop */
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    pthread_once(&crc_tables_once, build_crc_tables);
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint32_t c = ~crc;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        c = crc_table_word(c, word);
+    }
+    for (; i < size; i++) {
+        c = crc_table[0][(c ^ bytes[i]) & 0xff] ^ (c >> 8);
+    }
+    return ~c;
+}
+
+uint32_t encrypt_buffer_crc32c(unsigned char *buffer, size_t size, unsigned char key, uint32_t crc) {
+    return checksum_active_kernel()->xor_crc_fn(buffer, size, key, crc, 0);
+}
+
+uint32_t decrypt_buffer_crc32c(unsigned char *buffer, size_t size, unsigned char key, uint32_t crc) {
+    return checksum_active_kernel()->xor_crc_fn(buffer, size, key, crc, 1);
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t length2) {
+    pthread_once(&crc_tables_once, build_crc_tables);
+    return multmodp(x2nmodp(length2, 3), crc1) ^ crc2;
 }
 
 /* Encrypt buffer in place */
@@ -87,9 +693,7 @@ int encrypt_buffer(unsigned char *buffer, size_t size, unsigned char key) {
     if (!buffer) {
         return ERROR_MEMORY;
     }
-    for (size_t i = 0; i < size; i++) {
-        buffer[i] ^= key;
-    }
+    crypto_active_kernel()->xor_fn(buffer, size, key);
     return SUCCESS;
 }
 
@@ -98,12 +702,12 @@ int decrypt_buffer(unsigned char *buffer, size_t size, unsigned char key) {
     return encrypt_buffer(buffer, size, key);  // XOR is symmetric
 }
 
-/* Encrypt data in memory and return new buffer */
+/* Encrypt data in memory and return new buffer (release it with buffer_pool_free) */
 unsigned char* encrypt_data_in_memory(unsigned char *data, size_t size, unsigned char key) {
     if (!data) {
         return NULL;
     }
-    unsigned char *encrypted = (unsigned char *)malloc(size);
+    unsigned char *encrypted = (unsigned char *)buffer_pool_alloc(size);
     if (!encrypted) {
         return NULL;
     }
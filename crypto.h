@@ -2,15 +2,80 @@
 #define CRYPTO_H
 
 #include "common.h"
+#include <stdint.h>
+
+/* Environment variable that forces a specific XOR kernel by name */
+#define XOR_KERNEL_ENV "EFTT_XOR_KERNEL"
+
+/* XOR cipher kernel, selected at runtime from the CPU's feature flags */
+typedef struct {
+    const char *name;
+    void (*xor_fn)(unsigned char *buffer, size_t size, unsigned char key);
+    int (*supported)(void);
+} crypto_kernel_t;
+
+/* Environment variable that forces a specific checksum kernel by name */
+#define CHECKSUM_KERNEL_ENV "EFTT_CRC_KERNEL"
+
+/*
+ * XOR pass fused with a CRC32C (Castagnoli) of the plaintext, so a buffer
+ * is checksummed while it is encrypted or decrypted rather than read
+ * twice. decrypt selects which side of the XOR is the plaintext.
+ */
+typedef struct {
+    const char *name;
+    uint32_t (*xor_crc_fn)(unsigned char *buffer, size_t size, unsigned char key, uint32_t crc, int decrypt);
+    int (*supported)(void);
+} checksum_kernel_t;
+
+/*
+ * File transforms. A regular input file is memory-mapped and XORed in
+ * CRYPT_FILE_CHUNK_SIZE chunks by a team of threads, each writing its
+ * chunks to the output with pwrite. An output_file that is NULL or names
+ * the input transforms it in place; "-" for either side streams through
+ * stdin or stdout instead, as do pipes and devices.
+ */
+#define CRYPT_FILE_CHUNK_SIZE (8 * 1024 * 1024)   // Unit of work claimed by a thread
+#define CRYPT_FILE_BLOCK_SIZE (256 * 1024)        // Copied, XORed and written while still in cache
+#define CRYPT_STREAM_BUFFER_SIZE (256 * 1024)     // Likewise between read and write when streaming
+#define CRYPT_MAX_THREADS 256
 
 /* Encryption/Decryption function prototypes */
 int encrypt_file(const char *input_file, const char *output_file, unsigned char key);
 int decrypt_file(const char *input_file, const char *output_file, unsigned char key);
+
+/* Threads used by the file transforms; 0 (the default) means one per online CPU */
+void crypto_set_file_threads(size_t threads);
 int encrypt_buffer(unsigned char *buffer, size_t size, unsigned char key);
 int decrypt_buffer(unsigned char *buffer, size_t size, unsigned char key);
+
+/* Copies come from the buffer pool; release them with buffer_pool_free(copy, size) */
 unsigned char* encrypt_data_in_memory(unsigned char *data, size_t size, unsigned char key);
 unsigned char* decrypt_data_in_memory(unsigned char *data, size_t size, unsigned char key);
 
+/* Kernel dispatch */
+size_t crypto_kernel_count(void);
+const crypto_kernel_t* crypto_kernel_at(size_t index);
+const crypto_kernel_t* crypto_active_kernel(void);
+
+/*
+ * CRC32C with zlib's chaining convention: start from 0 and pass the last
+ * result back in to continue. The fused forms XOR the buffer in place and
+ * return the CRC of its plaintext (the input when encrypting, the output
+ * when decrypting).
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+uint32_t encrypt_buffer_crc32c(unsigned char *buffer, size_t size, unsigned char key, uint32_t crc);
+uint32_t decrypt_buffer_crc32c(unsigned char *buffer, size_t size, unsigned char key, uint32_t crc);
+
+/* CRC32C of A followed by B, from the CRCs of A and B and the length of B */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t length2);
+
+/* Checksum kernel dispatch */
+size_t checksum_kernel_count(void);
+const checksum_kernel_t* checksum_kernel_at(size_t index);
+const checksum_kernel_t* checksum_active_kernel(void);
+
 #endif /* CRYPTO_H */
 
 
@@ -0,0 +1,167 @@
+#include "common.h"
+#include "crypto.h"
+
+/* Buffer sizes exercised per kernel */
+static const size_t bench_sizes[] = { 64, 1024, 4096, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+
+#define BENCH_SIZE_COUNT (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+#define BENCH_BYTES_PER_RUN (512ULL * 1024 * 1024)  // Bytes processed per measurement
+#define BENCH_MAX_OFFSET 64                         // Misalignments checked against scalar
+
+/* Monotonic time in seconds */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Compare a kernel against the scalar reference across sizes and misalignments */
+static int verify_kernel(const crypto_kernel_t *kernel, const crypto_kernel_t *reference,
+                         unsigned char *work, unsigned char *expected, size_t max_size) {
+    for (size_t offset = 0; offset < BENCH_MAX_OFFSET; offset++) {
+        for (size_t size = 0; size + offset <= max_size && size < 1024; size++) {
+            for (size_t i = 0; i < size; i++) {
+                work[offset + i] = expected[offset + i] = (unsigned char)(i * 31 + offset);
+            }
+            kernel->xor_fn(work + offset, size, ENCRYPTION_KEY);
+            reference->xor_fn(expected + offset, size, ENCRYPTION_KEY);
+            if (memcmp(work + offset, expected + offset, size) != 0) {
+                fprintf(stderr, "Kernel %s mismatch at offset %zu size %zu\n", kernel->name, offset, size);
+                return ERROR_MEMORY;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+/* Check a checksum kernel against the reference vector and the table kernel, both directions */
+static int verify_checksum_kernel(const checksum_kernel_t *kernel, const checksum_kernel_t *reference,
+                                  unsigned char *work, unsigned char *expected, size_t max_size) {
+    unsigned char check[] = "123456789";
+    if (kernel->xor_crc_fn(check, 9, 0, 0, 0) != 0xE3069283u) {
+        fprintf(stderr, "Checksum kernel %s fails the CRC32C check value\n", kernel->name);
+        return ERROR_MEMORY;
+    }
+    static const size_t large_sizes[] = { 3 * 4096, 3 * 4096 + 13, 64 * 1024 + 5, 1024 * 1024 };
+    for (size_t offset = 0; offset < BENCH_MAX_OFFSET; offset += 7) {
+        for (size_t size = 0; size + offset <= max_size && size < 1024 + 4; size++) {
+            size_t test_size = (size < 1024) ? size : large_sizes[size - 1024];
+            for (int decrypt = 0; decrypt <= 1; decrypt++) {
+                for (size_t i = 0; i < test_size; i++) {
+                    work[offset + i] = expected[offset + i] = (unsigned char)(i * 131 + offset);
+                }
+                uint32_t got = kernel->xor_crc_fn(work + offset, test_size, ENCRYPTION_KEY, 0x1234u, decrypt);
+                uint32_t want = reference->xor_crc_fn(expected + offset, test_size, ENCRYPTION_KEY, 0x1234u,
+                                                      decrypt);
+                if (got != want || memcmp(work + offset, expected + offset, test_size) != 0) {
+                    fprintf(stderr, "Checksum kernel %s mismatch at offset %zu size %zu\n", kernel->name,
+                            offset, test_size);
+                    return ERROR_MEMORY;
+                }
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+/* Fused XOR + CRC against the same work done as two passes over the buffer */
+static int bench_checksum_kernels(unsigned char *work, unsigned char *expected, size_t max_size) {
+    const checksum_kernel_t *reference = checksum_kernel_at(0);
+    const crypto_kernel_t *xor_kernel = crypto_active_kernel();
+    printf("\nActive checksum kernel: %s\n", checksum_active_kernel()->name);
+    printf("%-8s %12s %10s %10s\n", "crc", "buffer", "fused", "two-pass");
+
+    int status = SUCCESS;
+    uint32_t crc = 0;
+    for (size_t k = 0; k < checksum_kernel_count(); k++) {
+        const checksum_kernel_t *kernel = checksum_kernel_at(k);
+        if (!kernel->supported()) {
+            printf("%-8s %12s %10s\n", kernel->name, "-", "unsupported");
+            continue;
+        }
+        if (verify_checksum_kernel(kernel, reference, work, expected, max_size) != SUCCESS) {
+            status = ERROR_MEMORY;
+            continue;
+        }
+
+        for (size_t s = 0; s < BENCH_SIZE_COUNT; s++) {
+            size_t size = bench_sizes[s];
+            size_t iterations = BENCH_BYTES_PER_RUN / size;
+            crc = kernel->xor_crc_fn(work, size, ENCRYPTION_KEY, crc, 1);  // Warm up
+
+            double start = now_seconds();
+            for (size_t i = 0; i < iterations; i++) {
+                crc = kernel->xor_crc_fn(work, size, ENCRYPTION_KEY, crc, 1);
+            }
+            double fused = now_seconds() - start;
+
+            /* Second pass: the same CRC kernel over the buffer with a zero key, which leaves it unchanged */
+            start = now_seconds();
+            for (size_t i = 0; i < iterations; i++) {
+                xor_kernel->xor_fn(work, size, ENCRYPTION_KEY);
+                crc = kernel->xor_crc_fn(work, size, 0, crc, 1);
+            }
+            double two_pass = now_seconds() - start;
+
+            printf("%-8s %12zu %10.2f %10.2f\n", kernel->name, size, (double)iterations * size / fused / 1e9,
+                   (double)iterations * size / two_pass / 1e9);
+        }
+    }
+    if (crc == 0x5A5A5A5Au) {
+        printf("\n");  // Keeps the loops from being optimized away
+    }
+    return status;
+}
+
+int main(void) {
+    size_t max_size = bench_sizes[BENCH_SIZE_COUNT - 1] + BENCH_MAX_OFFSET;
+    unsigned char *work = (unsigned char *)malloc(max_size);
+    unsigned char *expected = (unsigned char *)malloc(max_size);
+    if (!work || !expected) {
+        perror("Memory allocation failed");
+        free(work);
+        free(expected);
+        return EXIT_FAILURE;
+    }
+    memset(work, 0x5A, max_size);
+
+    const crypto_kernel_t *reference = crypto_kernel_at(0);
+    printf("Active kernel: %s\n", crypto_active_kernel()->name);
+    printf("%-8s %12s %10s\n", "kernel", "buffer", "GB/s");
+
+    int status = EXIT_SUCCESS;
+    for (size_t k = 0; k < crypto_kernel_count(); k++) {
+        const crypto_kernel_t *kernel = crypto_kernel_at(k);
+        if (!kernel->supported()) {
+            printf("%-8s %12s %10s\n", kernel->name, "-", "unsupported");
+            continue;
+        }
+        if (verify_kernel(kernel, reference, work, expected, max_size) != SUCCESS) {
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        for (size_t s = 0; s < BENCH_SIZE_COUNT; s++) {
+            size_t size = bench_sizes[s];
+            size_t iterations = BENCH_BYTES_PER_RUN / size;
+            kernel->xor_fn(work, size, ENCRYPTION_KEY);  // Warm the cache and page tables
+
+            double start = now_seconds();
+            for (size_t i = 0; i < iterations; i++) {
+                kernel->xor_fn(work, size, (unsigned char)i);
+            }
+            double elapsed = now_seconds() - start;
+
+            printf("%-8s %12zu %10.2f\n", kernel->name, size,
+                   (double)iterations * size / elapsed / 1e9);
+        }
+    }
+
+    if (bench_checksum_kernels(work, expected, max_size) != SUCCESS) {
+        status = EXIT_FAILURE;
+    }
+
+    free(work);
+    free(expected);
+    return status;
+}
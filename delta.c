@@ -0,0 +1,543 @@
+#include "delta.h"
+#include "crypto.h"
+#include "protocol.h"
+#include <sys/mman.h>
+
+/* Weak-checksum hash chains are scanned this far before giving up on a better candidate */
+#define DELTA_MAX_CANDIDATES 256
+#define DELTA_NO_BLOCK UINT32_MAX
+#define DELTA_MAX_BLOCKS (1u << 30)
+
+/* Upper bound on a coalesced COPY so lengths fit the 32-bit field */
+#define DELTA_MAX_COPY (1024u * 1024u * 1024u)
+
+/* rsync-style rolling checksum over a window */
+typedef struct {
+    uint32_t s1;
+    uint32_t s2;
+} rolling_sum_t;
+
+/* Signatures of the server's copy, as seen by the client */
+typedef struct {
+    uint32_t block_size;
+    uint64_t basis_size;
+    uint64_t block_count;
+    uint32_t *weak;
+    unsigned char *strong;  // block_count * DELTA_STRONG_SIZE
+    uint32_t *heads;        // Weak-checksum hash buckets
+    uint32_t *next;
+    uint32_t mask;
+} signature_table_t;
+
+/* One step of the rebuild plan; literals refer to the client's own file */
+typedef struct {
+    uint32_t type;
+    uint64_t target;
+    uint64_t source;
+    uint64_t length;
+} plan_entry_t;
+
+typedef struct {
+    plan_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} delta_plan_t;
+
+uint32_t delta_block_size(uint64_t file_size) {
+    uint32_t block_size = DELTA_MIN_BLOCK_SIZE;
+    while (block_size < DELTA_MAX_BLOCK_SIZE && (uint64_t)block_size * block_size < file_size) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+static void rolling_init(rolling_sum_t *sum, const unsigned char *data, size_t size) {
+    sum->s1 = 0;
+    sum->s2 = 0;
+    for (size_t i = 0; i < size; i++) {
+        sum->s1 += data[i];
+        sum->s2 += sum->s1;
+    }
+}
+
+/* Slide the window one byte: drop out, take in */
+static inline void rolling_roll(rolling_sum_t *sum, unsigned char out, unsigned char in, uint32_t size) {
+    sum->s1 += (uint32_t)in - out;
+    sum->s2 += sum->s1 - size * (uint32_t)out;
+}
+
+static inline uint32_t rolling_digest(const rolling_sum_t *sum) {
+    return (sum->s1 & 0xffff) | (sum->s2 << 16);
+}
+
+static void strong_checksum(const unsigned char *data, size_t size, unsigned char *out) {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    sha256(data, size, digest);
+    memcpy(out, digest, DELTA_STRONG_SIZE);
+}
+
+int delta_send_signatures(int sockfd, int basis_fd, uint64_t basis_size) {
+    uint32_t block_size = delta_block_size(basis_size);
+    unsigned char header[DELTA_SIGNATURE_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    put_le32(header, block_size);
+    put_le64(header + 8, basis_size);
+    if (send_all(sockfd, header, sizeof(header)) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    if (basis_fd < 0 || basis_size == 0) {
+        return SUCCESS;
+    }
+
+    /* Read whole blocks a stream chunk at a time and sign them in batches */
+    size_t blocks_per_read = (block_size < STREAM_CHUNK_SIZE) ? STREAM_CHUNK_SIZE / block_size : 1;
+    size_t read_size = blocks_per_read * block_size;
+    unsigned char *data = (unsigned char *)malloc(read_size);
+    unsigned char *batch = (unsigned char *)malloc(blocks_per_read * DELTA_BLOCK_SIGNATURE_SIZE);
+    if (!data || !batch) {
+        perror("Failed to allocate signature buffers");
+        free(data);
+        free(batch);
+        return ERROR_MEMORY;
+    }
+
+    int status = SUCCESS;
+    for (uint64_t offset = 0; offset < basis_size && status == SUCCESS; offset += read_size) {
+        size_t want = (basis_size - offset < read_size) ? (size_t)(basis_size - offset) : read_size;
+        if (pread(basis_fd, data, want, (off_t)offset) != (ssize_t)want) {
+            perror("Failed to read existing copy");
+            status = ERROR_FILE_IO;
+            break;
+        }
+
+        size_t signed_blocks = 0;
+        for (size_t start = 0; start < want; start += block_size) {
+            size_t length = (want - start < block_size) ? want - start : block_size;
+            unsigned char *out = batch + signed_blocks * DELTA_BLOCK_SIGNATURE_SIZE;
+            rolling_sum_t sum;
+            rolling_init(&sum, data + start, length);
+            put_le32(out, rolling_digest(&sum));
+            strong_checksum(data + start, length, out + 4);
+            signed_blocks++;
+        }
+        status = send_all(sockfd, batch, signed_blocks * DELTA_BLOCK_SIGNATURE_SIZE);
+    }
+
+    free(data);
+    free(batch);
+    return status;
+}
+
+static void free_signatures(signature_table_t *table) {
+    free(table->weak);
+    free(table->strong);
+    free(table->heads);
+    free(table->next);
+}
+
+/* Receive the signatures and index them by weak checksum */
+static int recv_signatures(int sockfd, signature_table_t *table) {
+    memset(table, 0, sizeof(*table));
+    unsigned char header[DELTA_SIGNATURE_HEADER_SIZE];
+    if (recv_all(sockfd, header, sizeof(header)) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    table->block_size = get_le32(header);
+    table->basis_size = get_le64(header + 8);
+    if (table->block_size < DELTA_MIN_BLOCK_SIZE || table->block_size > DELTA_MAX_BLOCK_SIZE) {
+        return ERROR_NETWORK;
+    }
+    table->block_count = (table->basis_size + table->block_size - 1) / table->block_size;
+    if (table->block_count > DELTA_MAX_BLOCKS) {
+        return ERROR_NETWORK;
+    }
+
+    uint32_t buckets = 1;
+    while (buckets < table->block_count * 2) {
+        buckets <<= 1;
+    }
+    table->mask = buckets - 1;
+    table->weak = (uint32_t *)malloc((size_t)table->block_count * sizeof(uint32_t) + 1);
+    table->strong = (unsigned char *)malloc((size_t)table->block_count * DELTA_STRONG_SIZE + 1);
+    table->next = (uint32_t *)malloc((size_t)table->block_count * sizeof(uint32_t) + 1);
+    table->heads = (uint32_t *)malloc((size_t)buckets * sizeof(uint32_t));
+    if (!table->weak || !table->strong || !table->next || !table->heads) {
+        free_signatures(table);
+        return ERROR_MEMORY;
+    }
+    memset(table->heads, 0xff, (size_t)buckets * sizeof(uint32_t));
+
+    unsigned char record[DELTA_BLOCK_SIGNATURE_SIZE];
+    for (uint32_t i = 0; i < table->block_count; i++) {
+        if (recv_all(sockfd, record, sizeof(record)) != SUCCESS) {
+            free_signatures(table);
+            return ERROR_NETWORK;
+        }
+        table->weak[i] = get_le32(record);
+        memcpy(table->strong + (size_t)i * DELTA_STRONG_SIZE, record + 4, DELTA_STRONG_SIZE);
+    }
+
+    /* Insert in reverse so each chain lists blocks in file order */
+    for (uint32_t i = (uint32_t)table->block_count; i-- > 0;) {
+        uint32_t bucket = (table->weak[i] * 0x9e3779b1u) & table->mask;
+        table->next[i] = table->heads[bucket];
+        table->heads[bucket] = i;
+    }
+    return SUCCESS;
+}
+
+/* Compare a window against a block whose weak checksum already matched */
+static int block_matches(const signature_table_t *table, uint32_t index, const unsigned char *window,
+                         unsigned char *window_strong, int *strong_ready) {
+    if (!*strong_ready) {
+        strong_checksum(window, table->block_size, window_strong);
+        *strong_ready = 1;
+    }
+    return memcmp(table->strong + (size_t)index * DELTA_STRONG_SIZE, window_strong, DELTA_STRONG_SIZE) == 0;
+}
+
+/*
+ * Find a full block equal to the window at target. Prefer the block already
+ * at this offset, then the successor of the previous match, then any block
+ * at or after target, so the plan stays patchable in place where possible.
+ */
+static uint32_t find_block(const signature_table_t *table, uint32_t weak, const unsigned char *window,
+                           uint64_t target, uint32_t previous) {
+    unsigned char window_strong[DELTA_STRONG_SIZE];
+    int strong_ready = 0;
+    uint32_t full_blocks = (uint32_t)(table->basis_size / table->block_size);
+
+    if (target % table->block_size == 0 && target / table->block_size < full_blocks) {
+        uint32_t index = (uint32_t)(target / table->block_size);
+        if (table->weak[index] == weak && block_matches(table, index, window, window_strong, &strong_ready)) {
+            return index;
+        }
+    }
+    if (previous != DELTA_NO_BLOCK && previous + 1 < full_blocks && table->weak[previous + 1] == weak &&
+        block_matches(table, previous + 1, window, window_strong, &strong_ready)) {
+        return previous + 1;
+    }
+
+    uint32_t fallback = DELTA_NO_BLOCK;
+    int scanned = 0;
+    for (uint32_t index = table->heads[(weak * 0x9e3779b1u) & table->mask];
+         index != DELTA_NO_BLOCK && scanned < DELTA_MAX_CANDIDATES; index = table->next[index], scanned++) {
+        if (index >= full_blocks || table->weak[index] != weak ||
+            !block_matches(table, index, window, window_strong, &strong_ready)) {
+            continue;
+        }
+        if ((uint64_t)index * table->block_size >= target) {
+            return index;
+        }
+        if (fallback == DELTA_NO_BLOCK) {
+            fallback = index;
+        }
+    }
+    return fallback;
+}
+
+static int plan_append(delta_plan_t *plan, uint32_t type, uint64_t target, uint64_t source, uint64_t length) {
+    if (length == 0) {
+        return SUCCESS;
+    }
+
+    /* Extend the previous copy when the new one continues it */
+    if (plan->count > 0) {
+        plan_entry_t *last = &plan->entries[plan->count - 1];
+        if (type == DELTA_CMD_COPY && last->type == DELTA_CMD_COPY &&
+            last->source + last->length == source && last->target + last->length == target &&
+            last->length + length <= DELTA_MAX_COPY) {
+            last->length += length;
+            return SUCCESS;
+        }
+    }
+
+    if (plan->count == plan->capacity) {
+        size_t capacity = plan->capacity ? plan->capacity * 2 : 256;
+        plan_entry_t *entries = (plan_entry_t *)realloc(plan->entries, capacity * sizeof(plan_entry_t));
+        if (!entries) {
+            return ERROR_MEMORY;
+        }
+        plan->entries = entries;
+        plan->capacity = capacity;
+    }
+    plan_entry_t *entry = &plan->entries[plan->count++];
+    entry->type = type;
+    entry->target = target;
+    entry->source = source;
+    entry->length = length;
+    return SUCCESS;
+}
+
+/* Scan the new file with the rolling checksum and record copies and literals */
+static int build_plan(const signature_table_t *table, const unsigned char *data, uint64_t size,
+                      delta_plan_t *plan) {
+    uint32_t block_size = table->block_size;
+    uint64_t position = 0;
+    uint64_t literal_start = 0;
+    uint32_t previous = DELTA_NO_BLOCK;
+    rolling_sum_t sum;
+    int sum_valid = 0;
+    int status = SUCCESS;
+
+    while (table->block_count > 0 && position + block_size <= size && status == SUCCESS) {
+        if (!sum_valid) {
+            rolling_init(&sum, data + position, block_size);
+            sum_valid = 1;
+        }
+
+        uint32_t index = find_block(table, rolling_digest(&sum), data + position, position, previous);
+        if (index != DELTA_NO_BLOCK) {
+            status = plan_append(plan, DELTA_CMD_LITERAL, literal_start, literal_start, position - literal_start);
+            if (status == SUCCESS) {
+                status = plan_append(plan, DELTA_CMD_COPY, position, (uint64_t)index * block_size, block_size);
+            }
+            position += block_size;
+            literal_start = position;
+            previous = index;
+            sum_valid = 0;
+            continue;
+        }
+
+        if (position + block_size < size) {
+            rolling_roll(&sum, data[position], data[position + block_size], block_size);
+        }
+        position++;
+    }
+
+    /* The server's short final block can only match the end of the new file */
+    uint64_t tail_length = table->basis_size % block_size;
+    if (status == SUCCESS && tail_length > 0 && size - literal_start >= tail_length) {
+        uint64_t tail_start = size - tail_length;
+        uint32_t tail_index = (uint32_t)(table->block_count - 1);
+        unsigned char tail_strong[DELTA_STRONG_SIZE];
+        rolling_sum_t tail_sum;
+        rolling_init(&tail_sum, data + tail_start, tail_length);
+        strong_checksum(data + tail_start, tail_length, tail_strong);
+        if (rolling_digest(&tail_sum) == table->weak[tail_index] &&
+            memcmp(tail_strong, table->strong + (size_t)tail_index * DELTA_STRONG_SIZE, DELTA_STRONG_SIZE) == 0) {
+            status = plan_append(plan, DELTA_CMD_LITERAL, literal_start, literal_start, tail_start - literal_start);
+            if (status == SUCCESS) {
+                status = plan_append(plan, DELTA_CMD_COPY, tail_start, (uint64_t)tail_index * block_size,
+                                     tail_length);
+            }
+            literal_start = size;
+        }
+    }
+    if (status == SUCCESS) {
+        status = plan_append(plan, DELTA_CMD_LITERAL, literal_start, literal_start, size - literal_start);
+    }
+    return status;
+}
+
+static int send_command(int sockfd, uint32_t type, uint32_t length, uint64_t source) {
+    unsigned char command[DELTA_COMMAND_SIZE];
+    put_le32(command, type);
+    put_le32(command + 4, length);
+    put_le64(command + 8, source);
+    return send_all(sockfd, command, sizeof(command));
+}
+
+/* Send the plan flags, the commands and the whole-file digest */
+static int send_plan(int sockfd, const delta_plan_t *plan, const unsigned char *data, uint64_t size,
+                     delta_stats_t *stats) {
+    stats->flags = DELTA_FLAG_INPLACE;
+    for (size_t i = 0; i < plan->count; i++) {
+        if (plan->entries[i].type == DELTA_CMD_COPY && plan->entries[i].source < plan->entries[i].target) {
+            stats->flags &= ~(uint32_t)DELTA_FLAG_INPLACE;
+        }
+    }
+    unsigned char flags[DELTA_FLAGS_SIZE];
+    memset(flags, 0, sizeof(flags));
+    put_le32(flags, stats->flags);
+    if (send_all(sockfd, flags, sizeof(flags)) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+
+    unsigned char *chunk = (unsigned char *)malloc(STREAM_CHUNK_SIZE);
+    if (!chunk) {
+        perror("Failed to allocate literal buffer");
+        return ERROR_MEMORY;
+    }
+
+    int status = SUCCESS;
+    for (size_t i = 0; i < plan->count && status == SUCCESS; i++) {
+        const plan_entry_t *entry = &plan->entries[i];
+        if (entry->type == DELTA_CMD_COPY) {
+            status = send_command(sockfd, DELTA_CMD_COPY, (uint32_t)entry->length, entry->source);
+            stats->copied_bytes += entry->length;
+            stats->commands++;
+            continue;
+        }
+        for (uint64_t done = 0; done < entry->length && status == SUCCESS;) {
+            size_t length = (entry->length - done < STREAM_CHUNK_SIZE) ? (size_t)(entry->length - done)
+                                                                       : STREAM_CHUNK_SIZE;
+            memcpy(chunk, data + entry->source + done, length);
+            encrypt_buffer(chunk, length, ENCRYPTION_KEY);
+            status = send_command(sockfd, DELTA_CMD_LITERAL, (uint32_t)length, 0);
+            if (status == SUCCESS) {
+                status = send_all(sockfd, chunk, length);
+            }
+            done += length;
+            stats->literal_bytes += length;
+            stats->commands++;
+        }
+    }
+    free(chunk);
+
+    if (status == SUCCESS) {
+        unsigned char digest[SHA256_DIGEST_SIZE];
+        sha256(data, (size_t)size, digest);
+        status = send_command(sockfd, DELTA_CMD_END, 0, 0);
+        if (status == SUCCESS) {
+            status = send_all(sockfd, digest, sizeof(digest));
+        }
+    }
+    return status;
+}
+
+int delta_send(int sockfd, int file_fd, uint64_t file_size, delta_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    signature_table_t table;
+    int status = recv_signatures(sockfd, &table);
+    if (status != SUCCESS) {
+        return status;
+    }
+
+    /* The scan needs random access to the whole file, so map it */
+    unsigned char *data = NULL;
+    if (file_size > 0) {
+        data = (unsigned char *)mmap(NULL, (size_t)file_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+        if (data == MAP_FAILED) {
+            perror("Failed to map file");
+            free_signatures(&table);
+            return ERROR_FILE_IO;
+        }
+        madvise(data, (size_t)file_size, MADV_SEQUENTIAL);
+    }
+
+    delta_plan_t plan = {NULL, 0, 0};
+    status = build_plan(&table, data, file_size, &plan);
+    free_signatures(&table);
+    if (status == SUCCESS) {
+        status = send_plan(sockfd, &plan, data, file_size, stats);
+    }
+
+    free(plan.entries);
+    if (data) {
+        munmap(data, (size_t)file_size);
+    }
+    return status;
+}
+
+int delta_recv_flags(int sockfd, uint32_t *flags) {
+    unsigned char raw[DELTA_FLAGS_SIZE];
+    if (recv_all(sockfd, raw, sizeof(raw)) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    *flags = get_le32(raw);
+    return SUCCESS;
+}
+
+/* Copy length bytes of the server's copy into place, hashing them on the way */
+static int apply_copy(int basis_fd, int out_fd, uint64_t source, uint64_t target, uint64_t length,
+                      unsigned char *buffer, sha256_ctx_t *ctx, delta_stats_t *stats) {
+    /* Blocks already in position when patching in place are only read back for the digest */
+    int in_position = (basis_fd == out_fd && source == target);
+    for (uint64_t done = 0; done < length;) {
+        size_t want = (length - done < STREAM_CHUNK_SIZE) ? (size_t)(length - done) : STREAM_CHUNK_SIZE;
+        if (pread(basis_fd, buffer, want, (off_t)(source + done)) != (ssize_t)want) {
+            perror("Failed to read existing copy");
+            return ERROR_FILE_IO;
+        }
+        sha256_update(ctx, buffer, want);
+        if (!in_position) {
+            if (pwrite(out_fd, buffer, want, (off_t)(target + done)) != (ssize_t)want) {
+                perror("Failed to write file data");
+                return ERROR_FILE_IO;
+            }
+            stats->written_bytes += want;
+        }
+        done += want;
+    }
+    stats->copied_bytes += length;
+    return SUCCESS;
+}
+
+int delta_apply(int sockfd, int basis_fd, uint64_t basis_size, int out_fd, uint64_t target_size,
+                delta_stats_t *stats) {
+    unsigned char *buffer = (unsigned char *)malloc(STREAM_CHUNK_SIZE);
+    if (!buffer) {
+        perror("Failed to allocate delta buffer");
+        return ERROR_MEMORY;
+    }
+
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    int in_place = (basis_fd >= 0 && basis_fd == out_fd);
+    uint64_t written = 0;
+    int status = SUCCESS;
+    for (;;) {
+        unsigned char command[DELTA_COMMAND_SIZE];
+        if (recv_all(sockfd, command, sizeof(command)) != SUCCESS) {
+            status = ERROR_NETWORK;
+            break;
+        }
+        uint32_t type = get_le32(command);
+        uint64_t length = get_le32(command + 4);
+        uint64_t source = get_le64(command + 8);
+        stats->commands++;
+
+        if (type == DELTA_CMD_END) {
+            unsigned char expected[SHA256_DIGEST_SIZE];
+            unsigned char actual[SHA256_DIGEST_SIZE];
+            if (recv_all(sockfd, expected, sizeof(expected)) != SUCCESS) {
+                status = ERROR_NETWORK;
+                break;
+            }
+            sha256_final(&ctx, actual);
+            if (written != target_size || memcmp(expected, actual, sizeof(actual)) != 0) {
+                fprintf(stderr, "Delta result does not match the client's file (%llu of %llu bytes)\n",
+                        (unsigned long long)written, (unsigned long long)target_size);
+                status = ERROR_FILE_IO;
+            }
+            break;
+        }
+
+        if (length > target_size - written) {
+            status = ERROR_NETWORK;
+            break;
+        }
+        if (type == DELTA_CMD_COPY) {
+            /* In place, a copy may only read data that has not been overwritten yet */
+            if (basis_fd < 0 || source > basis_size || length > basis_size - source ||
+                (in_place && source < written)) {
+                status = ERROR_NETWORK;
+                break;
+            }
+            status = apply_copy(basis_fd, out_fd, source, written, length, buffer, &ctx, stats);
+        } else if (type == DELTA_CMD_LITERAL && length <= STREAM_CHUNK_SIZE) {
+            if (recv_all(sockfd, buffer, (size_t)length) != SUCCESS) {
+                status = ERROR_NETWORK;
+                break;
+            }
+            decrypt_buffer(buffer, (size_t)length, ENCRYPTION_KEY);
+            sha256_update(&ctx, buffer, (size_t)length);
+            if (pwrite(out_fd, buffer, (size_t)length, (off_t)written) != (ssize_t)length) {
+                perror("Failed to write file data");
+                status = ERROR_FILE_IO;
+            }
+            stats->literal_bytes += length;
+            stats->written_bytes += length;
+        } else {
+            status = ERROR_NETWORK;
+        }
+        if (status != SUCCESS) {
+            break;
+        }
+        written += length;
+    }
+
+    free(buffer);
+    return status;
+}
@@ -0,0 +1,64 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "common.h"
+#include "hash.h"
+#include <stdint.h>
+
+/*
+ * Delta uploads (OP_DELTA), rsync style. The server answers the request
+ * with signatures of its existing copy: a header (block size, copy size)
+ * followed by a rolling weak checksum and a truncated SHA-256 per block.
+ * The client replies with plan flags and a stream of commands that
+ * rebuild the new file front to back: COPY a run of the server's blocks
+ * or insert LITERAL (encrypted) bytes. END carries the SHA-256 of the
+ * whole new file, which the server checks before publishing it.
+ */
+#define DELTA_MIN_BLOCK_SIZE 2048
+#define DELTA_MAX_BLOCK_SIZE (128 * 1024)
+#define DELTA_STRONG_SIZE 16
+#define DELTA_SIGNATURE_HEADER_SIZE 16
+#define DELTA_BLOCK_SIGNATURE_SIZE (4 + DELTA_STRONG_SIZE)
+#define DELTA_COMMAND_SIZE 16
+#define DELTA_FLAGS_SIZE 8
+
+/* Commands */
+#define DELTA_CMD_END 0
+#define DELTA_CMD_COPY 1     // length bytes of the server's copy starting at a block boundary
+#define DELTA_CMD_LITERAL 2  // length (<= STREAM_CHUNK_SIZE) encrypted bytes follow
+
+/* Plan flags: every COPY reads at or after its target offset, so the server may patch in place */
+#define DELTA_FLAG_INPLACE 0x1
+
+/* Rebuilt files are staged here unless they are patched in place */
+#define DELTA_FILE_SUFFIX ".delta"
+
+typedef struct {
+    uint64_t literal_bytes;  // New data sent over the wire
+    uint64_t copied_bytes;   // Data reused from the server's copy
+    uint64_t written_bytes;  // Bytes the server actually wrote to disk
+    uint64_t commands;
+    uint32_t flags;
+} delta_stats_t;
+
+/* Block size used to sign a copy of the given size (grows with sqrt(size)) */
+uint32_t delta_block_size(uint64_t file_size);
+
+/* Server: sign basis_fd (may be -1 when there is no existing copy) */
+int delta_send_signatures(int sockfd, int basis_fd, uint64_t basis_size);
+
+/* Client: receive signatures, then send the commands that turn the server's copy into file_fd */
+int delta_send(int sockfd, int file_fd, uint64_t file_size, delta_stats_t *stats);
+
+/* Server: read the client's plan flags */
+int delta_recv_flags(int sockfd, uint32_t *flags);
+
+/*
+ * Server: apply commands, writing target_size bytes to out_fd. out_fd may
+ * be basis_fd itself when patching in place; blocks already in position
+ * are then verified but not rewritten.
+ */
+int delta_apply(int sockfd, int basis_fd, uint64_t basis_size, int out_fd, uint64_t target_size,
+                delta_stats_t *stats);
+
+#endif /* DELTA_H */
@@ -0,0 +1,311 @@
+#include "download_cache.h"
+#include "crypto.h"
+#include "buffer_pool.h"
+
+typedef enum {
+    SLOT_EMPTY,
+    SLOT_FILLING,  // Pinned by the reader that is encrypting it; others wait
+    SLOT_READY
+} slot_state_t;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t index;
+} chunk_key_t;
+
+typedef struct {
+    chunk_key_t key;
+    unsigned char *data;  // DOWNLOAD_CHUNK_SIZE bytes from the buffer pool, allocated on first use
+    size_t length;
+    int pins;
+    slot_state_t state;
+    int hash_next;  // Next slot in the same bucket, or -1
+    int lru_prev;   // Toward the most recently used end, or -1
+    int lru_next;
+} cache_slot_t;
+
+struct download_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    cache_slot_t *slots;
+    int slot_count;
+    int *buckets;
+    size_t bucket_mask;
+    int *free_slots;  // Stack of empty, unpinned slots
+    int free_count;
+    int lru_head;     // Most recently used
+    int lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bypassed;
+    uint64_t evictions;
+};
+
+static size_t key_hash(const chunk_key_t *key) {
+    uint64_t hash = key->ino * 0x9e3779b97f4a7c15ULL;
+    hash ^= (key->index + key->mtime_ns + (key->dev << 32)) * 0xc2b2ae3d27d4eb4fULL;
+    return (size_t)(hash ^ (hash >> 29));
+}
+
+static int key_equal(const chunk_key_t *a, const chunk_key_t *b) {
+    return a->ino == b->ino && a->index == b->index && a->dev == b->dev && a->size == b->size &&
+           a->mtime_ns == b->mtime_ns;
+}
+
+download_cache_t* download_cache_create(size_t capacity_bytes) {
+    int slot_count = (int)(capacity_bytes / DOWNLOAD_CHUNK_SIZE);
+    if (slot_count < 1) {
+        return NULL;
+    }
+    size_t bucket_count = 1;
+    while (bucket_count < (size_t)slot_count * 2) {
+        bucket_count <<= 1;
+    }
+    download_cache_t *cache = (download_cache_t *)calloc(1, sizeof(download_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    cache->slots = (cache_slot_t *)calloc((size_t)slot_count, sizeof(cache_slot_t));
+    cache->buckets = (int *)malloc(bucket_count * sizeof(int));
+    cache->free_slots = (int *)malloc((size_t)slot_count * sizeof(int));
+    if (!cache->slots || !cache->buckets || !cache->free_slots) {
+        free(cache->slots);
+        free(cache->buckets);
+        free(cache->free_slots);
+        free(cache);
+        return NULL;
+    }
+    for (size_t i = 0; i < bucket_count; i++) {
+        cache->buckets[i] = -1;
+    }
+    for (int i = 0; i < slot_count; i++) {
+        cache->free_slots[i] = slot_count - 1 - i;
+    }
+    cache->slot_count = slot_count;
+    cache->free_count = slot_count;
+    cache->bucket_mask = bucket_count - 1;
+    cache->lru_head = -1;
+    cache->lru_tail = -1;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->filled, NULL);
+    return cache;
+}
+
+void download_cache_destroy(download_cache_t *cache) {
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < cache->slot_count; i++) {
+        buffer_pool_free(cache->slots[i].data, DOWNLOAD_CHUNK_SIZE);
+    }
+    pthread_cond_destroy(&cache->filled);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->slots);
+    free(cache->buckets);
+    free(cache->free_slots);
+    free(cache);
+}
+
+/* The helpers below run with the cache lock held */
+
+static int find_slot(download_cache_t *cache, const chunk_key_t *key) {
+    int slot = cache->buckets[key_hash(key) & cache->bucket_mask];
+    while (slot >= 0 && !key_equal(&cache->slots[slot].key, key)) {
+        slot = cache->slots[slot].hash_next;
+    }
+    return slot;
+}
+
+static void hash_insert(download_cache_t *cache, int slot) {
+    int *bucket = &cache->buckets[key_hash(&cache->slots[slot].key) & cache->bucket_mask];
+    cache->slots[slot].hash_next = *bucket;
+    *bucket = slot;
+}
+
+static void hash_remove(download_cache_t *cache, int slot) {
+    int *link = &cache->buckets[key_hash(&cache->slots[slot].key) & cache->bucket_mask];
+    while (*link != slot) {
+        link = &cache->slots[*link].hash_next;
+    }
+    *link = cache->slots[slot].hash_next;
+}
+
+static void lru_unlink(download_cache_t *cache, int slot) {
+    cache_slot_t *s = &cache->slots[slot];
+    if (s->lru_prev >= 0) {
+        cache->slots[s->lru_prev].lru_next = s->lru_next;
+    } else {
+        cache->lru_head = s->lru_next;
+    }
+    if (s->lru_next >= 0) {
+        cache->slots[s->lru_next].lru_prev = s->lru_prev;
+    } else {
+        cache->lru_tail = s->lru_prev;
+    }
+}
+
+static void lru_push_head(download_cache_t *cache, int slot) {
+    cache_slot_t *s = &cache->slots[slot];
+    s->lru_prev = -1;
+    s->lru_next = cache->lru_head;
+    if (cache->lru_head >= 0) {
+        cache->slots[cache->lru_head].lru_prev = slot;
+    } else {
+        cache->lru_tail = slot;
+    }
+    cache->lru_head = slot;
+}
+
+/* An empty slot, or the least recently used unpinned one; -1 if every slot is pinned */
+static int take_victim(download_cache_t *cache) {
+    if (cache->free_count > 0) {
+        return cache->free_slots[--cache->free_count];
+    }
+    for (int slot = cache->lru_tail; slot >= 0; slot = cache->slots[slot].lru_prev) {
+        if (cache->slots[slot].pins == 0) {
+            hash_remove(cache, slot);
+            lru_unlink(cache, slot);
+            cache->evictions++;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+static void unpin(download_cache_t *cache, int slot) {
+    cache_slot_t *s = &cache->slots[slot];
+    if (--s->pins == 0 && s->state == SLOT_EMPTY) {
+        cache->free_slots[cache->free_count++] = slot;
+    }
+}
+
+ssize_t read_encrypted_chunk(int fd, uint64_t file_size, uint64_t index, unsigned char *buffer) {
+    uint64_t offset = index * DOWNLOAD_CHUNK_SIZE;
+    if (offset >= file_size) {
+        return ERROR_FILE_IO;
+    }
+    size_t want = DOWNLOAD_CHUNK_SIZE;
+    if (file_size - offset < want) {
+        want = (size_t)(file_size - offset);
+    }
+    size_t filled = 0;
+    while (filled < want) {
+        ssize_t bytes_read = pread(fd, buffer + filled, want - filled, (off_t)(offset + filled));
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return ERROR_FILE_IO;  // Truncated underneath us
+        }
+        filled += (size_t)bytes_read;
+    }
+    encrypt_buffer(buffer, want, ENCRYPTION_KEY);
+    return (ssize_t)want;
+}
+
+int download_cache_acquire(download_cache_t *cache, int fd, const struct stat *file_stat, uint64_t index,
+                           download_chunk_t *chunk) {
+    chunk_key_t key;
+    memset(&key, 0, sizeof(key));
+    key.dev = (uint64_t)file_stat->st_dev;
+    key.ino = (uint64_t)file_stat->st_ino;
+    key.size = (uint64_t)file_stat->st_size;
+    key.mtime_ns = (uint64_t)file_stat->st_mtim.tv_sec * 1000000000ULL + (uint64_t)file_stat->st_mtim.tv_nsec;
+    key.index = index;
+
+    pthread_mutex_lock(&cache->lock);
+    int slot = find_slot(cache, &key);
+    if (slot >= 0) {
+        cache_slot_t *s = &cache->slots[slot];
+        s->pins++;
+        while (s->state == SLOT_FILLING) {
+            pthread_cond_wait(&cache->filled, &cache->lock);
+        }
+        if (s->state != SLOT_READY) {
+            unpin(cache, slot);  // The reader filling it failed
+            pthread_mutex_unlock(&cache->lock);
+            return ERROR_FILE_IO;
+        }
+        cache->hits++;
+        lru_unlink(cache, slot);
+        lru_push_head(cache, slot);
+        pthread_mutex_unlock(&cache->lock);
+        chunk->data = s->data;
+        chunk->length = s->length;
+        chunk->slot = slot;
+        return SUCCESS;
+    }
+
+    slot = take_victim(cache);
+    if (slot < 0) {
+        cache->bypassed++;
+        pthread_mutex_unlock(&cache->lock);
+        return ERROR_BUSY;
+    }
+    cache_slot_t *s = &cache->slots[slot];
+    if (!s->data) {
+        s->data = (unsigned char *)buffer_pool_alloc(DOWNLOAD_CHUNK_SIZE);
+    }
+    if (!s->data) {
+        s->state = SLOT_EMPTY;
+        cache->free_slots[cache->free_count++] = slot;
+        pthread_mutex_unlock(&cache->lock);
+        return ERROR_BUSY;
+    }
+    s->key = key;
+    s->state = SLOT_FILLING;
+    s->pins = 1;
+    hash_insert(cache, slot);
+    lru_push_head(cache, slot);
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Encrypt outside the lock; readers of other chunks carry on meanwhile */
+    ssize_t length = read_encrypted_chunk(fd, key.size, index, s->data);
+
+    pthread_mutex_lock(&cache->lock);
+    if (length < 0) {
+        s->state = SLOT_EMPTY;
+        hash_remove(cache, slot);
+        lru_unlink(cache, slot);
+        unpin(cache, slot);
+    } else {
+        s->length = (size_t)length;
+        s->state = SLOT_READY;
+    }
+    pthread_cond_broadcast(&cache->filled);
+    pthread_mutex_unlock(&cache->lock);
+    if (length < 0) {
+        return ERROR_FILE_IO;
+    }
+    chunk->data = s->data;
+    chunk->length = s->length;
+    chunk->slot = slot;
+    return SUCCESS;
+}
+
+void download_cache_release(download_cache_t *cache, download_chunk_t *chunk) {
+    pthread_mutex_lock(&cache->lock);
+    unpin(cache, chunk->slot);
+    pthread_mutex_unlock(&cache->lock);
+    chunk->data = NULL;
+    chunk->slot = -1;
+}
+
+void download_cache_get_stats(download_cache_t *cache, download_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!cache) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->bypassed = cache->bypassed;
+    stats->evictions = cache->evictions;
+    stats->slots = (size_t)cache->slot_count;
+    stats->slots_used = (size_t)(cache->slot_count - cache->free_count);
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,53 @@
+#ifndef DOWNLOAD_CACHE_H
+#define DOWNLOAD_CACHE_H
+
+#include "common.h"
+#include <stdint.h>
+
+/*
+ * LRU cache of encrypted file chunks for downloads. A chunk is keyed by
+ * the file's identity (device, inode, size, mtime) and its index, so a
+ * rewritten file never serves stale data. Readers pin a chunk while they
+ * send it; the first reader of a missing chunk reads and encrypts it while
+ * later readers of the same chunk wait for it rather than repeat the work.
+ */
+#define DOWNLOAD_CHUNK_SIZE (256 * 1024)
+#define DEFAULT_DOWNLOAD_CACHE_MB 64
+
+typedef struct download_cache download_cache_t;
+
+/* A pinned chunk: data holds length encrypted bytes until it is released */
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    int slot;
+} download_chunk_t;
+
+typedef struct {
+    uint64_t hits;       // Served from an encrypted chunk already in the cache
+    uint64_t misses;     // Read and encrypted into the cache
+    uint64_t bypassed;   // Every slot was pinned; encrypted privately instead
+    uint64_t evictions;
+    size_t slots;
+    size_t slots_used;
+} download_cache_stats_t;
+
+/* Cache lifecycle; capacity is rounded down to whole chunks */
+download_cache_t* download_cache_create(size_t capacity_bytes);
+void download_cache_destroy(download_cache_t *cache);
+
+/*
+ * Pin chunk `index` of the open file described by file_stat, reading and
+ * encrypting it on a miss. Returns SUCCESS, ERROR_BUSY if every slot is
+ * pinned (the caller encrypts the chunk itself), or ERROR_FILE_IO.
+ */
+int download_cache_acquire(download_cache_t *cache, int fd, const struct stat *file_stat, uint64_t index,
+                           download_chunk_t *chunk);
+void download_cache_release(download_cache_t *cache, download_chunk_t *chunk);
+
+void download_cache_get_stats(download_cache_t *cache, download_cache_stats_t *stats);
+
+/* Read and encrypt chunk `index` of fd into buffer; returns its length or ERROR_FILE_IO */
+ssize_t read_encrypted_chunk(int fd, uint64_t file_size, uint64_t index, unsigned char *buffer);
+
+#endif /* DOWNLOAD_CACHE_H */
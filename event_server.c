@@ -0,0 +1,518 @@
+#include "event_server.h"
+#include "crypto.h"
+#include "logger.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "buffer_pool.h"
+#include "checksum.h"
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+/* Reads served per readiness event before yielding to other connections */
+#define READS_PER_EVENT 16
+
+/* Outcome of handle_readable that moves the connection to a blocking handler */
+#define CONN_HANDOFF 1
+
+/* Protocol phases of a single upload */
+typedef enum {
+    CONN_FRAMING,     // First bytes, read until they tell legacy from extended framing
+    CONN_PUT_HEADER,  // Versioned OP_PUT header and filename
+    CONN_FILENAME,    // Legacy NUL-terminated filename and size
+    CONN_BODY,
+    CONN_TRAILER,     // Checksum trailer after the body (PUT_FEATURE_CHECKSUM)
+    CONN_ACK
+} conn_state_t;
+
+/* Per-connection state machine; payload bytes live in the loop-wide buffer */
+typedef struct {
+    int socket;
+    conn_state_t state;
+    struct sockaddr_in client_addr;
+    uint64_t accepted_ns;
+    char client_ip[INET_ADDRSTRLEN];
+    int client_port;
+    char filename[MAX_FILENAME_LEN];
+    size_t file_size;
+    size_t total_received;
+    unsigned char header[PROTOCOL_HEADER_SIZE + MAX_FILENAME_LEN];  // Extended or legacy header bytes
+    size_t header_len;
+    size_t header_need;  // Bytes of header plus filename; set once the fixed part is in
+    uint32_t features;   // PUT_FEATURE_* granted to this upload
+    checksum_state_t checksum;
+    FILE *output_file;
+    char output_path[MAX_PATH_LEN];
+    const char *ack;
+    size_t ack_len;
+    size_t ack_sent;
+} connection_t;
+
+static const char *ack_message = ACK_FILE_COMPLETE;
+static client_handler_t extended_request_handler = NULL;
+
+/* Hand a connection and its fixed header to the handler, which takes over the now blocking socket */
+static void handoff_connection(int epoll_fd, connection_t *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    metrics_add(METRIC_ACTIVE_CONNECTIONS, -1);  // The handler counts it from here on
+
+    int flags = fcntl(conn->socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(conn->socket, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        perror("Failed to hand off connection");
+        close(conn->socket);
+        buffer_pool_free(conn, sizeof(connection_t));
+        return;
+    }
+    client_info_t client;
+    client.client_socket = conn->socket;
+    client.client_addr = conn->client_addr;
+    client.accepted_ns = conn->accepted_ns;
+    client.request_header = conn->header;
+    extended_request_handler(&client);
+    buffer_pool_free(conn, sizeof(connection_t));
+}
+
+/*
+ * Decide from the first bytes how to serve the connection: legacy uploads
+ * and OP_PUT stay in the loop, other extended requests return CONN_HANDOFF
+ * once their fixed header is in conn->header. The bytes are read, not
+ * peeked, so a header that arrives in pieces does not leave the socket
+ * readable and spin the loop.
+ */
+static int consume_framing(connection_t *conn, const unsigned char *data, size_t len, size_t *pos) {
+    size_t need = PROTOCOL_HEADER_SIZE - conn->header_len;
+    size_t take = (len - *pos < need) ? len - *pos : need;
+    memcpy(conn->header + conn->header_len, data + *pos, take);
+    conn->header_len += take;
+    *pos += take;
+    if (!extended_prefix_matches(conn->header, conn->header_len)) {
+        conn->state = CONN_FILENAME;
+        return SUCCESS;
+    }
+    if (conn->header_len < PROTOCOL_HEADER_SIZE) {
+        return SUCCESS;  // Wait for the whole fixed header before deciding
+    }
+    request_header_t header;
+    decode_request_header(conn->header, &header);
+    if (header.opcode != OP_PUT) {
+        return CONN_HANDOFF;
+    }
+    conn->state = CONN_PUT_HEADER;
+    return SUCCESS;
+}
+
+/* Release a connection, discarding any partially written file */
+static void close_connection(int epoll_fd, connection_t *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    if (conn->output_file) {
+        fclose(conn->output_file);
+        unlink(conn->output_path);
+        log_transfer(conn->client_ip, conn->client_port, conn->filename, conn->file_size, "FAILED");
+        metrics_add(METRIC_FILES_FAILED, 1);
+    }
+    checksum_free(&conn->checksum);
+    close(conn->socket);
+    metrics_add(METRIC_ACTIVE_CONNECTIONS, -1);
+    metrics_observe(METRIC_REQUEST_TIME, metrics_now_ns() - conn->accepted_ns);
+    buffer_pool_free(conn, sizeof(connection_t));
+}
+
+/* Transition into the body phase once the header is complete */
+static int begin_body(connection_t *conn) {
+    printf("Receiving file: %s (%zu bytes) from %s:%d\n", conn->filename, conn->file_size,
+           conn->client_ip, conn->client_port);
+    snprintf(conn->output_path, sizeof(conn->output_path), "%s/%s", RECEIVED_FILES_DIR, conn->filename);
+    conn->output_file = fopen(conn->output_path, "wb");
+    if (!conn->output_file) {
+        perror("Failed to create output file");
+        log_message(LOG_ERROR, "Failed to create output file: %s", conn->output_path);
+        return ERROR_FILE_IO;
+    }
+    conn->state = CONN_BODY;
+    return SUCCESS;
+}
+
+/* Collect the OP_PUT header and filename, then answer with the granted features */
+static int consume_put_header(connection_t *conn, const unsigned char *data, size_t len, size_t *pos) {
+    size_t need = conn->header_need ? conn->header_need : PROTOCOL_HEADER_SIZE;
+    size_t take = (len - *pos < need - conn->header_len) ? len - *pos : need - conn->header_len;
+    memcpy(conn->header + conn->header_len, data + *pos, take);
+    conn->header_len += take;
+    *pos += take;
+    if (conn->header_len < need) {
+        return SUCCESS;
+    }
+
+    request_header_t header;
+    decode_request_header(conn->header, &header);
+    if (!conn->header_need) {
+        if (check_request_header(&header, sizeof(conn->filename)) != SUCCESS) {
+            log_message(LOG_ERROR, "Invalid request header from %s:%d", conn->client_ip, conn->client_port);
+            return ERROR_NETWORK;
+        }
+        conn->header_need = PROTOCOL_HEADER_SIZE + header.name_len;
+        return SUCCESS;
+    }
+    memcpy(conn->filename, conn->header + PROTOCOL_HEADER_SIZE, header.name_len);
+    conn->filename[header.name_len] = '\0';
+    if (check_request_name(conn->filename, header.name_len) != SUCCESS) {
+        log_message(LOG_ERROR, "Invalid request header from %s:%d", conn->client_ip, conn->client_port);
+        return ERROR_NETWORK;
+    }
+    conn->file_size = (size_t)header.length;
+    /* fsync would stall every connection on the loop, so PUT_FEATURE_SYNC is not granted here */
+    conn->features = header.flags & PUT_FEATURES_SUPPORTED & ~(uint32_t)PUT_FEATURE_SYNC;
+    if ((conn->features & PUT_FEATURE_CHECKSUM) && checksum_init(&conn->checksum, header.length) != SUCCESS) {
+        conn->features &= ~(uint32_t)PUT_FEATURE_CHECKSUM;  // No room for the chunk CRCs: take it unverified
+    }
+    if (begin_body(conn) != SUCCESS) {
+        return ERROR_FILE_IO;
+    }
+
+    /* Four bytes on a fresh connection always fit in the socket buffer */
+    unsigned char reply[PUT_REPLY_SIZE];
+    put_le32(reply, conn->features);
+    if (send(conn->socket, reply, sizeof(reply), MSG_NOSIGNAL) != (ssize_t)sizeof(reply)) {
+        log_message(LOG_ERROR, "Failed to answer upload request from %s:%d", conn->client_ip, conn->client_port);
+        return ERROR_NETWORK;
+    }
+    return SUCCESS;
+}
+
+/* Collect the legacy filename and size; bytes past them are handed back as body */
+static int consume_legacy_header(connection_t *conn, const unsigned char *data, size_t len, size_t *pos) {
+    size_t room = MAX_FILENAME_LEN + sizeof(size_t) - conn->header_len;
+    size_t take = (len - *pos < room) ? len - *pos : room;
+    memcpy(conn->header + conn->header_len, data + *pos, take);
+    conn->header_len += take;
+    *pos += take;
+
+    uint64_t file_size;
+    int header_len = parse_legacy_header(conn->header, conn->header_len, conn->filename,
+                                         sizeof(conn->filename), &file_size);
+    if (header_len == 0) {
+        return SUCCESS;
+    }
+    if (header_len < 0) {
+        log_message(LOG_ERROR, "Invalid file header from %s:%d", conn->client_ip, conn->client_port);
+        return ERROR_FILE_IO;
+    }
+    *pos -= conn->header_len - (size_t)header_len;
+    conn->file_size = (size_t)file_size;
+    return begin_body(conn);
+}
+
+/* Switch the connection to sending message, then closing */
+static int queue_ack(int epoll_fd, connection_t *conn, const char *message) {
+    conn->state = CONN_ACK;
+    conn->ack = message;
+    conn->ack_len = strlen(message);
+    conn->ack_sent = 0;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->socket, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return ERROR_NETWORK;
+    }
+    return SUCCESS;
+}
+
+/* Finish the body phase and queue the acknowledgment */
+static int finish_body(int epoll_fd, connection_t *conn) {
+    FILE *output_file = conn->output_file;
+    conn->output_file = NULL;
+    if (fclose(output_file) != 0) {
+        perror("Failed to flush output file");
+        unlink(conn->output_path);
+        log_transfer(conn->client_ip, conn->client_port, conn->filename, conn->file_size, "FAILED");
+        metrics_add(METRIC_FILES_FAILED, 1);
+        return ERROR_FILE_IO;
+    }
+
+    printf("File saved successfully: %s\n", conn->output_path);
+    log_transfer(conn->client_ip, conn->client_port, conn->filename, conn->file_size, "SUCCESS");
+    metrics_add(METRIC_FILES_STORED, 1);
+    return queue_ack(epoll_fd, conn, ack_message);
+}
+
+/* The body is in: finish now, or first collect and check the checksum trailer */
+static int end_body(int epoll_fd, connection_t *conn) {
+    if (conn->state == CONN_BODY && (conn->features & PUT_FEATURE_CHECKSUM)) {
+        conn->state = CONN_TRAILER;
+        return SUCCESS;
+    }
+    if (conn->state == CONN_TRAILER && checksum_verify(&conn->checksum) != SUCCESS) {
+        fclose(conn->output_file);
+        conn->output_file = NULL;
+        unlink(conn->output_path);
+        printf("Checksum mismatch, discarding %s\n", conn->filename);
+        log_message(LOG_ERROR, "Checksum mismatch for %s from %s:%d at trailer entry %llu of %llu",
+                    conn->filename, conn->client_ip, conn->client_port,
+                    (unsigned long long)conn->checksum.bad_entry,
+                    (unsigned long long)conn->checksum.chunk_count + 1);
+        log_transfer(conn->client_ip, conn->client_port, conn->filename, conn->file_size, "FAILED");
+        metrics_add(METRIC_FILES_FAILED, 1);
+        metrics_add(METRIC_CHECKSUM_FAILURES, 1);
+        return queue_ack(epoll_fd, conn, ACK_CHECKSUM_MISMATCH);
+    }
+    return finish_body(epoll_fd, conn);
+}
+
+/* Feed received bytes through the state machine; body bytes are decrypted in place */
+static int consume_bytes(int epoll_fd, connection_t *conn, unsigned char *data, size_t len) {
+    size_t pos = 0;
+    int status;
+    while (pos < len && conn->state != CONN_ACK) {
+        switch (conn->state) {
+        case CONN_PUT_HEADER:
+            if (consume_put_header(conn, data, len, &pos) != SUCCESS) {
+                return ERROR_FILE_IO;
+            }
+            if (conn->state == CONN_BODY && conn->file_size == 0) {
+                if (end_body(epoll_fd, conn) != SUCCESS) {
+                    return ERROR_NETWORK;
+                }
+            }
+            break;
+        case CONN_FRAMING:
+            status = consume_framing(conn, data, len, &pos);
+            if (status != SUCCESS) {
+                return status;
+            }
+            if (conn->state != CONN_FILENAME) {
+                break;
+            }
+            /* A short legacy upload may be complete already */
+            /* fall through */
+        case CONN_FILENAME:
+            if (consume_legacy_header(conn, data, len, &pos) != SUCCESS) {
+                return ERROR_FILE_IO;
+            }
+            if (conn->state == CONN_BODY && conn->file_size == 0) {
+                return finish_body(epoll_fd, conn);
+            }
+            break;
+        case CONN_BODY: {
+            size_t remaining = conn->file_size - conn->total_received;
+            size_t take = (len - pos < remaining) ? len - pos : remaining;
+            if (conn->features & PUT_FEATURE_CHECKSUM) {
+                checksum_decrypt(&conn->checksum, data + pos, take);
+            } else {
+                decrypt_buffer(data + pos, take, ENCRYPTION_KEY);
+            }
+            uint64_t started = metrics_now_ns();
+            size_t written = fwrite(data + pos, 1, take, conn->output_file);
+            metrics_observe(METRIC_WRITE_TIME, metrics_now_ns() - started);
+            metrics_add(METRIC_BYTES_WRITTEN, (int64_t)written);
+            if (written != take) {
+                perror("Failed to write file data");
+                log_message(LOG_ERROR, "Write failed for %s after %zu bytes",
+                            conn->output_path, conn->total_received);
+                return ERROR_FILE_IO;
+            }
+            conn->total_received += take;
+            pos += take;
+            if (conn->total_received == conn->file_size && end_body(epoll_fd, conn) != SUCCESS) {
+                return ERROR_NETWORK;
+            }
+            break;
+        }
+        case CONN_TRAILER:
+            pos += checksum_consume_trailer(&conn->checksum, data + pos, len - pos);
+            if (checksum_trailer_remaining(&conn->checksum) == 0) {
+                return end_body(epoll_fd, conn);
+            }
+            break;
+        case CONN_ACK:
+            break;
+        }
+    }
+    return SUCCESS;
+}
+
+/* Drain readable data from a connection; returns negative when it should be closed */
+static int handle_readable(int epoll_fd, connection_t *conn, unsigned char *buffer, size_t chunk_size) {
+    for (int i = 0; i < READS_PER_EVENT && conn->state != CONN_ACK; i++) {
+        size_t want = chunk_size;
+        if (conn->state == CONN_FRAMING) {
+            want = PROTOCOL_HEADER_SIZE - conn->header_len;  // Nothing past the header before a handoff
+        } else if (conn->state == CONN_BODY && conn->file_size - conn->total_received < want) {
+            want = conn->file_size - conn->total_received;
+        } else if (conn->state == CONN_TRAILER && checksum_trailer_remaining(&conn->checksum) < want) {
+            want = checksum_trailer_remaining(&conn->checksum);
+        }
+        uint64_t started = metrics_now_ns();
+        ssize_t bytes_received = recv(conn->socket, buffer, want, 0);
+        metrics_observe(METRIC_RECV_TIME, metrics_now_ns() - started);
+        if (bytes_received > 0) {
+            metrics_add(METRIC_BYTES_RECEIVED, bytes_received);
+        }
+        if (bytes_received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return SUCCESS;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERROR_NETWORK;
+        }
+        if (bytes_received == 0) {
+            if (conn->header_len > 0 &&
+                (conn->state != CONN_BODY || conn->total_received != conn->file_size)) {
+                log_message(LOG_ERROR, "Connection from %s:%d closed mid-transfer",
+                            conn->client_ip, conn->client_port);
+            }
+            return ERROR_NETWORK;
+        }
+        int status = consume_bytes(epoll_fd, conn, buffer, (size_t)bytes_received);
+        if (status != SUCCESS) {
+            return status;
+        }
+    }
+    return SUCCESS;
+}
+
+/* Push the pending acknowledgment; returns 1 once it has been fully sent */
+static int handle_writable(connection_t *conn) {
+    while (conn->ack_sent < conn->ack_len) {
+        ssize_t bytes_sent = send(conn->socket, conn->ack + conn->ack_sent,
+                                  conn->ack_len - conn->ack_sent, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        conn->ack_sent += bytes_sent;
+    }
+    return 1;
+}
+
+/* Accept every pending connection on the listening socket */
+static void accept_connections(int epoll_fd, int listen_socket) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept4(listen_socket, (struct sockaddr *)&client_addr, &client_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Accept failed");
+                log_message(LOG_ERROR, "Accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        connection_t *conn = (connection_t *)buffer_pool_alloc(sizeof(connection_t));
+        if (!conn) {
+            perror("Failed to allocate memory for connection");
+            close(client_socket);
+            continue;
+        }
+        memset(conn, 0, sizeof(*conn));
+        conn->socket = client_socket;
+        conn->state = CONN_FRAMING;
+        conn->client_addr = client_addr;
+        conn->accepted_ns = metrics_now_ns();
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn->client_ip, INET_ADDRSTRLEN);
+        conn->client_port = ntohs(client_addr.sin_port);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close(client_socket);
+            buffer_pool_free(conn, sizeof(connection_t));
+            continue;
+        }
+        metrics_add(METRIC_CONNECTIONS, 1);
+        metrics_add(METRIC_ACTIVE_CONNECTIONS, 1);
+        log_message(LOG_INFO, "Client connected: %s:%d", conn->client_ip, conn->client_port);
+    }
+}
+
+/* Event loop: one thread multiplexes every connection through epoll */
+int run_event_server(int listen_socket, size_t chunk_size, client_handler_t extended_handler,
+                     volatile sig_atomic_t *running) {
+    extended_request_handler = extended_handler;
+    int flags = fcntl(listen_socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(listen_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("Failed to make listening socket non-blocking");
+        return ERROR_SOCKET;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return ERROR_SOCKET;
+    }
+
+    /* The listening socket is tagged with a NULL pointer */
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_socket, &ev) < 0) {
+        perror("epoll_ctl failed");
+        close(epoll_fd);
+        return ERROR_SOCKET;
+    }
+
+    /* Single receive buffer shared by every connection; the loop is single-threaded */
+    unsigned char *buffer = (unsigned char *)buffer_pool_alloc(chunk_size);
+    if (!buffer) {
+        perror("Failed to allocate receive buffer");
+        close(epoll_fd);
+        return ERROR_MEMORY;
+    }
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (*running) {
+        int ready = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            connection_t *conn = (connection_t *)events[i].data.ptr;
+            if (!conn) {
+                if (*running) {
+                    accept_connections(epoll_fd, listen_socket);  // Shutdown wakes the listener too
+                }
+                continue;
+            }
+
+            if (conn->state == CONN_ACK) {
+                int status = handle_writable(conn);
+                if (status != 0) {
+                    close_connection(epoll_fd, conn);
+                }
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                int status = handle_readable(epoll_fd, conn, buffer, chunk_size);
+                if (status == CONN_HANDOFF) {
+                    handoff_connection(epoll_fd, conn);
+                } else if (status != SUCCESS) {
+                    close_connection(epoll_fd, conn);
+                }
+            }
+        }
+    }
+
+    buffer_pool_free(buffer, chunk_size);
+    close(epoll_fd);
+    return SUCCESS;
+}
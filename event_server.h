@@ -0,0 +1,20 @@
+#ifndef EVENT_SERVER_H
+#define EVENT_SERVER_H
+
+#include "common.h"
+
+/* Maximum events fetched per epoll_wait call */
+#define EPOLL_MAX_EVENTS 256
+
+/*
+ * Run the epoll-driven connection engine on an already listening socket.
+ * Legacy uploads and OP_PUT requests are handled inline. Other extended
+ * requests are passed, with the header the loop already read in
+ * request_header, to extended_handler on the loop thread; it owns the
+ * socket from then on and must not block (the server starts a dedicated
+ * thread for the request).
+ */
+int run_event_server(int listen_socket, size_t chunk_size, client_handler_t extended_handler,
+                     volatile sig_atomic_t *running);
+
+#endif /* EVENT_SERVER_H */
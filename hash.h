@@ -0,0 +1,26 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include "common.h"
+#include <stdint.h>
+
+/* SHA-256 (FIPS 180-4), used for block signatures and whole-file checks */
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;                         // Bytes hashed so far
+    unsigned char block[SHA256_BLOCK_SIZE];  // Pending partial block
+    size_t used;
+} sha256_ctx_t;
+
+/* Incremental hashing */
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t size);
+void sha256_final(sha256_ctx_t *ctx, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+/* One-shot digest of a buffer */
+void sha256(const void *data, size_t size, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif /* HASH_H */
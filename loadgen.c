@@ -0,0 +1,557 @@
+#include "common.h"
+#include "transfer.h"
+#include "protocol.h"
+#include "chunk_store.h"
+#include "pack_store.h"
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+
+/*
+ * Load generator: starts a local server in a scratch directory, then for
+ * each file size runs the configured number of client threads uploading
+ * back to back with the client's OP_PUT code for a fixed time. Results go
+ * out as JSON so runs of different builds can be compared. With a list of
+ * shard counts the whole matrix is repeated against a server restarted
+ * with each -n; tiny files turn transfers/s into a connection-rate test.
+ * A list of storage layouts (-S files,pack) repeats it once more per
+ * layout, and unique names (-u) make every upload create a new file.
+ */
+#define LOADGEN_DEFAULT_SIZES "1K,64K,1M,16M,256M,1G,10G"
+#define LOADGEN_DEFAULT_CLIENTS 4
+#define LOADGEN_DEFAULT_SECONDS 3.0
+#define LOADGEN_DEFAULT_PORT 9400
+#define LOADGEN_MAX_SIZES 32
+#define LOADGEN_MAX_SHARD_COUNTS 8
+#define LOADGEN_MAX_STORAGES 4
+#define LOADGEN_MAX_CLIENTS 1024
+#define LOADGEN_STARTUP_TIMEOUT_MS 5000
+#define LOADGEN_DISK_SHARE 0.9  // A size is skipped if its files would fill more of the free space
+
+/* One client thread and the latencies of its completed uploads */
+typedef struct {
+    int port;
+    int file_fd;
+    const struct stat *file_stat;
+    char filename[64];
+    int index;
+    int unique;             // A new name for every upload
+    double deadline;
+    pthread_barrier_t *start;
+    uint64_t *latencies_ns;
+    size_t count;
+    size_t capacity;
+    uint64_t failed;
+} bench_client_t;
+
+/* Aggregate results for one file size */
+typedef struct {
+    const char *storage;
+    int shards;
+    uint64_t size;
+    const char *skipped;  // Reason, or NULL if the size ran
+    uint64_t transfers;
+    uint64_t failed;
+    double elapsed;
+    double p50_ms;
+    double p99_ms;
+    double p999_ms;
+    double max_ms;
+} bench_result_t;
+
+static volatile pid_t server_pid = -1;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stop_server(void) {
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+        server_pid = -1;
+    }
+}
+
+/* Signal handler: never leave the spawned server running */
+static void signal_handler(int sig) {
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+    }
+    _exit(128 + sig);
+}
+
+static int parse_size_list(const char *text, uint64_t *sizes, size_t *count) {
+    char list[512];
+    if (strlen(text) >= sizeof(list)) {
+        return ERROR_FILE_IO;
+    }
+    strcpy(list, text);
+    *count = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (*count == LOADGEN_MAX_SIZES || parse_byte_size(item, &sizes[*count]) != SUCCESS) {
+            return ERROR_FILE_IO;
+        }
+        (*count)++;
+    }
+    return (*count > 0) ? SUCCESS : ERROR_FILE_IO;
+}
+
+static int parse_shard_list(const char *text, int *shards, size_t *count) {
+    *count = 0;
+    const char *pos = text;
+    while (*pos) {
+        char *end;
+        long value = strtol(pos, &end, 10);
+        if (end == pos || value < 1 || *count == LOADGEN_MAX_SHARD_COUNTS || (*end != ',' && *end != '\0')) {
+            return ERROR_FILE_IO;
+        }
+        shards[(*count)++] = (int)value;
+        pos = (*end == ',') ? end + 1 : end;
+    }
+    return (*count > 0) ? SUCCESS : ERROR_FILE_IO;
+}
+
+static int parse_storage_list(char *text, const char **storages, size_t *count) {
+    *count = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(text, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (*count == LOADGEN_MAX_STORAGES ||
+            (strcmp(item, "files") != 0 && strcmp(item, "cas") != 0 && strcmp(item, "pack") != 0)) {
+            return ERROR_FILE_IO;
+        }
+        storages[(*count)++] = item;
+    }
+    return (*count > 0) ? SUCCESS : ERROR_FILE_IO;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+/*
+ * Wait until port can be bound again. A server that used io_uring may
+ * still hold its listening socket for a moment after it exited, while
+ * the kernel tears the ring down.
+ */
+static void wait_for_port(int port) {
+    for (int waited = 0; waited < LOADGEN_STARTUP_TIMEOUT_MS; waited += 10) {
+        int probe = create_socket();
+        int opt = 1;
+        setsockopt(probe, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = INADDR_ANY;
+        int bound = bind(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(probe);
+        if (bound) {
+            return;
+        }
+        usleep(10000);
+    }
+}
+
+/* Delete what earlier runs stored, so every run starts from an empty layout */
+static void clear_storage(const char *workdir) {
+    const char *dirs[] = { RECEIVED_FILES_DIR, CHUNK_STORE_DIR, PACK_STORE_DIR };
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", workdir, dirs[i]) < (int)sizeof(path)) {
+            nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        }
+    }
+}
+
+/* Start the server in workdir and wait until its metrics port accepts connections */
+static int start_server(const char *server_path, const char *workdir, const char *engine, const char *storage,
+                        int shards, int port) {
+    char port_text[16];
+    char metrics_text[16];
+    char shards_text[16];
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    snprintf(metrics_text, sizeof(metrics_text), "%d", port + 1);
+    snprintf(shards_text, sizeof(shards_text), "%d", shards);
+
+    wait_for_port(port);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        return ERROR_THREAD;
+    }
+    if (pid == 0) {
+        int out = -1;
+        if (chdir(workdir) == 0) {
+            out = open("server.out", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+        if (out >= 0) {
+            dup2(out, STDOUT_FILENO);
+            dup2(out, STDERR_FILENO);
+        }
+        execl(server_path, "server", "-e", engine, "-s", storage, "-n", shards_text, "-M", metrics_text, port_text,
+              (char *)NULL);
+        perror("Failed to start server");
+        _exit(127);
+    }
+    server_pid = pid;
+
+    /* The metrics listener starts just before the connection engine */
+    for (int waited = 0; waited < LOADGEN_STARTUP_TIMEOUT_MS; waited += 10) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            server_pid = -1;
+            fprintf(stderr, "Server exited during startup; see %s/server.out\n", workdir);
+            return ERROR_CONNECT;
+        }
+        int probe = create_socket();
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)(port + 1));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int connected = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(probe);
+        if (connected) {
+            return SUCCESS;
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "Server did not start within %d ms\n", LOADGEN_STARTUP_TIMEOUT_MS);
+    stop_server();
+    return ERROR_CONNECT;
+}
+
+static void* bench_client_main(void *arg) {
+    bench_client_t *client = (bench_client_t *)arg;
+    pthread_barrier_wait(client->start);
+    do {
+        struct timespec started;
+        struct timespec finished;
+        if (client->unique) {
+            snprintf(client->filename, sizeof(client->filename), "bench-%d-%llu.bin", client->index,
+                     (unsigned long long)(client->count + client->failed));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        int status = put_file("127.0.0.1", client->port, client->file_fd, client->filename,
+                              client->file_stat, PUT_FEATURE_CHECKSUM);
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        if (status != SUCCESS) {
+            client->failed++;
+            if (status == ERROR_CONNECT) {
+                break;
+            }
+            continue;
+        }
+        if (client->count == client->capacity) {
+            size_t capacity = client->capacity ? client->capacity * 2 : 1024;
+            uint64_t *grown = (uint64_t *)realloc(client->latencies_ns, capacity * sizeof(uint64_t));
+            if (!grown) {
+                break;
+            }
+            client->latencies_ns = grown;
+            client->capacity = capacity;
+        }
+        client->latencies_ns[client->count++] =
+            (uint64_t)(finished.tv_sec - started.tv_sec) * 1000000000ULL + finished.tv_nsec - started.tv_nsec;
+    } while (now_seconds() < client->deadline);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted latencies, in milliseconds */
+static double percentile_ms(const uint64_t *sorted, size_t count, double fraction) {
+    size_t rank = (size_t)(fraction * count + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    return sorted[(rank > count ? count : rank) - 1] / 1e6;
+}
+
+/* Upload size-byte files from every client for `seconds`, then summarize */
+static int run_size(const char *workdir, int port, int clients, double seconds, int unique,
+                    bench_result_t *result) {
+    struct statvfs disk;
+    if (statvfs(workdir, &disk) == 0 &&
+        (double)result->size * clients > (double)disk.f_bavail * disk.f_frsize * LOADGEN_DISK_SHARE) {
+        result->skipped = "not enough free disk space";
+        return SUCCESS;
+    }
+
+    /* A sparse source file: reads cost page-cache copies, not disk space */
+    char source[PATH_MAX];
+    if (snprintf(source, sizeof(source), "%s/source.bin", workdir) >= (int)sizeof(source)) {
+        return ERROR_FILE_IO;
+    }
+    int file_fd = open(source, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file_fd < 0 || ftruncate(file_fd, (off_t)result->size) < 0) {
+        perror("Failed to create source file");
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        return ERROR_FILE_IO;
+    }
+    struct stat file_stat;
+    fstat(file_fd, &file_stat);
+
+    bench_client_t *states = (bench_client_t *)calloc((size_t)clients, sizeof(bench_client_t));
+    pthread_t *threads = (pthread_t *)calloc((size_t)clients, sizeof(pthread_t));
+    pthread_barrier_t start;
+    int status = (states && threads) ? SUCCESS : ERROR_MEMORY;
+    int started = 0;
+    if (status == SUCCESS) {
+        pthread_barrier_init(&start, NULL, (unsigned)clients + 1);
+        for (; started < clients; started++) {
+            bench_client_t *client = &states[started];
+            client->port = port;
+            client->file_fd = file_fd;
+            client->file_stat = &file_stat;
+            client->start = &start;
+            client->index = started;
+            client->unique = unique;
+            snprintf(client->filename, sizeof(client->filename), "bench-%d.bin", started);
+            if (pthread_create(&threads[started], NULL, bench_client_main, client) != 0) {
+                perror("Failed to create client thread");
+                status = ERROR_THREAD;
+                break;
+            }
+        }
+    }
+
+    if (status == SUCCESS) {
+        double start_time = now_seconds();
+        for (int i = 0; i < clients; i++) {
+            states[i].deadline = start_time + seconds;
+        }
+        pthread_barrier_wait(&start);
+        for (int i = 0; i < clients; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        result->elapsed = now_seconds() - start_time;
+        pthread_barrier_destroy(&start);
+
+        size_t total = 0;
+        for (int i = 0; i < clients; i++) {
+            total += states[i].count;
+            result->failed += states[i].failed;
+        }
+        uint64_t *latencies = (uint64_t *)malloc((total ? total : 1) * sizeof(uint64_t));
+        if (latencies) {
+            size_t filled = 0;
+            for (int i = 0; i < clients; i++) {
+                memcpy(latencies + filled, states[i].latencies_ns, states[i].count * sizeof(uint64_t));
+                filled += states[i].count;
+            }
+            qsort(latencies, total, sizeof(uint64_t), compare_u64);
+            result->transfers = total;
+            if (total > 0) {
+                result->p50_ms = percentile_ms(latencies, total, 0.50);
+                result->p99_ms = percentile_ms(latencies, total, 0.99);
+                result->p999_ms = percentile_ms(latencies, total, 0.999);
+                result->max_ms = latencies[total - 1] / 1e6;
+            }
+            free(latencies);
+        } else {
+            status = ERROR_MEMORY;
+        }
+    } else if (started > 0) {
+        /* Release the threads that did start; they see a deadline in the past */
+        for (int i = started; i < clients; i++) {
+            pthread_barrier_wait(&start);
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for (int i = 0; states && i < clients; i++) {
+        char received[PATH_MAX];
+        if (snprintf(received, sizeof(received), "%s/%s/%s", workdir, RECEIVED_FILES_DIR,
+                     states[i].filename) < (int)sizeof(received)) {
+            unlink(received);
+        }
+        free(states[i].latencies_ns);
+    }
+    free(states);
+    free(threads);
+    close(file_fd);
+    unlink(source);
+    return status;
+}
+
+static void write_json(FILE *out, const char *label, const char *engine, int clients, double seconds,
+                       const bench_result_t *results, size_t count) {
+    fprintf(out, "{\n  \"tool\": \"eftt-loadgen\",\n  \"label\": \"%s\",\n  \"engine\": \"%s\",\n"
+            "  \"clients\": %d,\n  \"seconds_per_size\": %.3f,\n  \"cpus\": %ld,\n  \"results\": [\n",
+            label, engine, clients, seconds, sysconf(_SC_NPROCESSORS_ONLN));
+    for (size_t i = 0; i < count; i++) {
+        const bench_result_t *r = &results[i];
+        fprintf(out, "    {\"storage\": \"%s\", \"shards\": %d, \"size_bytes\": %llu, ", r->storage, r->shards,
+                (unsigned long long)r->size);
+        if (r->skipped) {
+            fprintf(out, "\"skipped\": \"%s\"}", r->skipped);
+        } else {
+            double elapsed = r->elapsed > 0 ? r->elapsed : 1e-9;
+            fprintf(out, "\"transfers\": %llu, \"failed\": %llu, \"elapsed_s\": %.3f, "
+                    "\"mb_per_s\": %.2f, \"transfers_per_s\": %.2f, "
+                    "\"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}}",
+                    (unsigned long long)r->transfers, (unsigned long long)r->failed, r->elapsed,
+                    (double)r->size * r->transfers / elapsed / 1e6, r->transfers / elapsed,
+                    r->p50_ms, r->p99_ms, r->p999_ms, r->max_ms);
+        }
+        fprintf(out, "%s\n", (i + 1 < count) ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s sizes] [-c clients] [-t seconds] [-e engine] [-n shards] [-S storages]\n"
+                    "          [-u] [-p port] [-b server] [-w dir] [-L label] [-o file.json]\n", prog);
+    fprintf(stderr, "  -s sizes    Comma-separated file sizes, K/M/G suffixes (default: %s)\n",
+            LOADGEN_DEFAULT_SIZES);
+    fprintf(stderr, "  -c clients  Concurrent client threads (default: %d)\n", LOADGEN_DEFAULT_CLIENTS);
+    fprintf(stderr, "  -t seconds  Time spent on each size; every client uploads at least once (default: %.0f)\n",
+            LOADGEN_DEFAULT_SECONDS);
+    fprintf(stderr, "  -e engine   Server connection engine (default: threads)\n");
+    fprintf(stderr, "  -n shards   Comma-separated server shard counts, each run in turn (default: 1)\n");
+    fprintf(stderr, "  -S storages Comma-separated server storage layouts (files, cas, pack), each run in\n"
+                    "              turn against an empty store (default: files)\n");
+    fprintf(stderr, "  -u          Give every upload a new name instead of overwriting one file per client\n");
+    fprintf(stderr, "  -p port     Server port; port+1 serves its metrics (default: %d)\n", LOADGEN_DEFAULT_PORT);
+    fprintf(stderr, "  -b server   Server binary (default: ./server)\n");
+    fprintf(stderr, "  -w dir      Where the scratch directory is created (default: $TMPDIR or /tmp)\n");
+    fprintf(stderr, "  -L label    Free-form label copied into the report (e.g. a commit id)\n");
+    fprintf(stderr, "  -o file     Write the JSON report to file instead of stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *size_list = LOADGEN_DEFAULT_SIZES;
+    int clients = LOADGEN_DEFAULT_CLIENTS;
+    double seconds = LOADGEN_DEFAULT_SECONDS;
+    const char *engine = "threads";
+    const char *shard_list = "1";
+    char storage_list[64] = "files";
+    int unique = 0;
+    int port = LOADGEN_DEFAULT_PORT;
+    const char *server_binary = "./server";
+    const char *scratch_base = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    const char *label = "";
+    const char *output_path = NULL;
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "s:c:t:e:n:S:up:b:w:L:o:h")) != -1) {
+        switch (opt_char) {
+        case 's': size_list = optarg; break;
+        case 'c': clients = atoi(optarg); break;
+        case 't': seconds = atof(optarg); break;
+        case 'e': engine = optarg; break;
+        case 'n': shard_list = optarg; break;
+        case 'S': snprintf(storage_list, sizeof(storage_list), "%s", optarg); break;
+        case 'u': unique = 1; break;
+        case 'p': port = atoi(optarg); break;
+        case 'b': server_binary = optarg; break;
+        case 'w': scratch_base = optarg; break;
+        case 'L': label = optarg; break;
+        case 'o': output_path = optarg; break;
+        default:
+            print_usage(argv[0]);
+            return (opt_char == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    uint64_t sizes[LOADGEN_MAX_SIZES];
+    size_t size_count;
+    if (parse_size_list(size_list, sizes, &size_count) != SUCCESS) {
+        fprintf(stderr, "Invalid size list: %s\n", size_list);
+        return EXIT_FAILURE;
+    }
+    int shard_counts[LOADGEN_MAX_SHARD_COUNTS];
+    size_t shard_run_count;
+    if (parse_shard_list(shard_list, shard_counts, &shard_run_count) != SUCCESS) {
+        fprintf(stderr, "Invalid shard list: %s\n", shard_list);
+        return EXIT_FAILURE;
+    }
+    const char *storages[LOADGEN_MAX_STORAGES];
+    size_t storage_count;
+    if (parse_storage_list(storage_list, storages, &storage_count) != SUCCESS) {
+        fprintf(stderr, "Invalid storage list: %s\n", storage_list);
+        return EXIT_FAILURE;
+    }
+    if (clients < 1 || clients > LOADGEN_MAX_CLIENTS || seconds < 0 || port <= 0 || port >= 65535 ||
+        strchr(label, '"') || strchr(label, '\\')) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    char server_path[PATH_MAX];
+    if (!realpath(server_binary, server_path)) {
+        fprintf(stderr, "Server binary not found: %s\n", server_binary);
+        return EXIT_FAILURE;
+    }
+    char workdir[PATH_MAX];
+    snprintf(workdir, sizeof(workdir), "%s/eftt-bench-XXXXXX", scratch_base);
+    if (!mkdtemp(workdir)) {
+        perror("Failed to create scratch directory");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setup_signal_handlers(signal_handler);
+    static bench_result_t results[LOADGEN_MAX_STORAGES * LOADGEN_MAX_SHARD_COUNTS * LOADGEN_MAX_SIZES];
+    size_t result_count = 0;
+    int status = SUCCESS;
+    fprintf(stderr, "%7s %6s %12s %10s %8s %10s %10s %10s %10s %10s\n", "storage", "shards", "size", "transfers",
+            "failed", "MB/s", "xfers/s", "p50 ms", "p99 ms", "p999 ms");
+    for (size_t run = 0; run < storage_count * shard_run_count && status == SUCCESS; run++) {
+        const char *storage = storages[run / shard_run_count];
+        int shards = shard_counts[run % shard_run_count];
+        clear_storage(workdir);
+        status = start_server(server_path, workdir, engine, storage, shards, port);
+        for (size_t i = 0; i < size_count && status == SUCCESS; i++) {
+            bench_result_t *r = &results[result_count++];
+            r->storage = storage;
+            r->shards = shards;
+            r->size = sizes[i];
+            status = run_size(workdir, port, clients, seconds, unique, r);
+            if (r->skipped) {
+                fprintf(stderr, "%7s %6d %12llu skipped: %s\n", r->storage, r->shards, (unsigned long long)r->size,
+                        r->skipped);
+            } else if (status == SUCCESS) {
+                double elapsed = r->elapsed > 0 ? r->elapsed : 1e-9;
+                fprintf(stderr, "%7s %6d %12llu %10llu %8llu %10.1f %10.1f %10.3f %10.3f %10.3f\n", r->storage,
+                        r->shards, (unsigned long long)r->size, (unsigned long long)r->transfers,
+                        (unsigned long long)r->failed, (double)r->size * r->transfers / elapsed / 1e6,
+                        r->transfers / elapsed, r->p50_ms, r->p99_ms, r->p999_ms);
+            }
+        }
+        stop_server();
+    }
+    nftw(workdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    if (status != SUCCESS) {
+        fprintf(stderr, "Benchmark aborted\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = output_path ? fopen(output_path, "w") : stdout;
+    if (!out) {
+        perror("Failed to open report file");
+        return EXIT_FAILURE;
+    }
+    write_json(out, label, engine, clients, seconds, results, result_count);
+    if (output_path) {
+        fclose(out);
+        fprintf(stderr, "Report written to %s\n", output_path);
+    }
+    return EXIT_SUCCESS;
+}
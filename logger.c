@@ -1,60 +1,340 @@
 #include "logger.h"
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sched.h>
 
-static FILE *log_file = NULL;
+#define LOG_TEXT_SIZE 960           // Message text, or a transfer's filename
+#define LOG_LINE_SIZE 1280
+#define LOG_BATCH_SIZE (64 * 1024)  // Flusher output buffer
+#define LOG_WAKE_THRESHOLD (LOG_RING_CAPACITY / 4)
+
+typedef enum {
+    RECORD_MESSAGE,
+    RECORD_TRANSFER
+} record_kind_t;
+
+/* One queued event, kept binary until the flusher formats it */
+typedef struct {
+    atomic_size_t sequence;  // Slot state in the bounded MPSC queue
+    time_t time;
+    record_kind_t kind;
+    const char *level;
+    int client_port;
+    size_t file_size;
+    char client_ip[INET_ADDRSTRLEN];
+    char status[16];
+    char text[LOG_TEXT_SIZE];
+} log_record_t;
+
+static int log_fd = -1;
+static log_mode_t log_mode = LOG_MODE_SYNC;
+
+/*
+ * Bounded multi-producer queue (Vyukov): a slot is free for ticket pos when
+ * its sequence equals pos and holds a record once it equals pos + 1. The
+ * flusher is the only consumer and the only writer of dequeue_pos;
+ * producers read it to decide when to wake the flusher early.
+ */
+static log_record_t *ring = NULL;
+static atomic_size_t enqueue_pos;
+static atomic_size_t dequeue_pos;
+static atomic_ulong dropped_records;
+static atomic_int stopping;
+static atomic_int flusher_sleeping;
+static pthread_t flusher_thread;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wakeup = PTHREAD_COND_INITIALIZER;
+
+/* Write all of buffer, retrying on short writes */
+static void write_log(const char *buffer, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(log_fd, buffer, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return;
+        }
+        buffer += written;
+        size -= (size_t)written;
+    }
+}
+
+/* Format "YYYY-MM-DD HH:MM:SS", reusing the last result within the same second */
+static const char* format_time(time_t time, char *cache, time_t *cached_time) {
+    if (time != *cached_time) {
+        struct tm tm_info;
+        localtime_r(&time, &tm_info);
+        strftime(cache, 32, "%Y-%m-%d %H:%M:%S", &tm_info);
+        *cached_time = time;
+    }
+    return cache;
+}
+
+/* Format one record as a log line; returns its length */
+static size_t format_record(const log_record_t *record, const char *timestamp, char *line, size_t size) {
+    int length;
+    if (record->kind == RECORD_TRANSFER) {
+        length = snprintf(line, size, "[%s] [TRANSFER] Client: %s:%d | File: %s | Size: %zu bytes | Status: %s\n",
+                          timestamp, record->client_ip, record->client_port, record->text,
+                          record->file_size, record->status);
+    } else {
+        length = snprintf(line, size, "[%s] [%s] %s\n", timestamp, record->level, record->text);
+    }
+    return (length < 0) ? 0 : ((size_t)length < size ? (size_t)length : size - 1);
+}
+
+/* Coarse clock: a vDSO read of the last tick, no syscall and no shared buffer */
+static time_t coarse_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return now.tv_sec;
+}
+
+static void wake_flusher(void) {
+    if (atomic_load_explicit(&flusher_sleeping, memory_order_relaxed)) {
+        pthread_cond_signal(&flusher_wakeup);
+    }
+}
+
+/* Claim a free slot; NULL if the record is dropped. *ticket is passed to publish_record */
+static log_record_t* claim_record(size_t *ticket) {
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        log_record_t *record = &ring[pos & (LOG_RING_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *ticket = pos;
+                return record;
+            }
+        } else if (diff < 0) {
+            /* Full: the flusher has not released this slot yet */
+            if (log_mode == LOG_MODE_DROP || atomic_load(&stopping)) {
+                atomic_fetch_add_explicit(&dropped_records, 1, memory_order_relaxed);
+                return NULL;
+            }
+            wake_flusher();
+            sched_yield();
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static void publish_record(log_record_t *record, size_t ticket) {
+    atomic_store_explicit(&record->sequence, ticket + 1, memory_order_release);
+    if (ticket + 1 - atomic_load_explicit(&dequeue_pos, memory_order_relaxed) >= LOG_WAKE_THRESHOLD) {
+        wake_flusher();
+    }
+}
+
+/* Format and write every published record, up to the deadline if one is given */
+static void drain_ring(char *batch, const struct timespec *deadline) {
+    static char timestamp[32];
+    static time_t cached_time = (time_t)-1;
+    size_t used = 0;
+    size_t pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+    
+    unsigned long dropped = atomic_exchange_explicit(&dropped_records, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        used += (size_t)snprintf(batch, LOG_LINE_SIZE, "[%s] [%s] %lu log records dropped (ring full)\n",
+                                 format_time(coarse_time(), timestamp, &cached_time), LOG_WARNING, dropped);
+    }
+    for (;;) {
+        log_record_t *record = &ring[pos & (LOG_RING_CAPACITY - 1)];
+        if (atomic_load_explicit(&record->sequence, memory_order_acquire) != pos + 1) {
+            break;
+        }
+        if (LOG_BATCH_SIZE - used < LOG_LINE_SIZE) {
+            write_log(batch, used);
+            used = 0;
+            if (deadline) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                if (now.tv_sec > deadline->tv_sec ||
+                    (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec)) {
+                    break;
+                }
+            }
+        }
+        used += format_record(record, format_time(record->time, timestamp, &cached_time), batch + used,
+                              LOG_LINE_SIZE);
+        atomic_store_explicit(&record->sequence, pos + LOG_RING_CAPACITY, memory_order_release);
+        pos++;
+        atomic_store_explicit(&dequeue_pos, pos, memory_order_relaxed);
+    }
+    write_log(batch, used);
+}
+
+/* Background flusher: wakes every LOG_FLUSH_INTERVAL_MS or when the ring fills up */
+static void* flusher_main(void *arg) {
+    (void)arg;
+    char *batch = (char *)malloc(LOG_BATCH_SIZE);
+    if (!batch) {
+        return NULL;
+    }
+    
+    while (!atomic_load(&stopping)) {
+        drain_ring(batch, NULL);
+    
+        struct timespec wake_at;
+        clock_gettime(CLOCK_REALTIME, &wake_at);
+        wake_at.tv_nsec += (long)LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (wake_at.tv_nsec >= 1000000000L) {
+            wake_at.tv_sec++;
+            wake_at.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&flusher_lock);
+        atomic_store(&flusher_sleeping, 1);
+        if (!atomic_load(&stopping)) {
+            pthread_cond_timedwait(&flusher_wakeup, &flusher_lock, &wake_at);
+        }
+        atomic_store(&flusher_sleeping, 0);
+        pthread_mutex_unlock(&flusher_lock);
+    }
+    
+    /* Bounded final flush: a record claimed but never published ends it early */
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += LOG_SHUTDOWN_TIMEOUT_MS / 1000;
+    drain_ring(batch, &deadline);
+    free(batch);
+    return NULL;
+}
 
 /* Initialize logger */
-int init_logger() {
+int init_logger(log_mode_t mode) {
     create_directory_if_not_exists(LOGS_DIR);
     
-    log_file = fopen(LOG_FILE, "a");
-    if (!log_file) {
+    log_fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
         perror("Failed to open log file");
         return ERROR_FILE_IO;
     }
     
-    log_message(LOG_INFO, "Logger initialized");
+    log_mode = mode;
+    if (mode != LOG_MODE_SYNC) {
+        ring = (log_record_t *)malloc(LOG_RING_CAPACITY * sizeof(log_record_t));
+        if (!ring) {
+            perror("Failed to allocate log ring");
+            log_mode = LOG_MODE_SYNC;
+        } else {
+            for (size_t i = 0; i < LOG_RING_CAPACITY; i++) {
+                atomic_init(&ring[i].sequence, i);
+            }
+            atomic_store(&enqueue_pos, 0);
+            atomic_store(&dequeue_pos, 0);
+            atomic_store(&stopping, 0);
+            if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) != 0) {
+                perror("Failed to start log flusher");
+                free(ring);
+                ring = NULL;
+                log_mode = LOG_MODE_SYNC;
+            }
+        }
+    }
+    
+    log_message(LOG_INFO, "Logger initialized (%s)",
+                (log_mode == LOG_MODE_SYNC) ? "sync" : (log_mode == LOG_MODE_BLOCK) ? "async, block" : "async, drop");
     return SUCCESS;
 }
 
 /* Log a message with level and format */
 void log_message(const char *level, const char *format, ...) {
-    if (!log_file) {
+    if (log_fd < 0) {
         return;
     }
     
-    char *timestamp = get_timestamp();
-    fprintf(log_file, "[%s] [%s] ", timestamp, level);
-    
     va_list args;
     va_start(args, format);
-    vfprintf(log_file, format, args);
-    va_end(args);
+    if (log_mode == LOG_MODE_SYNC) {
+        log_record_t record;
+        record.kind = RECORD_MESSAGE;
+        record.level = level;
+        vsnprintf(record.text, sizeof(record.text), format, args);
+        va_end(args);
     
-    fprintf(log_file, "\n");
-    fflush(log_file);
+        char line[LOG_LINE_SIZE];
+        char timestamp[32];
+        time_t cached_time = (time_t)-1;
+        write_log(line, format_record(&record, format_time(time(NULL), timestamp, &cached_time), line,
+                                      sizeof(line)));
+        return;
+    }
+    
+    size_t ticket;
+    log_record_t *record = claim_record(&ticket);
+    if (record) {
+        record->time = coarse_time();
+        record->kind = RECORD_MESSAGE;
+        record->level = level;
+        vsnprintf(record->text, sizeof(record->text), format, args);
+        publish_record(record, ticket);
+    }
+    va_end(args);
 }
 
 /* Log file transfer details */
-void log_transfer(const char *client_ip, int client_port, const char *filename, 
+void log_transfer(const char *client_ip, int client_port, const char *filename,
                   size_t file_size, const char *status) {
-    if (!log_file) {
+    if (log_fd < 0) {
         return;
     }
     
-    char *timestamp = get_timestamp();
-    fprintf(log_file, "[%s] [TRANSFER] Client: %s:%d | File: %s | Size: %zu bytes | Status: %s\n",
-            timestamp, client_ip, client_port, filename, file_size, status);
-    fflush(log_file);
+    log_record_t local;
+    size_t ticket = 0;
+    log_record_t *record = (log_mode == LOG_MODE_SYNC) ? &local : claim_record(&ticket);
+    if (!record) {
+        return;
+    }
+    record->time = (log_mode == LOG_MODE_SYNC) ? time(NULL) : coarse_time();
+    record->kind = RECORD_TRANSFER;
+    record->client_port = client_port;
+    record->file_size = file_size;
+    snprintf(record->client_ip, sizeof(record->client_ip), "%s", client_ip);
+    snprintf(record->status, sizeof(record->status), "%s", status);
+    snprintf(record->text, sizeof(record->text), "%s", filename);
+    
+    if (log_mode == LOG_MODE_SYNC) {
+        char line[LOG_LINE_SIZE];
+        char timestamp[32];
+        time_t cached_time = (time_t)-1;
+        write_log(line, format_record(record, format_time(record->time, timestamp, &cached_time), line,
+                                      sizeof(line)));
+    } else {
+        publish_record(record, ticket);
+    }
 }
 
-/* Close logger */
+/* Close logger; queued records get at most LOG_SHUTDOWN_TIMEOUT_MS to reach the file */
 void close_logger() {
-    if (log_file) {
-        log_message(LOG_INFO, "Logger closing");
-        fclose(log_file);
-        log_file = NULL;
+    if (log_fd < 0) {
+        return;
+    }
+    log_message(LOG_INFO, "Logger closing");
+    
+    if (log_mode != LOG_MODE_SYNC && !atomic_exchange(&stopping, 1)) {
+        pthread_mutex_lock(&flusher_lock);
+        pthread_cond_signal(&flusher_wakeup);
+        pthread_mutex_unlock(&flusher_lock);
+    
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += LOG_SHUTDOWN_TIMEOUT_MS / 1000 + 1;
+        if (pthread_timedjoin_np(flusher_thread, NULL, &deadline) != 0) {
+            /* The flusher is stuck (e.g. on a full disk); leave it and its file descriptor */
+            pthread_detach(flusher_thread);
+            log_fd = -1;
+            return;
+        }
+        /* The ring stays allocated: late callers on detached threads now drop into it */
     }
+    close(log_fd);
+    log_fd = -1;
 }
-
-
@@ -3,19 +3,32 @@
 
 #include "common.h"
 
+/*
+ * Logging modes. The asynchronous modes queue records in a lock-free ring
+ * that a background thread formats and writes in batches; they differ in
+ * what a thread does when the ring is full.
+ */
+typedef enum {
+    LOG_MODE_SYNC,   // Format and write on the calling thread
+    LOG_MODE_BLOCK,  // Queue; wait for room when the ring is full
+    LOG_MODE_DROP    // Queue; drop (and count) records when the ring is full
+} log_mode_t;
+
+#define LOG_RING_CAPACITY 4096       // Records; must be a power of two
+#define LOG_FLUSH_INTERVAL_MS 100    // Longest a queued record waits to be written
+#define LOG_SHUTDOWN_TIMEOUT_MS 2000 // Longest close_logger waits for the ring to drain
+
 /* Logging function prototypes */
-int init_logger();
+int init_logger(log_mode_t mode);
 void log_message(const char *level, const char *format, ...);
-void log_transfer(const char *client_ip, int client_port, const char *filename, 
+void log_transfer(const char *client_ip, int client_port, const char *filename,
                   size_t file_size, const char *status);
 void close_logger();
 
-/* Log levels */
+/* Log levels (string literals; queued records keep the pointer) */
 #define LOG_INFO "INFO"
 #define LOG_ERROR "ERROR"
 #define LOG_WARNING "WARNING"
 #define LOG_DEBUG "DEBUG"
 
 #endif /* LOGGER_H */
-
-
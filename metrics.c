@@ -0,0 +1,346 @@
+#include "metrics.h"
+#include <stdatomic.h>
+#include <stdarg.h>
+
+#define METRICS_REQUEST_LIMIT 1024
+#define METRICS_IO_TIMEOUT_SEC 1
+#define METRICS_EXTRA_SPACE (128 * 1024)  // Room guaranteed to the extra writer (per-client series)
+#define METRICS_FIRST_LE_SHIFT 10  // Exported buckets: 2^10 ns (~1 us) ...
+#define METRICS_LAST_LE_SHIFT 36   // ... to 2^36 ns (~69 s), doubling
+
+typedef struct {
+    _Atomic uint64_t buckets[METRICS_BUCKET_COUNT];
+    _Atomic uint64_t sum_ns;
+} histogram_t;
+
+/* One thread's counters; padded so neighbouring shards never share a line */
+typedef struct metrics_shard {
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+    struct metrics_shard *next;
+    atomic_int in_use;
+} __attribute__((aligned(64))) metrics_shard_t;
+
+static const char *counter_names[METRIC_COUNTER_COUNT][3] = {
+    { "eftt_connections_total", "counter", "Accepted client connections" },
+    { "eftt_active_connections", "gauge", "Connections being served" },
+    { "eftt_received_bytes_total", "counter", "Payload bytes read from client sockets" },
+    { "eftt_written_bytes_total", "counter", "Bytes written to received files" },
+    { "eftt_files_stored_total", "counter", "Files stored successfully" },
+    { "eftt_files_failed_total", "counter", "Files that failed to transfer" },
+    { "eftt_uring_enter_calls_total", "counter", "io_uring_enter calls made by the uring engine" },
+    { "eftt_sent_bytes_total", "counter", "Download payload bytes sent to clients" },
+    { "eftt_files_served_total", "counter", "Downloads completed" },
+    { "eftt_checksum_failures_total", "counter", "Uploads discarded because their checksums did not match" },
+};
+
+static const char *histogram_names[METRIC_HISTOGRAM_COUNT][3] = {
+    { "eftt_request_duration_seconds", "request", "Accept to acknowledgment, per connection" },
+    { "eftt_recv_duration_seconds", "recv", "Time in one recv() call on a client socket" },
+    { "eftt_write_duration_seconds", "write", "Time in one write to a received file" },
+};
+
+/* Push-only list of every shard ever created */
+static _Atomic(metrics_shard_t *) shards = NULL;
+static _Thread_local metrics_shard_t *local_shard = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static int listen_socket = -1;
+static pthread_t exporter_thread;
+static metrics_writer_t extra_writer = NULL;
+static uint64_t start_ns;
+
+uint64_t metrics_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/* Thread exit: leave the shard (and its totals) for the next thread */
+static void release_shard(void *shard) {
+    atomic_store(&((metrics_shard_t *)shard)->in_use, 0);
+}
+
+static void create_shard_key(void) {
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static metrics_shard_t* acquire_shard(void) {
+    pthread_once(&shard_key_once, create_shard_key);
+    metrics_shard_t *shard;
+    for (shard = atomic_load(&shards); shard; shard = shard->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&shard->in_use, &expected, 1)) {
+            break;
+        }
+    }
+    if (!shard) {
+        shard = (metrics_shard_t *)aligned_alloc(64, sizeof(metrics_shard_t));
+        if (!shard) {
+            return NULL;
+        }
+        memset(shard, 0, sizeof(*shard));
+        atomic_init(&shard->in_use, 1);
+        shard->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &shard->next, shard)) {
+        }
+    }
+    pthread_setspecific(shard_key, shard);
+    local_shard = shard;
+    return shard;
+}
+
+/* Single-writer add: a relaxed load and store, no locked instruction */
+static inline void shard_add(_Atomic uint64_t *value, uint64_t delta) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+void metrics_add(metric_counter_t counter, int64_t delta) {
+    metrics_shard_t *shard = local_shard ? local_shard : acquire_shard();
+    if (shard) {
+        /* Gauges may go down in a different shard than they went up; the sum wraps back */
+        shard_add(&shard->counters[counter], (uint64_t)delta);
+    }
+}
+
+static unsigned bucket_index(uint64_t value) {
+    if (value < (1u << METRICS_SUB_BUCKET_BITS)) {
+        return (unsigned)value;
+    }
+    unsigned exponent = 63 - (unsigned)__builtin_clzll(value);
+    unsigned index = (exponent - METRICS_SUB_BUCKET_BITS + 1) << METRICS_SUB_BUCKET_BITS |
+                     (unsigned)((value >> (exponent - METRICS_SUB_BUCKET_BITS)) &
+                                ((1u << METRICS_SUB_BUCKET_BITS) - 1));
+    return (index < METRICS_BUCKET_COUNT) ? index : METRICS_BUCKET_COUNT - 1;
+}
+
+/* Exclusive upper bound of a bucket in nanoseconds */
+static uint64_t bucket_upper_bound(unsigned index) {
+    if (index < (1u << METRICS_SUB_BUCKET_BITS)) {
+        return index + 1;
+    }
+    unsigned shift = (index >> METRICS_SUB_BUCKET_BITS) - 1;
+    uint64_t mantissa = (1u << METRICS_SUB_BUCKET_BITS) + (index & ((1u << METRICS_SUB_BUCKET_BITS) - 1)) + 1;
+    return mantissa << shift;
+}
+
+void metrics_observe(metric_histogram_t histogram, uint64_t nanoseconds) {
+    metrics_shard_t *shard = local_shard ? local_shard : acquire_shard();
+    if (shard) {
+        histogram_t *target = &shard->histograms[histogram];
+        shard_add(&target->buckets[bucket_index(nanoseconds)], 1);
+        shard_add(&target->sum_ns, nanoseconds);
+    }
+}
+
+/* Growable exposition buffer */
+typedef struct {
+    char *data;
+    size_t used;
+    size_t capacity;
+} text_buffer_t;
+
+static void append(text_buffer_t *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(text_buffer_t *text, const char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(text->data + text->used, text->capacity - text->used, format, args);
+        va_end(args);
+        if (length < 0) {
+            return;
+        }
+        if ((size_t)length < text->capacity - text->used) {
+            text->used += (size_t)length;
+            return;
+        }
+        char *grown = (char *)realloc(text->data, text->capacity * 2);
+        if (!grown) {
+            return;
+        }
+        text->data = grown;
+        text->capacity *= 2;
+    }
+}
+
+/* Sum the shards and render every metric in Prometheus text format */
+static void render_metrics(text_buffer_t *text) {
+    uint64_t counters[METRIC_COUNTER_COUNT] = { 0 };
+    static uint64_t buckets[METRIC_HISTOGRAM_COUNT][METRICS_BUCKET_COUNT];
+    uint64_t sums[METRIC_HISTOGRAM_COUNT] = { 0 };
+    memset(buckets, 0, sizeof(buckets));
+    for (metrics_shard_t *shard = atomic_load(&shards); shard; shard = shard->next) {
+        for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+            counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+            for (int b = 0; b < METRICS_BUCKET_COUNT; b++) {
+                buckets[h][b] += atomic_load_explicit(&shard->histograms[h].buckets[b], memory_order_relaxed);
+            }
+            sums[h] += atomic_load_explicit(&shard->histograms[h].sum_ns, memory_order_relaxed);
+        }
+    }
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        append(text, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", counter_names[i][0], counter_names[i][2],
+               counter_names[i][0], counter_names[i][1], counter_names[i][0],
+               (i == METRIC_ACTIVE_CONNECTIONS) ? (long long)(int64_t)counters[i] : (long long)counters[i]);
+    }
+    append(text, "# HELP eftt_uptime_seconds Seconds since the server started\n"
+           "# TYPE eftt_uptime_seconds gauge\neftt_uptime_seconds %.3f\n",
+           (metrics_now_ns() - start_ns) / 1e9);
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+        const char *name = histogram_names[h][0];
+        append(text, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_names[h][2], name);
+
+        /* Octave boundaries line up with bucket edges, so the cumulative counts are exact */
+        uint64_t count = 0;
+        unsigned b = 0;
+        for (unsigned shift = METRICS_FIRST_LE_SHIFT; shift <= METRICS_LAST_LE_SHIFT; shift++) {
+            for (; b < METRICS_BUCKET_COUNT && bucket_upper_bound(b) <= (1ULL << shift); b++) {
+                count += buckets[h][b];
+            }
+            append(text, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(1ULL << shift) / 1e9,
+                   (unsigned long long)count);
+        }
+        for (; b < METRICS_BUCKET_COUNT; b++) {
+            count += buckets[h][b];
+        }
+        append(text, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", name,
+               (unsigned long long)count, name, sums[h] / 1e9, name, (unsigned long long)count);
+    }
+
+    /* Tail latencies from the fine buckets (upper bound, within 12.5%) */
+    append(text, "# HELP eftt_latency_quantile_seconds Latency quantiles since start\n"
+           "# TYPE eftt_latency_quantile_seconds gauge\n");
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+        uint64_t total = 0;
+        for (int b = 0; b < METRICS_BUCKET_COUNT; b++) {
+            total += buckets[h][b];
+        }
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && total > 0; q++) {
+            uint64_t rank = (uint64_t)(quantiles[q] * (double)total);
+            uint64_t seen = 0;
+            unsigned b = 0;
+            while (b < METRICS_BUCKET_COUNT - 1 && (seen += buckets[h][b]) <= rank) {
+                b++;
+            }
+            append(text, "eftt_latency_quantile_seconds{histogram=\"%s\",quantile=\"%g\"} %.9f\n",
+                   histogram_names[h][1], quantiles[q], bucket_upper_bound(b) / 1e9);
+        }
+    }
+
+    if (extra_writer) {
+        while (text->capacity - text->used < METRICS_EXTRA_SPACE) {
+            char *grown = (char *)realloc(text->data, text->capacity * 2);
+            if (!grown) {
+                return;
+            }
+            text->data = grown;
+            text->capacity *= 2;
+        }
+        text->used += extra_writer(text->data + text->used, text->capacity - text->used);
+    }
+}
+
+/* Answer one HTTP request: GET /metrics (or /) gets the exposition, anything else 404 */
+static void serve_scrape(int client_socket) {
+    struct timeval timeout = { METRICS_IO_TIMEOUT_SEC, 0 };
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[METRICS_REQUEST_LIMIT];
+    size_t used = 0;
+    while (used < sizeof(request) - 1) {
+        ssize_t received = recv(client_socket, request + used, sizeof(request) - 1 - used, 0);
+        if (received <= 0) {
+            break;
+        }
+        used += (size_t)received;
+        request[used] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+    request[used] = '\0';
+
+    text_buffer_t text = { (char *)malloc(64 * 1024), 0, 64 * 1024 };
+    if (!text.data) {
+        return;
+    }
+    char header[128];
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        render_metrics(&text);
+        snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n\r\n", text.used);
+    } else {
+        snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+    }
+    if (send_all(client_socket, header, strlen(header)) == SUCCESS) {
+        send_all(client_socket, text.data, text.used);
+    }
+    free(text.data);
+}
+
+/* Exporter thread: one scrape at a time, off the data path */
+static void* exporter_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        int client_socket = accept4(listen_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return NULL;
+        }
+        serve_scrape(client_socket);
+        close(client_socket);
+    }
+}
+
+int metrics_start(int port, metrics_writer_t extra) {
+    start_ns = metrics_now_ns();
+    extra_writer = extra;
+    listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_socket < 0) {
+        perror("Failed to create metrics socket");
+        return ERROR_SOCKET;
+    }
+    int opt = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    /* Loopback only: the endpoint has no authentication */
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_socket, 16) < 0) {
+        perror("Failed to listen for metrics scrapes");
+        close(listen_socket);
+        listen_socket = -1;
+        return ERROR_SOCKET;
+    }
+    if (pthread_create(&exporter_thread, NULL, exporter_main, NULL) != 0) {
+        perror("Failed to start metrics exporter");
+        close(listen_socket);
+        listen_socket = -1;
+        return ERROR_SOCKET;
+    }
+    return SUCCESS;
+}
+
+void metrics_stop(void) {
+    if (listen_socket < 0) {
+        return;
+    }
+    shutdown(listen_socket, SHUT_RDWR);
+    pthread_join(exporter_thread, NULL);
+    close(listen_socket);
+    listen_socket = -1;
+}
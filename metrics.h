@@ -0,0 +1,56 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+#include <stdint.h>
+
+/*
+ * Server metrics. Each thread updates its own shard with plain relaxed
+ * stores, so the data path never shares a cache line or takes a lock;
+ * the exporter sums the shards when it is scraped. Shards of exited
+ * threads are handed to new threads, so totals never go backwards.
+ */
+typedef enum {
+    METRIC_CONNECTIONS,         // Accepted connections
+    METRIC_ACTIVE_CONNECTIONS,  // Gauge: connections being served
+    METRIC_BYTES_RECEIVED,      // Payload bytes read from sockets
+    METRIC_BYTES_WRITTEN,       // Bytes written to received files
+    METRIC_FILES_STORED,
+    METRIC_FILES_FAILED,
+    METRIC_URING_ENTERS,        // io_uring_enter calls made by the uring engine
+    METRIC_BYTES_SENT,          // Download payload bytes sent to clients
+    METRIC_FILES_SERVED,        // Downloads completed
+    METRIC_CHECKSUM_FAILURES,   // Uploads whose checksum trailer did not match
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum {
+    METRIC_REQUEST_TIME,  // Accept until the connection is done (after the acknowledgment)
+    METRIC_RECV_TIME,     // One recv() call on a client socket
+    METRIC_WRITE_TIME,    // One write to a received file
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+/*
+ * Log-linear (HDR-style) histogram buckets: values below 8 ns are exact,
+ * then each power of two is split into 8 sub-buckets (12.5% precision),
+ * up to about 9 minutes.
+ */
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_BUCKET_COUNT 304
+
+/* Extra exposition text (e.g. queue gauges); returns the bytes written to out */
+typedef size_t (*metrics_writer_t)(char *out, size_t size);
+
+/* Monotonic clock in nanoseconds */
+uint64_t metrics_now_ns(void);
+
+/* Update the calling thread's shard */
+void metrics_add(metric_counter_t counter, int64_t delta);
+void metrics_observe(metric_histogram_t histogram, uint64_t nanoseconds);
+
+/* Serve Prometheus text format on 127.0.0.1:port from a background thread */
+int metrics_start(int port, metrics_writer_t extra);
+void metrics_stop(void);
+
+#endif /* METRICS_H */
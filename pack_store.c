@@ -0,0 +1,686 @@
+#include "pack_store.h"
+#include "crypto.h"
+#include "protocol.h"
+#include "logger.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+typedef enum {
+    PACK_SLOT_EMPTY,    // Never used; ends a probe
+    PACK_SLOT_LIVE,
+    PACK_SLOT_DELETED   // Removed; probes continue past it and inserts may reuse it
+} pack_slot_state_t;
+
+/* One index entry (24 bytes); the name itself lives in the object */
+typedef struct {
+    uint64_t hash;      // FNV-1a of the name
+    uint32_t offset;    // Object's offset in its pack
+    uint32_t length;    // Payload bytes
+    uint16_t pack;
+    uint16_t name_len;
+    uint32_t state;
+} pack_slot_t;
+
+/* Start of the index file; the slot table follows it */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;     // Slots, a power of two
+    uint64_t live;
+    uint64_t deleted;
+    uint32_t active_pack;  // Pack that appends go to
+    uint32_t reserved[7];
+    uint64_t live_bytes[PACK_MAX_FILES];  // Per pack, so dead space is known without a scan
+} pack_index_header_t;
+
+struct pack_store {
+    pthread_mutex_t lock;          // Guards the index and the pack table; object writes happen outside it
+    char dir[MAX_FILENAME_LEN];
+    int dir_fd;                    // Holds the flock that keeps a second process out
+    int index_fd;
+    pack_index_header_t *header;   // The whole index is one shared mapping starting here
+    pack_slot_t *slots;
+    size_t map_size;
+    int pack_fds[PACK_MAX_FILES];  // -1 where no pack exists
+    uint64_t pack_sizes[PACK_MAX_FILES];  // Next append offset of each pack
+};
+
+static uint64_t name_hash(const char *name, size_t name_len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a
+    for (size_t i = 0; i < name_len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint32_t object_size(uint16_t name_len, uint32_t length) {
+    return PACK_OBJECT_HEADER_SIZE + (uint32_t)name_len + length;
+}
+
+static size_t index_size(uint64_t capacity) {
+    return sizeof(pack_index_header_t) + (size_t)capacity * sizeof(pack_slot_t);
+}
+
+static void pack_path(const pack_store_t *store, int id, char *path, size_t size) {
+    snprintf(path, size, "%s/pack-%04d.dat", store->dir, id);
+}
+
+/* Open (creating) pack id and reserve its blocks without changing its size */
+static int open_pack(pack_store_t *store, int id) {
+    char path[MAX_PATH_LEN];
+    pack_path(store, id, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat pack_stat;
+    if (fd < 0 || fstat(fd, &pack_stat) < 0) {
+        perror("Failed to open pack file");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ERROR_FILE_IO;
+    }
+    /* Best effort: a filesystem without fallocate just allocates as it goes */
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, PACK_FILE_SIZE);
+    store->pack_fds[id] = fd;
+    store->pack_sizes[id] = (uint64_t)pack_stat.st_size;
+    return SUCCESS;
+}
+
+/* Start appending to a new pack under the lowest free id; caller holds the lock */
+static int roll_pack(pack_store_t *store) {
+    for (int id = 0; id < PACK_MAX_FILES; id++) {
+        if (store->pack_fds[id] < 0) {
+            if (open_pack(store, id) != SUCCESS) {
+                return ERROR_FILE_IO;
+            }
+            store->header->live_bytes[id] = 0;
+            store->header->active_pack = (uint32_t)id;
+            return SUCCESS;
+        }
+    }
+    log_message(LOG_ERROR, "Pack store: all %d packs are in use; compact it", PACK_MAX_FILES);
+    return ERROR_FILE_IO;
+}
+
+/* Claim size bytes at the end of the active pack; caller holds the lock */
+static int reserve_space(pack_store_t *store, uint32_t size, uint16_t *pack, uint32_t *offset) {
+    uint32_t active = store->header->active_pack;
+    if (store->pack_sizes[active] + size > PACK_FILE_SIZE && store->pack_sizes[active] > 0 &&
+        roll_pack(store) != SUCCESS) {
+        return ERROR_FILE_IO;
+    }
+    active = store->header->active_pack;
+    *pack = (uint16_t)active;
+    *offset = (uint32_t)store->pack_sizes[active];
+    store->pack_sizes[active] += size;
+    return SUCCESS;
+}
+
+/* Read and verify the object a slot points at; returns a malloc'd copy of the whole object */
+static unsigned char* read_object(pack_store_t *store, const pack_slot_t *slot, int *status) {
+    uint32_t size = object_size(slot->name_len, slot->length);
+    unsigned char *object = (unsigned char *)malloc(size);
+    if (!object) {
+        *status = ERROR_MEMORY;
+        return NULL;
+    }
+    *status = SUCCESS;
+    int fd = store->pack_fds[slot->pack];
+    if (fd < 0 || pread(fd, object, size, (off_t)slot->offset) != (ssize_t)size ||
+        get_le32(object) != PACK_OBJECT_MAGIC || get_le16(object + 4) != slot->name_len ||
+        get_le32(object + 8) != slot->length ||
+        crc32c(0, object + PACK_OBJECT_HEADER_SIZE, size - PACK_OBJECT_HEADER_SIZE) != get_le32(object + 12)) {
+        *status = ERROR_CHECKSUM;
+        free(object);
+        return NULL;
+    }
+    return object;
+}
+
+/* True if a live slot holds name; reads the name from the pack only when the hash matches */
+static int slot_holds(pack_store_t *store, const pack_slot_t *slot, const char *name, size_t name_len,
+                      uint64_t hash) {
+    if (slot->state != PACK_SLOT_LIVE || slot->hash != hash || slot->name_len != name_len) {
+        return 0;
+    }
+    char stored[USHRT_MAX];
+    int fd = store->pack_fds[slot->pack];
+    return fd >= 0 && pread(fd, stored, name_len, (off_t)slot->offset + PACK_OBJECT_HEADER_SIZE) ==
+                          (ssize_t)name_len && memcmp(stored, name, name_len) == 0;
+}
+
+/*
+ * Probe for name; returns its slot or -1. insert_at (if set) gets the
+ * first slot a new entry could take. Caller holds the lock.
+ */
+static int64_t find_slot(pack_store_t *store, const char *name, size_t name_len, uint64_t hash,
+                         int64_t *insert_at) {
+    uint64_t mask = store->header->capacity - 1;
+    int64_t reusable = -1;
+    for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+        pack_slot_t *slot = &store->slots[i];
+        if (slot->state == PACK_SLOT_EMPTY) {
+            if (insert_at) {
+                *insert_at = (reusable >= 0) ? reusable : (int64_t)i;
+            }
+            return -1;
+        }
+        if (slot->state == PACK_SLOT_DELETED && reusable < 0) {
+            reusable = (int64_t)i;
+        } else if (slot_holds(store, slot, name, name_len, hash)) {
+            return (int64_t)i;
+        }
+    }
+}
+
+/* Map an index file of the given capacity; a new one gets a fresh header */
+static int map_index(pack_store_t *store, int fd, uint64_t capacity, int initialize) {
+    size_t size = index_size(capacity);
+    if (initialize && ftruncate(fd, (off_t)size) < 0) {
+        return ERROR_FILE_IO;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return ERROR_FILE_IO;
+    }
+    store->index_fd = fd;
+    store->header = (pack_index_header_t *)map;
+    store->slots = (pack_slot_t *)((unsigned char *)map + sizeof(pack_index_header_t));
+    store->map_size = size;
+    if (initialize) {
+        store->header->magic = PACK_INDEX_MAGIC;
+        store->header->version = PACK_INDEX_VERSION;
+        store->header->capacity = capacity;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Rebuild the index into a new file sized for the live entries, dropping
+ * deleted slots, and rename it over the old one. Caller holds the lock.
+ */
+static int rebuild_index(pack_store_t *store) {
+    uint64_t capacity = store->header->capacity;
+    while ((store->header->live + 1) * 4 > capacity) {
+        capacity *= 2;
+    }
+    char path[MAX_PATH_LEN];
+    char staging_path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", store->dir, PACK_INDEX_FILE);
+    snprintf(staging_path, sizeof(staging_path), "%s/.%s.tmp", store->dir, PACK_INDEX_FILE);
+    int fd = open(staging_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Failed to create pack index");
+        return ERROR_FILE_IO;
+    }
+
+    pack_store_t rebuilt;
+    if (map_index(&rebuilt, fd, capacity, 1) != SUCCESS) {
+        perror("Failed to map pack index");
+        close(fd);
+        unlink(staging_path);
+        return ERROR_FILE_IO;
+    }
+    rebuilt.header->active_pack = store->header->active_pack;
+    memcpy(rebuilt.header->live_bytes, store->header->live_bytes, sizeof(rebuilt.header->live_bytes));
+    for (uint64_t i = 0; i < store->header->capacity; i++) {
+        const pack_slot_t *slot = &store->slots[i];
+        if (slot->state != PACK_SLOT_LIVE) {
+            continue;
+        }
+        uint64_t at = slot->hash & (capacity - 1);
+        while (rebuilt.slots[at].state != PACK_SLOT_EMPTY) {
+            at = (at + 1) & (capacity - 1);
+        }
+        rebuilt.slots[at] = *slot;
+        rebuilt.header->live++;
+    }
+    if (msync(rebuilt.header, rebuilt.map_size, MS_SYNC) < 0 || rename(staging_path, path) < 0) {
+        perror("Failed to replace pack index");
+        munmap(rebuilt.header, rebuilt.map_size);
+        close(fd);
+        unlink(staging_path);
+        return ERROR_FILE_IO;
+    }
+    munmap(store->header, store->map_size);
+    close(store->index_fd);
+    store->index_fd = rebuilt.index_fd;
+    store->header = rebuilt.header;
+    store->slots = rebuilt.slots;
+    store->map_size = rebuilt.map_size;
+    return SUCCESS;
+}
+
+/* Open every pack-NNNN.dat in the store directory */
+static int open_packs(pack_store_t *store) {
+    DIR *dir = opendir(store->dir);
+    if (!dir) {
+        return ERROR_FILE_IO;
+    }
+    int status = SUCCESS;
+    struct dirent *entry;
+    while (status == SUCCESS && (entry = readdir(dir)) != NULL) {
+        int id;
+        char tail;
+        if (sscanf(entry->d_name, "pack-%d.da%c", &id, &tail) == 2 && tail == 't' && id >= 0 &&
+            id < PACK_MAX_FILES && store->pack_fds[id] < 0) {
+            status = open_pack(store, id);
+        }
+    }
+    closedir(dir);
+    return status;
+}
+
+pack_store_t* pack_store_open(const char *dir) {
+    pack_store_t *store = (pack_store_t *)calloc(1, sizeof(pack_store_t));
+    if (!store) {
+        return NULL;
+    }
+    pthread_mutex_init(&store->lock, NULL);
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    store->dir_fd = -1;
+    store->index_fd = -1;
+    for (int i = 0; i < PACK_MAX_FILES; i++) {
+        store->pack_fds[i] = -1;
+    }
+    create_directory_if_not_exists(dir);
+
+    /* The index is rewritten in place, so only one process may have it mapped */
+    store->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store->dir_fd < 0 || flock(store->dir_fd, LOCK_EX | LOCK_NB) < 0) {
+        if (store->dir_fd >= 0 && errno == EWOULDBLOCK) {
+            fprintf(stderr, "Failed to open %s: pack store in use\n", dir);
+        } else {
+            perror("Failed to lock pack store");
+        }
+        pack_store_close(store);
+        return NULL;
+    }
+
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dir, PACK_INDEX_FILE);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat index_stat;
+    if (fd < 0 || fstat(fd, &index_stat) < 0) {
+        perror("Failed to open pack index");
+        if (fd >= 0) {
+            close(fd);
+        }
+        pack_store_close(store);
+        return NULL;
+    }
+
+    /* A restart only maps the index; its size must match the capacity it records */
+    int status;
+    if (index_stat.st_size == 0) {
+        status = map_index(store, fd, PACK_INDEX_INITIAL_SLOTS, 1);
+    } else {
+        pack_index_header_t header;
+        status = (pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                  header.magic == PACK_INDEX_MAGIC && header.version == PACK_INDEX_VERSION &&
+                  header.capacity > 0 && (header.capacity & (header.capacity - 1)) == 0 &&
+                  (uint64_t)index_stat.st_size == index_size(header.capacity))
+                 ? map_index(store, fd, header.capacity, 0) : ERROR_FILE_IO;
+    }
+    if (status != SUCCESS) {
+        fprintf(stderr, "Invalid pack index: %s\n", path);
+        close(fd);
+        pack_store_close(store);
+        return NULL;
+    }
+
+    if (open_packs(store) != SUCCESS ||
+        (store->pack_fds[store->header->active_pack % PACK_MAX_FILES] < 0 && roll_pack(store) != SUCCESS)) {
+        fprintf(stderr, "Failed to open the pack files in %s\n", dir);
+        pack_store_close(store);
+        return NULL;
+    }
+    store->header->active_pack %= PACK_MAX_FILES;
+
+    pack_store_stats_t stats;
+    pack_store_get_stats(store, &stats);
+    log_message(LOG_INFO, "Pack store %s: %llu objects in %llu packs, %llu bytes (%llu dead)", dir,
+                (unsigned long long)stats.objects, (unsigned long long)stats.packs,
+                (unsigned long long)stats.pack_bytes, (unsigned long long)stats.dead_bytes);
+    return store;
+}
+
+void pack_store_close(pack_store_t *store) {
+    if (!store) {
+        return;
+    }
+    if (store->header) {
+        munmap(store->header, store->map_size);
+    }
+    if (store->index_fd >= 0) {
+        close(store->index_fd);
+    }
+    for (int i = 0; i < PACK_MAX_FILES; i++) {
+        if (store->pack_fds[i] >= 0) {
+            close(store->pack_fds[i]);
+        }
+    }
+    if (store->dir_fd >= 0) {
+        close(store->dir_fd);  // Releases the flock
+    }
+    pthread_mutex_destroy(&store->lock);
+    free(store);
+}
+
+/* Point name at a freshly written object; caller holds the lock */
+static int link_object(pack_store_t *store, const char *name, size_t name_len, uint64_t hash, uint16_t pack,
+                       uint32_t offset, uint32_t length) {
+    pack_index_header_t *header = store->header;
+    if ((header->live + header->deleted + 1) * 10 > header->capacity * 7 && rebuild_index(store) != SUCCESS) {
+        return ERROR_FILE_IO;
+    }
+    header = store->header;
+    int64_t insert_at = -1;
+    int64_t found = find_slot(store, name, name_len, hash, &insert_at);
+    pack_slot_t *slot;
+    if (found >= 0) {
+        slot = &store->slots[found];
+        header->live_bytes[slot->pack] -= object_size(slot->name_len, slot->length);
+    } else {
+        slot = &store->slots[insert_at];
+        if (slot->state == PACK_SLOT_DELETED) {
+            header->deleted--;
+        }
+        header->live++;
+    }
+    slot->hash = hash;
+    slot->offset = offset;
+    slot->length = length;
+    slot->pack = pack;
+    slot->name_len = (uint16_t)name_len;
+    slot->state = PACK_SLOT_LIVE;
+    header->live_bytes[pack] += object_size((uint16_t)name_len, length);
+    return SUCCESS;
+}
+
+int pack_store_put(pack_store_t *store, const char *name, const unsigned char *data, uint32_t length,
+                   int sync) {
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > USHRT_MAX || length > PACK_FILE_SIZE - PACK_OBJECT_HEADER_SIZE - name_len) {
+        return ERROR_FILE_IO;
+    }
+    unsigned char header[PACK_OBJECT_HEADER_SIZE];
+    put_le32(header, PACK_OBJECT_MAGIC);
+    put_le16(header + 4, (uint16_t)name_len);
+    put_le16(header + 6, 0);
+    put_le32(header + 8, length);
+    put_le32(header + 12, crc32c(crc32c(0, name, name_len), data, length));
+    uint32_t size = object_size((uint16_t)name_len, length);
+
+    uint16_t pack;
+    uint32_t offset;
+    pthread_mutex_lock(&store->lock);
+    int status = reserve_space(store, size, &pack, &offset);
+    int fd = store->pack_fds[pack];
+    pthread_mutex_unlock(&store->lock);
+    if (status != SUCCESS) {
+        return status;
+    }
+
+    /* Reserve-then-write keeps the lock off the disk path; an unlinked object is only dead space */
+    struct iovec parts[3] = {
+        { header, sizeof(header) }, { (void *)name, name_len }, { (void *)data, length }
+    };
+    if (pwritev(fd, parts, 3, (off_t)offset) != (ssize_t)size || (sync && fdatasync(fd) < 0)) {
+        perror("Failed to write pack object");
+        return ERROR_FILE_IO;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    status = link_object(store, name, name_len, name_hash(name, name_len), pack, offset, length);
+    if (status == SUCCESS && sync && msync(store->header, store->map_size, MS_SYNC) < 0) {
+        perror("Failed to sync pack index");
+        status = ERROR_FILE_IO;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return status;
+}
+
+int pack_store_remove(pack_store_t *store, const char *name) {
+    size_t name_len = strlen(name);
+    pthread_mutex_lock(&store->lock);
+    int64_t found = find_slot(store, name, name_len, name_hash(name, name_len), NULL);
+    if (found >= 0) {
+        pack_slot_t *slot = &store->slots[found];
+        store->header->live_bytes[slot->pack] -= object_size(slot->name_len, slot->length);
+        slot->state = PACK_SLOT_DELETED;
+        store->header->live--;
+        store->header->deleted++;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return SUCCESS;
+}
+
+int pack_store_get(pack_store_t *store, const char *name, unsigned char **data, uint32_t *length) {
+    size_t name_len = strlen(name);
+    pthread_mutex_lock(&store->lock);
+    int64_t found = find_slot(store, name, name_len, name_hash(name, name_len), NULL);
+    pack_slot_t slot;
+    if (found >= 0) {
+        slot = store->slots[found];
+    }
+    pthread_mutex_unlock(&store->lock);
+    if (found < 0) {
+        return ERROR_FILE_IO;
+    }
+
+    /* Objects are never rewritten in place, so reading after the unlock is safe */
+    int status;
+    unsigned char *object = read_object(store, &slot, &status);
+    if (!object) {
+        if (status == ERROR_CHECKSUM) {
+            log_message(LOG_ERROR, "Pack store: object for %s is damaged", name);
+        }
+        return status;
+    }
+    memmove(object, object + PACK_OBJECT_HEADER_SIZE + slot.name_len, slot.length);
+    *data = object;
+    *length = slot.length;
+    return SUCCESS;
+}
+
+static int write_fully(int fd, const unsigned char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return ERROR_FILE_IO;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return SUCCESS;
+}
+
+int pack_store_extract(pack_store_t *store, const char *name, int out_fd) {
+    unsigned char *data;
+    uint32_t length;
+    int status = pack_store_get(store, name, &data, &length);
+    if (status != SUCCESS) {
+        fprintf(stderr, "%s: %s\n", name, (status == ERROR_CHECKSUM) ? "stored object is damaged"
+                                                                    : "not in the pack store");
+        return status;
+    }
+    status = write_fully(out_fd, data, length);
+    if (status != SUCCESS) {
+        perror("Failed to write extracted data");
+    }
+    free(data);
+    return status;
+}
+
+/* Create out_dir/name, making the directories of a session path on the way */
+static int create_extracted_file(const char *out_dir, const char *name, size_t name_len) {
+    char path[PATH_MAX];
+    size_t base_len = (size_t)snprintf(path, sizeof(path), "%s/", out_dir);
+    if (base_len + name_len >= sizeof(path)) {
+        return -1;
+    }
+    memcpy(path + base_len, name, name_len);
+    path[base_len + name_len] = '\0';
+    for (char *slash = strchr(path + base_len, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+int64_t pack_store_extract_all(pack_store_t *store, const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("Failed to create extraction directory");
+        return ERROR_FILE_IO;
+    }
+    int64_t extracted = 0;
+    int failed = 0;
+    pthread_mutex_lock(&store->lock);
+    for (uint64_t i = 0; i < store->header->capacity; i++) {
+        const pack_slot_t *slot = &store->slots[i];
+        if (slot->state != PACK_SLOT_LIVE) {
+            continue;
+        }
+        int status;
+        unsigned char *object = read_object(store, slot, &status);
+        const char *name = (const char *)object + PACK_OBJECT_HEADER_SIZE;
+        char safe_name[USHRT_MAX + 1];
+        if (object) {
+            memcpy(safe_name, name, slot->name_len);
+            safe_name[slot->name_len] = '\0';
+        }
+        int fd = -1;
+        if (!object || strlen(safe_name) != slot->name_len || !is_safe_relative_path(safe_name) ||
+            (fd = create_extracted_file(dir, safe_name, slot->name_len)) < 0 ||
+            write_fully(fd, object + PACK_OBJECT_HEADER_SIZE + slot->name_len, slot->length) != SUCCESS) {
+            fprintf(stderr, "Failed to extract object %llu: %s\n", (unsigned long long)i,
+                    object ? strerror(errno) : "damaged");
+            failed++;
+        } else {
+            extracted++;
+        }
+        if (fd >= 0 && close(fd) < 0) {
+            failed++;
+        }
+        free(object);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return failed ? ERROR_FILE_IO : extracted;
+}
+
+int pack_store_compact(pack_store_t *store, int dead_percent) {
+    pthread_mutex_lock(&store->lock);
+    pack_index_header_t *header = store->header;
+    unsigned char victim[PACK_MAX_FILES];
+    int victims = 0;
+    uint64_t reclaimed = 0;
+    for (int id = 0; id < PACK_MAX_FILES; id++) {
+        uint64_t size = store->pack_sizes[id];
+        victim[id] = store->pack_fds[id] >= 0 && size > 0 &&
+                     (size - header->live_bytes[id]) * 100 >= size * (uint64_t)dead_percent;
+        if (victim[id]) {
+            victims++;
+            reclaimed += size - header->live_bytes[id];
+        }
+    }
+    int status = SUCCESS;
+    if (victims > 0 && victim[header->active_pack]) {
+        status = roll_pack(store);
+    }
+
+    /* Copy each live object out of the victims, then repoint its slot */
+    uint64_t moved = 0;
+    for (uint64_t i = 0; i < header->capacity && status == SUCCESS && victims > 0; i++) {
+        pack_slot_t *slot = &store->slots[i];
+        if (slot->state != PACK_SLOT_LIVE || !victim[slot->pack]) {
+            continue;
+        }
+        uint32_t size = object_size(slot->name_len, slot->length);
+        unsigned char *object = read_object(store, slot, &status);
+        if (!object) {
+            if (status != ERROR_CHECKSUM) {
+                break;
+            }
+            /* It cannot be served anyway; do not let it hold the pack alive */
+            log_message(LOG_WARNING, "Pack store: dropping damaged object in pack %u", slot->pack);
+            header->live_bytes[slot->pack] -= size;
+            slot->state = PACK_SLOT_DELETED;
+            header->live--;
+            header->deleted++;
+            status = SUCCESS;
+            continue;
+        }
+        uint16_t pack = 0;
+        uint32_t offset = 0;
+        status = reserve_space(store, size, &pack, &offset);
+        if (status == SUCCESS && pwrite(store->pack_fds[pack], object, size, (off_t)offset) != (ssize_t)size) {
+            perror("Failed to copy pack object");
+            status = ERROR_FILE_IO;
+        }
+        if (status == SUCCESS) {
+            header->live_bytes[slot->pack] -= size;
+            header->live_bytes[pack] += size;
+            slot->pack = pack;
+            slot->offset = offset;
+            moved++;
+        }
+        free(object);
+    }
+
+    /* The copies and the index must be on disk before the originals go */
+    for (int id = 0; id < PACK_MAX_FILES && status == SUCCESS && victims > 0; id++) {
+        if (store->pack_fds[id] >= 0 && !victim[id] && fdatasync(store->pack_fds[id]) < 0) {
+            status = ERROR_FILE_IO;
+        }
+    }
+    if (status == SUCCESS && victims > 0 && msync(header, store->map_size, MS_SYNC) < 0) {
+        status = ERROR_FILE_IO;
+    }
+    for (int id = 0; id < PACK_MAX_FILES && status == SUCCESS && victims > 0; id++) {
+        if (victim[id]) {
+            char path[MAX_PATH_LEN];
+            pack_path(store, id, path, sizeof(path));
+            close(store->pack_fds[id]);
+            unlink(path);
+            store->pack_fds[id] = -1;
+            store->pack_sizes[id] = 0;
+            header->live_bytes[id] = 0;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    if (status != SUCCESS) {
+        fprintf(stderr, "Compaction failed; every pack is left in place\n");
+        return status;
+    }
+    fprintf(stderr, "Compacted %d pack(s): %llu live objects moved, %llu dead bytes reclaimed\n", victims,
+            (unsigned long long)moved, (unsigned long long)reclaimed);
+    log_message(LOG_INFO, "Pack store compaction: %d packs, %llu objects moved, %llu bytes reclaimed", victims,
+                (unsigned long long)moved, (unsigned long long)reclaimed);
+    return SUCCESS;
+}
+
+void pack_store_get_stats(pack_store_t *store, pack_store_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&store->lock);
+    stats->objects = store->header->live;
+    stats->index_slots = store->header->capacity;
+    for (int id = 0; id < PACK_MAX_FILES; id++) {
+        if (store->pack_fds[id] >= 0) {
+            stats->packs++;
+            stats->pack_bytes += store->pack_sizes[id];
+            stats->dead_bytes += store->pack_sizes[id] - store->header->live_bytes[id];
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,78 @@
+#ifndef PACK_STORE_H
+#define PACK_STORE_H
+
+#include "common.h"
+#include <stdint.h>
+
+/*
+ * Pack-file storage for small uploads. Instead of one file (and one inode)
+ * per upload, each payload is appended as an object to a large pack file
+ * preallocated in PACK_FILE_SIZE steps. An object carries its name and a
+ * CRC32C of name and data, so a stale or torn index entry is caught on read.
+ *
+ * The index is an open-addressing hash table in one file that is mapped
+ * into memory and updated in place: a restart maps it and is ready, with
+ * no load or replay. A name points at its latest object; the object a
+ * re-upload replaced stays in its pack as dead space until compaction
+ * copies the live objects out of mostly-dead packs and deletes them.
+ *
+ * The index is stored in host byte order (little-endian on every platform
+ * the server builds for) so lookups read the mapping directly.
+ */
+#define PACK_STORE_DIR "pack_store"
+#define PACK_INDEX_FILE "pack.idx"
+#define PACK_FILE_SIZE (256 * 1024 * 1024)    // Preallocated size of each pack
+#define PACK_MAX_FILES 1024
+#define PACK_MAX_OBJECT_SIZE (64 * 1024)      // Larger uploads are stored as plain files
+#define PACK_INDEX_INITIAL_SLOTS (1 << 16)
+#define PACK_COMPACT_DEAD_PERCENT 25          // Compaction rewrites packs with at least this much dead space
+
+#define PACK_INDEX_MAGIC 0x50544645u   // "EFTP" on disk
+#define PACK_INDEX_VERSION 1
+#define PACK_OBJECT_MAGIC 0x4f544645u  // "EFTO" on disk
+#define PACK_OBJECT_HEADER_SIZE 16     // magic, name length (2), reserved (2), length, CRC32C of name + data
+
+typedef struct pack_store pack_store_t;
+
+typedef struct {
+    uint64_t objects;       // Names with a stored object
+    uint64_t packs;
+    uint64_t pack_bytes;    // Bytes appended to the packs, live or not
+    uint64_t dead_bytes;    // Replaced objects awaiting compaction
+    uint64_t index_slots;
+} pack_store_stats_t;
+
+/*
+ * Open (creating if needed) the store under dir and map its index. The
+ * directory is flock'ed for as long as the store is open, so a second
+ * server or a -x/-X run on the same store fails with "pack store in use".
+ */
+pack_store_t* pack_store_open(const char *dir);
+void pack_store_close(pack_store_t *store);
+
+/* Store data under name, replacing any earlier object; with sync, durable before it returns */
+int pack_store_put(pack_store_t *store, const char *name, const unsigned char *data, uint32_t length,
+                   int sync);
+
+/* Forget name (e.g. it was re-uploaded as a plain file); SUCCESS even if it was not stored */
+int pack_store_remove(pack_store_t *store, const char *name);
+
+/*
+ * Look up name. Returns SUCCESS with *data (malloc'd, caller frees) and
+ * *length, ERROR_FILE_IO if it is not stored, or ERROR_CHECKSUM if its
+ * object is damaged.
+ */
+int pack_store_get(pack_store_t *store, const char *name, unsigned char **data, uint32_t *length);
+
+/* Write one stored object to out_fd */
+int pack_store_extract(pack_store_t *store, const char *name, int out_fd);
+
+/* Write every stored object to a file of the same name under dir; returns how many or an error */
+int64_t pack_store_extract_all(pack_store_t *store, const char *dir);
+
+/* Copy live objects out of packs that are at least dead_percent dead, then delete those packs */
+int pack_store_compact(pack_store_t *store, int dead_percent);
+
+void pack_store_get_stats(pack_store_t *store, pack_store_stats_t *stats);
+
+#endif /* PACK_STORE_H */
@@ -0,0 +1,355 @@
+#include "protocol.h"
+
+/* Little-endian field helpers */
+void put_le16(unsigned char *out, uint16_t value) {
+    out[0] = (unsigned char)value;
+    out[1] = (unsigned char)(value >> 8);
+}
+
+void put_le32(unsigned char *out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+void put_le64(unsigned char *out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+uint16_t get_le16(const unsigned char *in) {
+    return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+uint32_t get_le32(const unsigned char *in) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+uint64_t get_le64(const unsigned char *in) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+/* Serialize a header into PROTOCOL_HEADER_SIZE bytes */
+void encode_request_header(const request_header_t *header, unsigned char *out) {
+    put_le32(out, header->magic);
+    put_le16(out + 4, header->version);
+    put_le16(out + 6, header->opcode);
+    put_le16(out + 8, header->name_len);
+    put_le16(out + 10, header->flags);
+    put_le64(out + 12, header->transfer_id);
+    put_le64(out + 20, header->total_size);
+    put_le64(out + 28, header->offset);
+    put_le64(out + 36, header->length);
+}
+
+/* Parse PROTOCOL_HEADER_SIZE bytes into a header */
+void decode_request_header(const unsigned char *in, request_header_t *header) {
+    header->magic = get_le32(in);
+    header->version = get_le16(in + 4);
+    header->opcode = get_le16(in + 6);
+    header->name_len = get_le16(in + 8);
+    header->flags = get_le16(in + 10);
+    header->transfer_id = get_le64(in + 12);
+    header->total_size = get_le64(in + 20);
+    header->offset = get_le64(in + 28);
+    header->length = get_le64(in + 36);
+}
+
+/* Serialize a frame header into FRAME_HEADER_SIZE bytes */
+void encode_frame_header(const frame_header_t *frame, unsigned char *out) {
+    put_le32(out, frame->raw_length);
+    put_le32(out + 4, frame->stored_length | (frame->compressed ? FRAME_COMPRESSED : 0));
+    put_le32(out + 8, frame->cpu_usec);
+}
+
+/* Parse FRAME_HEADER_SIZE bytes into a frame header */
+void decode_frame_header(const unsigned char *in, frame_header_t *frame) {
+    uint32_t stored = get_le32(in + 4);
+    frame->raw_length = get_le32(in);
+    frame->stored_length = stored & ~FRAME_COMPRESSED;
+    frame->compressed = (stored & FRAME_COMPRESSED) != 0;
+    frame->cpu_usec = get_le32(in + 8);
+}
+
+/*
+ * True when the first len bytes of a connection (possibly fewer than
+ * PROTOCOL_PREFIX_SIZE) can start an extended request: the magic, then a
+ * supported version and a known opcode once those fields have arrived
+ */
+int extended_prefix_matches(const unsigned char *data, size_t len) {
+    unsigned char magic[PROTOCOL_MAGIC_SIZE];
+    put_le32(magic, PROTOCOL_MAGIC);
+    if (memcmp(data, magic, (len < PROTOCOL_MAGIC_SIZE) ? len : PROTOCOL_MAGIC_SIZE) != 0) {
+        return 0;
+    }
+    if (len >= 6) {
+        uint16_t version = get_le16(data + 4);
+        if (version < PROTOCOL_MIN_VERSION || version > PROTOCOL_VERSION) {
+            return 0;
+        }
+    }
+    if (len >= PROTOCOL_PREFIX_SIZE) {
+        uint16_t opcode = get_le16(data + 6);
+        return opcode >= OP_RANGE && opcode <= OP_MAX;
+    }
+    return 1;
+}
+
+/* True when a legacy header for this name and size would be read as an extended request */
+int legacy_header_collides(const char *filename, size_t file_size) {
+    unsigned char prefix[PROTOCOL_PREFIX_SIZE + sizeof(file_size)];
+    size_t name_bytes = strlen(filename) + 1;
+    if (name_bytes > PROTOCOL_PREFIX_SIZE) {
+        name_bytes = PROTOCOL_PREFIX_SIZE;
+    }
+    memcpy(prefix, filename, name_bytes);
+    memcpy(prefix + name_bytes, &file_size, sizeof(file_size));
+    return extended_prefix_matches(prefix, PROTOCOL_PREFIX_SIZE);
+}
+
+/* Returns 1 for an extended request, 0 for legacy framing, negative on error */
+int peek_extended_request(int sockfd) {
+    unsigned char prefix[PROTOCOL_PREFIX_SIZE];
+    ssize_t bytes_received;
+    do {
+        bytes_received = recv(sockfd, prefix, sizeof(prefix), MSG_PEEK | MSG_WAITALL);
+    } while (bytes_received < 0 && errno == EINTR);
+
+    if (bytes_received <= 0) {
+        return ERROR_NETWORK;
+    }
+    /* Legacy headers are at least a NUL plus a size_t, so a short peek means legacy */
+    return (bytes_received == PROTOCOL_PREFIX_SIZE && extended_prefix_matches(prefix, PROTOCOL_PREFIX_SIZE)) ? 1 : 0;
+}
+
+/* Send header and filename in one write */
+int send_request(int sockfd, const request_header_t *header, const char *filename) {
+    unsigned char packet[PROTOCOL_HEADER_SIZE + MAX_FILENAME_LEN];
+    if (header->name_len >= MAX_FILENAME_LEN) {
+        return ERROR_FILE_IO;
+    }
+    encode_request_header(header, packet);
+    memcpy(packet + PROTOCOL_HEADER_SIZE, filename, header->name_len);
+    return send_all(sockfd, packet, PROTOCOL_HEADER_SIZE + header->name_len);
+}
+
+/* Receive and validate header and filename */
+int recv_request(int sockfd, request_header_t *header, char *filename, size_t filename_size) {
+    unsigned char raw[PROTOCOL_HEADER_SIZE];
+    if (recv_all(sockfd, raw, sizeof(raw)) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    return recv_request_name(sockfd, raw, header, filename, filename_size);
+}
+
+/* Validate an already received fixed header, then receive and validate the filename */
+int recv_request_name(int sockfd, const unsigned char *raw, request_header_t *header, char *filename,
+                      size_t filename_size) {
+    decode_request_header(raw, header);
+    if (check_request_header(header, filename_size) != SUCCESS) {
+        return ERROR_FILE_IO;
+    }
+    if (recv_all(sockfd, filename, header->name_len) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    filename[header->name_len] = '\0';
+    return check_request_name(filename, header->name_len);
+}
+
+/* Magic, a version this server speaks, and a name that fits */
+int check_request_header(const request_header_t *header, size_t filename_size) {
+    if (header->magic != PROTOCOL_MAGIC || header->version < PROTOCOL_MIN_VERSION ||
+        header->version > PROTOCOL_VERSION || header->name_len == 0 || header->name_len >= filename_size) {
+        return ERROR_FILE_IO;
+    }
+    return SUCCESS;
+}
+
+/* filename holds name_len received bytes plus a NUL */
+int check_request_name(const char *filename, size_t name_len) {
+    return (strlen(filename) == name_len && is_safe_filename(filename)) ? SUCCESS : ERROR_FILE_IO;
+}
+
+int parse_legacy_header(const unsigned char *data, size_t len, char *filename, size_t filename_size,
+                        uint64_t *file_size) {
+    size_t scan = (len < filename_size) ? len : filename_size;
+    const unsigned char *nul = (const unsigned char *)memchr(data, '\0', scan);
+    if (!nul) {
+        return (len >= filename_size) ? ERROR_FILE_IO : 0;
+    }
+    size_t name_len = (size_t)(nul - data);
+    size_t header_len = name_len + 1 + sizeof(size_t);
+    if (len < header_len) {
+        return 0;
+    }
+    size_t size;
+    memcpy(filename, data, name_len + 1);
+    if (!is_safe_filename(filename)) {
+        return ERROR_FILE_IO;
+    }
+    memcpy(&size, nul + 1, sizeof(size));
+    *file_size = size;
+    return (int)header_len;
+}
+
+/* Send the chunk map for an OP_RESUME request */
+int send_chunk_map(int sockfd, uint32_t chunk_size, uint64_t chunk_count, const unsigned char *bitmap) {
+    unsigned char header[CHUNK_MAP_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    put_le32(header, chunk_size);
+    put_le64(header + 8, chunk_count);
+    if (send_all(sockfd, header, sizeof(header)) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    return send_all(sockfd, bitmap, (size_t)((chunk_count + 7) / 8));
+}
+
+/* Receive a chunk map; *bitmap is allocated and must be freed by the caller */
+int recv_chunk_map(int sockfd, uint32_t *chunk_size, uint64_t *chunk_count, unsigned char **bitmap) {
+    unsigned char header[CHUNK_MAP_HEADER_SIZE];
+    if (recv_all(sockfd, header, sizeof(header)) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    *chunk_size = get_le32(header);
+    *chunk_count = get_le64(header + 8);
+    if (*chunk_size == 0) {
+        return ERROR_NETWORK;
+    }
+
+    size_t bitmap_size = (size_t)((*chunk_count + 7) / 8);
+    *bitmap = (unsigned char *)calloc(bitmap_size + 1, 1);
+    if (!*bitmap) {
+        return ERROR_MEMORY;
+    }
+    if (recv_all(sockfd, *bitmap, bitmap_size) != SUCCESS) {
+        free(*bitmap);
+        *bitmap = NULL;
+        return ERROR_NETWORK;
+    }
+    return SUCCESS;
+}
+
+/* Announce the next chunk's position and length; length 0 ends the stream */
+int send_chunk_record(int sockfd, uint64_t offset, uint32_t length) {
+    unsigned char record[CHUNK_RECORD_SIZE];
+    put_le64(record, offset);
+    put_le32(record + 8, length);
+    return send_all(sockfd, record, sizeof(record));
+}
+
+/* Receive the next chunk record */
+int recv_chunk_record(int sockfd, uint64_t *offset, uint32_t *length) {
+    unsigned char record[CHUNK_RECORD_SIZE];
+    if (recv_all(sockfd, record, sizeof(record)) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    *offset = get_le64(record);
+    *length = get_le32(record + 8);
+    return SUCCESS;
+}
+
+/* Send a chunk list in batches so large files need no second copy of the list */
+int send_chunk_list(int sockfd, const chunk_ref_t *chunks, uint64_t count) {
+    unsigned char batch[256 * CHUNK_LIST_ENTRY_SIZE];
+    put_le64(batch, count);
+    if (send_all(sockfd, batch, 8) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    for (uint64_t i = 0; i < count;) {
+        size_t used = 0;
+        for (; i < count && used < sizeof(batch); i++, used += CHUNK_LIST_ENTRY_SIZE) {
+            memcpy(batch + used, chunks[i].digest, CHUNK_DIGEST_SIZE);
+            put_le32(batch + used + CHUNK_DIGEST_SIZE, chunks[i].length);
+        }
+        if (send_all(sockfd, batch, used) != SUCCESS) {
+            return ERROR_NETWORK;
+        }
+    }
+    return SUCCESS;
+}
+
+/* Receive a chunk list of at most max_count entries; *chunks must be freed by the caller */
+int recv_chunk_list(int sockfd, chunk_ref_t **chunks, uint64_t *count, uint64_t max_count) {
+    unsigned char batch[256 * CHUNK_LIST_ENTRY_SIZE];
+    if (recv_all(sockfd, batch, 8) != SUCCESS) {
+        return ERROR_NETWORK;
+    }
+    *count = get_le64(batch);
+    if (*count > max_count) {
+        return ERROR_NETWORK;
+    }
+
+    *chunks = (chunk_ref_t *)malloc((size_t)*count * sizeof(chunk_ref_t) + 1);
+    if (!*chunks) {
+        return ERROR_MEMORY;
+    }
+    for (uint64_t i = 0; i < *count;) {
+        uint64_t entries = *count - i;
+        if (entries > sizeof(batch) / CHUNK_LIST_ENTRY_SIZE) {
+            entries = sizeof(batch) / CHUNK_LIST_ENTRY_SIZE;
+        }
+        if (recv_all(sockfd, batch, (size_t)entries * CHUNK_LIST_ENTRY_SIZE) != SUCCESS) {
+            free(*chunks);
+            *chunks = NULL;
+            return ERROR_NETWORK;
+        }
+        for (uint64_t j = 0; j < entries; j++, i++) {
+            const unsigned char *entry = batch + j * CHUNK_LIST_ENTRY_SIZE;
+            memcpy((*chunks)[i].digest, entry, CHUNK_DIGEST_SIZE);
+            (*chunks)[i].length = get_le32(entry + CHUNK_DIGEST_SIZE);
+        }
+    }
+    return SUCCESS;
+}
+
+/* Record header ahead of each file in an OP_SESSION stream */
+void encode_session_record(uint16_t path_len, uint64_t size, unsigned char *out) {
+    put_le16(out, path_len);
+    put_le16(out + 2, 0);
+    put_le64(out + 4, size);
+}
+
+void encode_session_ack(uint32_t kind, uint32_t count, uint64_t bytes, unsigned char *out) {
+    put_le32(out, kind);
+    put_le32(out + 4, count);
+    put_le64(out + 8, bytes);
+}
+
+/* A plain basename: no separators and no dot entries */
+int is_safe_filename(const char *filename) {
+    if (filename[0] == '\0' || strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
+        return 0;
+    }
+    return strchr(filename, '/') == NULL;
+}
+
+/* A relative path whose every component is a safe filename */
+int is_safe_relative_path(const char *path) {
+    char component[MAX_FILENAME_LEN];
+    const char *start = path;
+    for (;;) {
+        const char *end = strchr(start, '/');
+        size_t length = end ? (size_t)(end - start) : strlen(start);
+        if (length == 0 || length >= sizeof(component)) {
+            return 0;
+        }
+        memcpy(component, start, length);
+        component[length] = '\0';
+        if (!is_safe_filename(component)) {
+            return 0;
+        }
+        if (!end) {
+            return 1;
+        }
+        start = end + 1;
+    }
+}
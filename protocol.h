@@ -0,0 +1,212 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "common.h"
+#include <stdint.h>
+
+/*
+ * Extended request framing. Legacy uploads start with a NUL-terminated
+ * filename; extended requests start with PROTOCOL_MAGIC instead, followed
+ * by a fixed little-endian header, the filename (name_len bytes, no NUL)
+ * and then `length` bytes of encrypted payload. The server accepts any
+ * version from PROTOCOL_MIN_VERSION up to PROTOCOL_VERSION; version 2
+ * added OP_PUT and version 3 OP_GET.
+ *
+ * Servers treat a connection as extended only when its first
+ * PROTOCOL_PREFIX_SIZE bytes are the magic, a supported version and a
+ * known opcode. That prefix is reserved: a legacy header (name, NUL, size)
+ * may not begin with it. Only the names "EFTX\x01" to "EFTX\x03" with
+ * some sizes can collide, and the legacy client refuses to send those;
+ * other names that start with "EFTX" are ordinary legacy uploads.
+ */
+#define PROTOCOL_MAGIC 0x58544645u  // "EFTX" on the wire
+#define PROTOCOL_MAGIC_SIZE 4
+#define PROTOCOL_PREFIX_SIZE 8      // Magic, version and opcode
+#define PROTOCOL_VERSION 3
+#define PROTOCOL_MIN_VERSION 1
+#define PROTOCOL_HEADER_SIZE 44
+
+/* Request opcodes */
+#define OP_RANGE 1   // One byte range of a file sent over several connections
+#define OP_RESUME 2  // Ask for the chunk map, then send only the missing chunks
+#define OP_DELTA 3   // Receive block signatures, then send only changed data (see delta.h)
+#define OP_CAS 4     // Send the chunk list, then only chunks the server's store lacks
+#define OP_UPLOAD 5  // Whole file as frames, compressed with a negotiated codec
+#define OP_SESSION 6 // Many files back to back over one connection (a directory tree)
+#define OP_PUT 7     // Whole file in one stream; replaces the legacy framing
+#define OP_GET 8     // Download a stored file (or a range of it)
+#define OP_MAX OP_GET  // Highest opcode a server accepts
+
+/* Resumable transfers are tracked in chunks of this size */
+#define TRANSFER_CHUNK_SIZE (1024 * 1024)
+#define CHUNK_MAP_HEADER_SIZE 16
+#define CHUNK_RECORD_SIZE 12
+
+/* Content-defined chunks are named by their SHA-256 digest */
+#define CHUNK_DIGEST_SIZE 32
+#define CHUNK_LIST_ENTRY_SIZE (CHUNK_DIGEST_SIZE + 4)
+
+/*
+ * OP_UPLOAD framing: the server answers the request with the codec it
+ * picked (le32). The file then follows as frames of at most
+ * STREAM_CHUNK_SIZE raw bytes: raw length, stored length (FRAME_COMPRESSED
+ * set if the payload is compressed), the sender's CPU time spent
+ * compressing it in microseconds, then the encrypted payload.
+ */
+#define CODEC_REPLY_SIZE 4
+#define FRAME_HEADER_SIZE 12
+#define FRAME_COMPRESSED 0x80000000u
+
+typedef struct {
+    uint32_t raw_length;
+    uint32_t stored_length;
+    int compressed;
+    uint32_t cpu_usec;
+} frame_header_t;
+
+/*
+ * OP_PUT: `length` bytes of encrypted file follow the filename directly.
+ * flags carries the PUT_FEATURE_* bits the client asks for; the server
+ * answers at once with the subset it will honour (le32) and does not wait
+ * for the client to read it, so the client can stream the file first and
+ * read the reply just before the acknowledgment.
+ *
+ * With PUT_FEATURE_CHECKSUM granted, the client follows the payload with a
+ * trailer: the CRC32C of each CHECKSUM_CHUNK_SIZE piece of the plaintext,
+ * then the CRC32C of the whole file (le32 each). The server acknowledges
+ * only once every one matches what it decrypted, and otherwise discards
+ * the file and answers ACK_CHECKSUM_MISMATCH. A server that does not grant
+ * the feature expects no trailer.
+ */
+#define PUT_REPLY_SIZE 4
+#define PUT_FEATURE_SYNC 0x0001      // fsync the file before acknowledging it
+#define PUT_FEATURE_CHECKSUM 0x0002  // Verify the checksum trailer before acknowledging it
+#define PUT_FEATURES_SUPPORTED (PUT_FEATURE_SYNC | PUT_FEATURE_CHECKSUM)
+#define CHECKSUM_CHUNK_SIZE TRANSFER_CHUNK_SIZE
+
+/*
+ * OP_GET: the request names a file in RECEIVED_FILES_DIR; offset and
+ * length select a range (length 0 means to the end of the file). The
+ * server answers with status (le32: SUCCESS or a negative error code),
+ * the file's total size and the payload length (le64 each), then sends
+ * that many encrypted bytes and closes the connection.
+ */
+#define GET_REPLY_SIZE 20
+
+/*
+ * OP_SESSION stream: the request names the root directory, total_size is
+ * the sum of the file sizes and length the number of files. Each file
+ * follows as a record (path length, flags, size), its path relative to the
+ * root ('/'-separated) and its encrypted data; a record with path length
+ * 0 ends the session. The client never waits between files: the server
+ * acknowledges in batches (kind, count, bytes) every SESSION_ACK_FILES
+ * files or SESSION_ACK_BYTES bytes, reports each failed file by index and
+ * finishes with SESSION_ACK_DONE.
+ */
+#define SESSION_RECORD_HEADER_SIZE 12
+#define SESSION_ACK_SIZE 16
+#define SESSION_MAX_PATH_LEN 1024
+#define SESSION_ACK_FILES 256
+#define SESSION_ACK_BYTES (16 * 1024 * 1024)
+
+#define SESSION_ACK_BATCH 1   // count = files stored so far, bytes = their total size
+#define SESSION_ACK_FAILED 2  // count = index of a file that could not be stored
+#define SESSION_ACK_DONE 3    // Final batch; the connection closes after it
+
+/* Responses */
+#define ACK_FILE_COMPLETE "File received successfully"
+#define ACK_RANGE_STORED "Range received"
+#define ACK_CHUNKS_STORED "Chunks stored, transfer incomplete"
+#define ACK_CHECKSUM_MISMATCH "Checksum mismatch"
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t opcode;
+    uint16_t name_len;
+    uint16_t flags;        // Opcode-specific (OP_UPLOAD: offered codecs, see compress.h)
+    uint64_t transfer_id;  // Groups the ranges of one logical transfer
+    uint64_t total_size;   // Size of the whole file
+    uint64_t offset;       // File offset of this request's payload
+    uint64_t length;       // Payload bytes following the filename
+} request_header_t;
+
+/* One content-defined chunk of a file */
+typedef struct {
+    unsigned char digest[CHUNK_DIGEST_SIZE];
+    uint32_t length;
+} chunk_ref_t;
+
+/* Little-endian field helpers */
+void put_le16(unsigned char *out, uint16_t value);
+void put_le32(unsigned char *out, uint32_t value);
+void put_le64(unsigned char *out, uint64_t value);
+uint16_t get_le16(const unsigned char *in);
+uint32_t get_le32(const unsigned char *in);
+uint64_t get_le64(const unsigned char *in);
+
+/* Header encoding */
+void encode_request_header(const request_header_t *header, unsigned char *out);
+void decode_request_header(const unsigned char *in, request_header_t *header);
+
+/* Frame header encoding */
+void encode_frame_header(const frame_header_t *frame, unsigned char *out);
+void decode_frame_header(const unsigned char *in, frame_header_t *frame);
+
+/* Peek at a connection to see whether it carries an extended request */
+int peek_extended_request(int sockfd);
+int extended_prefix_matches(const unsigned char *data, size_t len);
+
+/* True when a legacy header (name, NUL, size) would begin with the reserved prefix */
+int legacy_header_collides(const char *filename, size_t file_size);
+
+/* Send a header and filename; receive them on the server side */
+int send_request(int sockfd, const request_header_t *header, const char *filename);
+int recv_request(int sockfd, request_header_t *header, char *filename, size_t filename_size);
+/* The rest of recv_request once the fixed header (raw) has been read by other means */
+int recv_request_name(int sockfd, const unsigned char *raw, request_header_t *header, char *filename,
+                      size_t filename_size);
+
+/* Validation shared by recv_request and the event-driven engines */
+int check_request_header(const request_header_t *header, size_t filename_size);
+int check_request_name(const char *filename, size_t name_len);
+
+/*
+ * Parse a legacy header (NUL-terminated filename, then a host-endian
+ * size_t) from the start of data. Returns the header length, 0 if more
+ * bytes are needed, or ERROR_FILE_IO if no NUL ends the name within
+ * filename_size bytes or the name fails is_safe_filename.
+ */
+int parse_legacy_header(const unsigned char *data, size_t len, char *filename, size_t filename_size,
+                        uint64_t *file_size);
+
+/*
+ * OP_RESUME exchange: the server answers with a chunk map (chunk size,
+ * chunk count, then one bit per chunk already stored). The client then
+ * sends chunk records (offset, length, payload) and ends with a record
+ * of length 0.
+ */
+int send_chunk_map(int sockfd, uint32_t chunk_size, uint64_t chunk_count, const unsigned char *bitmap);
+int recv_chunk_map(int sockfd, uint32_t *chunk_size, uint64_t *chunk_count, unsigned char **bitmap);
+int send_chunk_record(int sockfd, uint64_t offset, uint32_t length);
+int recv_chunk_record(int sockfd, uint64_t *offset, uint32_t *length);
+
+/*
+ * OP_CAS exchange: the client sends its chunk list (count, then digest and
+ * length per chunk). The server answers with a chunk map marking the chunks
+ * its store already holds (chunk size field = largest chunk length). The
+ * client then sends the missing chunks' encrypted data back to back, in
+ * list order.
+ */
+int send_chunk_list(int sockfd, const chunk_ref_t *chunks, uint64_t count);
+int recv_chunk_list(int sockfd, chunk_ref_t **chunks, uint64_t *count, uint64_t max_count);
+
+/* Session records and acknowledgments */
+void encode_session_record(uint16_t path_len, uint64_t size, unsigned char *out);
+void encode_session_ack(uint32_t kind, uint32_t count, uint64_t bytes, unsigned char *out);
+
+/* Reject names that could escape RECEIVED_FILES_DIR */
+int is_safe_filename(const char *filename);
+int is_safe_relative_path(const char *path);
+
+#endif /* PROTOCOL_H */
@@ -0,0 +1,305 @@
+#include "range_assembly.h"
+#include "logger.h"
+#include "protocol.h"
+#include <fcntl.h>
+
+struct range_assembly {
+    struct range_assembly *next;
+    pthread_mutex_t lock;          // Guards the bitmap and manifest below
+    char filename[MAX_FILENAME_LEN];
+    char part_path[MAX_PATH_LEN];
+    char manifest_path[MAX_PATH_LEN];
+    char final_path[MAX_PATH_LEN];
+    uint64_t transfer_id;
+    uint64_t total_size;
+    uint32_t chunk_size;
+    uint64_t chunk_count;
+    uint64_t chunks_present;
+    unsigned char *bitmap;
+    size_t bitmap_size;
+    int unsynced_chunks;           // Committed chunks not yet recorded in the manifest
+    int fd;
+    int manifest_fd;
+    int refs;
+    int complete;
+};
+
+static range_assembly_t *assemblies = NULL;
+static pthread_mutex_t assemblies_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Unlink an entry from the registry; caller holds assemblies_lock */
+static void remove_assembly(range_assembly_t *assembly) {
+    range_assembly_t **link = &assemblies;
+    while (*link && *link != assembly) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = assembly->next;
+    }
+}
+
+/* Release an entry's descriptors and memory */
+static void free_assembly(range_assembly_t *assembly) {
+    if (assembly->fd >= 0) {
+        close(assembly->fd);
+    }
+    if (assembly->manifest_fd >= 0) {
+        close(assembly->manifest_fd);
+    }
+    pthread_mutex_destroy(&assembly->lock);
+    free(assembly->bitmap);
+    free(assembly);
+}
+
+/* Persist the bitmap after making the chunk data it describes durable; caller holds assembly->lock */
+static int flush_manifest(range_assembly_t *assembly) {
+    if (assembly->unsynced_chunks == 0 || assembly->complete) {
+        return SUCCESS;
+    }
+    if (fdatasync(assembly->fd) < 0 ||
+        pwrite(assembly->manifest_fd, assembly->bitmap, assembly->bitmap_size, MANIFEST_HEADER_SIZE) !=
+            (ssize_t)assembly->bitmap_size) {
+        perror("Failed to update transfer manifest");
+        return ERROR_FILE_IO;
+    }
+    assembly->unsynced_chunks = 0;
+    return SUCCESS;
+}
+
+/* Load a matching manifest from disk; returns SUCCESS only if it can be resumed */
+static int load_manifest(range_assembly_t *assembly) {
+    int manifest_fd = open(assembly->manifest_path, O_RDWR | O_CLOEXEC);
+    if (manifest_fd < 0) {
+        return ERROR_FILE_IO;
+    }
+
+    unsigned char header[MANIFEST_HEADER_SIZE];
+    if (pread(manifest_fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        get_le32(header) != MANIFEST_MAGIC || get_le32(header + 4) != MANIFEST_VERSION ||
+        get_le64(header + 8) != assembly->transfer_id || get_le64(header + 16) != assembly->total_size ||
+        get_le32(header + 24) != assembly->chunk_size ||
+        pread(manifest_fd, assembly->bitmap, assembly->bitmap_size, MANIFEST_HEADER_SIZE) !=
+            (ssize_t)assembly->bitmap_size) {
+        close(manifest_fd);
+        return ERROR_FILE_IO;
+    }
+
+    int fd = open(assembly->part_path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        close(manifest_fd);
+        return ERROR_FILE_IO;
+    }
+
+    assembly->fd = fd;
+    assembly->manifest_fd = manifest_fd;
+    for (uint64_t i = 0; i < assembly->chunk_count; i++) {
+        if (assembly->bitmap[i / 8] & (1u << (i % 8))) {
+            assembly->chunks_present++;
+        }
+    }
+    return SUCCESS;
+}
+
+/* Start a fresh partial file and manifest, replacing any stale ones */
+static int create_partial(range_assembly_t *assembly) {
+    assembly->fd = open(assembly->part_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (assembly->fd < 0) {
+        perror("Failed to create partial file");
+        return ERROR_FILE_IO;
+    }
+
+    /* Reserve the full size up front so chunks can land in any order */
+    if (assembly->total_size > 0) {
+        int status = posix_fallocate(assembly->fd, 0, (off_t)assembly->total_size);
+        if (status != 0 && ftruncate(assembly->fd, (off_t)assembly->total_size) < 0) {
+            perror("Failed to preallocate partial file");
+            unlink(assembly->part_path);
+            return ERROR_FILE_IO;
+        }
+    }
+
+    assembly->manifest_fd = open(assembly->manifest_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (assembly->manifest_fd < 0) {
+        perror("Failed to create transfer manifest");
+        unlink(assembly->part_path);
+        return ERROR_FILE_IO;
+    }
+
+    unsigned char header[MANIFEST_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    put_le32(header, MANIFEST_MAGIC);
+    put_le32(header + 4, MANIFEST_VERSION);
+    put_le64(header + 8, assembly->transfer_id);
+    put_le64(header + 16, assembly->total_size);
+    put_le32(header + 24, assembly->chunk_size);
+    if (pwrite(assembly->manifest_fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        pwrite(assembly->manifest_fd, assembly->bitmap, assembly->bitmap_size, MANIFEST_HEADER_SIZE) !=
+            (ssize_t)assembly->bitmap_size) {
+        perror("Failed to write transfer manifest");
+        unlink(assembly->part_path);
+        unlink(assembly->manifest_path);
+        return ERROR_FILE_IO;
+    }
+    return SUCCESS;
+}
+
+/* Build a registry entry, resuming from disk when the manifest matches; caller holds assemblies_lock */
+static range_assembly_t* create_assembly(const char *filename, uint64_t transfer_id, uint64_t total_size) {
+    range_assembly_t *assembly = (range_assembly_t *)calloc(1, sizeof(range_assembly_t));
+    if (!assembly) {
+        return NULL;
+    }
+    pthread_mutex_init(&assembly->lock, NULL);
+    assembly->fd = -1;
+    assembly->manifest_fd = -1;
+    snprintf(assembly->filename, sizeof(assembly->filename), "%s", filename);
+    snprintf(assembly->final_path, sizeof(assembly->final_path), "%s/%s", RECEIVED_FILES_DIR, filename);
+    snprintf(assembly->part_path, sizeof(assembly->part_path), "%s/%s%s", RECEIVED_FILES_DIR,
+             filename, PARTIAL_FILE_SUFFIX);
+    snprintf(assembly->manifest_path, sizeof(assembly->manifest_path), "%s/%s%s", RECEIVED_FILES_DIR,
+             filename, MANIFEST_SUFFIX);
+    assembly->transfer_id = transfer_id;
+    assembly->total_size = total_size;
+    assembly->chunk_size = TRANSFER_CHUNK_SIZE;
+    assembly->chunk_count = (total_size + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE;
+    assembly->bitmap_size = (size_t)((assembly->chunk_count + 7) / 8);
+    assembly->bitmap = (unsigned char *)calloc(assembly->bitmap_size + 1, 1);
+    if (!assembly->bitmap) {
+        free_assembly(assembly);
+        return NULL;
+    }
+
+    if (load_manifest(assembly) == SUCCESS) {
+        log_message(LOG_INFO, "Resuming %s: %llu of %llu chunks already stored", filename,
+                    (unsigned long long)assembly->chunks_present,
+                    (unsigned long long)assembly->chunk_count);
+    } else if (create_partial(assembly) != SUCCESS) {
+        free_assembly(assembly);
+        return NULL;
+    }
+
+    assembly->next = assemblies;
+    assemblies = assembly;
+    return assembly;
+}
+
+/* Publish the finished file and drop its manifest; caller holds assembly->lock */
+static int publish_assembly(range_assembly_t *assembly) {
+    if (rename(assembly->part_path, assembly->final_path) < 0) {
+        perror("Failed to publish assembled file");
+        return ERROR_FILE_IO;
+    }
+    unlink(assembly->manifest_path);
+    assembly->complete = 1;
+    return SUCCESS;
+}
+
+/* Join, resume from disk, or start the assembly of filename for a given transfer */
+range_assembly_t* assembly_open(const char *filename, uint64_t transfer_id, uint64_t total_size) {
+    pthread_mutex_lock(&assemblies_lock);
+    range_assembly_t *assembly = assemblies;
+    while (assembly && strcmp(assembly->filename, filename) != 0) {
+        assembly = assembly->next;
+    }
+
+    if (assembly && (assembly->transfer_id != transfer_id || assembly->total_size != total_size ||
+                     assembly->complete)) {
+        /* Another version of this file is being uploaded right now */
+        assembly = NULL;
+    } else if (!assembly) {
+        assembly = create_assembly(filename, transfer_id, total_size);
+        if (assembly && assembly->chunk_count == 0) {
+            pthread_mutex_lock(&assembly->lock);
+            publish_assembly(assembly);
+            pthread_mutex_unlock(&assembly->lock);
+        }
+    }
+
+    if (assembly) {
+        assembly->refs++;
+    }
+    pthread_mutex_unlock(&assemblies_lock);
+    return assembly;
+}
+
+/* Output descriptor to pwrite() chunks into */
+int assembly_fd(const range_assembly_t *assembly) {
+    return assembly->fd;
+}
+
+/* Chunk size recorded in the manifest */
+uint32_t assembly_chunk_size(const range_assembly_t *assembly) {
+    return assembly->chunk_size;
+}
+
+/* Number of chunks in the file */
+uint64_t assembly_chunk_count(const range_assembly_t *assembly) {
+    return assembly->chunk_count;
+}
+
+/* Copy the received-chunk bitmap; returns the number of bytes copied */
+size_t assembly_copy_bitmap(range_assembly_t *assembly, unsigned char *bitmap, size_t size) {
+    pthread_mutex_lock(&assembly->lock);
+    size_t copy = (size < assembly->bitmap_size) ? size : assembly->bitmap_size;
+    memcpy(bitmap, assembly->bitmap, copy);
+    pthread_mutex_unlock(&assembly->lock);
+    return copy;
+}
+
+/* Expected length of a chunk, 0 if index is out of range */
+uint64_t assembly_chunk_length(const range_assembly_t *assembly, uint64_t index) {
+    if (index >= assembly->chunk_count) {
+        return 0;
+    }
+    uint64_t offset = index * assembly->chunk_size;
+    uint64_t remaining = assembly->total_size - offset;
+    return (remaining < assembly->chunk_size) ? remaining : assembly->chunk_size;
+}
+
+/* True once the file has been published under its final name */
+int assembly_is_complete(range_assembly_t *assembly) {
+    pthread_mutex_lock(&assembly->lock);
+    int complete = assembly->complete;
+    pthread_mutex_unlock(&assembly->lock);
+    return complete;
+}
+
+/* Record a fully written chunk; sets *complete once every chunk has arrived */
+int assembly_commit_chunk(range_assembly_t *assembly, uint64_t index, int *complete) {
+    int status = SUCCESS;
+    *complete = 0;
+    if (index >= assembly->chunk_count) {
+        return ERROR_FILE_IO;
+    }
+
+    pthread_mutex_lock(&assembly->lock);
+    unsigned char bit = (unsigned char)(1u << (index % 8));
+    if (!(assembly->bitmap[index / 8] & bit) && !assembly->complete) {
+        assembly->bitmap[index / 8] |= bit;
+        assembly->chunks_present++;
+        assembly->unsynced_chunks++;
+        if (assembly->chunks_present == assembly->chunk_count) {
+            status = publish_assembly(assembly);
+            *complete = (status == SUCCESS);
+        } else if (assembly->unsynced_chunks >= MANIFEST_SYNC_CHUNKS) {
+            status = flush_manifest(assembly);
+        }
+    }
+    pthread_mutex_unlock(&assembly->lock);
+    return status;
+}
+
+/* Drop a reference; the entry leaves memory with its last reference, the manifest stays on disk */
+void assembly_release(range_assembly_t *assembly) {
+    pthread_mutex_lock(&assemblies_lock);
+    pthread_mutex_lock(&assembly->lock);
+    flush_manifest(assembly);
+    pthread_mutex_unlock(&assembly->lock);
+
+    assembly->refs--;
+    if (assembly->refs == 0) {
+        remove_assembly(assembly);
+        free_assembly(assembly);
+    }
+    pthread_mutex_unlock(&assemblies_lock);
+}
@@ -0,0 +1,47 @@
+#ifndef RANGE_ASSEMBLY_H
+#define RANGE_ASSEMBLY_H
+
+#include "common.h"
+#include <stdint.h>
+
+/*
+ * Partial uploads live next to their final path in RECEIVED_FILES_DIR:
+ * the data in <name>.part and a chunk manifest in <name>.manifest that
+ * records which TRANSFER_CHUNK_SIZE chunks have been written. Both
+ * survive disconnects and restarts so a client can resume later.
+ */
+#define PARTIAL_FILE_SUFFIX ".part"
+#define MANIFEST_SUFFIX ".manifest"
+#define MANIFEST_MAGIC 0x4D544645u  // "EFTM" on disk
+#define MANIFEST_VERSION 1
+#define MANIFEST_HEADER_SIZE 32
+
+/* Chunks committed between manifest flushes (each flush fdatasyncs the data first) */
+#define MANIFEST_SYNC_CHUNKS 16
+
+typedef struct range_assembly range_assembly_t;
+
+/* Join, resume from disk, or start the assembly of filename for a given transfer */
+range_assembly_t* assembly_open(const char *filename, uint64_t transfer_id, uint64_t total_size);
+
+/* Output descriptor to pwrite() chunks into */
+int assembly_fd(const range_assembly_t *assembly);
+
+/* Chunk geometry and the current map of received chunks */
+uint32_t assembly_chunk_size(const range_assembly_t *assembly);
+uint64_t assembly_chunk_count(const range_assembly_t *assembly);
+size_t assembly_copy_bitmap(range_assembly_t *assembly, unsigned char *bitmap, size_t size);
+
+/* Expected length of a chunk, 0 if index is out of range */
+uint64_t assembly_chunk_length(const range_assembly_t *assembly, uint64_t index);
+
+/* True once the file has been published under its final name */
+int assembly_is_complete(range_assembly_t *assembly);
+
+/* Record a fully written chunk; sets *complete once every chunk has arrived */
+int assembly_commit_chunk(range_assembly_t *assembly, uint64_t index, int *complete);
+
+/* Drop a reference; pending manifest updates are flushed */
+void assembly_release(range_assembly_t *assembly);
+
+#endif /* RANGE_ASSEMBLY_H */
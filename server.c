@@ -1,31 +1,1375 @@
 #include "common.h"
 #include "crypto.h"
 #include "logger.h"
+#include "event_server.h"
+#include "uring_server.h"
+#include "worker_pool.h"
+#include "protocol.h"
+#include "range_assembly.h"
+#include "delta.h"
+#include "chunk_store.h"
+#include "chunker.h"
+#include "hash.h"
+#include "compress.h"
+#include "metrics.h"
+#include "buffer_pool.h"
+#include "download_cache.h"
+#include "checksum.h"
+#include "bandwidth.h"
+#include "pack_store.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 
 /* Global variables */
-static int server_socket = -1;
 static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t shutdown_signal = 0;
+static size_t stream_chunk_size = STREAM_CHUNK_SIZE;
+static chunk_store_t *chunk_store = NULL;
+static pack_store_t *pack_store = NULL;
+static download_cache_t *download_cache = NULL;
+static bandwidth_scheduler_t *bandwidth = NULL;
 
-/* Structure to pass client info to thread */
+/* The transfer the calling thread is serving; its received bytes are charged to the scheduler */
+static _Thread_local bandwidth_flow_t *current_flow = NULL;
+
+/* Connections handed to a handler thread or the pool; main waits for them before tearing down */
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t active_done = PTHREAD_COND_INITIALIZER;
+static int active_clients = 0;
+
+/* Connection engines selectable at startup */
+typedef enum {
+    ENGINE_THREADS,
+    ENGINE_EPOLL,
+    ENGINE_POOL,
+    ENGINE_URING
+} server_engine_t;
+
+/* What the pool engine does with a client when the work queue is full */
+typedef enum {
+    OVERFLOW_REJECT,
+    OVERFLOW_WAIT
+} overflow_policy_t;
+
+/*
+ * One acceptor group. With -n above 1 every shard binds its own
+ * SO_REUSEPORT socket, so the kernel hashes each new connection to one
+ * shard's accept queue and no lock or queue is shared between shards.
+ * The shard's thread, and every thread it starts, runs on its CPU set.
+ */
 typedef struct {
-    int client_socket;
-    struct sockaddr_in client_addr;
-} client_info_t;
+    int index;
+    int listen_socket;
+    cpu_set_t cpus;
+    int pinned;            // cpus is applied; otherwise the shard runs wherever it is scheduled
+    worker_pool_t *pool;   // Pool engine only
+    pthread_t thread;
+} server_shard_t;
+
+static server_engine_t engine = ENGINE_THREADS;
+static overflow_policy_t overflow = OVERFLOW_REJECT;
+static server_shard_t *shards = NULL;
+static int shard_count = 0;
+
+/* Work queue counters summed over every shard's pool; returns 0 if no shard has one */
+static int get_pool_stats(worker_pool_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    int pools = 0;
+    for (int i = 0; i < shard_count; i++) {
+        if (!shards[i].pool) {
+            continue;
+        }
+        worker_pool_stats_t shard_stats;
+        worker_pool_get_stats(shards[i].pool, &shard_stats);
+        stats->queue_depth += shard_stats.queue_depth;
+        stats->queue_capacity += shard_stats.queue_capacity;
+        stats->queue_high_water += shard_stats.queue_high_water;
+        stats->active_workers += shard_stats.active_workers;
+        stats->accepted_total += shard_stats.accepted_total;
+        stats->rejected_total += shard_stats.rejected_total;
+        stats->completed_total += shard_stats.completed_total;
+        pools++;
+    }
+    return pools;
+}
+
+/* Log the buffer pool, download cache, pack store and work queue counters */
+static void log_pool_stats(void) {
+    buffer_pool_stats_t buffers;
+    buffer_pool_get_stats(&buffers);
+    log_message(LOG_INFO, "Buffer pool hits: %llu | Misses: %llu | Oversize: %llu | Slabs: %llu (%llu huge)",
+                (unsigned long long)buffers.hits, (unsigned long long)buffers.misses,
+                (unsigned long long)buffers.oversize, (unsigned long long)buffers.slabs,
+                (unsigned long long)buffers.huge_slabs);
+    if (download_cache) {
+        download_cache_stats_t cached;
+        download_cache_get_stats(download_cache, &cached);
+        log_message(LOG_INFO, "Download cache hits: %llu | Misses: %llu | Bypassed: %llu | Evictions: %llu | "
+                    "Chunks: %zu/%zu", (unsigned long long)cached.hits, (unsigned long long)cached.misses,
+                    (unsigned long long)cached.bypassed, (unsigned long long)cached.evictions,
+                    cached.slots_used, cached.slots);
+    }
+    if (pack_store) {
+        pack_store_stats_t packed;
+        pack_store_get_stats(pack_store, &packed);
+        log_message(LOG_INFO, "Pack store objects: %llu | Packs: %llu | Bytes: %llu (%llu dead)",
+                    (unsigned long long)packed.objects, (unsigned long long)packed.packs,
+                    (unsigned long long)packed.pack_bytes, (unsigned long long)packed.dead_bytes);
+    }
+    if (bandwidth) {
+        bandwidth_stats_t shaped;
+        bandwidth_get_stats(bandwidth, &shaped);
+        log_message(LOG_INFO, "Bandwidth clients: %zu | Active transfers: %zu | Throttled: %.3f s",
+                    shaped.clients, shaped.active_transfers, shaped.throttled_ns / 1e9);
+    }
+    worker_pool_stats_t stats;
+    if (!get_pool_stats(&stats)) {
+        return;
+    }
+    log_message(LOG_INFO, "Queue depth %zu/%zu (high water %zu) | Active workers: %zu | "
+                "Accepted: %zu | Rejected: %zu | Completed: %zu",
+                stats.queue_depth, stats.queue_capacity, stats.queue_high_water,
+                stats.active_workers, stats.accepted_total, stats.rejected_total,
+                stats.completed_total);
+}
+
+/* Buffer pool, download cache, pack store, per-client bandwidth and pool queue metrics for the endpoint */
+static size_t write_pool_metrics(char *out, size_t size) {
+    buffer_pool_stats_t buffers;
+    buffer_pool_get_stats(&buffers);
+    download_cache_stats_t cached;
+    download_cache_get_stats(download_cache, &cached);
+    int length = snprintf(out, size,
+                          "# TYPE eftt_buffer_pool_hits_total counter\neftt_buffer_pool_hits_total %llu\n"
+                          "# TYPE eftt_buffer_pool_misses_total counter\neftt_buffer_pool_misses_total %llu\n"
+                          "# TYPE eftt_buffer_pool_oversize_total counter\neftt_buffer_pool_oversize_total %llu\n"
+                          "# TYPE eftt_buffer_pool_slabs gauge\neftt_buffer_pool_slabs %llu\n"
+                          "# TYPE eftt_buffer_pool_huge_slabs gauge\neftt_buffer_pool_huge_slabs %llu\n"
+                          "# TYPE eftt_download_cache_hits_total counter\neftt_download_cache_hits_total %llu\n"
+                          "# TYPE eftt_download_cache_misses_total counter\neftt_download_cache_misses_total %llu\n"
+                          "# TYPE eftt_download_cache_bypassed_total counter\n"
+                          "eftt_download_cache_bypassed_total %llu\n"
+                          "# TYPE eftt_download_cache_evictions_total counter\n"
+                          "eftt_download_cache_evictions_total %llu\n"
+                          "# TYPE eftt_download_cache_chunks gauge\neftt_download_cache_chunks %zu\n",
+                          (unsigned long long)buffers.hits, (unsigned long long)buffers.misses,
+                          (unsigned long long)buffers.oversize, (unsigned long long)buffers.slabs,
+                          (unsigned long long)buffers.huge_slabs, (unsigned long long)cached.hits,
+                          (unsigned long long)cached.misses, (unsigned long long)cached.bypassed,
+                          (unsigned long long)cached.evictions, cached.slots_used);
+    if (length < 0 || (size_t)length >= size) {
+        return 0;
+    }
+    size_t used = (size_t)length;
+    if (pack_store) {
+        pack_store_stats_t packed;
+        pack_store_get_stats(pack_store, &packed);
+        length = snprintf(out + used, size - used,
+                          "# TYPE eftt_pack_objects gauge\neftt_pack_objects %llu\n"
+                          "# TYPE eftt_pack_files gauge\neftt_pack_files %llu\n"
+                          "# TYPE eftt_pack_bytes gauge\neftt_pack_bytes %llu\n"
+                          "# TYPE eftt_pack_dead_bytes gauge\neftt_pack_dead_bytes %llu\n",
+                          (unsigned long long)packed.objects, (unsigned long long)packed.packs,
+                          (unsigned long long)packed.pack_bytes, (unsigned long long)packed.dead_bytes);
+        if (length > 0 && (size_t)length < size - used) {
+            used += (size_t)length;
+        }
+    }
+    if (bandwidth) {
+        used += bandwidth_write_metrics(bandwidth, out + used, size - used);
+    }
+    worker_pool_stats_t stats;
+    if (!get_pool_stats(&stats)) {
+        return used;
+    }
+    length = snprintf(out + used, size - used,
+                          "# TYPE eftt_pool_queue_depth gauge\neftt_pool_queue_depth %zu\n"
+                          "# TYPE eftt_pool_queue_high_water gauge\neftt_pool_queue_high_water %zu\n"
+                          "# TYPE eftt_pool_active_workers gauge\neftt_pool_active_workers %zu\n"
+                          "# TYPE eftt_pool_rejected_total counter\neftt_pool_rejected_total %zu\n",
+                          stats.queue_depth, stats.queue_high_water, stats.active_workers,
+                          stats.rejected_total);
+    return (length < 0 || (size_t)length >= size - used) ? used : used + (size_t)length;
+}
+
+/*
+ * Signal handler for graceful shutdown: stop the engines and leave the
+ * teardown to main. shutdown() wakes accept() and the event loops where
+ * close() would not; close_shards closes the sockets. A second signal
+ * exits without waiting for transfers still in progress.
+ */
+void signal_handler(int sig) {
+    if (!running) {
+        _exit(EXIT_FAILURE);
+    }
+    shutdown_signal = sig;
+    running = 0;
+    for (int i = 0; i < shard_count; i++) {
+        shutdown(shards[i].listen_socket, SHUT_RDWR);
+    }
+}
+
+/* Count a connection before it is handed on, so main cannot miss one whose handler has not started */
+static void claim_connection(void) {
+    pthread_mutex_lock(&active_lock);
+    active_clients++;
+    pthread_mutex_unlock(&active_lock);
+}
+
+/* Drop a claimed connection once it has been served or could not be handed on */
+static void release_connection(void) {
+    pthread_mutex_lock(&active_lock);
+    if (--active_clients == 0) {
+        pthread_cond_broadcast(&active_done);
+    }
+    pthread_mutex_unlock(&active_lock);
+}
+
+/* recv() that feeds the receive-time histogram and byte counter */
+static ssize_t metered_recv(int client_socket, void *data, size_t size) {
+    uint64_t started = metrics_now_ns();
+    ssize_t received = recv(client_socket, data, size, 0);
+    metrics_observe(METRIC_RECV_TIME, metrics_now_ns() - started);
+    if (received > 0) {
+        metrics_add(METRIC_BYTES_RECEIVED, received);
+        if (current_flow) {
+            bandwidth_charge(bandwidth, current_flow, (size_t)received);  // May sleep until the client's turn
+        }
+    }
+    return received;
+}
+
+static int metered_recv_all(int client_socket, void *data, size_t size) {
+    unsigned char *ptr = (unsigned char *)data;
+    while (size > 0) {
+        ssize_t received = metered_recv(client_socket, ptr, size);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return ERROR_NETWORK;
+        }
+        ptr += received;
+        size -= (size_t)received;
+    }
+    return SUCCESS;
+}
+
+/* pwrite() that feeds the write-time histogram and byte counter */
+static ssize_t metered_pwrite(int fd, const void *data, size_t size, off_t offset) {
+    uint64_t started = metrics_now_ns();
+    ssize_t written = pwrite(fd, data, size, offset);
+    metrics_observe(METRIC_WRITE_TIME, metrics_now_ns() - started);
+    if (written > 0) {
+        metrics_add(METRIC_BYTES_WRITTEN, written);
+    }
+    return written;
+}
+
+/* Receive length encrypted bytes, decrypt (and checksum, if checksum is set) and write them to fd at offset */
+static int receive_payload(int client_socket, int fd, uint64_t offset, uint64_t length,
+                           checksum_state_t *checksum, uint64_t *received) {
+    *received = 0;
+    
+    /* Per-connection buffer is bounded by the configured chunk size, not the file size */
+    size_t chunk_size = stream_chunk_size;
+    unsigned char *chunk = (unsigned char *)buffer_pool_alloc(chunk_size);
+    if (!chunk) {
+        perror("Failed to allocate receive buffer");
+        return ERROR_MEMORY;
+    }
+    
+    int status = SUCCESS;
+    while (*received < length) {
+        size_t want = chunk_size;
+        if (length - *received < want) {
+            want = (size_t)(length - *received);
+        }
+        ssize_t bytes_received = metered_recv(client_socket, chunk, want);
+        if (bytes_received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_received <= 0) {
+            status = ERROR_NETWORK;
+            break;
+        }
+    
+        if (checksum) {
+            checksum_decrypt(checksum, chunk, (size_t)bytes_received);
+        } else {
+            decrypt_buffer(chunk, (size_t)bytes_received, ENCRYPTION_KEY);
+        }
+        ssize_t bytes_written = metered_pwrite(fd, chunk, (size_t)bytes_received, (off_t)(offset + *received));
+        if (bytes_written != bytes_received) {
+            perror("Failed to write file data");
+            status = ERROR_FILE_IO;
+            break;
+        }
+        *received += (uint64_t)bytes_received;
+    }
+    
+    buffer_pool_free(chunk, chunk_size);
+    return status;
+}
+
+/* Receive one chunk into the assembly and mark it present */
+static int receive_chunk(int client_socket, range_assembly_t *assembly, uint64_t index,
+                         uint64_t *received, int *complete) {
+    uint64_t offset = index * assembly_chunk_size(assembly);
+    uint64_t length = assembly_chunk_length(assembly, index);
+    uint64_t chunk_received = 0;
+    int status = receive_payload(client_socket, assembly_fd(assembly), offset, length, NULL, &chunk_received);
+    *received += chunk_received;
+    if (status != SUCCESS) {
+        return status;
+    }
+    return assembly_commit_chunk(assembly, index, complete);
+}
+
+/* Receive one byte range of a file that is being sent over several connections */
+static void serve_range_request(int client_socket, const request_header_t *header,
+                                const char *filename, const char *client_ip, int client_port) {
+    printf("Receiving range %llu+%llu of %s (%llu bytes)\n", (unsigned long long)header->offset,
+           (unsigned long long)header->length, filename, (unsigned long long)header->total_size);
+    
+    range_assembly_t *assembly = assembly_open(filename, header->transfer_id, header->total_size);
+    if (!assembly) {
+        log_message(LOG_ERROR, "Cannot assemble %s for %s:%d", filename, client_ip, client_port);
+        return;
+    }
+    
+    /* Ranges must start on a chunk boundary and cover whole chunks (or run to the end) */
+    uint64_t chunk_size = assembly_chunk_size(assembly);
+    uint64_t received = 0;
+    int status = SUCCESS;
+    if (header->offset > header->total_size || header->length > header->total_size - header->offset ||
+        header->offset % chunk_size != 0 ||
+        (header->length % chunk_size != 0 && header->offset + header->length != header->total_size)) {
+        log_message(LOG_ERROR, "Range %llu+%llu outside %s from %s:%d", (unsigned long long)header->offset,
+                    (unsigned long long)header->length, filename, client_ip, client_port);
+        status = ERROR_FILE_IO;
+    }
+    
+    int complete = assembly_is_complete(assembly);
+    uint64_t first = header->offset / chunk_size;
+    uint64_t last = (header->length == 0) ? first : (header->offset + header->length + chunk_size - 1) / chunk_size;
+    for (uint64_t index = first; status == SUCCESS && index < last; index++) {
+        status = receive_chunk(client_socket, assembly, index, &received, &complete);
+    }
+    assembly_release(assembly);
+    
+    if (status != SUCCESS) {
+        printf("Error receiving range of %s\n", filename);
+        log_message(LOG_ERROR, "Range %llu+%llu of %s from %s:%d failed after %llu bytes",
+                    (unsigned long long)header->offset, (unsigned long long)header->length,
+                    filename, client_ip, client_port, (unsigned long long)received);
+        return;
+    }
+    
+    log_message(LOG_INFO, "Range %llu+%llu of %s stored", (unsigned long long)header->offset,
+                (unsigned long long)header->length, filename);
+    if (complete) {
+        printf("File saved successfully: %s/%s\n", RECEIVED_FILES_DIR, filename);
+        log_transfer(client_ip, client_port, filename, (size_t)header->total_size, "SUCCESS");
+        metrics_add(METRIC_FILES_STORED, 1);
+    }
+    
+    const char *ack = complete ? ACK_FILE_COMPLETE : ACK_RANGE_STORED;
+    send(client_socket, ack, strlen(ack), MSG_NOSIGNAL);
+}
+
+/* Report the chunks already stored, then receive only the ones the client sends */
+static void serve_resume_request(int client_socket, const request_header_t *header,
+                                 const char *filename, const char *client_ip, int client_port) {
+    range_assembly_t *assembly = assembly_open(filename, header->transfer_id, header->total_size);
+    if (!assembly) {
+        log_message(LOG_ERROR, "Cannot resume %s for %s:%d", filename, client_ip, client_port);
+        return;
+    }
+    
+    uint64_t chunk_count = assembly_chunk_count(assembly);
+    size_t bitmap_size = (size_t)((chunk_count + 7) / 8);
+    unsigned char *bitmap = (unsigned char *)calloc(bitmap_size + 1, 1);
+    if (!bitmap) {
+        perror("Failed to allocate chunk map");
+        assembly_release(assembly);
+        return;
+    }
+    assembly_copy_bitmap(assembly, bitmap, bitmap_size);
+    int status = send_chunk_map(client_socket, assembly_chunk_size(assembly), chunk_count, bitmap);
+    free(bitmap);
+    
+    /* Chunk records until the client sends the zero-length terminator */
+    int complete = assembly_is_complete(assembly);
+    uint64_t received = 0;
+    uint64_t chunks_received = 0;
+    while (status == SUCCESS) {
+        uint64_t offset;
+        uint32_t length;
+        status = recv_chunk_record(client_socket, &offset, &length);
+        if (status != SUCCESS || length == 0) {
+            break;
+        }
+        uint64_t index = offset / assembly_chunk_size(assembly);
+        if (offset % assembly_chunk_size(assembly) != 0 || length != assembly_chunk_length(assembly, index)) {
+            log_message(LOG_ERROR, "Bad chunk %llu+%u of %s from %s:%d", (unsigned long long)offset,
+                        length, filename, client_ip, client_port);
+            status = ERROR_FILE_IO;
+            break;
+        }
+        status = receive_chunk(client_socket, assembly, index, &received, &complete);
+        chunks_received++;
+    }
+    assembly_release(assembly);
+    
+    log_message(LOG_INFO, "Resumable transfer of %s from %s:%d: %llu chunks (%llu bytes) this session%s",
+                filename, client_ip, client_port, (unsigned long long)chunks_received,
+                (unsigned long long)received, (status == SUCCESS) ? "" : ", interrupted");
+    if (status != SUCCESS) {
+        printf("Transfer of %s interrupted; partial state kept for resume\n", filename);
+        return;
+    }
+    if (complete) {
+        printf("File saved successfully: %s/%s\n", RECEIVED_FILES_DIR, filename);
+        log_transfer(client_ip, client_port, filename, (size_t)header->total_size, "SUCCESS");
+        metrics_add(METRIC_FILES_STORED, 1);
+    }
+    
+    const char *ack = complete ? ACK_FILE_COMPLETE : ACK_CHUNKS_STORED;
+    send(client_socket, ack, strlen(ack), MSG_NOSIGNAL);
+}
+
+/* Sign the existing copy, then rebuild the file from the client's delta */
+static void serve_delta_request(int client_socket, const request_header_t *header,
+                                const char *filename, const char *client_ip, int client_port) {
+    char final_path[MAX_PATH_LEN];
+    char staging_path[MAX_PATH_LEN];
+    snprintf(final_path, sizeof(final_path), "%s/%s", RECEIVED_FILES_DIR, filename);
+    snprintf(staging_path, sizeof(staging_path), "%s/%s%s", RECEIVED_FILES_DIR, filename, DELTA_FILE_SUFFIX);
+    
+    /* The existing copy is opened read-write so it can be patched in place */
+    uint64_t basis_size = 0;
+    int basis_fd = open(final_path, O_RDWR | O_CLOEXEC);
+    struct stat basis_stat;
+    if (basis_fd >= 0 && (fstat(basis_fd, &basis_stat) < 0 || !S_ISREG(basis_stat.st_mode))) {
+        close(basis_fd);
+        basis_fd = -1;
+    }
+    if (basis_fd >= 0) {
+        basis_size = (uint64_t)basis_stat.st_size;
+    }
+    printf("Delta upload of %s (%llu bytes) against %llu bytes on disk\n", filename,
+           (unsigned long long)header->total_size, (unsigned long long)basis_size);
+    
+    delta_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    uint32_t flags = 0;
+    int status = delta_send_signatures(client_socket, basis_fd, basis_size);
+    if (status == SUCCESS) {
+        status = delta_recv_flags(client_socket, &flags);
+    }
+    
+    int in_place = (basis_fd >= 0 && (flags & DELTA_FLAG_INPLACE));
+    int output_fd = basis_fd;
+    if (status == SUCCESS && !in_place) {
+        output_fd = open(staging_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (output_fd < 0) {
+            perror("Failed to create delta staging file");
+            status = ERROR_FILE_IO;
+        }
+    }
+    if (status == SUCCESS) {
+        status = delta_apply(client_socket, basis_fd, basis_size, output_fd, header->total_size, &stats);
+    }
+    if (status == SUCCESS && in_place && ftruncate(output_fd, (off_t)header->total_size) < 0) {
+        perror("Failed to truncate patched file");
+        status = ERROR_FILE_IO;
+    }
+    if (output_fd >= 0 && output_fd != basis_fd && close(output_fd) < 0 && status == SUCCESS) {
+        perror("Failed to flush delta staging file");
+        status = ERROR_FILE_IO;
+    }
+    if (status == SUCCESS && !in_place && rename(staging_path, final_path) < 0) {
+        perror("Failed to publish delta result");
+        status = ERROR_FILE_IO;
+    }
+    if (basis_fd >= 0) {
+        close(basis_fd);
+    }
+    
+    /* Like a plain upload, a failed transfer leaves no half-written file behind */
+    if (status != SUCCESS) {
+        printf("Error receiving delta for %s\n", filename);
+        log_message(LOG_ERROR, "Delta upload of %s from %s:%d failed", filename, client_ip, client_port);
+        if (!in_place) {
+            unlink(staging_path);
+        } else if (stats.written_bytes > 0) {
+            unlink(final_path);
+        }
+        log_transfer(client_ip, client_port, filename, (size_t)header->total_size, "FAILED");
+        metrics_add(METRIC_FILES_FAILED, 1);
+        return;
+    }
+    
+    log_message(LOG_INFO, "Delta upload of %s from %s:%d: %llu literal bytes, %llu reused, "
+                "%llu written %s", filename, client_ip, client_port,
+                (unsigned long long)stats.literal_bytes, (unsigned long long)stats.copied_bytes,
+                (unsigned long long)stats.written_bytes, in_place ? "in place" : "to a new copy");
+    printf("File saved successfully: %s\n", final_path);
+    log_transfer(client_ip, client_port, filename, (size_t)header->total_size, "SUCCESS");
+    metrics_add(METRIC_FILES_STORED, 1);
+    
+    const char *ack = ACK_FILE_COMPLETE;
+    send(client_socket, ack, strlen(ack), MSG_NOSIGNAL);
+}
+
+/* Mark chunks the store already has, and repeats of a chunk earlier in the same list */
+static uint64_t mark_present_chunks(const chunk_ref_t *chunks, uint64_t count, unsigned char *bitmap) {
+    size_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity <<= 1;
+    }
+    uint64_t *seen = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    if (seen) {
+        memset(seen, 0xff, capacity * sizeof(uint64_t));
+    }
+    
+    uint64_t present = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        int found = chunk_store_contains(chunk_store, chunks[i].digest);
+        if (!found && seen) {
+            uint64_t key;
+            memcpy(&key, chunks[i].digest, sizeof(key));
+            size_t slot = (size_t)key & (capacity - 1);
+            for (; seen[slot] != UINT64_MAX; slot = (slot + 1) & (capacity - 1)) {
+                if (memcmp(chunks[seen[slot]].digest, chunks[i].digest, CHUNK_DIGEST_SIZE) == 0) {
+                    found = 1;
+                    break;
+                }
+            }
+            if (!found) {
+                seen[slot] = i;
+            }
+        }
+        if (found) {
+            bitmap[i / 8] |= (unsigned char)(1u << (i % 8));
+            present++;
+        }
+    }
+    free(seen);
+    return present;
+}
+
+/* Store a file as content-defined chunks, receiving only those the chunk store lacks */
+static void serve_cas_request(int client_socket, const request_header_t *header,
+                              const char *filename, const char *client_ip, int client_port) {
+    if (!chunk_store) {
+        log_message(LOG_ERROR, "Chunk store upload of %s from %s:%d refused: server not started with -s cas",
+                    filename, client_ip, client_port);
+        return;
+    }
+    
+    /* The list must tile the file with chunks the chunker could have produced */
+    chunk_ref_t *chunks = NULL;
+    uint64_t count = 0;
+    int status = recv_chunk_list(client_socket, &chunks, &count, header->total_size / CDC_MIN_CHUNK_SIZE + 1);
+    uint64_t listed = 0;
+    for (uint64_t i = 0; status == SUCCESS && i < count; i++) {
+        if (chunks[i].length == 0 || chunks[i].length > CDC_MAX_CHUNK_SIZE) {
+            status = ERROR_NETWORK;
+        }
+        listed += chunks[i].length;
+    }
+    if (status != SUCCESS || listed != header->total_size) {
+        log_message(LOG_ERROR, "Invalid chunk list for %s from %s:%d", filename, client_ip, client_port);
+        free(chunks);
+        return;
+    }
+    
+    unsigned char *bitmap = (unsigned char *)calloc((size_t)((count + 7) / 8) + 1, 1);
+    unsigned char *buffer = (unsigned char *)buffer_pool_alloc(CDC_MAX_CHUNK_SIZE);
+    if (!bitmap || !buffer) {
+        perror("Failed to allocate chunk buffers");
+        free(chunks);
+        free(bitmap);
+        buffer_pool_free(buffer, CDC_MAX_CHUNK_SIZE);
+        return;
+    }
+    uint64_t present = mark_present_chunks(chunks, count, bitmap);
+    status = send_chunk_map(client_socket, CDC_MAX_CHUNK_SIZE, count, bitmap);
+    printf("Chunk store upload of %s: %llu of %llu chunks already stored\n", filename,
+           (unsigned long long)present, (unsigned long long)count);
+    
+    /* Missing chunks arrive in list order; each must hash to its listed digest */
+    uint64_t received = 0;
+    for (uint64_t i = 0; status == SUCCESS && i < count; i++) {
+        if (bitmap[i / 8] & (1u << (i % 8))) {
+            continue;
+        }
+        if (metered_recv_all(client_socket, buffer, chunks[i].length) != SUCCESS) {
+            status = ERROR_NETWORK;
+            break;
+        }
+        decrypt_buffer(buffer, chunks[i].length, ENCRYPTION_KEY);
+        unsigned char digest[SHA256_DIGEST_SIZE];
+        sha256(buffer, chunks[i].length, digest);
+        if (memcmp(digest, chunks[i].digest, CHUNK_DIGEST_SIZE) != 0) {
+            log_message(LOG_ERROR, "Chunk %llu of %s from %s:%d does not match its digest",
+                        (unsigned long long)i, filename, client_ip, client_port);
+            status = ERROR_FILE_IO;
+            break;
+        }
+        status = chunk_store_put(chunk_store, chunks[i].digest, buffer, chunks[i].length);
+        received += chunks[i].length;
+    }
+    if (status == SUCCESS) {
+        status = chunk_store_commit_file(chunk_store, filename, header->total_size, chunks, count);
+    }
+    free(chunks);
+    free(bitmap);
+    buffer_pool_free(buffer, CDC_MAX_CHUNK_SIZE);
+    
+    if (status != SUCCESS) {
+        printf("Error receiving chunks of %s\n", filename);
+        log_message(LOG_ERROR, "Chunk store upload of %s from %s:%d failed after %llu bytes", filename,
+                    client_ip, client_port, (unsigned long long)received);
+        log_transfer(client_ip, client_port, filename, (size_t)header->total_size, "FAILED");
+        metrics_add(METRIC_FILES_FAILED, 1);
+        return;
+    }
+    
+    log_message(LOG_INFO, "Chunk store upload of %s from %s:%d: %llu of %llu chunks new, "
+                "%llu bytes received, %llu deduplicated", filename, client_ip, client_port,
+                (unsigned long long)(count - present), (unsigned long long)count,
+                (unsigned long long)received, (unsigned long long)(header->total_size - received));
+    printf("File stored: %s/%s/%s\n", CHUNK_STORE_DIR, CHUNK_FILES_DIR, filename);
+    log_transfer(client_ip, client_port, filename, (size_t)header->total_size, "SUCCESS");
+    metrics_add(METRIC_FILES_STORED, 1);
+    
+    const char *ack = ACK_FILE_COMPLETE;
+    send(client_socket, ack, strlen(ack), MSG_NOSIGNAL);
+}
+
+/* Per-upload frame counters for the transfer log */
+typedef struct {
+    uint64_t frames;
+    uint64_t compressed_frames;
+    uint64_t wire_bytes;
+    double best_ratio;
+    double worst_ratio;
+    unsigned long long compress_usec;    // Reported by the client per frame
+    unsigned long long decompress_nsec;
+} frame_stats_t;
+
+/* Receive total_size bytes as frames, decrypting and decompressing each into fd */
+static int receive_frames(int client_socket, int fd, uint64_t total_size, uint32_t codec,
+                          uint64_t *received, frame_stats_t *stats) {
+    size_t packed_size = lz_compress_bound(STREAM_CHUNK_SIZE);
+    unsigned char *packed = (unsigned char *)buffer_pool_alloc(packed_size);
+    unsigned char *raw = (unsigned char *)buffer_pool_alloc(STREAM_CHUNK_SIZE);
+    if (!packed || !raw) {
+        perror("Failed to allocate frame buffers");
+        buffer_pool_free(packed, packed_size);
+        buffer_pool_free(raw, STREAM_CHUNK_SIZE);
+        return ERROR_MEMORY;
+    }
+    
+    int status = SUCCESS;
+    *received = 0;
+    while (*received < total_size) {
+        unsigned char encoded[FRAME_HEADER_SIZE];
+        frame_header_t frame;
+        if (metered_recv_all(client_socket, encoded, sizeof(encoded)) != SUCCESS) {
+            status = ERROR_NETWORK;
+            break;
+        }
+        decode_frame_header(encoded, &frame);
+        if (frame.raw_length == 0 || frame.raw_length > STREAM_CHUNK_SIZE ||
+            frame.raw_length > total_size - *received ||
+            (frame.compressed ? (codec == CODEC_NONE || frame.stored_length > lz_compress_bound(frame.raw_length))
+                              : frame.stored_length != frame.raw_length)) {
+            log_message(LOG_ERROR, "Malformed frame at byte %llu", (unsigned long long)*received);
+            status = ERROR_NETWORK;
+            break;
+        }
+        if (metered_recv_all(client_socket, packed, frame.stored_length) != SUCCESS) {
+            status = ERROR_NETWORK;
+            break;
+        }
+    
+        /* Compression runs before the cipher, so decrypt first */
+        decrypt_buffer(packed, frame.stored_length, ENCRYPTION_KEY);
+        const unsigned char *data = packed;
+        if (frame.compressed) {
+            unsigned long long started = thread_cpu_time_ns();
+            if (lz_decompress(packed, frame.stored_length, raw, frame.raw_length) != SUCCESS) {
+                log_message(LOG_ERROR, "Corrupt compressed frame at byte %llu", (unsigned long long)*received);
+                status = ERROR_NETWORK;
+                break;
+            }
+            stats->decompress_nsec += thread_cpu_time_ns() - started;
+            stats->compressed_frames++;
+            data = raw;
+        }
+        if (metered_pwrite(fd, data, frame.raw_length, (off_t)*received) != (ssize_t)frame.raw_length) {
+            perror("Failed to write file data");
+            status = ERROR_FILE_IO;
+            break;
+        }
+    
+        double ratio = (double)frame.raw_length / frame.stored_length;
+        if (stats->frames == 0 || ratio > stats->best_ratio) {
+            stats->best_ratio = ratio;
+        }
+        if (stats->frames == 0 || ratio < stats->worst_ratio) {
+            stats->worst_ratio = ratio;
+        }
+        stats->frames++;
+        stats->wire_bytes += FRAME_HEADER_SIZE + frame.stored_length;
+        stats->compress_usec += frame.cpu_usec;
+        *received += frame.raw_length;
+    }
+    
+    buffer_pool_free(packed, packed_size);
+    buffer_pool_free(raw, STREAM_CHUNK_SIZE);
+    return status;
+}
+
+/* Receive a whole file as frames, compressed with the codec agreed in the reply */
+static void serve_upload_request(int client_socket, const request_header_t *header,
+                                 const char *filename, const char *client_ip, int client_port) {
+    uint32_t codec = (header->flags & CODEC_MASK(CODEC_LZ)) ? CODEC_LZ : CODEC_NONE;
+    unsigned char reply[CODEC_REPLY_SIZE];
+    put_le32(reply, codec);
+    if (send_all(client_socket, reply, sizeof(reply)) != SUCCESS) {
+        return;
+    }
+    printf("Receiving %s (%llu bytes, codec %s)\n", filename, (unsigned long long)header->total_size,
+           codec_name(codec));
+    
+    char output_path[MAX_PATH_LEN];
+    snprintf(output_path, sizeof(output_path), "%s/%s", RECEIVED_FILES_DIR, filename);
+    int output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (output_fd < 0) {
+        perror("Failed to create output file");
+        log_message(LOG_ERROR, "Failed to create output file: %s", output_path);
+        return;
+    }
+    
+    frame_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    uint64_t received = 0;
+    int status = receive_frames(client_socket, output_fd, header->total_size, codec, &received, &stats);
+    if (close(output_fd) < 0 && status == SUCCESS) {
+        perror("Failed to flush output file");
+        status = ERROR_FILE_IO;
+    }
+    if (status != SUCCESS) {
+        printf("Error receiving file data\n");
+        log_message(LOG_ERROR, "Transfer of %s from %s:%d failed after %llu of %llu bytes", filename,
+                    client_ip, client_port, (unsigned long long)received,
+                    (unsigned long long)header->total_size);
+        unlink(output_path);
+        log_transfer(client_ip, client_port, filename, (size_t)header->total_size, "FAILED");
+        metrics_add(METRIC_FILES_FAILED, 1);
+        return;
+    }
+    
+    log_message(LOG_INFO, "Upload of %s from %s:%d: codec %s, %llu of %llu chunks compressed, "
+                "%llu wire bytes for %llu (%.2fx; per chunk best %.2fx, worst %.2fx), "
+                "CPU %.1f ms compress (client), %.1f ms decompress", filename, client_ip, client_port,
+                codec_name(codec), (unsigned long long)stats.compressed_frames,
+                (unsigned long long)stats.frames, (unsigned long long)stats.wire_bytes,
+                (unsigned long long)received, stats.wire_bytes ? (double)received / stats.wire_bytes : 1.0,
+                stats.best_ratio, stats.worst_ratio, stats.compress_usec / 1000.0,
+                stats.decompress_nsec / 1000000.0);
+    printf("File saved successfully: %s\n", output_path);
+    log_transfer(client_ip, client_port, filename, (size_t)header->total_size, "SUCCESS");
+    metrics_add(METRIC_FILES_STORED, 1);
+    
+    const char *ack = ACK_FILE_COMPLETE;
+    send(client_socket, ack, strlen(ack), MSG_NOSIGNAL);
+}
+
+/* Buffered reader so small files do not cost a recv() per record field */
+typedef struct {
+    int sock;
+    unsigned char *buffer;
+    size_t capacity;
+    size_t pos;
+    size_t len;
+} session_reader_t;
+
+/* Make at least one unread byte available */
+static int session_fill(session_reader_t *reader) {
+    if (reader->pos < reader->len) {
+        return SUCCESS;
+    }
+    for (;;) {
+        ssize_t received = metered_recv(reader->sock, reader->buffer, reader->capacity);
+        if (received > 0) {
+            reader->pos = 0;
+            reader->len = (size_t)received;
+            return SUCCESS;
+        }
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        return ERROR_NETWORK;
+    }
+}
+
+static int session_read(session_reader_t *reader, void *data, size_t size) {
+    unsigned char *out = (unsigned char *)data;
+    while (size > 0) {
+        if (session_fill(reader) != SUCCESS) {
+            return ERROR_NETWORK;
+        }
+        size_t take = reader->len - reader->pos;
+        if (take > size) {
+            take = size;
+        }
+        memcpy(out, reader->buffer + reader->pos, take);
+        reader->pos += take;
+        out += take;
+        size -= take;
+    }
+    return SUCCESS;
+}
+
+/* Create the directories leading to path (relative to base); last_dir caches the previous one */
+static int make_parent_dirs(char *path, size_t base_len, char *last_dir, size_t last_dir_size) {
+    char *slash = strrchr(path + base_len, '/');
+    if (!slash) {
+        return SUCCESS;
+    }
+    *slash = '\0';
+    if (strcmp(path, last_dir) == 0) {
+        *slash = '/';
+        return SUCCESS;
+    }
+    
+    int status = SUCCESS;
+    for (char *next = path + base_len; next && status == SUCCESS;) {
+        next = strchr(next, '/');
+        if (next) {
+            *next = '\0';
+        }
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            status = ERROR_FILE_IO;
+        }
+        if (next) {
+            *next++ = '/';
+        }
+    }
+    if (status == SUCCESS) {
+        snprintf(last_dir, last_dir_size, "%s", path);
+    }
+    *slash = '/';
+    return status;
+}
+
+/* Decrypt and write the next size bytes of the stream; fd < 0 discards them */
+static int session_receive_file(session_reader_t *reader, int fd, uint64_t size) {
+    int status = SUCCESS;
+    uint64_t offset = 0;
+    while (offset < size) {
+        if (session_fill(reader) != SUCCESS) {
+            return ERROR_NETWORK;
+        }
+        size_t take = reader->len - reader->pos;
+        if (take > size - offset) {
+            take = (size_t)(size - offset);
+        }
+        unsigned char *data = reader->buffer + reader->pos;
+        if (fd >= 0 && status == SUCCESS) {
+            decrypt_buffer(data, take, ENCRYPTION_KEY);
+            if (metered_pwrite(fd, data, take, (off_t)offset) != (ssize_t)take) {
+                status = ERROR_FILE_IO;
+            }
+        }
+        reader->pos += take;
+        offset += take;
+    }
+    return status;
+}
+
+/* Receive a stream of files under RECEIVED_FILES_DIR/<root> or the pack store, acknowledging in batches */
+static void serve_session_request(int client_socket, const request_header_t *header,
+                                  const char *root, const char *client_ip, int client_port) {
+    printf("Session for %s/: %llu files, %llu bytes\n", root, (unsigned long long)header->length,
+           (unsigned long long)header->total_size);
+    
+    char *path = (char *)malloc(PATH_MAX);
+    char *last_dir = (char *)malloc(PATH_MAX);
+    session_reader_t reader = { client_socket, (unsigned char *)buffer_pool_alloc(stream_chunk_size),
+                                stream_chunk_size, 0, 0 };
+    unsigned char *pack_buffer = pack_store ? (unsigned char *)buffer_pool_alloc(PACK_MAX_OBJECT_SIZE) : NULL;
+    if (!path || !last_dir || !reader.buffer || (pack_store && !pack_buffer)) {
+        perror("Failed to allocate session buffers");
+        free(path);
+        free(last_dir);
+        buffer_pool_free(reader.buffer, reader.capacity);
+        buffer_pool_free(pack_buffer, PACK_MAX_OBJECT_SIZE);
+        return;
+    }
+    int base_len = snprintf(path, PATH_MAX, "%s/%s/", RECEIVED_FILES_DIR, root);
+    path[base_len - 1] = '\0';
+    int status = (mkdir(path, 0755) < 0 && errno != EEXIST) ? ERROR_FILE_IO : SUCCESS;
+    path[base_len - 1] = '/';
+    last_dir[0] = '\0';
+    if (status != SUCCESS) {
+        perror("Failed to create session directory");
+        log_message(LOG_ERROR, "Failed to create session directory %s/%s", RECEIVED_FILES_DIR, root);
+    }
+    
+    uint32_t files = 0;
+    uint32_t stored = 0;
+    uint32_t failed = 0;
+    uint64_t stored_bytes = 0;
+    uint32_t unacked_files = 0;
+    uint64_t unacked_bytes = 0;
+    unsigned char ack[SESSION_ACK_SIZE];
+    while (status == SUCCESS) {
+        unsigned char record[SESSION_RECORD_HEADER_SIZE];
+        if (session_read(&reader, record, sizeof(record)) != SUCCESS) {
+            status = ERROR_NETWORK;
+            break;
+        }
+        uint16_t path_len = get_le16(record);
+        uint64_t size = get_le64(record + 4);
+        if (path_len == 0) {
+            break;
+        }
+        char *relative = path + base_len;
+        if (path_len > SESSION_MAX_PATH_LEN || (size_t)base_len + path_len >= PATH_MAX ||
+            session_read(&reader, relative, path_len) != SUCCESS) {
+            status = ERROR_NETWORK;
+            break;
+        }
+        relative[path_len] = '\0';
+        if (strlen(relative) != path_len || !is_safe_relative_path(relative)) {
+            log_message(LOG_ERROR, "Unsafe path in session from %s:%d", client_ip, client_port);
+            status = ERROR_NETWORK;
+            break;
+        }
+    
+        /* A file that cannot be stored is drained and reported; the session goes on */
+        const char *stored_name = path + strlen(RECEIVED_FILES_DIR) + 1;
+        int output_fd = -1;
+        int file_status = SUCCESS;
+        int received;
+        if (pack_buffer && size <= PACK_MAX_OBJECT_SIZE) {
+            received = session_read(&reader, pack_buffer, (size_t)size);
+            if (received == SUCCESS) {
+                decrypt_buffer(pack_buffer, (size_t)size, ENCRYPTION_KEY);
+                file_status = pack_store_put(pack_store, stored_name, pack_buffer, (uint32_t)size, 0);
+                errno = (file_status == SUCCESS) ? 0 : EIO;
+            }
+        } else {
+            if (make_parent_dirs(path, (size_t)base_len, last_dir, PATH_MAX) == SUCCESS) {
+                output_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            }
+            file_status = (output_fd < 0) ? ERROR_FILE_IO : SUCCESS;
+            received = session_receive_file(&reader, output_fd, size);
+        }
+        if (received == ERROR_NETWORK) {
+            status = ERROR_NETWORK;
+        } else if (received != SUCCESS) {
+            file_status = received;
+        }
+        if (output_fd >= 0 && close(output_fd) < 0) {
+            file_status = ERROR_FILE_IO;
+        }
+        int file_errno = errno;
+    
+        if (status != SUCCESS || file_status != SUCCESS) {
+            if (output_fd >= 0) {
+                unlink(path);
+            }
+            log_transfer(client_ip, client_port, stored_name, (size_t)size, "FAILED");
+            metrics_add(METRIC_FILES_FAILED, 1);
+            if (status != SUCCESS) {
+                break;
+            }
+            log_message(LOG_ERROR, "Failed to store %s from %s:%d: %s", path, client_ip, client_port,
+                        strerror(file_errno));
+            failed++;
+            encode_session_ack(SESSION_ACK_FAILED, files, 0, ack);
+            status = send_all(client_socket, ack, sizeof(ack));
+        } else {
+            if (output_fd < 0) {
+                unlink(path);  // Packed: drop a plain file the object would be shadowed by
+            } else if (pack_store) {
+                pack_store_remove(pack_store, stored_name);
+            }
+            log_transfer(client_ip, client_port, stored_name, (size_t)size, "SUCCESS");
+            metrics_add(METRIC_FILES_STORED, 1);
+            stored++;
+            stored_bytes += size;
+            unacked_files++;
+            unacked_bytes += size;
+        }
+        files++;
+    
+        if (status == SUCCESS && (unacked_files >= SESSION_ACK_FILES || unacked_bytes >= SESSION_ACK_BYTES)) {
+            encode_session_ack(SESSION_ACK_BATCH, stored, stored_bytes, ack);
+            status = send_all(client_socket, ack, sizeof(ack));
+            unacked_files = 0;
+            unacked_bytes = 0;
+        }
+    }
+    free(path);
+    free(last_dir);
+    buffer_pool_free(reader.buffer, reader.capacity);
+    buffer_pool_free(pack_buffer, PACK_MAX_OBJECT_SIZE);
+    
+    if (status != SUCCESS) {
+        printf("Session for %s/ failed after %u files\n", root, files);
+        log_message(LOG_ERROR, "Session %s/ from %s:%d failed after %u files (%u stored, %u failed)",
+                    root, client_ip, client_port, files, stored, failed);
+        return;
+    }
+    encode_session_ack(SESSION_ACK_DONE, stored, stored_bytes, ack);
+    send_all(client_socket, ack, sizeof(ack));
+    printf("Session for %s/ complete: %u files stored, %u failed\n", root, stored, failed);
+    log_message(LOG_INFO, "Session %s/ from %s:%d: %u files, %llu bytes stored, %u failed", root,
+                client_ip, client_port, stored, (unsigned long long)stored_bytes, failed);
+}
+
+/* Receive the checksum trailer of an upload and compare it as it arrives */
+static int receive_checksum_trailer(int client_socket, checksum_state_t *checksum) {
+    unsigned char trailer[4096];
+    while (checksum_trailer_remaining(checksum) > 0) {
+        size_t want = sizeof(trailer);
+        if (checksum_trailer_remaining(checksum) < want) {
+            want = checksum_trailer_remaining(checksum);
+        }
+        if (metered_recv_all(client_socket, trailer, want) != SUCCESS) {
+            return ERROR_NETWORK;
+        }
+        checksum_consume_trailer(checksum, trailer, want);
+    }
+    return checksum_verify(checksum);
+}
+
+/* Receive a small upload whole, decrypt and verify it, and append it to the pack store */
+static int receive_packed(int client_socket, const char *filename, uint64_t file_size, uint32_t features,
+                          checksum_state_t *checksum, const unsigned char *prefix, size_t prefix_len,
+                          uint64_t *total_received) {
+    unsigned char *data = (unsigned char *)buffer_pool_alloc(PACK_MAX_OBJECT_SIZE);
+    if (!data) {
+        perror("Failed to allocate receive buffer");
+        return ERROR_MEMORY;
+    }
+    memcpy(data, prefix, prefix_len);
+    int status = metered_recv_all(client_socket, data + prefix_len, (size_t)file_size - prefix_len);
+    *total_received = (status == SUCCESS) ? file_size : prefix_len;
+    if (status == SUCCESS) {
+        if (checksum) {
+            checksum_decrypt(checksum, data, (size_t)file_size);
+            status = receive_checksum_trailer(client_socket, checksum);
+        } else {
+            decrypt_buffer(data, (size_t)file_size, ENCRYPTION_KEY);
+        }
+    }
+    if (status == SUCCESS) {
+        status = pack_store_put(pack_store, filename, data, (uint32_t)file_size,
+                                (features & PUT_FEATURE_SYNC) != 0);
+    }
+    buffer_pool_free(data, PACK_MAX_OBJECT_SIZE);
+    return status;
+}
+
+/*
+ * Store a whole-file upload and acknowledge it. prefix holds payload bytes
+ * that arrived together with the header. With checksum set, the payload is
+ * followed by a checksum trailer and is only kept if the trailer matches.
+ * With a pack store, uploads up to PACK_MAX_OBJECT_SIZE go into it instead
+ * of a file of their own.
+ */
+static void receive_upload(int client_socket, const char *filename, uint64_t file_size, uint32_t features,
+                           checksum_state_t *checksum, unsigned char *prefix, size_t prefix_len,
+                           const char *client_ip, int client_port) {
+    char output_path[MAX_PATH_LEN];
+    snprintf(output_path, sizeof(output_path), "%s/%s", RECEIVED_FILES_DIR, filename);
+    int status = SUCCESS;
+    uint64_t total_received = 0;
+    if (prefix_len > file_size) {
+        prefix_len = (size_t)file_size;
+    }
+    int packed = pack_store && file_size <= PACK_MAX_OBJECT_SIZE;
+    if (packed) {
+        status = receive_packed(client_socket, filename, file_size, features, checksum, prefix, prefix_len,
+                                &total_received);
+    } else {
+        /* Open output file before any payload arrives so chunks can be written as they land */
+        int output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (output_fd < 0) {
+            perror("Failed to create output file");
+            log_message(LOG_ERROR, "Failed to create output file: %s", output_path);
+            return;
+        }
+    
+        /* Receive, decrypt and write the payload one chunk at a time */
+        if (prefix_len > 0) {
+            if (checksum) {
+                checksum_decrypt(checksum, prefix, prefix_len);
+            } else {
+                decrypt_buffer(prefix, prefix_len, ENCRYPTION_KEY);
+            }
+            if (metered_pwrite(output_fd, prefix, prefix_len, 0) != (ssize_t)prefix_len) {
+                perror("Failed to write file data");
+                status = ERROR_FILE_IO;
+            }
+        }
+        if (status == SUCCESS) {
+            status = receive_payload(client_socket, output_fd, prefix_len, file_size - prefix_len, checksum,
+                                     &total_received);
+            total_received += prefix_len;
+        }
+        if (status == SUCCESS && checksum) {
+            status = receive_checksum_trailer(client_socket, checksum);
+        }
+        if (status == SUCCESS && (features & PUT_FEATURE_SYNC) && fsync(output_fd) < 0) {
+            perror("Failed to sync output file");
+            status = ERROR_FILE_IO;
+        }
+        if (close(output_fd) < 0 && status == SUCCESS) {
+            perror("Failed to flush output file");
+            status = ERROR_FILE_IO;
+        }
+    }
+    
+    /* Do not leave a truncated or corrupted file behind on a failed transfer */
+    if (status == ERROR_CHECKSUM) {
+        printf("Checksum mismatch, discarding %s\n", filename);
+        log_message(LOG_ERROR, "Checksum mismatch for %s from %s:%d at trailer entry %llu of %llu",
+                    filename, client_ip, client_port, (unsigned long long)checksum->bad_entry,
+                    (unsigned long long)checksum->chunk_count + 1);
+        metrics_add(METRIC_CHECKSUM_FAILURES, 1);
+    } else if (status != SUCCESS) {
+        printf("Error receiving file data\n");
+        log_message(LOG_ERROR, "Transfer of %s from %s:%d failed after %llu of %llu bytes",
+                    filename, client_ip, client_port, (unsigned long long)total_received,
+                    (unsigned long long)file_size);
+    }
+    if (status != SUCCESS) {
+        if (!packed) {
+            unlink(output_path);
+        }
+        log_transfer(client_ip, client_port, filename, (size_t)file_size, "FAILED");
+        metrics_add(METRIC_FILES_FAILED, 1);
+        if (status == ERROR_CHECKSUM) {
+            send(client_socket, ACK_CHECKSUM_MISMATCH, strlen(ACK_CHECKSUM_MISMATCH), MSG_NOSIGNAL);
+        }
+        return;
+    }
+    
+    /* A plain file shadows a packed object of the same name, so only one of them is kept */
+    if (packed) {
+        unlink(output_path);
+    } else if (pack_store) {
+        pack_store_remove(pack_store, filename);
+    }
+    printf("Received %llu bytes of encrypted data\n", (unsigned long long)total_received);
+    
+    printf("File saved successfully: %s\n", packed ? filename : output_path);
+    log_transfer(client_ip, client_port, filename, (size_t)file_size, "SUCCESS");
+    metrics_add(METRIC_FILES_STORED, 1);
+    
+    /* Send acknowledgment */
+    const char *ack = ACK_FILE_COMPLETE;
+    send(client_socket, ack, strlen(ack), MSG_NOSIGNAL);
+}
+
+/* Whole-file upload with the versioned header; the feature reply goes out before the payload */
+static void serve_put_request(int client_socket, const request_header_t *header, const char *filename,
+                              const char *client_ip, int client_port) {
+    uint32_t features = header->flags & PUT_FEATURES_SUPPORTED;
+    checksum_state_t checksum;
+    if (checksum_init(&checksum, (features & PUT_FEATURE_CHECKSUM) ? header->length : 0) != SUCCESS) {
+        features &= ~(uint32_t)PUT_FEATURE_CHECKSUM;  // No room for the chunk CRCs: take the file unverified
+    }
+    unsigned char reply[PUT_REPLY_SIZE];
+    put_le32(reply, features);
+    if (send_all(client_socket, reply, sizeof(reply)) != SUCCESS) {
+        log_message(LOG_ERROR, "Failed to answer upload request from %s:%d", client_ip, client_port);
+        checksum_free(&checksum);
+        return;
+    }
+    
+    printf("Receiving file: %s\n", filename);
+    printf("File size: %llu bytes\n", (unsigned long long)header->length);
+    receive_upload(client_socket, filename, header->length, features,
+                   (features & PUT_FEATURE_CHECKSUM) ? &checksum : NULL, NULL, 0, client_ip, client_port);
+    checksum_free(&checksum);
+}
+
+/* Send encrypted bytes [offset, offset + length) of an open file, chunk by chunk through the cache */
+static int send_file_range(int client_socket, int fd, const struct stat *file_stat, uint64_t offset,
+                           uint64_t length) {
+    unsigned char *private_chunk = NULL;  // For chunks the cache cannot take
+    int status = SUCCESS;
+    uint64_t end = offset + length;
+    uint64_t pos = offset;
+    while (status == SUCCESS && pos < end) {
+        uint64_t index = pos / DOWNLOAD_CHUNK_SIZE;
+        download_chunk_t chunk = { NULL, 0, -1 };
+        status = download_cache ? download_cache_acquire(download_cache, fd, file_stat, index, &chunk)
+                                : ERROR_BUSY;
+        if (status == ERROR_BUSY) {
+            if (!private_chunk) {
+                private_chunk = (unsigned char *)buffer_pool_alloc(DOWNLOAD_CHUNK_SIZE);
+            }
+            ssize_t chunk_length = private_chunk ? read_encrypted_chunk(fd, (uint64_t)file_stat->st_size, index,
+                                                                        private_chunk) : ERROR_MEMORY;
+            status = (chunk_length < 0) ? (int)chunk_length : SUCCESS;
+            chunk.data = private_chunk;
+            chunk.length = (chunk_length < 0) ? 0 : (size_t)chunk_length;
+        }
+        if (status != SUCCESS) {
+            break;
+        }
+    
+        /* Cached chunks are sent straight from the cache; nothing is encrypted per reader */
+        size_t start = (size_t)(pos - index * DOWNLOAD_CHUNK_SIZE);
+        size_t count = chunk.length - start;
+        if (end - pos < count) {
+            count = (size_t)(end - pos);
+        }
+        if (send_all(client_socket, chunk.data + start, count) != SUCCESS) {
+            status = ERROR_NETWORK;
+        } else {
+            metrics_add(METRIC_BYTES_SENT, (int64_t)count);
+            pos += count;
+        }
+        if (chunk.slot >= 0) {
+            download_cache_release(download_cache, &chunk);
+        }
+    }
+    buffer_pool_free(private_chunk, DOWNLOAD_CHUNK_SIZE);
+    return status;
+}
 
-/* Signal handler for graceful shutdown */
-void signal_handler(int sig) {
-    printf("\nReceived signal %d. Shutting down gracefully...\n", sig);
-    running = 0;
-    if (server_socket >= 0) {
-        close(server_socket);
+/* Download: reply with the status and sizes, then stream the requested range */
+static void serve_get_request(int client_socket, const request_header_t *header, const char *filename,
+                              const char *client_ip, int client_port) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", RECEIVED_FILES_DIR, filename);
+    struct stat file_stat;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int status = SUCCESS;
+    
+    /* Names without a plain file may be packed; the object is small enough to encrypt in one go */
+    unsigned char *packed = NULL;
+    uint32_t packed_length = 0;
+    if (fd < 0 && pack_store && pack_store_get(pack_store, filename, &packed, &packed_length) == SUCCESS) {
+        memset(&file_stat, 0, sizeof(file_stat));
+        file_stat.st_mode = S_IFREG;
+        file_stat.st_size = (off_t)packed_length;
+    } else if (fd < 0 || fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+        status = ERROR_FILE_IO;
     }
-    close_logger();
-    exit(EXIT_SUCCESS);
+    if (status == SUCCESS && header->offset > (uint64_t)file_stat.st_size) {
+        status = ERROR_FILE_IO;
+    }
+    uint64_t file_size = (status == SUCCESS) ? (uint64_t)file_stat.st_size : 0;
+    uint64_t length = file_size - ((status == SUCCESS) ? header->offset : 0);
+    if (header->length != 0 && header->length < length) {
+        length = header->length;
+    }
+    
+    unsigned char reply[GET_REPLY_SIZE];
+    put_le32(reply, (uint32_t)status);
+    put_le64(reply + 4, file_size);
+    put_le64(reply + 12, (status == SUCCESS) ? length : 0);
+    if (status != SUCCESS) {
+        printf("Download of %s refused: not a stored file\n", filename);
+        log_message(LOG_ERROR, "Download of %s from %s:%d refused: not a stored file", filename, client_ip,
+                    client_port);
+        send_all(client_socket, reply, sizeof(reply));
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(packed);
+        return;
+    }
+    
+    printf("Sending file: %s (%llu bytes from offset %llu)\n", filename, (unsigned long long)length,
+           (unsigned long long)header->offset);
+    if (send_all(client_socket, reply, sizeof(reply)) != SUCCESS) {
+        status = ERROR_NETWORK;
+    } else if (packed) {
+        unsigned char *range = packed + header->offset;
+        encrypt_buffer(range, (size_t)length, ENCRYPTION_KEY);
+        status = send_all(client_socket, range, (size_t)length);
+        if (status == SUCCESS) {
+            metrics_add(METRIC_BYTES_SENT, (int64_t)length);
+        }
+    } else {
+        status = send_file_range(client_socket, fd, &file_stat, header->offset, length);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(packed);
+    if (status != SUCCESS) {
+        log_message(LOG_ERROR, "Download of %s to %s:%d failed", filename, client_ip, client_port);
+        log_transfer(client_ip, client_port, filename, (size_t)length, "SEND_FAILED");
+        return;
+    }
+    log_transfer(client_ip, client_port, filename, (size_t)length, "SENT");
+    metrics_add(METRIC_FILES_SERVED, 1);
 }
 
-/* Handle file transfer from client */
-void* handle_client(void *arg) {
-    client_info_t *client = (client_info_t *)arg;
+/* Dispatch a request that uses the extended framing; raw is its fixed header if already read */
+static void serve_extended_request(int client_socket, const unsigned char *raw, const char *client_ip,
+                                   int client_port) {
+    request_header_t header;
+    char filename[MAX_FILENAME_LEN];
+    int status = raw ? recv_request_name(client_socket, raw, &header, filename, sizeof(filename))
+                     : recv_request(client_socket, &header, filename, sizeof(filename));
+    if (status != SUCCESS) {
+        printf("Invalid request header from client\n");
+        log_message(LOG_ERROR, "Invalid request header from %s:%d", client_ip, client_port);
+        return;
+    }
+    
+    switch (header.opcode) {
+    case OP_RANGE:
+        serve_range_request(client_socket, &header, filename, client_ip, client_port);
+        break;
+    case OP_RESUME:
+        serve_resume_request(client_socket, &header, filename, client_ip, client_port);
+        break;
+    case OP_DELTA:
+        serve_delta_request(client_socket, &header, filename, client_ip, client_port);
+        break;
+    case OP_CAS:
+        serve_cas_request(client_socket, &header, filename, client_ip, client_port);
+        break;
+    case OP_UPLOAD:
+        serve_upload_request(client_socket, &header, filename, client_ip, client_port);
+        break;
+    case OP_SESSION:
+        serve_session_request(client_socket, &header, filename, client_ip, client_port);
+        break;
+    case OP_PUT:
+        serve_put_request(client_socket, &header, filename, client_ip, client_port);
+        break;
+    case OP_GET:
+        serve_get_request(client_socket, &header, filename, client_ip, client_port);
+        break;
+    default:
+        log_message(LOG_ERROR, "Unknown opcode %u from %s:%d", header.opcode, client_ip, client_port);
+        break;
+    }
+}
+
+/* Handle file transfer from client; always closes the client socket */
+static void serve_client(const client_info_t *client) {
     int client_socket = client->client_socket;
     char client_ip[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &(client->client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
@@ -34,122 +1378,612 @@ void* handle_client(void *arg) {
     printf("Client connected: %s:%d\n", client_ip, client_port);
     log_message(LOG_INFO, "Client connected: %s:%d", client_ip, client_port);
     
-    /* Receive filename - read byte by byte until null terminator */
-    char filename[MAX_FILENAME_LEN];
-    memset(filename, 0, sizeof(filename));
-    int filename_idx = 0;
-    char c;
+    /* Extended requests announce themselves with a magic number instead of a filename */
+    int extended = client->request_header ? 1 : peek_extended_request(client_socket);
+    if (extended != 0) {
+        if (extended > 0) {
+            serve_extended_request(client_socket, client->request_header, client_ip, client_port);
+        } else {
+            log_message(LOG_ERROR, "Failed to receive request from %s:%d", client_ip, client_port);
+        }
+        close(client_socket);
+        return;
+    }
     
-    while (filename_idx < MAX_FILENAME_LEN - 1) {
-        ssize_t bytes_received = recv(client_socket, &c, 1, 0);
-        if (bytes_received <= 0) {
-            printf("Failed to receive filename from client\n");
-            log_message(LOG_ERROR, "Failed to receive filename from %s:%d", client_ip, client_port);
-            close(client_socket);
-            free(client);
-            pthread_exit(NULL);
+    /* Legacy header: usually arrives whole, with the start of the payload, in one recv */
+    unsigned char head[MAX_FILENAME_LEN + sizeof(size_t)];
+    size_t head_filled = 0;
+    char filename[MAX_FILENAME_LEN];
+    uint64_t file_size = 0;
+    int header_len;
+    while ((header_len = parse_legacy_header(head, head_filled, filename, sizeof(filename), &file_size)) == 0) {
+        ssize_t bytes_received = metered_recv(client_socket, head + head_filled, sizeof(head) - head_filled);
+        if (bytes_received < 0 && errno == EINTR) {
+            continue;
         }
-        filename[filename_idx] = c;
-        if (c == '\0') {
+        if (bytes_received <= 0) {
             break;
         }
-        filename_idx++;
+        head_filled += (size_t)bytes_received;
+    }
+    if (header_len < 0) {
+        printf("Invalid file header from client\n");
+        log_message(LOG_ERROR, "Invalid file header from %s:%d", client_ip, client_port);
+        close(client_socket);
+        return;
+    }
+    if (header_len == 0) {
+        printf("Failed to receive file header from client\n");
+        log_message(LOG_ERROR, "Failed to receive file header from %s:%d", client_ip, client_port);
+        close(client_socket);
+        return;
     }
     
     printf("Receiving file: %s\n", filename);
+    printf("File size: %llu bytes\n", (unsigned long long)file_size);
+    receive_upload(client_socket, filename, file_size, 0, NULL, head + header_len,
+                   head_filled - (size_t)header_len, client_ip, client_port);
+    close(client_socket);
+    printf("Client %s:%d disconnected\n", client_ip, client_port);
+}
+
+/* Serve a claimed client as one scheduled transfer, record its metrics and release it */
+static void serve_connection(const client_info_t *client) {
+    bandwidth_flow_t flow;
+    if (bandwidth) {
+        bandwidth_begin(bandwidth, &client->client_addr, &flow);
+        current_flow = &flow;
+    }
+    metrics_add(METRIC_ACTIVE_CONNECTIONS, 1);
+    serve_client(client);
+    metrics_add(METRIC_ACTIVE_CONNECTIONS, -1);
+    if (current_flow) {
+        current_flow = NULL;
+        bandwidth_end(bandwidth, &flow);
+    }
+    metrics_observe(METRIC_REQUEST_TIME, metrics_now_ns() - client->accepted_ns);
+    release_connection();
+}
+
+/* A client for its own thread, with a copy of the extended header an event loop already read */
+typedef struct {
+    client_info_t info;  // First, so handle_client frees the whole block
+    unsigned char request_header[PROTOCOL_HEADER_SIZE];
+} client_thread_arg_t;
+
+/* Thread entry point for the thread-per-connection engine */
+void* handle_client(void *arg) {
+    client_info_t *client = (client_info_t *)arg;
+    serve_connection(client);
+    buffer_pool_free(client, sizeof(client_thread_arg_t));
+    return NULL;
+}
+
+/*
+ * Serve a client on its own detached thread. Used by the thread-per-connection
+ * engine and for requests the epoll and io_uring loops hand off; runs on the
+ * accepting thread, so the connection is counted before its handler exists.
+ */
+static void start_client_thread(const client_info_t *client) {
+    client_thread_arg_t *copy = (client_thread_arg_t *)buffer_pool_alloc(sizeof(client_thread_arg_t));
+    if (!copy) {
+        perror("Failed to allocate memory for client info");
+        close(client->client_socket);
+        return;
+    }
+    copy->info = *client;
+    if (client->request_header) {
+        /* The loop's buffer goes away with its connection state */
+        memcpy(copy->request_header, client->request_header, PROTOCOL_HEADER_SIZE);
+        copy->info.request_header = copy->request_header;
+    }
     
-    /* Receive file size - ensure we receive all bytes */
-    size_t file_size = 0;
-    size_t size_bytes_received = 0;
-    while (size_bytes_received < sizeof(file_size)) {
-        ssize_t bytes_received = recv(client_socket, ((char*)&file_size) + size_bytes_received, 
-                             sizeof(file_size) - size_bytes_received, 0);
-        if (bytes_received <= 0) {
-            printf("Failed to receive file size\n");
-            log_message(LOG_ERROR, "Failed to receive file size from %s:%d", client_ip, client_port);
-            close(client_socket);
-            free(client);
-            pthread_exit(NULL);
-        }
-        size_bytes_received += bytes_received;
+    /* Create thread for client */
+    pthread_t thread_id;
+    claim_connection();
+    if (pthread_create(&thread_id, NULL, handle_client, (void *)&copy->info) != 0) {
+        perror("Failed to create thread");
+        release_connection();
+        buffer_pool_free(copy, sizeof(client_thread_arg_t));
+        close(client->client_socket);
+        return;
     }
     
-    printf("File size: %zu bytes\n", file_size);
+    /* Detach thread so it cleans up automatically */
+    pthread_detach(thread_id);
+}
+
+/* Thread-per-connection engine: accept and hand each client to a detached thread */
+static void run_threaded_server(int listen_socket) {
+    while (running) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
     
-    /* Allocate buffer for encrypted data */
-    unsigned char *encrypted_buffer = (unsigned char *)malloc(file_size);
-    if (!encrypted_buffer) {
-        perror("Failed to allocate memory for encrypted data");
-        log_message(LOG_ERROR, "Memory allocation failed for file %s", filename);
-        close(client_socket);
-        free(client);
-        pthread_exit(NULL);
+        int client_socket = accept(listen_socket, (struct sockaddr *)&client_addr, &client_len);
+        if (client_socket < 0) {
+            if (running) {
+                perror("Accept failed");
+            }
+            continue;
+        }
+        
+        client_info_t client;
+        client.client_socket = client_socket;
+        client.client_addr = client_addr;
+        client.accepted_ns = metrics_now_ns();
+        client.request_header = NULL;
+        metrics_add(METRIC_CONNECTIONS, 1);
+        start_client_thread(&client);
     }
+}
+
+/* Pool engine: the accept loop feeds a bounded queue drained by a fixed set of workers */
+static void run_pool_server(int listen_socket, worker_pool_t *pool) {
+    while (running) {
+        client_info_t client;
+        socklen_t client_len = sizeof(client.client_addr);
     
-    /* Receive encrypted file data */
-    size_t total_received = 0;
-    while (total_received < file_size) {
-        ssize_t bytes_received = recv(client_socket, encrypted_buffer + total_received, 
-                             file_size - total_received, 0);
-        if (bytes_received <= 0) {
-            printf("Error receiving file data\n");
-            free(encrypted_buffer);
-            close(client_socket);
-            free(client);
-            pthread_exit(NULL);
+        client.client_socket = accept(listen_socket, (struct sockaddr *)&client.client_addr, &client_len);
+        if (client.client_socket < 0) {
+            if (running) {
+                perror("Accept failed");
+            }
+            continue;
         }
-        total_received += bytes_received;
+        
+        client.accepted_ns = metrics_now_ns();
+        client.request_header = NULL;
+        metrics_add(METRIC_CONNECTIONS, 1);
+        claim_connection();
+        if (worker_pool_submit(pool, &client, overflow == OVERFLOW_WAIT) == SUCCESS) {
+            continue;
+        }
+        release_connection();
+        
+        /* Queue is full: tell the client explicitly instead of letting it hang */
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client.client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+        printf("Server busy, rejecting %s:%d\n", client_ip, ntohs(client.client_addr.sin_port));
+        log_message(LOG_WARNING, "Rejected %s:%d: work queue full", client_ip,
+                    ntohs(client.client_addr.sin_port));
+        log_pool_stats();
+        send(client.client_socket, BUSY_RESPONSE, strlen(BUSY_RESPONSE), MSG_NOSIGNAL);
+        shutdown(client.client_socket, SHUT_WR);
+        close(client.client_socket);
     }
-    
-    printf("Received %zu bytes of encrypted data\n", total_received);
-    
-    /* Decrypt the data */
-    decrypt_buffer(encrypted_buffer, file_size, ENCRYPTION_KEY);
-    
-    /* Save decrypted file */
-    char output_path[MAX_PATH_LEN];
-    snprintf(output_path, sizeof(output_path), "%s/%s", RECEIVED_FILES_DIR, filename);
-    
-    FILE *output_file = fopen(output_path, "wb");
-    if (!output_file) {
-        perror("Failed to create output file");
-        log_message(LOG_ERROR, "Failed to create output file: %s", output_path);
-        free(encrypted_buffer);
-        close(client_socket);
-        free(client);
-        pthread_exit(NULL);
+}
+
+/* Parse a CPU list such as "0-3,6" into set */
+static int parse_cpu_list(const char *text, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *pos = text;
+    while (*pos) {
+        char *end;
+        long first = strtol(pos, &end, 10);
+        long last = first;
+        if (end == pos) {
+            return ERROR_FILE_IO;
+        }
+        if (*end == '-') {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            if (end == pos) {
+                return ERROR_FILE_IO;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return ERROR_FILE_IO;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET((int)cpu, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return ERROR_FILE_IO;
+        }
+        pos = end;
     }
-    
-    size_t bytes_written = fwrite(encrypted_buffer, 1, file_size, output_file);
-    fclose(output_file);
-    free(encrypted_buffer);
-    
-    if (bytes_written != file_size) {
-        printf("Warning: File size mismatch (expected %zu, wrote %zu)\n", file_size, bytes_written);
+    return (CPU_COUNT(set) > 0) ? SUCCESS : ERROR_FILE_IO;
+}
+
+/* Comma-separated CPUs of set, e.g. "0,4" */
+static void format_cpu_set(const cpu_set_t *set, char *out, size_t size) {
+    size_t used = 0;
+    out[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && used < size; cpu++) {
+        if (CPU_ISSET(cpu, set)) {
+            int length = snprintf(out + used, size - used, "%s%d", used ? "," : "", cpu);
+            used += (length > 0) ? (size_t)length : 0;
+        }
+    }
+}
+
+/*
+ * Deal the CPUs of allowed out to the shards round-robin: with more CPUs
+ * than shards each shard gets several, with fewer the shards share them.
+ */
+static void assign_shard_cpus(const cpu_set_t *allowed) {
+    int cpus[CPU_SETSIZE];
+    int cpu_count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, allowed)) {
+            cpus[cpu_count++] = cpu;
+        }
+    }
+    for (int i = 0; i < shard_count; i++) {
+        CPU_ZERO(&shards[i].cpus);
+    }
+    if (cpu_count >= shard_count) {
+        for (int j = 0; j < cpu_count; j++) {
+            CPU_SET(cpus[j], &shards[j % shard_count].cpus);
+        }
+    } else {
+        for (int i = 0; i < shard_count; i++) {
+            CPU_SET(cpus[i % cpu_count], &shards[i].cpus);
+        }
+    }
+}
+
+/* Bind and listen on port; reuse_port lets several shards bind the same port */
+static int open_listen_socket(int port, int backlog, int reuse_port) {
+    int listen_socket = create_socket();
+    int opt = 1;
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (reuse_port && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)) {
+        perror("setsockopt failed");
+        close(listen_socket);
+        return -1;
     }
     
-    printf("File saved successfully: %s\n", output_path);
-    log_transfer(client_ip, client_port, filename, file_size, "SUCCESS");
-    
-    /* Send acknowledgment */
-    const char *ack = "File received successfully";
-    send(client_socket, ack, strlen(ack), 0);
-    
-    close(client_socket);
-    free(client);
-    printf("Client %s:%d disconnected\n", client_ip, client_port);
-    
-    pthread_exit(NULL);
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    if (bind(listen_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(listen_socket);
+        return -1;
+    }
+    if (listen(listen_socket, backlog) < 0) {
+        perror("Listen failed");
+        close(listen_socket);
+        return -1;
+    }
+    return listen_socket;
+}
+
+/* Move the calling thread onto the shard's CPUs; threads it creates from here inherit them */
+static void pin_to_shard(server_shard_t *shard) {
+    if (!shard->pinned) {
+        return;
+    }
+    int status = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &shard->cpus);
+    if (status != 0) {
+        errno = status;
+        perror("Failed to pin shard");
+        log_message(LOG_WARNING, "Shard %d runs unpinned: %s", shard->index, strerror(status));
+        shard->pinned = 0;
+    }
+}
+
+/* Run the selected connection engine on the shard's socket until shutdown */
+static void run_shard(server_shard_t *shard) {
+    pin_to_shard(shard);
+    if (engine == ENGINE_EPOLL) {
+        run_event_server(shard->listen_socket, stream_chunk_size, start_client_thread, &running);
+    } else if (engine == ENGINE_URING) {
+        if (run_uring_server(shard->listen_socket, stream_chunk_size, start_client_thread, &running) ==
+            ERROR_UNSUPPORTED) {
+            printf("io_uring is unavailable; falling back to the threads engine\n");
+            log_message(LOG_WARNING, "io_uring unavailable, using the threads engine");
+            run_threaded_server(shard->listen_socket);
+        }
+    } else if (engine == ENGINE_POOL) {
+        run_pool_server(shard->listen_socket, shard->pool);
+    } else {
+        run_threaded_server(shard->listen_socket);
+    }
+}
+
+static void* shard_main(void *arg) {
+    run_shard((server_shard_t *)arg);
+    return NULL;
+}
+
+/* Create each shard's worker pool from a thread pinned like the shard, so the workers inherit its CPUs */
+static int create_shard_pools(size_t worker_count, size_t queue_depth) {
+    cpu_set_t original;
+    int restore = pthread_getaffinity_np(pthread_self(), sizeof(original), &original) == 0;
+    int status = SUCCESS;
+    for (int i = 0; i < shard_count && status == SUCCESS; i++) {
+        if (shards[i].pinned) {
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &shards[i].cpus);
+        }
+        shards[i].pool = worker_pool_create(worker_count, queue_depth, serve_connection);
+        status = shards[i].pool ? SUCCESS : ERROR_MEMORY;
+    }
+    if (restore) {
+        pthread_setaffinity_np(pthread_self(), sizeof(original), &original);
+    }
+    return status;
+}
+
+/* Tear down what main set up for the shards */
+static void close_shards(void) {
+    for (int i = 0; i < shard_count; i++) {
+        close(shards[i].listen_socket);
+        if (shards[i].pool) {
+            worker_pool_destroy(shards[i].pool);
+            shards[i].pool = NULL;
+        }
+    }
+}
+
+/* Print server usage */
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m chunk_bytes] [-e threads|epoll|pool|uring] [-w workers] [-q depth]\n"
+                    "          [-o reject|wait] [-b backlog] [-s files|cas|pack] [-l sync|block|drop]\n"
+                    "          [-M metrics_port] [-C cache_mb] [-n shards] [-P cpus] [-R rate] [-r rate]\n"
+                    "          [-W ip=weight] [-H] [PORT]\n"
+                    "       %s [-s pack] -x name > file\n"
+                    "       %s -s pack [-X dir] [-K]\n", prog, prog, prog);
+    fprintf(stderr, "  -m chunk_bytes  Per-connection receive buffer size (default: %d)\n",
+            STREAM_CHUNK_SIZE);
+    fprintf(stderr, "  -e engine       Connection engine: threads (default), epoll, pool, or uring\n"
+                    "                  (io_uring; falls back to threads if the kernel lacks it)\n");
+    fprintf(stderr, "  -w workers      Worker threads for the pool engine (default: %d)\n",
+            DEFAULT_WORKER_THREADS);
+    fprintf(stderr, "  -q depth        Work queue depth for the pool engine (default: %d)\n",
+            DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  -o policy       When the queue is full: reject with a busy response (default)\n"
+                    "                  or wait, leaving clients in the listen backlog\n");
+    fprintf(stderr, "  -b backlog      Listen backlog (default: %d)\n", DEFAULT_LISTEN_BACKLOG);
+    fprintf(stderr, "  -s storage      files (default); cas to also accept deduplicated uploads\n"
+                    "                  into the chunk store under %s/; pack to append\n"
+                    "                  uploads of up to %d bytes to pack files under %s/\n", CHUNK_STORE_DIR,
+            PACK_MAX_OBJECT_SIZE, PACK_STORE_DIR);
+    fprintf(stderr, "  -x name         Write a file from the chunk store (pack store with -s pack) to\n"
+                    "                  stdout and exit\n");
+    fprintf(stderr, "  -X dir          With -s pack: write every packed object to a file under dir and exit\n");
+    fprintf(stderr, "  -K              With -s pack: compact packs at least %d%% dead and exit\n",
+            PACK_COMPACT_DEAD_PERCENT);
+    fprintf(stderr, "  -l mode         Logging: block (default) or drop queue records for a background\n"
+                    "                  writer and wait or drop when its ring is full; sync writes inline\n");
+    fprintf(stderr, "  -M port         Serve Prometheus metrics at http://127.0.0.1:port/metrics\n");
+    fprintf(stderr, "  -C cache_mb     Encrypted chunks kept for downloads, in MiB; 0 disables (default: %d)\n",
+            DEFAULT_DOWNLOAD_CACHE_MB);
+    fprintf(stderr, "  -n shards       Acceptor groups, each with its own SO_REUSEPORT socket and engine\n"
+                    "                  (default: 1, up to %d)\n", MAX_SERVER_SHARDS);
+    fprintf(stderr, "  -P cpus         CPUs to pin shards to, e.g. 0-3,6; dealt out round-robin\n"
+                    "                  (default with -n: every CPU the server may run on)\n");
+    fprintf(stderr, "  -R rate         Total upload rate in bytes/s, K/M/G suffixes (default: unlimited)\n");
+    fprintf(stderr, "  -r rate         Upload rate per client IP in bytes/s (default: unlimited)\n");
+    fprintf(stderr, "  -W ip=weight    Share of contended bandwidth for ip's transfers, 1-%d (default: 1);\n"
+                    "                  repeatable. Limits apply to connections served on handler threads: all\n"
+                    "                  of them on the threads and pool engines; epoll and uring receive\n"
+                    "                  legacy and OP_PUT uploads inline, unshaped\n",
+            BANDWIDTH_MAX_WEIGHT);
+    fprintf(stderr, "  -H              Back I/O buffer slabs with reserved huge pages (MAP_HUGETLB)\n");
 }
 
 int main(int argc, char *argv[]) {
-    int port = (argc > 1) ? atoi(argv[1]) : DEFAULT_PORT;
+    size_t worker_count = DEFAULT_WORKER_THREADS;
+    size_t queue_depth = DEFAULT_QUEUE_DEPTH;
+    int backlog = DEFAULT_LISTEN_BACKLOG;
+    int use_chunk_store = 0;
+    int use_pack_store = 0;
+    const char *extract_name = NULL;
+    const char *extract_dir = NULL;
+    int compact_packs = 0;
+    log_mode_t log_mode = LOG_MODE_BLOCK;
+    int metrics_port = 0;
+    long cache_mb = DEFAULT_DOWNLOAD_CACHE_MB;
+    int requested_shards = 1;
+    const char *cpu_list = NULL;
+    uint64_t global_rate = 0;
+    uint64_t client_rate = 0;
+    const char *weight_rules[BANDWIDTH_MAX_CLIENTS];
+    int weight_rule_count = 0;
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "m:e:w:q:o:b:s:x:X:Kl:M:C:n:P:R:r:W:Hh")) != -1) {
+        switch (opt_char) {
+        case 'm': {
+            long value = atol(optarg);
+            if (value <= 0) {
+                fprintf(stderr, "Invalid chunk size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            stream_chunk_size = (size_t)value;
+            break;
+        }
+        case 'e':
+            if (strcmp(optarg, "threads") == 0) {
+                engine = ENGINE_THREADS;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                engine = ENGINE_EPOLL;
+            } else if (strcmp(optarg, "pool") == 0) {
+                engine = ENGINE_POOL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                engine = ENGINE_URING;
+            } else {
+                fprintf(stderr, "Unknown engine: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'w':
+        case 'q':
+        case 'b': {
+            long value = atol(optarg);
+            if (value <= 0) {
+                fprintf(stderr, "Invalid value for -%c: %s\n", opt_char, optarg);
+                return EXIT_FAILURE;
+            }
+            if (opt_char == 'w') {
+                worker_count = (size_t)value;
+            } else if (opt_char == 'q') {
+                queue_depth = (size_t)value;
+            } else {
+                backlog = (int)value;
+            }
+            break;
+        }
+        case 'o':
+            if (strcmp(optarg, "reject") == 0) {
+                overflow = OVERFLOW_REJECT;
+            } else if (strcmp(optarg, "wait") == 0) {
+                overflow = OVERFLOW_WAIT;
+            } else {
+                fprintf(stderr, "Unknown overflow policy: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            use_chunk_store = strcmp(optarg, "cas") == 0;
+            use_pack_store = strcmp(optarg, "pack") == 0;
+            if (!use_chunk_store && !use_pack_store && strcmp(optarg, "files") != 0) {
+                fprintf(stderr, "Unknown storage: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'x':
+            extract_name = optarg;
+            break;
+        case 'X':
+            extract_dir = optarg;
+            break;
+        case 'K':
+            compact_packs = 1;
+            break;
+        case 'M':
+            metrics_port = atoi(optarg);
+            if (metrics_port <= 0 || metrics_port > 65535) {
+                fprintf(stderr, "Invalid metrics port: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'H':
+            buffer_pool_use_hugepages(1);
+            break;
+        case 'n':
+            requested_shards = atoi(optarg);
+            if (requested_shards < 1 || requested_shards > MAX_SERVER_SHARDS) {
+                fprintf(stderr, "Invalid shard count: %s (1-%d)\n", optarg, MAX_SERVER_SHARDS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            cpu_list = optarg;
+            break;
+        case 'R':
+        case 'r':
+            if (parse_byte_size(optarg, (opt_char == 'R') ? &global_rate : &client_rate) != SUCCESS) {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'W':
+            if (weight_rule_count == BANDWIDTH_MAX_CLIENTS - 1 || !strchr(optarg, '=')) {
+                fprintf(stderr, "Invalid weight rule: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            weight_rules[weight_rule_count++] = optarg;
+            break;
+        case 'C':
+            cache_mb = atol(optarg);
+            if (cache_mb < 0) {
+                fprintf(stderr, "Invalid download cache size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'l':
+            if (strcmp(optarg, "sync") == 0) {
+                log_mode = LOG_MODE_SYNC;
+            } else if (strcmp(optarg, "block") == 0) {
+                log_mode = LOG_MODE_BLOCK;
+            } else if (strcmp(optarg, "drop") == 0) {
+                log_mode = LOG_MODE_DROP;
+            } else {
+                fprintf(stderr, "Unknown log mode: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return (opt_char == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    int port = (optind < argc) ? atoi(argv[optind]) : DEFAULT_PORT;
+    cpu_set_t allowed;
+    if (cpu_list) {
+        cpu_set_t available;
+        if (parse_cpu_list(cpu_list, &allowed) != SUCCESS) {
+            fprintf(stderr, "Invalid CPU list: %s\n", cpu_list);
+            return EXIT_FAILURE;
+        }
+        if (sched_getaffinity(0, sizeof(available), &available) == 0) {
+            CPU_AND(&allowed, &allowed, &available);
+        }
+        if (CPU_COUNT(&allowed) == 0) {
+            fprintf(stderr, "None of the CPUs in %s are available\n", cpu_list);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    /* Extraction writes the file to stdout, so it runs before anything else prints */
+    if (use_pack_store && (extract_name || extract_dir || compact_packs)) {
+        struct stat store_stat;
+        if (stat(PACK_STORE_DIR, &store_stat) < 0) {
+            fprintf(stderr, "No pack store under %s\n", PACK_STORE_DIR);
+            return EXIT_FAILURE;
+        }
+        pack_store = pack_store_open(PACK_STORE_DIR);
+        if (!pack_store) {
+            return EXIT_FAILURE;
+        }
+        int status = SUCCESS;
+        if (extract_name) {
+            if (is_safe_relative_path(extract_name)) {
+                status = pack_store_extract(pack_store, extract_name, STDOUT_FILENO);
+            } else {
+                fprintf(stderr, "No pack store entry for %s\n", extract_name);
+                status = ERROR_FILE_IO;
+            }
+        }
+        if (status == SUCCESS && extract_dir) {
+            int64_t extracted = pack_store_extract_all(pack_store, extract_dir);
+            status = (extracted < 0) ? (int)extracted : SUCCESS;
+            fprintf(stderr, "Extracted %lld objects to %s\n", (long long)((extracted < 0) ? 0 : extracted),
+                    extract_dir);
+        }
+        if (status == SUCCESS && compact_packs) {
+            status = pack_store_compact(pack_store, PACK_COMPACT_DEAD_PERCENT);
+        }
+        pack_store_close(pack_store);
+        return (status == SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (extract_dir || compact_packs) {
+        fprintf(stderr, "-X and -K need -s pack\n");
+        return EXIT_FAILURE;
+    }
+    if (extract_name) {
+        struct stat store_stat;
+        if (!is_safe_filename(extract_name) || stat(CHUNK_STORE_DIR, &store_stat) < 0) {
+            fprintf(stderr, "No chunk store entry for %s\n", extract_name);
+            return EXIT_FAILURE;
+        }
+        chunk_store = chunk_store_open(CHUNK_STORE_DIR);
+        int status = chunk_store ? chunk_store_extract(chunk_store, extract_name, STDOUT_FILENO) : ERROR_FILE_IO;
+        chunk_store_close(chunk_store);
+        return (status == SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     
     /* Setup signal handlers */
     setup_signal_handlers(signal_handler);
     
     /* Initialize logger */
-    if (init_logger() != SUCCESS) {
+    if (init_logger(log_mode) != SUCCESS) {
         fprintf(stderr, "Failed to initialize logger\n");
         return EXIT_FAILURE;
     }
@@ -157,74 +1991,205 @@ int main(int argc, char *argv[]) {
     /* Create directories */
     create_directory_if_not_exists(RECEIVED_FILES_DIR);
     create_directory_if_not_exists(LOGS_DIR);
-    
-    /* Create server socket */
-    server_socket = create_socket();
-    
-    /* Set socket options for reuse */
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        error_exit("setsockopt failed");
+    if (use_chunk_store) {
+        chunk_store = chunk_store_open(CHUNK_STORE_DIR);
+        if (!chunk_store) {
+            close_logger();
+            return EXIT_FAILURE;
+        }
+    }
+    if (use_pack_store) {
+        pack_store = pack_store_open(PACK_STORE_DIR);
+        if (!pack_store) {
+            close_logger();
+            return EXIT_FAILURE;
+        }
+    }
+    if (cache_mb > 0) {
+        download_cache = download_cache_create((size_t)cache_mb * 1024 * 1024);
+        if (!download_cache) {
+            fprintf(stderr, "Failed to create the download cache\n");
+            chunk_store_close(chunk_store);
+            pack_store_close(pack_store);
+            close_logger();
+            return EXIT_FAILURE;
+        }
+    }
+    bandwidth = bandwidth_create(global_rate, client_rate);
+    if (!bandwidth) {
+        fprintf(stderr, "Failed to create the bandwidth scheduler\n");
+        chunk_store_close(chunk_store);
+        pack_store_close(pack_store);
+        download_cache_destroy(download_cache);
+        close_logger();
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < weight_rule_count; i++) {
+        char ip[INET_ADDRSTRLEN] = "";
+        const char *equals = strchr(weight_rules[i], '=');
+        size_t ip_len = (size_t)(equals - weight_rules[i]);
+        long weight = atol(equals + 1);
+        if (ip_len < sizeof(ip)) {
+            memcpy(ip, weight_rules[i], ip_len);
+            ip[ip_len] = '\0';
+        }
+        if (weight < 1 || weight > BANDWIDTH_MAX_WEIGHT ||
+            bandwidth_set_weight(bandwidth, ip, (unsigned)weight) != SUCCESS) {
+            fprintf(stderr, "Invalid weight rule: %s\n", weight_rules[i]);
+            bandwidth_destroy(bandwidth);
+            chunk_store_close(chunk_store);
+            pack_store_close(pack_store);
+            download_cache_destroy(download_cache);
+            close_logger();
+            return EXIT_FAILURE;
+        }
     }
     
-    /* Setup server address */
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    /* One listening socket per shard; they share the port through SO_REUSEPORT */
+    server_shard_t *shard_table = (server_shard_t *)calloc((size_t)requested_shards, sizeof(server_shard_t));
+    if (!shard_table) {
+        fprintf(stderr, "Failed to allocate shards\n");
+        bandwidth_destroy(bandwidth);
+        chunk_store_close(chunk_store);
+        pack_store_close(pack_store);
+        download_cache_destroy(download_cache);
+        close_logger();
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < requested_shards; i++) {
+        shard_table[i].index = i;
+        shard_table[i].listen_socket = open_listen_socket(port, backlog, requested_shards > 1);
+        if (shard_table[i].listen_socket < 0) {
+            while (--i >= 0) {
+                close(shard_table[i].listen_socket);
+            }
+            free(shard_table);
+            bandwidth_destroy(bandwidth);
+            chunk_store_close(chunk_store);
+            pack_store_close(pack_store);
+            download_cache_destroy(download_cache);
+            close_logger();
+            return EXIT_FAILURE;
+        }
+    }
+    shards = shard_table;
+    shard_count = requested_shards;
     
-    /* Bind socket */
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        error_exit("Bind failed");
+    /* Pin shards to the -P CPUs, or spread them over the CPUs this process may use */
+    int pin_shards = cpu_list != NULL;
+    if (!cpu_list && shard_count > 1) {
+        pin_shards = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
     }
+    if (pin_shards) {
+        assign_shard_cpus(&allowed);
+        for (int i = 0; i < shard_count; i++) {
+            shards[i].pinned = 1;
     
-    /* Listen for connections */
-    if (listen(server_socket, 5) < 0) {
-        error_exit("Listen failed");
+            /* Prefer the shard whose CPU handled the connection's packets (kernel 6.2+ with SO_REUSEPORT) */
+            int first_cpu = 0;
+            while (!CPU_ISSET(first_cpu, &shards[i].cpus)) {
+                first_cpu++;
+            }
+            if (shard_count > 1) {
+                setsockopt(shards[i].listen_socket, SOL_SOCKET, SO_INCOMING_CPU, &first_cpu, sizeof(first_cpu));
+            }
+        }
     }
     
     printf("EFTT Server started on port %d\n", port);
-    printf("Waiting for client connections...\n");
-    log_message(LOG_INFO, "Server started on port %d", port);
-    
-    /* Accept connections in loop */
-    while (running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        if (client_socket < 0) {
-            if (running) {
-                perror("Accept failed");
-            }
-            continue;
+    printf("Receive buffer: %zu bytes per connection\n", stream_chunk_size);
+    if (engine == ENGINE_POOL) {
+        printf("Connection engine: pool (%zu workers, queue depth %zu, %s when full)\n",
+               worker_count, queue_depth, (overflow == OVERFLOW_WAIT) ? "wait" : "reject");
+    } else {
+        printf("Connection engine: %s\n", (engine == ENGINE_EPOLL) ? "epoll" :
+               (engine == ENGINE_URING) ? "uring" : "threads");
+    }
+    printf("Listen backlog: %d\n", backlog);
+    if (shard_count > 1 || pin_shards) {
+        printf("Shards: %d%s\n", shard_count, (shard_count > 1) ? " (SO_REUSEPORT)" : "");
+        for (int i = 0; i < shard_count && pin_shards; i++) {
+            char cpus[256];
+            format_cpu_set(&shards[i].cpus, cpus, sizeof(cpus));
+            printf("  shard %d: CPUs %s\n", i, cpus);
         }
-        
-        /* Create thread for client */
-        pthread_t thread_id;
-        client_info_t *client = (client_info_t *)malloc(sizeof(client_info_t));
-        if (!client) {
-            perror("Failed to allocate memory for client info");
-            close(client_socket);
-            continue;
+    }
+    if (engine == ENGINE_POOL && create_shard_pools(worker_count, queue_depth) != SUCCESS) {
+        fprintf(stderr, "Failed to create worker pool\n");
+        close_shards();
+        close_logger();
+        return EXIT_FAILURE;
+    }
+    if (global_rate > 0 || client_rate > 0) {
+        printf("Upload rate limit: %llu bytes/s total, %llu bytes/s per client (0 = unlimited), "
+               "%d weight rule(s)\n", (unsigned long long)global_rate, (unsigned long long)client_rate,
+               weight_rule_count);
+        if (engine == ENGINE_EPOLL || engine == ENGINE_URING) {
+            printf("Note: the %s engine receives uploads inline; only requests on handler threads are shaped\n",
+                   (engine == ENGINE_EPOLL) ? "epoll" : "uring");
         }
-        
-        client->client_socket = client_socket;
-        client->client_addr = client_addr;
-        
-        if (pthread_create(&thread_id, NULL, handle_client, (void *)client) != 0) {
-            perror("Failed to create thread");
-            free(client);
-            close(client_socket);
-            continue;
+    }
+    if (chunk_store) {
+        chunk_store_stats_t store_stats;
+        chunk_store_get_stats(chunk_store, &store_stats);
+        printf("Chunk store: %s (%llu chunks, %llu bytes)\n", CHUNK_STORE_DIR,
+               (unsigned long long)store_stats.chunks, (unsigned long long)store_stats.stored_bytes);
+    }
+    if (pack_store) {
+        pack_store_stats_t packed;
+        pack_store_get_stats(pack_store, &packed);
+        printf("Pack store: %s (%llu objects in %llu packs, %llu bytes, %llu dead); uploads up to %d bytes\n",
+               PACK_STORE_DIR, (unsigned long long)packed.objects, (unsigned long long)packed.packs,
+               (unsigned long long)packed.pack_bytes, (unsigned long long)packed.dead_bytes,
+               PACK_MAX_OBJECT_SIZE);
+        if (engine == ENGINE_EPOLL || engine == ENGINE_URING) {
+            printf("Note: the %s engine stores legacy and OP_PUT uploads inline as plain files\n",
+                   (engine == ENGINE_EPOLL) ? "epoll" : "uring");
         }
-        
-        /* Detach thread so it cleans up automatically */
-        pthread_detach(thread_id);
     }
+    if (metrics_port > 0) {
+        if (metrics_start(metrics_port, write_pool_metrics) != SUCCESS) {
+            close_shards();
+            close_logger();
+            return EXIT_FAILURE;
+        }
+        printf("Metrics: http://127.0.0.1:%d/metrics\n", metrics_port);
+    }
+    printf("Waiting for client connections...\n");
+    log_message(LOG_INFO, "Server started on port %d with %d shard(s)", port, shard_count);
+    
+    /* The first shard runs on the main thread; the others get their own */
+    for (int i = 1; i < shard_count; i++) {
+        if (pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]) != 0) {
+            error_exit("Failed to create shard thread");
+        }
+    }
+    run_shard(&shards[0]);
+    for (int i = 1; i < shard_count; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+    printf("\nReceived signal %d. Shutting down gracefully...\n", (int)shutdown_signal);
+    log_message(LOG_INFO, "Received signal %d, shutting down", (int)shutdown_signal);
+    
+    /* Handler threads and pool workers still use the logger */
+    pthread_mutex_lock(&active_lock);
+    if (active_clients > 0) {
+        printf("Waiting for %d transfer(s) to finish (signal again to exit now)\n", active_clients);
+    }
+    while (active_clients > 0) {
+        pthread_cond_wait(&active_done, &active_lock);
+    }
+    pthread_mutex_unlock(&active_lock);
     
-    close(server_socket);
+    metrics_stop();  // Scrapes read the pools' stats
+    log_pool_stats();
+    close_shards();
+    shard_count = 0;
+    free(shards);
+    chunk_store_close(chunk_store);
+    pack_store_close(pack_store);
+    download_cache_destroy(download_cache);
+    bandwidth_destroy(bandwidth);
     close_logger();
     printf("Server shutdown complete\n");
     
@@ -0,0 +1,106 @@
+#!/bin/bash
+# Resumable upload: run client -r through a relay that cuts the connection
+# partway, stop the client, run it again straight to the server and check
+# that the second run sends only the chunks the server lacked and the
+# stored file matches.
+#
+# Usage: tests/resume.sh   (PORT overrides the port, 9312; the relay uses PORT+1)
+
+set -u
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PORT=${PORT:-9312}
+RELAY_PORT=$((PORT + 1))
+CHUNK=$((1024 * 1024))   # TRANSFER_CHUNK_SIZE, the unit of the chunk map
+CHUNKS=32
+CUT=$((CHUNK * 25 / 2))  # The relay drops the first upload after 12.5 chunks
+WORK=$(mktemp -d)
+SERVER_PID=
+CLIENT_PID=
+
+cleanup() {
+    [ -n "$CLIENT_PID" ] && kill -9 "$CLIENT_PID" 2>/dev/null
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*"
+    [ -f "$WORK/client.log" ] && tail -n 5 "$WORK/client.log"
+    [ -f "$WORK/server.log" ] && tail -n 20 "$WORK/server.log"
+    exit 1
+}
+
+cd "$WORK" || exit 1
+SIZE=$((CHUNK * CHUNKS))
+head -c "$SIZE" /dev/urandom > upload.bin || fail "cannot create the test file"
+
+"$ROOT/server" "$PORT" > server.log 2>&1 &
+SERVER_PID=$!
+for _ in $(seq 50); do
+    (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+    sleep 0.1
+done
+kill -0 "$SERVER_PID" 2>/dev/null || fail "server did not start"
+
+# One-shot relay: forwards a single connection both ways and closes it once
+# CUT bytes have gone from the client to the server
+python3 - "$RELAY_PORT" "$PORT" "$CUT" > relay.log 2>&1 <<'EOF' &
+import socket, sys, threading
+relay_port, server_port, cut = (int(arg) for arg in sys.argv[1:4])
+listener = socket.create_server(("127.0.0.1", relay_port))
+print("listening", flush=True)
+client, _ = listener.accept()
+listener.close()
+server = socket.create_connection(("127.0.0.1", server_port))
+
+def back():
+    try:
+        while data := server.recv(65536):
+            client.sendall(data)
+    except OSError:
+        pass
+
+threading.Thread(target=back, daemon=True).start()
+forwarded = 0
+while forwarded < cut:
+    data = client.recv(min(65536, cut - forwarded))
+    if not data:
+        break
+    server.sendall(data)
+    forwarded += len(data)
+for sock in (server, client):
+    sock.shutdown(socket.SHUT_RDWR)
+    sock.close()
+print("cut after", forwarded, flush=True)
+EOF
+RELAY_PID=$!
+for _ in $(seq 50); do
+    grep -q listening relay.log 2>/dev/null && break
+    sleep 0.1
+done
+
+# First run: the relay drops the connection; stop the client while it waits to reconnect
+"$ROOT/client" -r 127.0.0.1 "$RELAY_PORT" upload.bin > first.log 2>&1 &
+CLIENT_PID=$!
+disown "$CLIENT_PID"   # Killed on purpose below; keep bash from reporting it
+wait "$RELAY_PID"
+grep -q "cut after $CUT" relay.log || fail "relay did not cut the upload: $(cat relay.log)"
+kill -9 "$CLIENT_PID" 2>/dev/null
+while kill -0 "$CLIENT_PID" 2>/dev/null; do sleep 0.1; done
+CLIENT_PID=
+sleep 0.5   # Let the server notice the closed connection and record its chunks
+
+# Second run: only the missing chunks go over the wire
+"$ROOT/client" -r 127.0.0.1 "$PORT" upload.bin > client.log 2>&1 || fail "resumed upload exited with $?"
+summary=$(grep "Server already had" client.log) || fail "no resume summary in the client output"
+read -r skipped total sent <<< "$(echo "$summary" |
+    sed -n 's/.*had \([0-9]*\) of \([0-9]*\) chunks; sent \([0-9]*\) bytes.*/\1 \2 \3/p')"
+[ "$total" = "$CHUNKS" ] || fail "chunk map has ${total:-?} chunks, expected $CHUNKS"
+[ "${skipped:-0}" -gt 0 ] || fail "server kept no chunks from the interrupted upload"
+[ "$skipped" -lt "$CHUNKS" ] || fail "interrupted upload had already stored every chunk"
+[ "$sent" -eq $(((CHUNKS - skipped) * CHUNK)) ] ||
+    fail "resent $sent bytes, expected $(((CHUNKS - skipped) * CHUNK)) for $((CHUNKS - skipped)) missing chunks"
+cmp -s upload.bin received_files/upload.bin || fail "received file differs"
+
+echo "PASS: resumed after $skipped of $CHUNKS chunks, resent $sent of $SIZE bytes"
@@ -0,0 +1,52 @@
+#!/bin/bash
+# Streaming receive with a small buffer: start ./server -m 4096, upload a
+# multi-megabyte file over legacy and OP_PUT framing, check each copy with
+# cmp and check the server's peak RSS stayed well below the file size.
+#
+# Usage: tests/stream_memory.sh [size_mb]   (PORT overrides the port, 9311)
+
+set -u
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SIZE_MB=${1:-64}
+PORT=${PORT:-9311}
+WORK=$(mktemp -d)
+SERVER_PID=
+
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*"
+    [ -f "$WORK/server.log" ] && tail -n 20 "$WORK/server.log"
+    exit 1
+}
+
+# Run from a scratch directory so received_files/ and logs/ land there
+cd "$WORK" || exit 1
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > upload.bin || fail "cannot create the test file"
+
+"$ROOT/server" -m 4096 "$PORT" > server.log 2>&1 &
+SERVER_PID=$!
+for _ in $(seq 50); do
+    (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+    sleep 0.1
+done
+kill -0 "$SERVER_PID" 2>/dev/null || fail "server did not start"
+
+for framing in -L ""; do
+    rm -f received_files/upload.bin
+    "$ROOT/client" $framing 127.0.0.1 "$PORT" upload.bin > client.log 2>&1 ||
+        fail "upload ${framing:-(OP_PUT)} exited with $?"
+    cmp -s upload.bin received_files/upload.bin || fail "received file differs (${framing:-OP_PUT})"
+done
+
+# With 4 KiB receive chunks the payload never sits in memory whole
+peak_kb=$(awk '/^VmHWM:/ { print $2 }' "/proc/$SERVER_PID/status")
+limit_kb=$((SIZE_MB * 1024 / 2))
+[ -n "$peak_kb" ] || fail "cannot read the server's peak RSS"
+[ "$peak_kb" -lt "$limit_kb" ] || fail "server peak RSS ${peak_kb} KiB for a ${SIZE_MB} MiB upload"
+
+echo "PASS: ${SIZE_MB} MiB uploaded twice with -m 4096, server peak RSS ${peak_kb} KiB"
@@ -0,0 +1,588 @@
+#include "transfer.h"
+#include "crypto.h"
+#include "protocol.h"
+#include "buffer_pool.h"
+#include "checksum.h"
+
+/* Print any response the server sent before dropping us (e.g. a busy rejection) */
+void report_early_response(int client_socket) {
+    char response[256];
+    ssize_t response_bytes = recv(client_socket, response, sizeof(response) - 1, MSG_DONTWAIT);
+    if (response_bytes > 0) {
+        response[response_bytes] = '\0';
+        printf("Server response: %s\n", response);
+    }
+}
+
+/* Connect to the server; returns the socket or -1 */
+int connect_to_server(const char *server_ip, int server_port) {
+    int client_socket = create_socket();
+
+    /* Setup server address */
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid server IP address: %s\n", server_ip);
+        close(client_socket);
+        return -1;
+    }
+
+    if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Connection failed");
+        close(client_socket);
+        return -1;
+    }
+    transport_tune_socket(client_socket);
+    return client_socket;
+}
+
+/* Read, encrypt (checksumming on the way if checksum is set) and send a range of the file */
+static int send_encrypted(int client_socket, int file_fd, uint64_t offset, uint64_t length,
+                          int show_progress, checksum_state_t *checksum) {
+    /* Reusable send buffer; memory use is independent of the file size */
+    unsigned char *chunk = (unsigned char *)buffer_pool_alloc(STREAM_CHUNK_SIZE);
+    if (!chunk) {
+        perror("Failed to allocate send buffer");
+        return ERROR_MEMORY;
+    }
+
+    progress_t progress;
+    progress_init(&progress);
+    uint64_t total_sent = 0;
+    while (total_sent < length) {
+        size_t want = STREAM_CHUNK_SIZE;
+        if (length - total_sent < want) {
+            want = (size_t)(length - total_sent);
+        }
+        ssize_t bytes_read = pread(file_fd, chunk, want, (off_t)(offset + total_sent));
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            fprintf(stderr, "\nFailed to read file (read %llu of %llu bytes)\n",
+                    (unsigned long long)total_sent, (unsigned long long)length);
+            buffer_pool_free(chunk, STREAM_CHUNK_SIZE);
+            return ERROR_FILE_IO;
+        }
+
+        if (checksum) {
+            checksum_encrypt(checksum, chunk, (size_t)bytes_read);
+        } else {
+            encrypt_buffer(chunk, (size_t)bytes_read, ENCRYPTION_KEY);
+        }
+        if (send_all(client_socket, chunk, (size_t)bytes_read) != SUCCESS) {
+            perror("Failed to send file data");
+            report_early_response(client_socket);
+            buffer_pool_free(chunk, STREAM_CHUNK_SIZE);
+            return ERROR_NETWORK;
+        }
+        total_sent += (uint64_t)bytes_read;
+        if (show_progress) {
+            progress_bytes(&progress, "Sent", total_sent, length);
+        }
+    }
+
+    buffer_pool_free(chunk, STREAM_CHUNK_SIZE);
+    return SUCCESS;
+}
+
+/* Read, encrypt and send length bytes of the file starting at offset */
+int send_file_data(int client_socket, int file_fd, uint64_t offset, uint64_t length,
+                   int show_progress) {
+    return send_encrypted(client_socket, file_fd, offset, length, show_progress, NULL);
+}
+
+/* Ring slot states; each stage hands a slot on to the next one */
+typedef enum {
+    SLOT_FREE,
+    SLOT_READ,
+    SLOT_ENCRYPTED
+} slot_state_t;
+
+typedef struct {
+    unsigned char *data;
+    size_t length;
+    slot_state_t state;
+    uint32_t zerocopy_id;  // Sent zerocopy; free once every send before this id has completed
+} pipeline_slot_t;
+
+/* Shared by the three stages; chunk n always lives in slot n % slot_count */
+typedef struct {
+    pipeline_slot_t *slots;
+    int slot_count;
+    size_t buffer_size;
+    int file_fd;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t chunk_count;
+    checksum_state_t *checksum;  // Only touched by the encryptor, which sees chunks in order
+    int status;  // First failure; every stage stops once it is set
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;
+    pthread_cond_t slot_read;
+    pthread_cond_t slot_encrypted;
+    pipeline_stats_t stats;  // Each field is only written by its own stage
+} pipeline_t;
+
+static uint64_t pipeline_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Wait for chunk seq's slot to reach state; returns NULL once the pipeline has failed */
+static pipeline_slot_t* pipeline_wait(pipeline_t *pipeline, uint64_t seq, slot_state_t state,
+                                      pthread_cond_t *cond, uint64_t *stall_ns) {
+    pipeline_slot_t *slot = &pipeline->slots[seq % (uint64_t)pipeline->slot_count];
+    pthread_mutex_lock(&pipeline->lock);
+    if (slot->state != state && pipeline->status == SUCCESS) {
+        uint64_t started = pipeline_now_ns();
+        while (slot->state != state && pipeline->status == SUCCESS) {
+            pthread_cond_wait(cond, &pipeline->lock);
+        }
+        *stall_ns += pipeline_now_ns() - started;
+    }
+    int failed = pipeline->status != SUCCESS;
+    pthread_mutex_unlock(&pipeline->lock);
+    return failed ? NULL : slot;
+}
+
+static void pipeline_advance(pipeline_t *pipeline, pipeline_slot_t *slot, slot_state_t state,
+                             pthread_cond_t *cond) {
+    pthread_mutex_lock(&pipeline->lock);
+    slot->state = state;
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+/* Record the first failure and wake every stage so they all stop */
+static void pipeline_fail(pipeline_t *pipeline, int status) {
+    pthread_mutex_lock(&pipeline->lock);
+    if (pipeline->status == SUCCESS) {
+        pipeline->status = status;
+    }
+    pthread_cond_broadcast(&pipeline->slot_free);
+    pthread_cond_broadcast(&pipeline->slot_read);
+    pthread_cond_broadcast(&pipeline->slot_encrypted);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void* pipeline_reader_main(void *arg) {
+    pipeline_t *pipeline = (pipeline_t *)arg;
+    for (uint64_t seq = 0; seq < pipeline->chunk_count; seq++) {
+        pipeline_slot_t *slot = pipeline_wait(pipeline, seq, SLOT_FREE, &pipeline->slot_free,
+                                              &pipeline->stats.read_stall_ns);
+        if (!slot) {
+            break;
+        }
+        uint64_t started = pipeline_now_ns();
+        uint64_t position = seq * pipeline->buffer_size;
+        size_t want = pipeline->buffer_size;
+        if (pipeline->length - position < want) {
+            want = (size_t)(pipeline->length - position);
+        }
+
+        /* Fill the buffer completely so chunk n always starts at n * buffer_size */
+        size_t filled = 0;
+        while (filled < want) {
+            ssize_t bytes_read = pread(pipeline->file_fd, slot->data + filled, want - filled,
+                                       (off_t)(pipeline->offset + position + filled));
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                fprintf(stderr, "\nFailed to read file (read %llu of %llu bytes)\n",
+                        (unsigned long long)(position + filled), (unsigned long long)pipeline->length);
+                pipeline_fail(pipeline, ERROR_FILE_IO);
+                return NULL;
+            }
+            filled += (size_t)bytes_read;
+        }
+        slot->length = want;
+        pipeline->stats.read_busy_ns += pipeline_now_ns() - started;
+        pipeline_advance(pipeline, slot, SLOT_READ, &pipeline->slot_read);
+    }
+    return NULL;
+}
+
+static void* pipeline_encryptor_main(void *arg) {
+    pipeline_t *pipeline = (pipeline_t *)arg;
+    for (uint64_t seq = 0; seq < pipeline->chunk_count; seq++) {
+        pipeline_slot_t *slot = pipeline_wait(pipeline, seq, SLOT_READ, &pipeline->slot_read,
+                                              &pipeline->stats.encrypt_stall_ns);
+        if (!slot) {
+            break;
+        }
+        uint64_t started = pipeline_now_ns();
+        if (pipeline->checksum) {
+            checksum_encrypt(pipeline->checksum, slot->data, slot->length);
+        } else {
+            encrypt_buffer(slot->data, slot->length, ENCRYPTION_KEY);
+        }
+        pipeline->stats.encrypt_busy_ns += pipeline_now_ns() - started;
+        pipeline_advance(pipeline, slot, SLOT_ENCRYPTED, &pipeline->slot_encrypted);
+    }
+    return NULL;
+}
+
+static void free_pipeline_slots(pipeline_t *pipeline, int count) {
+    for (int i = 0; pipeline->slots && i < count; i++) {
+        buffer_pool_free(pipeline->slots[i].data, pipeline->buffer_size);
+    }
+    free(pipeline->slots);
+}
+
+/* Read, encrypt and send on three threads linked by a ring of buffers */
+int send_file_pipelined(int client_socket, int file_fd, uint64_t offset, uint64_t length,
+                        const pipeline_config_t *config, int show_progress, checksum_state_t *checksum,
+                        pipeline_stats_t *stats) {
+    uint64_t started = pipeline_now_ns();
+    pipeline_t pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.buffer_size = config->buffer_size;
+    pipeline.file_fd = file_fd;
+    pipeline.offset = offset;
+    pipeline.length = length;
+    pipeline.chunk_count = (length + config->buffer_size - 1) / config->buffer_size;
+    pipeline.checksum = checksum;
+
+    /* A single buffer's worth cannot overlap anything; skip the threads */
+    if (pipeline.chunk_count <= 1) {
+        int status = send_encrypted(client_socket, file_fd, offset, length, show_progress, checksum);
+        if (stats) {
+            memset(stats, 0, sizeof(*stats));
+            stats->elapsed_ns = pipeline_now_ns() - started;
+        }
+        return status;
+    }
+
+    pipeline.slot_count = config->buffer_count;
+    if ((uint64_t)pipeline.slot_count > pipeline.chunk_count) {
+        pipeline.slot_count = (int)pipeline.chunk_count;
+    }
+    pipeline.slots = (pipeline_slot_t *)calloc((size_t)pipeline.slot_count, sizeof(pipeline_slot_t));
+    int allocated = 0;
+    while (pipeline.slots && allocated < pipeline.slot_count &&
+           (pipeline.slots[allocated].data = (unsigned char *)buffer_pool_alloc(pipeline.buffer_size))) {
+        pipeline.slots[allocated++].state = SLOT_FREE;
+    }
+    if (allocated < pipeline.slot_count) {
+        perror("Failed to allocate pipeline buffers");
+        free_pipeline_slots(&pipeline, allocated);
+        return ERROR_MEMORY;
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.slot_free, NULL);
+    pthread_cond_init(&pipeline.slot_read, NULL);
+    pthread_cond_init(&pipeline.slot_encrypted, NULL);
+
+    pthread_t reader;
+    pthread_t encryptor;
+    int reader_started = pthread_create(&reader, NULL, pipeline_reader_main, &pipeline) == 0;
+    int encryptor_started = reader_started &&
+                            pthread_create(&encryptor, NULL, pipeline_encryptor_main, &pipeline) == 0;
+    if (!encryptor_started) {
+        perror("Failed to create pipeline thread");
+        pipeline_fail(&pipeline, ERROR_THREAD);
+    }
+
+    /*
+     * The calling thread is the send stage. A slot sent zerocopy still
+     * belongs to the kernel, so it is handed back to the reader only once
+     * its completion is reaped; at most half the ring waits on the network
+     * so the reader and encryptor keep the rest.
+     */
+    zerocopy_sender_t *zerocopy = (zerocopy_sender_t *)malloc(sizeof(zerocopy_sender_t));
+    if (zerocopy) {
+        zerocopy_init(zerocopy, client_socket);
+    }
+    progress_t progress;
+    progress_init(&progress);
+    uint64_t total_sent = 0;
+    uint64_t unreleased = 0;  // Oldest chunk whose slot the sender still holds
+    for (uint64_t seq = 0; seq < pipeline.chunk_count; seq++) {
+        pipeline_slot_t *slot = pipeline_wait(&pipeline, seq, SLOT_ENCRYPTED, &pipeline.slot_encrypted,
+                                              &pipeline.stats.send_stall_ns);
+        if (!slot) {
+            break;
+        }
+        size_t sent = slot->length;  // The reader may refill the slot once it is released below
+        uint64_t send_started = pipeline_now_ns();
+        int status = zerocopy ? zerocopy_send(zerocopy, slot->data, sent)
+                              : send_all(client_socket, slot->data, sent);
+        if (status == SUCCESS && zerocopy) {
+            slot->zerocopy_id = zerocopy->next_id;
+            status = zerocopy_reap(zerocopy, 0);
+            while (status == SUCCESS && unreleased <= seq) {
+                pipeline_slot_t *oldest = &pipeline.slots[unreleased % (uint64_t)pipeline.slot_count];
+                if (zerocopy_reached(zerocopy, oldest->zerocopy_id)) {
+                    pipeline_advance(&pipeline, oldest, SLOT_FREE, &pipeline.slot_free);
+                    unreleased++;
+                } else if (seq + 1 - unreleased > (uint64_t)pipeline.slot_count / 2) {
+                    status = zerocopy_reap(zerocopy, 1);
+                } else {
+                    break;
+                }
+            }
+        } else if (status == SUCCESS) {
+            pipeline_advance(&pipeline, slot, SLOT_FREE, &pipeline.slot_free);
+        }
+        if (status != SUCCESS) {
+            perror("Failed to send file data");
+            report_early_response(client_socket);
+            pipeline_fail(&pipeline, ERROR_NETWORK);
+            break;
+        }
+        pipeline.stats.send_busy_ns += pipeline_now_ns() - send_started;
+        total_sent += sent;
+        if (show_progress) {
+            progress_bytes(&progress, "Sent", total_sent, length);
+        }
+    }
+
+    if (reader_started) {
+        pthread_join(reader, NULL);
+    }
+    if (encryptor_started) {
+        pthread_join(encryptor, NULL);
+    }
+
+    /* The buffers go back to the pool only once the kernel is done with them */
+    if (zerocopy) {
+        if (pipeline.status == SUCCESS && zerocopy_drain(zerocopy) != SUCCESS) {
+            perror("Failed to collect zerocopy completions");
+            pipeline.status = ERROR_NETWORK;
+        }
+        pipeline.stats.zerocopy_bytes = zerocopy->zerocopy_bytes;
+        pipeline.stats.zerocopy_copied = zerocopy->copied;
+        free(zerocopy);
+    }
+    pthread_cond_destroy(&pipeline.slot_free);
+    pthread_cond_destroy(&pipeline.slot_read);
+    pthread_cond_destroy(&pipeline.slot_encrypted);
+    pthread_mutex_destroy(&pipeline.lock);
+    free_pipeline_slots(&pipeline, pipeline.slot_count);
+
+    pipeline.stats.elapsed_ns = pipeline_now_ns() - started;
+    if (stats) {
+        *stats = pipeline.stats;
+    }
+    return pipeline.status;
+}
+
+/* Print one summary line of where the pipeline stalled */
+void print_pipeline_stats(const pipeline_config_t *config, const pipeline_stats_t *stats) {
+    printf("Pipeline: %d x %zu KiB buffers, %.1f ms; stalled: read %.1f ms, encrypt %.1f ms, send %.1f ms; "
+           "busy: read %.1f ms, encrypt %.1f ms, send %.1f ms\n",
+           config->buffer_count, config->buffer_size / 1024, stats->elapsed_ns / 1e6,
+           stats->read_stall_ns / 1e6, stats->encrypt_stall_ns / 1e6, stats->send_stall_ns / 1e6,
+           stats->read_busy_ns / 1e6, stats->encrypt_busy_ns / 1e6, stats->send_busy_ns / 1e6);
+    if (stats->zerocopy_bytes > 0) {
+        printf("Zerocopy: %.1f MiB sent from the pipeline buffers%s\n", stats->zerocopy_bytes / (1024.0 * 1024.0),
+               stats->zerocopy_copied ? "; the kernel copied them anyway (loopback?), so it was switched off" : "");
+    }
+}
+
+/* Wait for the server's acknowledgment; returns the number of bytes received */
+ssize_t receive_ack(int client_socket, char *ack_buffer, size_t size) {
+    memset(ack_buffer, 0, size);
+    ssize_t ack_bytes = recv(client_socket, ack_buffer, size - 1, 0);
+    if (ack_bytes > 0) {
+        ack_buffer[ack_bytes] = '\0';
+    }
+    return ack_bytes;
+}
+
+/* Stable id for a file's current contents, so a rerun resumes the same transfer */
+uint64_t file_transfer_id(const struct stat *file_stat) {
+    uint64_t fields[4] = {
+        (uint64_t)file_stat->st_dev, (uint64_t)file_stat->st_ino, (uint64_t)file_stat->st_size,
+        (uint64_t)file_stat->st_mtim.tv_sec * 1000000000ULL + (uint64_t)file_stat->st_mtim.tv_nsec
+    };
+    uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a over the identity fields
+    for (size_t i = 0; i < sizeof(fields); i++) {
+        hash ^= ((const unsigned char *)fields)[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Send the OP_PUT header and filename in one write, asking for the given features */
+int send_put_header(int client_socket, const char *filename, const struct stat *file_stat,
+                    uint16_t features) {
+    request_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTOCOL_MAGIC;
+    header.version = PROTOCOL_VERSION;
+    header.opcode = OP_PUT;
+    header.name_len = (uint16_t)strlen(filename);
+    header.flags = features;
+    header.transfer_id = file_transfer_id(file_stat);
+    header.total_size = (uint64_t)file_stat->st_size;
+    header.length = header.total_size;
+    if (send_request(client_socket, &header, filename) != SUCCESS) {
+        perror("Failed to send request header");
+        return ERROR_NETWORK;
+    }
+    return SUCCESS;
+}
+
+/* Read the server's granted features and report any it declined */
+int check_put_reply(int client_socket, uint16_t features, uint32_t *granted_features) {
+    unsigned char reply[PUT_REPLY_SIZE];
+    if (recv_all(client_socket, reply, sizeof(reply)) != SUCCESS) {
+        fprintf(stderr, "Server did not accept the upload (it may predate OP_PUT; retry with -L)\n");
+        return ERROR_NETWORK;
+    }
+    uint32_t granted = get_le32(reply);
+    if ((features & PUT_FEATURE_SYNC) && !(granted & PUT_FEATURE_SYNC)) {
+        printf("Server declined to fsync the file\n");
+    }
+    if (granted_features) {
+        *granted_features = granted;
+    }
+    return SUCCESS;
+}
+
+/* Send the chunk and file CRCs that follow a checksummed OP_PUT payload */
+int send_checksum_trailer(int client_socket, const checksum_state_t *checksum) {
+    size_t size = checksum_trailer_size(checksum);
+    unsigned char *trailer = (unsigned char *)buffer_pool_alloc(size);
+    if (!trailer) {
+        perror("Failed to allocate checksum trailer");
+        return ERROR_MEMORY;
+    }
+    checksum_encode_trailer(checksum, trailer);
+    int status = send_all(client_socket, trailer, size);
+    if (status != SUCCESS) {
+        perror("Failed to send checksums");
+    }
+    buffer_pool_free(trailer, size);
+    return status;
+}
+
+/* Plain OP_PUT upload of a whole file, without progress output */
+int put_file(const char *server_ip, int server_port, int file_fd, const char *filename,
+             const struct stat *file_stat, uint16_t features) {
+    int client_socket = connect_to_server(server_ip, server_port);
+    if (client_socket < 0) {
+        return ERROR_CONNECT;
+    }
+
+    checksum_state_t checksum;
+    int status = checksum_init(&checksum, (uint64_t)file_stat->st_size);
+    if (status == SUCCESS) {
+        socket_set_cork(client_socket, 1);  // Header rides in the payload's first segment
+        status = send_put_header(client_socket, filename, file_stat, features);
+        if (status != SUCCESS) {
+            report_early_response(client_socket);
+        }
+    }
+    if (status == SUCCESS) {
+        pipeline_config_t config = { PIPELINE_DEFAULT_BUFFERS, PIPELINE_DEFAULT_BUFFER_SIZE };
+        status = send_file_pipelined(client_socket, file_fd, 0, (uint64_t)file_stat->st_size, &config, 0,
+                                     (features & PUT_FEATURE_CHECKSUM) ? &checksum : NULL, NULL);
+        socket_set_cork(client_socket, 0);
+    }
+    uint32_t granted = 0;
+    if (status == SUCCESS) {
+        status = check_put_reply(client_socket, features, &granted);
+    }
+    if (status == SUCCESS && (granted & PUT_FEATURE_CHECKSUM)) {
+        status = send_checksum_trailer(client_socket, &checksum);
+    }
+    checksum_free(&checksum);
+    char response[256];
+    if (status == SUCCESS && (receive_ack(client_socket, response, sizeof(response)) <= 0 ||
+                              strcmp(response, ACK_FILE_COMPLETE) != 0)) {
+        status = ERROR_NETWORK;
+    }
+    close(client_socket);
+    return status;
+}
+
+/* Receive length encrypted bytes, decrypting them into out_fd (or dropping them if out_fd < 0) */
+static int receive_download(int client_socket, int out_fd, uint64_t length, int show_progress) {
+    unsigned char *chunk = (unsigned char *)buffer_pool_alloc(STREAM_CHUNK_SIZE);
+    if (!chunk) {
+        perror("Failed to allocate receive buffer");
+        return ERROR_MEMORY;
+    }
+
+    progress_t progress;
+    progress_init(&progress);
+    int status = SUCCESS;
+    uint64_t received = 0;
+    while (status == SUCCESS && received < length) {
+        size_t want = STREAM_CHUNK_SIZE;
+        if (length - received < want) {
+            want = (size_t)(length - received);
+        }
+        ssize_t bytes_received = recv(client_socket, chunk, want, 0);
+        if (bytes_received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_received <= 0) {
+            fprintf(stderr, "\nConnection lost after %llu of %llu bytes\n", (unsigned long long)received,
+                    (unsigned long long)length);
+            status = ERROR_NETWORK;
+            break;
+        }
+        decrypt_buffer(chunk, (size_t)bytes_received, ENCRYPTION_KEY);
+        for (size_t written = 0; out_fd >= 0 && written < (size_t)bytes_received;) {
+            ssize_t bytes_written = write(out_fd, chunk + written, (size_t)bytes_received - written);
+            if (bytes_written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_written <= 0) {
+                perror("Failed to write file data");
+                status = ERROR_FILE_IO;
+                break;
+            }
+            written += (size_t)bytes_written;
+        }
+        received += (uint64_t)bytes_received;
+        if (show_progress) {
+            progress_bytes(&progress, "Received", received, length);
+        }
+    }
+
+    buffer_pool_free(chunk, STREAM_CHUNK_SIZE);
+    return status;
+}
+
+/* OP_GET download of a whole stored file */
+int get_file(const char *server_ip, int server_port, const char *name, int out_fd, int show_progress,
+             uint64_t *file_size) {
+    int client_socket = connect_to_server(server_ip, server_port);
+    if (client_socket < 0) {
+        return ERROR_CONNECT;
+    }
+
+    request_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTOCOL_MAGIC;
+    header.version = PROTOCOL_VERSION;
+    header.opcode = OP_GET;
+    header.name_len = (uint16_t)strlen(name);
+    unsigned char reply[GET_REPLY_SIZE];
+    int status = send_request(client_socket, &header, name);
+    if (status != SUCCESS) {
+        perror("Failed to send request header");
+    } else if (recv_all(client_socket, reply, sizeof(reply)) != SUCCESS) {
+        fprintf(stderr, "Server did not answer the download request (it may predate OP_GET)\n");
+        status = ERROR_NETWORK;
+    } else if ((int32_t)get_le32(reply) != SUCCESS) {
+        fprintf(stderr, "Server has no stored file named %s\n", name);
+        status = ERROR_FILE_IO;
+    } else {
+        *file_size = get_le64(reply + 4);
+        status = receive_download(client_socket, out_fd, get_le64(reply + 12), show_progress);
+    }
+    close(client_socket);
+    return status;
+}
+
@@ -0,0 +1,89 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "common.h"
+#include "checksum.h"
+#include <stdint.h>
+
+/*
+ * Client-side upload building blocks shared by the client and the load
+ * generator. Payloads are encrypted as they are sent.
+ */
+
+/* Connect to the server; returns the socket or -1 */
+int connect_to_server(const char *server_ip, int server_port);
+
+/* Print any response the server sent before dropping us (e.g. a busy rejection) */
+void report_early_response(int client_socket);
+
+/* Read, encrypt and send length bytes of the file starting at offset */
+int send_file_data(int client_socket, int file_fd, uint64_t offset, uint64_t length, int show_progress);
+
+/*
+ * Pipelined sends: a reader thread, an encryptor thread and the calling
+ * thread (sender) pass a fixed ring of reusable buffers around, so the
+ * disk, the CPU and the socket are busy at the same time.
+ */
+#define PIPELINE_DEFAULT_BUFFERS 8
+#define PIPELINE_DEFAULT_BUFFER_SIZE (256 * 1024)
+#define PIPELINE_MAX_BUFFERS 256
+#define PIPELINE_MIN_BUFFER_SIZE 4096
+#define PIPELINE_MAX_BUFFER_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+    int buffer_count;
+    size_t buffer_size;
+} pipeline_config_t;
+
+/* Where each stage spent its time; a stall is time spent waiting on a neighbour */
+typedef struct {
+    uint64_t elapsed_ns;
+    uint64_t read_busy_ns;
+    uint64_t read_stall_ns;     // Reader waiting for a free buffer
+    uint64_t encrypt_busy_ns;
+    uint64_t encrypt_stall_ns;  // Encryptor waiting for a filled buffer
+    uint64_t send_busy_ns;
+    uint64_t send_stall_ns;     // Sender waiting for an encrypted buffer
+    uint64_t zerocopy_bytes;    // Sent with MSG_ZEROCOPY
+    int zerocopy_copied;        // The kernel copied zerocopy sends, so zerocopy was switched off
+} pipeline_stats_t;
+
+/*
+ * Same contract as send_file_data. With checksum set, the encryptor also
+ * checksums every chunk in the same pass; stats may be NULL.
+ */
+int send_file_pipelined(int client_socket, int file_fd, uint64_t offset, uint64_t length,
+                        const pipeline_config_t *config, int show_progress, checksum_state_t *checksum,
+                        pipeline_stats_t *stats);
+
+/* Print one summary line of where the pipeline stalled */
+void print_pipeline_stats(const pipeline_config_t *config, const pipeline_stats_t *stats);
+
+/* Wait for the server's acknowledgment; returns the number of bytes received */
+ssize_t receive_ack(int client_socket, char *ack_buffer, size_t size);
+
+/* Stable id for a file's current contents, so a rerun resumes the same transfer */
+uint64_t file_transfer_id(const struct stat *file_stat);
+
+/*
+ * OP_PUT: header and filename in one write; after the payload, the granted
+ * features (granted_features may be NULL) and, if PUT_FEATURE_CHECKSUM was
+ * granted, the checksum trailer.
+ */
+int send_put_header(int client_socket, const char *filename, const struct stat *file_stat,
+                    uint16_t features);
+int check_put_reply(int client_socket, uint16_t features, uint32_t *granted_features);
+int send_checksum_trailer(int client_socket, const checksum_state_t *checksum);
+
+/* Whole-file OP_PUT upload on a fresh connection, without progress output; fails unless acknowledged */
+int put_file(const char *server_ip, int server_port, int file_fd, const char *filename,
+             const struct stat *file_stat, uint16_t features);
+
+/*
+ * Whole-file OP_GET download on a fresh connection, decrypted into out_fd
+ * (discarded if out_fd < 0); file_size gets the stored file's size.
+ */
+int get_file(const char *server_ip, int server_port, const char *name, int out_fd, int show_progress,
+             uint64_t *file_size);
+
+#endif /* TRANSFER_H */
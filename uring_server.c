@@ -0,0 +1,993 @@
+#include "uring_server.h"
+#include "crypto.h"
+#include "logger.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "buffer_pool.h"
+#include "checksum.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Minimal io_uring binding over the raw system calls (no liburing) */
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned pending;  // Entries queued since the last io_uring_enter
+} ring_t;
+
+typedef enum {
+    URING_ACCEPT,
+    URING_HEADER,
+    URING_RECV,
+    URING_WRITE,
+    URING_FSYNC,
+    URING_REPLY,
+    URING_SEND
+} uring_op_kind_t;
+
+struct uring_conn;
+
+/* One in-flight request; its address is the SQE user_data */
+typedef struct {
+    uring_op_kind_t kind;
+    struct uring_conn *conn;
+    int buffer;              // Registered buffer for RECV and WRITE
+    uint32_t data_offset;    // Start of the payload within the buffer
+    uint32_t length;         // Payload bytes to write
+    uint32_t done;           // Bytes already written by earlier short writes
+    uint64_t file_offset;
+    uint64_t started_ns;
+} uring_op_t;
+
+/* Protocol phases of a single upload */
+typedef enum {
+    UCONN_PREFIX,      // Reserved prefix, then the rest of an extended header
+    UCONN_PUT_HEADER,  // Filename of a versioned OP_PUT request
+    UCONN_FILENAME,    // Legacy NUL-terminated filename and size
+    UCONN_BODY,
+    UCONN_TRAILER,     // Checksum trailer after the body (PUT_FEATURE_CHECKSUM)
+    UCONN_ACK
+} uring_conn_state_t;
+
+/* Per-connection state machine; payload lives in the shared registered buffers */
+typedef struct uring_conn {
+    int socket;
+    int socket_slot;         // Fixed-file slot of the socket
+    int file_fd;
+    int file_slot;           // Fixed-file slot of the output file
+    uring_conn_state_t state;
+    struct sockaddr_in client_addr;
+    uint64_t accepted_ns;
+    char client_ip[INET_ADDRSTRLEN];
+    int client_port;
+    char filename[MAX_FILENAME_LEN];
+    size_t file_size;
+    size_t total_received;   // Body bytes received
+    size_t total_written;    // Body bytes on disk
+    unsigned char header[PROTOCOL_HEADER_SIZE + MAX_FILENAME_LEN];  // Extended or legacy header bytes
+    size_t header_len;
+    size_t header_need;      // OP_PUT header plus filename
+    uint32_t features;       // PUT_FEATURE_* granted to this upload
+    checksum_state_t checksum;
+    unsigned char reply[PUT_REPLY_SIZE];
+    int recv_pending;
+    int writes_pending;      // Writes plus the PUT_FEATURE_SYNC fsync
+    int control_pending;     // Header receive, feature reply or acknowledgment in flight
+    int failed;              // Also set once the acknowledgment is out, to release the connection
+    int waiting;             // Queued for a free buffer
+    struct uring_conn *next_waiting;
+    const char *ack;
+    size_t ack_sent;
+    uring_op_t control;
+    uring_op_t sync;
+    char output_path[MAX_PATH_LEN];
+} uring_conn_t;
+
+/* Engine state, one copy per thread running the loop so each shard has its own ring */
+static _Thread_local ring_t ring;
+static _Thread_local size_t buffer_size;
+static _Thread_local unsigned char *buffer_memory = NULL;
+static _Thread_local uring_op_t buffer_ops[URING_BUFFER_COUNT];
+static _Thread_local int free_buffers[URING_BUFFER_COUNT];
+static _Thread_local int free_buffer_count = 0;
+static _Thread_local int free_slots[URING_FIXED_FILES];
+static _Thread_local int free_slot_count = 0;
+static _Thread_local uring_conn_t *waiting_head = NULL;
+static _Thread_local uring_conn_t *waiting_tail = NULL;
+static _Thread_local uring_op_t accept_op;
+static _Thread_local struct sockaddr_in accept_addr;
+static _Thread_local socklen_t accept_addr_len;
+
+/* Shared by every loop and read by handoff threads; the same for every shard */
+static const char *ack_message = ACK_FILE_COMPLETE;
+static client_handler_t extended_request_handler = NULL;
+
+static void ring_unmap(ring_t *r) {
+    if (r->sqes && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring && r->sq_ring != MAP_FAILED) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    close(r->fd);
+}
+
+/* Create the ring and map its queues; ERROR_UNSUPPORTED if the kernel refuses */
+static int ring_setup(ring_t *r, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (r->fd < 0) {
+        return ERROR_UNSUPPORTED;
+    }
+
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = r->sq_ring;
+    if (r->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        ring_unmap(r);
+        return ERROR_UNSUPPORTED;
+    }
+
+    unsigned char *sq = (unsigned char *)r->sq_ring;
+    unsigned char *cq = (unsigned char *)r->cq_ring;
+    r->sq_head = (unsigned *)(sq + params.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + params.sq_off.array);
+    r->sq_entries = params.sq_entries;
+    r->cq_head = (unsigned *)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return SUCCESS;
+}
+
+static int ring_register(ring_t *r, unsigned opcode, const void *arg, unsigned count) {
+    return (syscall(__NR_io_uring_register, r->fd, opcode, arg, count) < 0) ? ERROR_SOCKET : SUCCESS;
+}
+
+/* Check that the kernel implements every opcode the engine issues */
+static int ring_supports_opcodes(ring_t *r) {
+    static const unsigned char needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ_FIXED,
+        IORING_OP_WRITE_FIXED, IORING_OP_FSYNC
+    };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, size);
+    if (!probe) {
+        return 0;
+    }
+    int supported = (ring_register(r, IORING_REGISTER_PROBE, probe, 256) == SUCCESS);
+    for (size_t i = 0; supported && i < sizeof(needed); i++) {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+/*
+ * Submit queued entries and, if asked, wait for a completion, in one system
+ * call. ERROR_BUSY means the kernel wants completions reaped first.
+ */
+static int ring_enter(ring_t *r, unsigned wait_for) {
+    int submitted = (int)syscall(__NR_io_uring_enter, r->fd, r->pending, wait_for,
+                                 wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    metrics_add(METRIC_URING_ENTERS, 1);
+    if (submitted < 0) {
+        if (errno == EINTR) {
+            return SUCCESS;
+        }
+        return (errno == EAGAIN || errno == EBUSY) ? ERROR_BUSY : ERROR_SOCKET;
+    }
+    r->pending -= (unsigned)submitted;
+    return SUCCESS;
+}
+
+/* Next free SQE, zeroed; submits the queue first when it is full */
+static struct io_uring_sqe* ring_get_sqe(ring_t *r) {
+    unsigned tail = *r->sq_tail;
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        if (ring_enter(r, 0) != SUCCESS) {
+            return NULL;
+        }
+    }
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+    return sqe;
+}
+
+/* Point a fixed-file slot at fd; -1 empties it */
+static int set_fixed_file(int slot, int fd) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = (unsigned)slot;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    return ring_register(&ring, IORING_REGISTER_FILES_UPDATE, &update, 1);
+}
+
+static int claim_slot(int fd) {
+    if (free_slot_count == 0) {
+        return -1;
+    }
+    int slot = free_slots[--free_slot_count];
+    if (set_fixed_file(slot, fd) != SUCCESS) {
+        free_slots[free_slot_count++] = slot;
+        return -1;
+    }
+    return slot;
+}
+
+/* Empty a slot; must happen before its descriptor is closed */
+static void release_slot(int slot) {
+    set_fixed_file(slot, -1);
+    free_slots[free_slot_count++] = slot;
+}
+
+static unsigned char* buffer_data(int buffer) {
+    return buffer_memory + (size_t)buffer * buffer_size;
+}
+
+static void start_recv(uring_conn_t *conn);
+
+/* Return a buffer and hand it to the longest-waiting connection */
+static void release_buffer(int buffer) {
+    free_buffers[free_buffer_count++] = buffer;
+    while (waiting_head && free_buffer_count > 0) {
+        uring_conn_t *conn = waiting_head;
+        waiting_head = conn->next_waiting;
+        if (!waiting_head) {
+            waiting_tail = NULL;
+        }
+        conn->waiting = 0;
+        conn->next_waiting = NULL;
+        start_recv(conn);
+    }
+}
+
+static void stop_waiting(uring_conn_t *conn) {
+    uring_conn_t *previous = NULL;
+    uring_conn_t *current = waiting_head;
+    while (current && current != conn) {
+        previous = current;
+        current = current->next_waiting;
+    }
+    if (current) {
+        if (previous) {
+            previous->next_waiting = conn->next_waiting;
+        } else {
+            waiting_head = conn->next_waiting;
+        }
+        if (waiting_tail == conn) {
+            waiting_tail = previous;
+        }
+    }
+    conn->waiting = 0;
+}
+
+/* Release a failed or finished connection once none of its requests are in flight */
+static void maybe_destroy(uring_conn_t *conn) {
+    if (!conn->failed || conn->recv_pending || conn->writes_pending || conn->control_pending) {
+        return;
+    }
+    if (conn->waiting) {
+        stop_waiting(conn);
+    }
+    if (conn->file_slot >= 0) {
+        release_slot(conn->file_slot);
+    }
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        unlink(conn->output_path);
+        log_transfer(conn->client_ip, conn->client_port, conn->filename, conn->file_size, "FAILED");
+        metrics_add(METRIC_FILES_FAILED, 1);
+    }
+    checksum_free(&conn->checksum);
+    release_slot(conn->socket_slot);
+    close(conn->socket);
+    metrics_add(METRIC_ACTIVE_CONNECTIONS, -1);
+    metrics_observe(METRIC_REQUEST_TIME, metrics_now_ns() - conn->accepted_ns);
+    buffer_pool_free(conn, sizeof(uring_conn_t));
+}
+
+static void fail_connection(uring_conn_t *conn) {
+    conn->failed = 1;
+    maybe_destroy(conn);
+}
+
+/* Pass an extended request, with the header already read, to the blocking handler */
+static void handoff_connection(uring_conn_t *conn) {
+    release_slot(conn->socket_slot);
+    metrics_add(METRIC_ACTIVE_CONNECTIONS, -1);  // The handler counts it from here on
+
+    client_info_t client;
+    client.client_socket = conn->socket;
+    client.client_addr = conn->client_addr;
+    client.accepted_ns = conn->accepted_ns;
+    client.request_header = conn->header;
+    extended_request_handler(&client);
+    buffer_pool_free(conn, sizeof(uring_conn_t));
+}
+
+/*
+ * Receive the connection's first bytes into conn->header: the reserved
+ * prefix, and once that matches, the rest of the extended header. Every
+ * legacy header is longer than the prefix, so no payload is read here.
+ */
+static void submit_header_recv(uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+    if (!sqe) {
+        fail_connection(conn);
+        return;
+    }
+    size_t want = (conn->header_len < PROTOCOL_PREFIX_SIZE) ? PROTOCOL_PREFIX_SIZE : PROTOCOL_HEADER_SIZE;
+    conn->control.kind = URING_HEADER;
+    conn->control.conn = conn;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket_slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)(conn->header + conn->header_len);
+    sqe->len = (unsigned)(want - conn->header_len);
+    sqe->user_data = (uint64_t)(uintptr_t)&conn->control;
+    conn->control_pending = 1;
+}
+
+static int submit_reply(uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+    if (!sqe) {
+        return ERROR_NETWORK;
+    }
+    put_le32(conn->reply, conn->features);
+    conn->control.kind = URING_REPLY;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->socket_slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)conn->reply;
+    sqe->len = sizeof(conn->reply);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)&conn->control;
+    conn->control_pending = 1;
+    return SUCCESS;
+}
+
+static void submit_ack(uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+    if (!sqe) {
+        fail_connection(conn);
+        return;
+    }
+    conn->control.kind = URING_SEND;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->socket_slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)(conn->ack + conn->ack_sent);
+    sqe->len = (unsigned)(strlen(conn->ack) - conn->ack_sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)&conn->control;
+    conn->control_pending = 1;
+}
+
+/* Queue the unwritten part of a buffer's payload at its file offset */
+static int submit_write(uring_op_t *op) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+    if (!sqe) {
+        return ERROR_FILE_IO;
+    }
+    op->kind = URING_WRITE;
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = op->conn->file_slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)(buffer_data(op->buffer) + op->data_offset + op->done);
+    sqe->len = op->length - op->done;
+    sqe->off = op->file_offset + op->done;
+    sqe->buf_index = (uint16_t)op->buffer;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    return SUCCESS;
+}
+
+/* Flush a PUT_FEATURE_SYNC upload through the ring instead of blocking the loop in fsync */
+static int submit_fsync(uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+    if (!sqe) {
+        return ERROR_FILE_IO;
+    }
+    conn->sync.kind = URING_FSYNC;
+    conn->sync.conn = conn;
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = conn->file_slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->user_data = (uint64_t)(uintptr_t)&conn->sync;
+    conn->writes_pending++;
+    return SUCCESS;
+}
+
+/* Keep one receive in flight per connection while it has room for more writes */
+static void start_recv(uring_conn_t *conn) {
+    if (conn->failed || conn->recv_pending || conn->waiting || conn->state == UCONN_ACK ||
+        conn->writes_pending >= URING_WRITES_PER_CONN ||
+        (conn->state == UCONN_BODY && conn->total_received == conn->file_size) ||
+        (conn->state == UCONN_TRAILER && checksum_trailer_remaining(&conn->checksum) == 0)) {
+        return;
+    }
+    if (free_buffer_count == 0) {
+        conn->waiting = 1;
+        conn->next_waiting = NULL;
+        if (waiting_tail) {
+            waiting_tail->next_waiting = conn;
+        } else {
+            waiting_head = conn;
+        }
+        waiting_tail = conn;
+        return;
+    }
+    struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+    if (!sqe) {
+        fail_connection(conn);
+        return;
+    }
+
+    int buffer = free_buffers[--free_buffer_count];
+    uring_op_t *op = &buffer_ops[buffer];
+    size_t want = buffer_size;
+    if (conn->state == UCONN_BODY && conn->file_size - conn->total_received < want) {
+        want = conn->file_size - conn->total_received;
+    } else if (conn->state == UCONN_TRAILER && checksum_trailer_remaining(&conn->checksum) < want) {
+        want = checksum_trailer_remaining(&conn->checksum);
+    }
+    op->kind = URING_RECV;
+    op->conn = conn;
+    op->started_ns = metrics_now_ns();
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = conn->socket_slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)buffer_data(buffer);
+    sqe->len = (unsigned)want;
+    sqe->buf_index = (uint16_t)buffer;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    conn->recv_pending = 1;
+}
+
+/* Transition into the body phase once the header is complete */
+static int begin_body(uring_conn_t *conn) {
+    printf("Receiving file: %s (%zu bytes) from %s:%d\n", conn->filename, conn->file_size,
+           conn->client_ip, conn->client_port);
+    snprintf(conn->output_path, sizeof(conn->output_path), "%s/%s", RECEIVED_FILES_DIR, conn->filename);
+    conn->file_fd = open(conn->output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (conn->file_fd < 0) {
+        perror("Failed to create output file");
+        log_message(LOG_ERROR, "Failed to create output file: %s", conn->output_path);
+        return ERROR_FILE_IO;
+    }
+    conn->file_slot = claim_slot(conn->file_fd);
+    if (conn->file_slot < 0) {
+        log_message(LOG_ERROR, "No fixed-file slot left for %s", conn->output_path);
+        return ERROR_FILE_IO;
+    }
+    conn->state = UCONN_BODY;
+    return SUCCESS;
+}
+
+/* Every byte is on disk (and flushed if asked): close the file, log it and send the acknowledgment */
+static void finish_body(uring_conn_t *conn) {
+    release_slot(conn->file_slot);
+    conn->file_slot = -1;
+    int file_fd = conn->file_fd;
+    conn->file_fd = -1;
+    if (close(file_fd) < 0) {
+        perror("Failed to flush output file");
+        unlink(conn->output_path);
+        log_transfer(conn->client_ip, conn->client_port, conn->filename, conn->file_size, "FAILED");
+        metrics_add(METRIC_FILES_FAILED, 1);
+        fail_connection(conn);
+        return;
+    }
+
+    printf("File saved successfully: %s\n", conn->output_path);
+    log_transfer(conn->client_ip, conn->client_port, conn->filename, conn->file_size, "SUCCESS");
+    metrics_add(METRIC_FILES_STORED, 1);
+    conn->state = UCONN_ACK;
+    conn->ack = ack_message;
+    conn->ack_sent = 0;
+    if (!conn->control_pending) {
+        submit_ack(conn);  // Otherwise the feature reply's completion sends it
+    }
+}
+
+/* The checksum trailer did not match: discard the file and tell the client */
+static void reject_body(uring_conn_t *conn) {
+    release_slot(conn->file_slot);
+    conn->file_slot = -1;
+    close(conn->file_fd);
+    conn->file_fd = -1;
+    unlink(conn->output_path);
+    printf("Checksum mismatch, discarding %s\n", conn->filename);
+    log_message(LOG_ERROR, "Checksum mismatch for %s from %s:%d at trailer entry %llu of %llu",
+                conn->filename, conn->client_ip, conn->client_port, (unsigned long long)conn->checksum.bad_entry,
+                (unsigned long long)conn->checksum.chunk_count + 1);
+    log_transfer(conn->client_ip, conn->client_port, conn->filename, conn->file_size, "FAILED");
+    metrics_add(METRIC_FILES_FAILED, 1);
+    metrics_add(METRIC_CHECKSUM_FAILURES, 1);
+    conn->state = UCONN_ACK;
+    conn->ack = ACK_CHECKSUM_MISMATCH;
+    conn->ack_sent = 0;
+    if (!conn->control_pending) {
+        submit_ack(conn);
+    }
+}
+
+/*
+ * Called whenever the body or trailer advances: keep receiving the trailer,
+ * and once every byte is on disk (and the trailer is in) finish or reject.
+ * A PUT_FEATURE_SYNC upload is flushed first and finished by handle_fsync.
+ */
+static void maybe_finish(uring_conn_t *conn) {
+    if (conn->state == UCONN_TRAILER && checksum_trailer_remaining(&conn->checksum) > 0) {
+        start_recv(conn);
+        return;
+    }
+    if (conn->total_written < conn->file_size || conn->writes_pending) {
+        return;  // The last write completion comes back here
+    }
+    if (conn->state == UCONN_TRAILER && checksum_verify(&conn->checksum) != SUCCESS) {
+        reject_body(conn);
+        return;
+    }
+    if (conn->features & PUT_FEATURE_SYNC) {
+        if (submit_fsync(conn) != SUCCESS) {
+            fail_connection(conn);
+        }
+        return;  // handle_fsync finishes
+    }
+    finish_body(conn);
+}
+
+/* Collect the OP_PUT filename, then queue the granted-features reply */
+static int consume_put_header(uring_conn_t *conn, const unsigned char *data, size_t len, size_t *pos) {
+    size_t need = conn->header_need - conn->header_len;
+    size_t take = (len - *pos < need) ? len - *pos : need;
+    memcpy(conn->header + conn->header_len, data + *pos, take);
+    conn->header_len += take;
+    *pos += take;
+    if (conn->header_len < conn->header_need) {
+        return SUCCESS;
+    }
+
+    request_header_t header;
+    decode_request_header(conn->header, &header);
+    memcpy(conn->filename, conn->header + PROTOCOL_HEADER_SIZE, header.name_len);
+    conn->filename[header.name_len] = '\0';
+    if (check_request_name(conn->filename, header.name_len) != SUCCESS) {
+        log_message(LOG_ERROR, "Invalid request header from %s:%d", conn->client_ip, conn->client_port);
+        return ERROR_NETWORK;
+    }
+    conn->file_size = (size_t)header.length;
+    conn->features = header.flags & PUT_FEATURES_SUPPORTED;
+    if ((conn->features & PUT_FEATURE_CHECKSUM) && checksum_init(&conn->checksum, header.length) != SUCCESS) {
+        conn->features &= ~(uint32_t)PUT_FEATURE_CHECKSUM;  // No room for the chunk CRCs: take it unverified
+    }
+    if (begin_body(conn) != SUCCESS) {
+        return ERROR_FILE_IO;
+    }
+    return submit_reply(conn);
+}
+
+/* Collect the legacy filename and size; bytes past them are handed back as body */
+static int consume_legacy_header(uring_conn_t *conn, const unsigned char *data, size_t len, size_t *pos) {
+    size_t room = MAX_FILENAME_LEN + sizeof(size_t) - conn->header_len;
+    size_t take = (len - *pos < room) ? len - *pos : room;
+    memcpy(conn->header + conn->header_len, data + *pos, take);
+    conn->header_len += take;
+    *pos += take;
+
+    uint64_t file_size;
+    int header_len = parse_legacy_header(conn->header, conn->header_len, conn->filename,
+                                         sizeof(conn->filename), &file_size);
+    if (header_len == 0) {
+        return SUCCESS;
+    }
+    if (header_len < 0) {
+        log_message(LOG_ERROR, "Invalid file header from %s:%d", conn->client_ip, conn->client_port);
+        return ERROR_FILE_IO;
+    }
+    *pos -= conn->header_len - (size_t)header_len;
+    conn->file_size = (size_t)file_size;
+    return begin_body(conn);
+}
+
+/* Feed header bytes through the state machine; pos ends at the first body byte */
+static int consume_header(uring_conn_t *conn, const unsigned char *data, size_t len, size_t *pos) {
+    while (*pos < len && conn->state != UCONN_BODY) {
+        if (conn->state == UCONN_PUT_HEADER) {
+            if (consume_put_header(conn, data, len, pos) != SUCCESS) {
+                return ERROR_FILE_IO;
+            }
+        } else if (consume_legacy_header(conn, data, len, pos) != SUCCESS) {
+            return ERROR_FILE_IO;
+        }
+    }
+    return SUCCESS;
+}
+
+/* A receive completed: decrypt the payload in place and write it while the next receive runs */
+static void handle_recv(uring_op_t *op, int result) {
+    uring_conn_t *conn = op->conn;
+    conn->recv_pending = 0;
+    metrics_observe(METRIC_RECV_TIME, metrics_now_ns() - op->started_ns);
+    if (result > 0) {
+        metrics_add(METRIC_BYTES_RECEIVED, result);
+    }
+    if (result <= 0 || conn->failed) {
+        if (result == 0) {
+            log_message(LOG_ERROR, "Connection from %s:%d closed mid-transfer",
+                        conn->client_ip, conn->client_port);
+        }
+        release_buffer(op->buffer);
+        fail_connection(conn);
+        return;
+    }
+
+    unsigned char *data = buffer_data(op->buffer);
+    if (conn->state == UCONN_TRAILER) {
+        checksum_consume_trailer(&conn->checksum, data, (size_t)result);
+        release_buffer(op->buffer);
+        maybe_finish(conn);
+        return;
+    }
+    size_t pos = 0;
+    if (consume_header(conn, data, (size_t)result, &pos) != SUCCESS) {
+        release_buffer(op->buffer);
+        fail_connection(conn);
+        return;
+    }
+    if (conn->state != UCONN_BODY) {
+        release_buffer(op->buffer);
+        start_recv(conn);
+        return;
+    }
+
+    size_t take = (size_t)result - pos;
+    if (conn->file_size - conn->total_received < take) {
+        take = conn->file_size - conn->total_received;
+    }
+    if (take == 0) {
+        release_buffer(op->buffer);
+    } else {
+        if (conn->features & PUT_FEATURE_CHECKSUM) {
+            checksum_decrypt(&conn->checksum, data + pos, take);
+        } else {
+            decrypt_buffer(data + pos, take, ENCRYPTION_KEY);
+        }
+        op->data_offset = (uint32_t)pos;
+        op->length = (uint32_t)take;
+        op->done = 0;
+        op->file_offset = conn->total_received;
+        op->started_ns = metrics_now_ns();
+        if (submit_write(op) != SUCCESS) {
+            release_buffer(op->buffer);
+            fail_connection(conn);
+            return;
+        }
+        conn->total_received += take;
+        conn->writes_pending++;
+    }
+
+    if (conn->total_received == conn->file_size && (conn->features & PUT_FEATURE_CHECKSUM)) {
+        conn->state = UCONN_TRAILER;
+    }
+    if (conn->file_size == 0 || conn->state == UCONN_TRAILER) {
+        maybe_finish(conn);
+        return;
+    }
+    start_recv(conn);
+}
+
+static void handle_write(uring_op_t *op, int result) {
+    uring_conn_t *conn = op->conn;
+    if (result > 0 && op->done + (uint32_t)result < op->length && !conn->failed) {
+        op->done += (uint32_t)result;  // Short write: queue the rest
+        if (submit_write(op) == SUCCESS) {
+            return;
+        }
+        result = -EIO;
+    }
+    metrics_observe(METRIC_WRITE_TIME, metrics_now_ns() - op->started_ns);
+    conn->writes_pending--;
+    if (result <= 0) {
+        errno = (result < 0) ? -result : EIO;
+        perror("Failed to write file data");
+        log_message(LOG_ERROR, "Write failed for %s after %zu bytes",
+                    conn->output_path, conn->total_written);
+        conn->failed = 1;
+    } else {
+        conn->total_written += op->length;
+        metrics_add(METRIC_BYTES_WRITTEN, op->length);
+    }
+    release_buffer(op->buffer);
+
+    if (conn->failed) {
+        maybe_destroy(conn);
+    } else if (conn->state == UCONN_TRAILER || conn->total_written == conn->file_size) {
+        maybe_finish(conn);
+    } else {
+        start_recv(conn);
+    }
+}
+
+/* First bytes of a connection: keep reading an extended header, or start a legacy upload with them */
+static void handle_header(uring_conn_t *conn, int result) {
+    if (result <= 0) {
+        if (result == 0 && conn->header_len > 0) {
+            log_message(LOG_ERROR, "Connection from %s:%d closed before its header",
+                        conn->client_ip, conn->client_port);
+        }
+        fail_connection(conn);
+        return;
+    }
+    metrics_add(METRIC_BYTES_RECEIVED, result);
+    conn->header_len += (size_t)result;
+
+    if (!extended_prefix_matches(conn->header, conn->header_len)) {
+        /* Every legacy header is longer than the prefix, so these bytes are all header */
+        conn->state = UCONN_FILENAME;
+        start_recv(conn);
+        return;
+    }
+    if (conn->header_len < PROTOCOL_HEADER_SIZE) {
+        submit_header_recv(conn);
+        return;
+    }
+
+    request_header_t header;
+    decode_request_header(conn->header, &header);
+    if (header.opcode != OP_PUT) {
+        handoff_connection(conn);
+        return;
+    }
+    if (check_request_header(&header, sizeof(conn->filename)) != SUCCESS) {
+        log_message(LOG_ERROR, "Invalid request header from %s:%d", conn->client_ip, conn->client_port);
+        fail_connection(conn);
+        return;
+    }
+    conn->header_need = PROTOCOL_HEADER_SIZE + header.name_len;
+    conn->state = UCONN_PUT_HEADER;
+    start_recv(conn);
+}
+
+static void handle_fsync(uring_op_t *op, int result) {
+    uring_conn_t *conn = op->conn;
+    conn->writes_pending--;
+    if (result < 0) {
+        errno = -result;
+        perror("Failed to flush output file");
+        log_message(LOG_ERROR, "fsync failed for %s", conn->output_path);
+        conn->failed = 1;
+    }
+    if (conn->failed) {
+        maybe_destroy(conn);
+    } else {
+        finish_body(conn);
+    }
+}
+
+/* Header receive, feature reply and acknowledgment completions */
+static void handle_control(uring_op_t *op, int result) {
+    uring_conn_t *conn = op->conn;
+    conn->control_pending = 0;
+    if (conn->failed) {
+        maybe_destroy(conn);
+        return;
+    }
+
+    if (op->kind == URING_HEADER) {
+        handle_header(conn, result);
+    } else if (op->kind == URING_REPLY) {
+        if (result != PUT_REPLY_SIZE) {
+            fail_connection(conn);
+        } else if (conn->state == UCONN_ACK) {
+            submit_ack(conn);  // The body finished while the reply was in flight
+        }
+    } else if (result <= 0) {
+        fail_connection(conn);
+    } else {
+        conn->ack_sent += (size_t)result;
+        if (conn->ack_sent < strlen(conn->ack)) {
+            submit_ack(conn);
+        } else {
+            fail_connection(conn);  // Done: the file was closed and logged by finish_body
+        }
+    }
+}
+
+static void submit_accept(int listen_socket) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+    if (!sqe) {
+        return;
+    }
+    accept_addr_len = sizeof(accept_addr);
+    accept_op.kind = URING_ACCEPT;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_socket;
+    sqe->addr = (uint64_t)(uintptr_t)&accept_addr;
+    sqe->addr2 = (uint64_t)(uintptr_t)&accept_addr_len;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t)(uintptr_t)&accept_op;
+}
+
+static void handle_accept(int listen_socket, int result) {
+    struct sockaddr_in client_addr = accept_addr;
+    submit_accept(listen_socket);
+    if (result < 0) {
+        errno = -result;
+        perror("Accept failed");
+        log_message(LOG_ERROR, "Accept failed: %s", strerror(-result));
+        return;
+    }
+
+    int client_socket = result;
+    uring_conn_t *conn = (uring_conn_t *)buffer_pool_alloc(sizeof(uring_conn_t));
+    if (!conn) {
+        perror("Failed to allocate memory for connection");
+        close(client_socket);
+        return;
+    }
+    memset(conn, 0, sizeof(*conn));
+    conn->socket = client_socket;
+    conn->file_fd = -1;
+    conn->file_slot = -1;
+    conn->state = UCONN_PREFIX;
+    conn->client_addr = client_addr;
+    conn->accepted_ns = metrics_now_ns();
+    inet_ntop(AF_INET, &client_addr.sin_addr, conn->client_ip, INET_ADDRSTRLEN);
+    conn->client_port = ntohs(client_addr.sin_port);
+    conn->socket_slot = claim_slot(client_socket);
+    if (conn->socket_slot < 0) {
+        log_message(LOG_ERROR, "No fixed-file slot left for %s:%d", conn->client_ip, conn->client_port);
+        close(client_socket);
+        buffer_pool_free(conn, sizeof(uring_conn_t));
+        return;
+    }
+    metrics_add(METRIC_CONNECTIONS, 1);
+    metrics_add(METRIC_ACTIVE_CONNECTIONS, 1);
+    log_message(LOG_INFO, "Client connected: %s:%d", conn->client_ip, conn->client_port);
+    submit_header_recv(conn);
+}
+
+/* Register the receive buffers and an empty fixed-file table */
+static int register_resources(size_t chunk_size) {
+    buffer_size = chunk_size;
+    buffer_memory = (unsigned char *)mmap(NULL, URING_BUFFER_COUNT * chunk_size, PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer_memory == MAP_FAILED) {
+        buffer_memory = NULL;
+        return ERROR_MEMORY;
+    }
+    struct iovec iovecs[URING_BUFFER_COUNT];
+    for (int i = 0; i < URING_BUFFER_COUNT; i++) {
+        iovecs[i].iov_base = buffer_data(i);
+        iovecs[i].iov_len = chunk_size;
+        free_buffers[i] = URING_BUFFER_COUNT - 1 - i;
+        buffer_ops[i].buffer = i;
+    }
+    free_buffer_count = URING_BUFFER_COUNT;
+    if (ring_register(&ring, IORING_REGISTER_BUFFERS, iovecs, URING_BUFFER_COUNT) != SUCCESS) {
+        return ERROR_UNSUPPORTED;
+    }
+
+    static _Thread_local int files[URING_FIXED_FILES];
+    for (int i = 0; i < URING_FIXED_FILES; i++) {
+        files[i] = -1;
+        free_slots[i] = URING_FIXED_FILES - 1 - i;
+    }
+    free_slot_count = URING_FIXED_FILES;
+    if (ring_register(&ring, IORING_REGISTER_FILES, files, URING_FIXED_FILES) != SUCCESS) {
+        return ERROR_UNSUPPORTED;
+    }
+    return SUCCESS;
+}
+
+/* Completion loop: each io_uring_enter submits every queued request and waits for the next result */
+int run_uring_server(int listen_socket, size_t chunk_size, client_handler_t extended_handler,
+                     volatile sig_atomic_t *running) {
+    extended_request_handler = extended_handler;
+    if (chunk_size > UINT32_MAX) {
+        chunk_size = UINT32_MAX;
+    }
+    if (ring_setup(&ring, URING_QUEUE_DEPTH) != SUCCESS) {
+        return ERROR_UNSUPPORTED;
+    }
+    int status = ring_supports_opcodes(&ring) ? register_resources(chunk_size) : ERROR_UNSUPPORTED;
+    if (status != SUCCESS) {
+        ring_unmap(&ring);
+        if (buffer_memory) {
+            munmap(buffer_memory, URING_BUFFER_COUNT * buffer_size);
+            buffer_memory = NULL;
+        }
+        return ERROR_UNSUPPORTED;
+    }
+
+    submit_accept(listen_socket);
+    while (*running) {
+        status = ring_enter(&ring, 1);
+        if (status != SUCCESS && status != ERROR_BUSY) {
+            perror("io_uring_enter failed");
+            break;
+        }
+
+        unsigned head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            uring_op_t *op = (uring_op_t *)(uintptr_t)cqe->user_data;
+            int result = cqe->res;
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+            switch (op->kind) {
+            case URING_ACCEPT:
+                if (*running) {
+                    handle_accept(listen_socket, result);  // Shutdown fails the pending accept
+                } else if (result >= 0) {
+                    close(result);
+                }
+                break;
+            case URING_RECV:
+                handle_recv(op, result);
+                break;
+            case URING_WRITE:
+                handle_write(op, result);
+                break;
+            case URING_FSYNC:
+                handle_fsync(op, result);
+                break;
+            default:
+                handle_control(op, result);
+                break;
+            }
+        }
+    }
+
+    /* Closing the ring cancels whatever is still in flight */
+    ring_unmap(&ring);
+    munmap(buffer_memory, URING_BUFFER_COUNT * buffer_size);
+    buffer_memory = NULL;
+    return SUCCESS;
+}
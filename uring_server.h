@@ -0,0 +1,28 @@
+#ifndef URING_SERVER_H
+#define URING_SERVER_H
+
+#include "common.h"
+
+/* Ring and buffer sizing */
+#define URING_QUEUE_DEPTH 256
+#define URING_BUFFER_COUNT 128       // Registered receive buffers shared by all connections
+#define URING_WRITES_PER_CONN 8      // Writes one connection may have in flight
+#define URING_FIXED_FILES 2048       // Fixed-file slots (a socket and a file per connection)
+
+/*
+ * Run the io_uring connection engine on an already listening socket.
+ * Legacy uploads and OP_PUT requests are received into registered buffers
+ * and written with WRITE_FIXED through fixed files, so a connection's next
+ * receive overlaps its previous writes and one io_uring_enter submits the
+ * whole batch. Other extended requests are passed, with the header the loop already read in
+ * request_header, to extended_handler on the loop thread; it owns the
+ * socket from then on and must not block.
+ * Returns ERROR_UNSUPPORTED before serving anything if io_uring cannot be
+ * set up, so the caller can fall back to another engine. Several threads
+ * may each run a loop on their own listening socket; every loop gets its
+ * own ring and buffers.
+ */
+int run_uring_server(int listen_socket, size_t chunk_size, client_handler_t extended_handler,
+                     volatile sig_atomic_t *running);
+
+#endif /* URING_SERVER_H */
@@ -0,0 +1,144 @@
+#include "worker_pool.h"
+
+struct worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    client_info_t *queue;      // Ring buffer of pending clients
+    size_t head;
+    size_t count;
+    size_t capacity;
+    pthread_t *threads;
+    size_t thread_count;
+    client_handler_t handler;
+    int shutting_down;
+    worker_pool_stats_t stats;
+};
+
+/* Worker loop: pull clients off the queue until the pool shuts down */
+static void* worker_main(void *arg) {
+    worker_pool_t *pool = (worker_pool_t *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->shutting_down) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        if (pool->count == 0 && pool->shutting_down) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        client_info_t client = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pool->stats.queue_depth = pool->count;
+        pool->stats.active_workers++;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->handler(&client);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stats.active_workers--;
+        pool->stats.completed_total++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+/* Create a pool of worker_count threads fed by a queue of queue_depth slots */
+worker_pool_t* worker_pool_create(size_t worker_count, size_t queue_depth, client_handler_t handler) {
+    if (worker_count == 0 || queue_depth == 0 || !handler) {
+        return NULL;
+    }
+
+    worker_pool_t *pool = (worker_pool_t *)calloc(1, sizeof(worker_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->queue = (client_info_t *)calloc(queue_depth, sizeof(client_info_t));
+    pool->threads = (pthread_t *)calloc(worker_count, sizeof(pthread_t));
+    if (!pool->queue || !pool->threads) {
+        free(pool->queue);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    pool->capacity = queue_depth;
+    pool->handler = handler;
+    pool->stats.queue_capacity = queue_depth;
+
+    for (size_t i = 0; i < worker_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            perror("Failed to create worker thread");
+            pool->thread_count = i;
+            worker_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    pool->thread_count = worker_count;
+
+    return pool;
+}
+
+/* Drain the queue, stop the workers and release the pool */
+void worker_pool_destroy(worker_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutting_down = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_cond_broadcast(&pool->not_full);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+    free(pool->queue);
+    free(pool->threads);
+    free(pool);
+}
+
+/* Queue a client for the next free worker */
+int worker_pool_submit(worker_pool_t *pool, const client_info_t *client, int block) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == pool->capacity && block && !pool->shutting_down) {
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+    if (pool->count == pool->capacity || pool->shutting_down) {
+        pool->stats.rejected_total++;
+        pthread_mutex_unlock(&pool->lock);
+        return ERROR_BUSY;
+    }
+
+    pool->queue[(pool->head + pool->count) % pool->capacity] = *client;
+    pool->count++;
+    pool->stats.queue_depth = pool->count;
+    pool->stats.accepted_total++;
+    if (pool->count > pool->stats.queue_high_water) {
+        pool->stats.queue_high_water = pool->count;
+    }
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return SUCCESS;
+}
+
+/* Snapshot the queue counters */
+void worker_pool_get_stats(worker_pool_t *pool, worker_pool_stats_t *stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
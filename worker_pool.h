@@ -0,0 +1,34 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "common.h"
+
+/* Default pool sizing */
+#define DEFAULT_WORKER_THREADS 8
+#define DEFAULT_QUEUE_DEPTH 64
+
+/* Response sent to clients turned away by admission control */
+#define BUSY_RESPONSE "Server busy, try again later"
+
+/* Queue counters, readable while the pool is running */
+typedef struct {
+    size_t queue_depth;       // Clients currently waiting for a worker
+    size_t queue_capacity;
+    size_t queue_high_water;  // Deepest the queue has been
+    size_t active_workers;    // Workers currently serving a client
+    size_t accepted_total;    // Clients admitted to the queue
+    size_t rejected_total;    // Clients turned away because the queue was full
+    size_t completed_total;   // Clients fully served
+} worker_pool_stats_t;
+
+typedef struct worker_pool worker_pool_t;
+
+/* Pool lifecycle */
+worker_pool_t* worker_pool_create(size_t worker_count, size_t queue_depth, client_handler_t handler);
+void worker_pool_destroy(worker_pool_t *pool);
+
+/* Queue a client; returns ERROR_BUSY when full and block is zero */
+int worker_pool_submit(worker_pool_t *pool, const client_info_t *client, int block);
+void worker_pool_get_stats(worker_pool_t *pool, worker_pool_stats_t *stats);
+
+#endif /* WORKER_POOL_H */